@@ -0,0 +1,110 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TTreeFormula.h"
+#include "TStopwatch.h"
+#include "TMVA/Reader.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "thread_budget.cpp"
+#include "input_source.cpp"
+#include "trained_model.cpp"
+#include "run_properties.cpp"
+#include "dnn_inference.cpp"
+
+#define SIGNAL_FILE "signal_data.root"
+// Largest difference to TMVA::Reader a float32 network may have and still agree
+#define AGREEMENT_TOLERANCE 1e-4
+
+// Evaluates the model's input expressions on the first numEvents events of a tree, numInputs
+// values per event like DenseNetwork::evaluate wants them
+std::vector<Float_t> read_inputs(TTree *tree, TrainedModel &model, Long64_t numEvents) {
+  std::vector<TTreeFormula*> formulas;
+  for (std::string expression : model.expressions) {
+    formulas.push_back(new TTreeFormula("input", expression.c_str(), tree));
+  }
+  numEvents = std::min(numEvents, tree->GetEntries());
+  std::vector<Float_t> inputs(numEvents * formulas.size());
+  for (Long64_t e = 0; e < numEvents; e++) {
+    tree->LoadTree(e);
+    for (size_t i = 0; i < formulas.size(); i++) {
+      formulas[i]->GetNdata();
+      inputs[e * formulas.size() + i] = formulas[i]->EvalInstance(0);
+    }
+  }
+  for (TTreeFormula *f : formulas) {
+    delete f;
+  }
+  return inputs;
+}
+
+// Scores the same events with TMVA::Reader and with the native network at every weight
+// precision, and reports the throughput and how far the native scores are from the Reader's.
+// Returns false if the float32 network doesn't agree with the Reader.
+bool bench_dnn_inference(std::string runDir, Long64_t numEvents) {
+  TrainedModel model(runDir, method_to_tmva_name(DNN));
+  if (!model.isValid) {
+    return false;
+  }
+  InputSample input(SIGNAL_FILE);
+  if (input.tree == NULL) {
+    std::cout << "The benchmark reads its events from a TTree " << SIGNAL_FILE << std::endl;
+    return false;
+  }
+  std::vector<Float_t> inputs = read_inputs(input.tree, model, numEvents);
+  size_t numInputs = model.expressions.size();
+  numEvents = inputs.size() / numInputs;
+
+  std::vector<Float_t> readerInputs;
+  TMVA::Reader *reader = model.makeReader(readerInputs);
+  std::vector<Float_t> expected(numEvents);
+  TStopwatch readerWatch;
+  for (Long64_t e = 0; e < numEvents; e++) {
+    std::copy(inputs.begin() + e * numInputs, inputs.begin() + (e + 1) * numInputs, readerInputs.begin());
+    expected[e] = reader->EvaluateMVA(model.methodName.c_str());
+  }
+  readerWatch.Stop();
+  delete reader;
+
+  std::cout << model.describe() << std::endl;
+  std::cout << "  - TMVA::Reader: " << numEvents / readerWatch.RealTime() << " events/s" << std::endl;
+
+  bool agrees = true;
+  for (weight_precision precision : {WEIGHTS_FLOAT32, WEIGHTS_FLOAT16, WEIGHTS_INT8}) {
+    DenseNetwork network(model, precision);
+    if (!network.isValid) {
+      return false;
+    }
+    std::vector<Float_t> scores(numEvents);
+    TStopwatch watch;
+    network.evaluate(inputs.data(), numEvents, scores.data());
+    watch.Stop();
+
+    Double_t maxDifference = 0, sumDifference = 0;
+    for (Long64_t e = 0; e < numEvents; e++) {
+      Double_t difference = std::abs(scores[e] - expected[e]);
+      maxDifference = std::max(maxDifference, difference);
+      sumDifference += difference;
+    }
+    std::cout << "  - native " << precision_to_string(precision) << ": " << numEvents / watch.RealTime() << " events/s ("
+              << readerWatch.RealTime() / watch.RealTime() << "x), " << network.weightBytes() / 1024. << " kB of weights, "
+              << "max |difference| " << maxDifference << ", mean " << sumDifference / numEvents << std::endl;
+    if (precision == WEIGHTS_FLOAT32 && maxDifference > AGREEMENT_TOLERANCE) {
+      std::cout << "    float32 scores don't agree with TMVA::Reader!" << std::endl;
+      agrees = false;
+    }
+  }
+  return agrees;
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <Run-N directory> [number of events]" << std::endl;
+    return 1;
+  }
+  ThreadBudget::fromEnvironment().apply();
+  Long64_t numEvents = argc > 2 ? std::stoll(argv[2]) : 100000;
+  return bench_dnn_inference(argv[1], numEvents) ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+#include "TFile.h"
+#include "TROOT.h"
+#include "TStopwatch.h"
+#include "TSystem.h"
+#include "TMVA/DataLoader.h"
+#include "TMVA/Factory.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include "thread_budget.cpp"
+#include "run_properties.cpp"
+#include "input_source.cpp"
+#include "hist_gbdt.cpp"
+
+#define SIGNAL_FILE "signal_data.root"
+#define BACKGROUND_FILE "background_data.root"
+#define OUTPUT_DIR "bench_hgbdt_output/"
+
+// Trains TMVA's BDTG and the histogram BDT with the same settings on the very same training
+// events, and compares how long training took and the ROC integral on the same testing events.
+// Trees don't care about the scale of a variable, so the variables aren't normalized here.
+void bench_hgbdt(int numTrain, int numTest, int numTrees, int maxDepth) {
+  enable_async_prefetch();
+  InputSample signalInput(SIGNAL_FILE);
+  InputSample backgroundInput(BACKGROUND_FILE);
+  if (signalInput.tree == NULL || backgroundInput.tree == NULL) {
+    std::cout << "The benchmark needs TTree inputs, did you run slice_up_tree?" << std::endl;
+    return;
+  }
+  gROOT->SetBatch(true);
+
+  RunProperties properties(ALL, numTrain, numTrain, "", {BDTG, HGBDT});
+  properties.numSignalTest = numTest;
+  properties.numBackgroundTest = numTest;
+  properties.numTrees = numTrees;
+  properties.maxDepth = maxDepth;
+  properties.Print();
+
+  gSystem->mkdir(OUTPUT_DIR, kTRUE);
+  TFile *outputFile = TFile::Open((std::string(OUTPUT_DIR) + "TMVA.root").c_str(), "RECREATE");
+  TMVA::Factory *factory = new TMVA::Factory("TMVAClassification", outputFile,
+     "Silent:!Color:!DrawProgressBar:AnalysisType=Classification");
+  TMVA::DataLoader *dataloader = properties.generateDataLoader("dataset");
+  dataloader->AddSignalTree(signalInput.tree, 1.0);
+  dataloader->AddBackgroundTree(backgroundInput.tree, 1.0);
+  dataloader->SetBackgroundWeightExpression("PU_wgt");
+  properties.fillDataLoaderForTree(dataloader);
+  properties.fillFactory(factory, dataloader);
+
+  TStopwatch trainWatch, testWatch;
+  trainWatch.Start();
+  factory->TrainAllMethods();
+  trainWatch.Stop();
+  // Only scoring the test events is timed, like HistGBDTRun::testTime. EvaluateAllMethods
+  // computes TMVA's whole set of performance plots, which the histogram BDT never makes
+  testWatch.Start();
+  factory->TestAllMethods();
+  testWatch.Stop();
+  factory->EvaluateAllMethods();
+  Double_t tmvaRoc = factory->GetROCIntegral(dataloader, method_to_tmva_name(BDTG));
+
+  HistGBDTRun hgbdt = train_hist_gbdt(dataloader, properties, outputFile);
+  outputFile->Close();
+
+  std::cout << "BDTG vs HGBDT, " << numTrees << " trees of depth " << maxDepth << ", "
+            << numTrain << " training events per class, " << ROOT::GetThreadPoolSize() << " threads" << std::endl;
+  std::cout << "  - BDTG:  train " << trainWatch.RealTime() << " s, test " << testWatch.RealTime()
+            << " s, ROC integral " << tmvaRoc << std::endl;
+  std::cout << "  - HGBDT: train " << hgbdt.trainTime << " s, test " << hgbdt.testTime
+            << " s, ROC integral " << hgbdt.rocIntegral << std::endl;
+  std::cout << "  - speedup: " << trainWatch.RealTime() / hgbdt.trainTime << "x" << std::endl;
+
+  delete factory;
+  delete dataloader;
+}
+
+int main(int argc, char ** argv) {
+  ThreadBudget::fromEnvironment().apply();
+  int numTrain = argc > 1 ? std::stoi(argv[1]) : 100000;
+  int numTest = argc > 2 ? std::stoi(argv[2]) : 100000;
+  int numTrees = argc > 3 ? std::stoi(argv[3]) : 100;
+  int maxDepth = argc > 4 ? std::stoi(argv[4]) : 3;
+  bench_hgbdt(numTrain, numTest, numTrees, maxDepth);
+  return 0;
+}
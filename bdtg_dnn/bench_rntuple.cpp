@@ -0,0 +1,77 @@
+#include "TFile.h"
+#include "TStopwatch.h"
+#include "TSystem.h"
+#include <ROOT/RDataFrame.hxx>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "thread_budget.cpp"
+
+#define OUTPUT_DIR "tree_output_dir/"
+#define REPETITIONS 5
+
+// Reads every column of a sliced sample once and reports how long it took. The sum is only
+// there so the reads can't be optimized away.
+void read_everything(std::string label, std::string path) {
+  Long64_t fileSize = 0;
+  {
+    TFile *file = TFile::Open(path.c_str());
+    if (file == NULL || file->IsZombie()) {
+      std::cout << "Could not open " << path << ", did you run slice_up_tree (and slice_up_tree --rntuple)?" << std::endl;
+      return;
+    }
+    fileSize = file->GetSize();
+    file->Close();
+    delete file;
+  }
+
+  std::vector<std::string> columns = ROOT::RDataFrame("tree", path).GetColumnNames();
+  Double_t bestReal = -1;
+  Double_t bestCpu = -1;
+  ULong64_t events = 0;
+  Double_t checksum = 0;
+  for (int rep = 0; rep < REPETITIONS; rep++) {
+    // Start from the same state every time, as far as the page cache allows
+    ROOT::RDataFrame df("tree", path);
+    std::vector<ROOT::RDF::RResultPtr<double>> sums;
+    for (std::string column : columns) {
+      sums.push_back(df.Define("__" + column, "(double)" + column).Sum<double>("__" + column));
+    }
+    auto count = df.Count();
+
+    TStopwatch watch;
+    watch.Start();
+    events = *count;
+    watch.Stop();
+    checksum = 0;
+    for (auto &sum : sums) {
+      checksum += *sum;
+    }
+    if (bestReal < 0 || watch.RealTime() < bestReal) {
+      bestReal = watch.RealTime();
+      bestCpu = watch.CpuTime();
+    }
+  }
+
+  Double_t megabytes = fileSize / (1024. * 1024.);
+  std::cout << label << ": " << events << " events, " << columns.size() << " columns" << std::endl;
+  std::cout << "  - file size:  " << megabytes << " MB (" << (Double_t)fileSize / events << " bytes/event)" << std::endl;
+  std::cout << "  - read time:  " << bestReal << " s real, " << bestCpu << " s cpu (best of " << REPETITIONS << ")" << std::endl;
+  std::cout << "  - throughput: " << events / bestReal << " events/s, " << megabytes / bestReal << " MB/s" << std::endl;
+  std::cout << "  - cpu/event:  " << 1e9 * bestCpu / events << " ns (mostly decompression)" << std::endl;
+  std::cout << "  - checksum:   " << checksum << std::endl;
+}
+
+// Compares the TTree and RNTuple outputs of slice_up_tree for the same slice
+void bench_rntuple() {
+  for (std::string sample : {"signal_data", "background_data"}) {
+    read_everything(sample + " (TTree)", std::string(OUTPUT_DIR) + sample + ".root");
+    read_everything(sample + " (RNTuple)", std::string(OUTPUT_DIR) + sample + "_rntuple.root");
+  }
+}
+
+int main(int argc, char ** argv) {
+  ThreadBudget::fromEnvironment().apply();
+  bench_rntuple();
+  return 0;
+}
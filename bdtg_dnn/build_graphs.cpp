@@ -0,0 +1,91 @@
+#include "TStopwatch.h"
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "thread_budget.cpp"
+#include "input_source.cpp"
+#include "graph_dataset.cpp"
+
+#define SIGNAL_FILE "signal_data.root"
+#define BACKGROUND_FILE "background_data.root"
+// Labels generate_csvs gives its nodes ("Background" and "Signal" sorted as categories)
+#define BACKGROUND_LABEL 0
+#define SIGNAL_LABEL 1
+// Seed of the event order, so rebuilding gives the same file
+#define SHUFFLE_SEED 100
+
+// Features generate_csvs normalized, {name: {mean, sdev}} in the order of the csv columns
+std::vector<gnn_feature> read_normalization(std::string path) {
+  std::vector<gnn_feature> features;
+  std::ifstream input(path);
+  if (!input.good()) {
+    return features;
+  }
+  nlohmann::ordered_json data = nlohmann::ordered_json::parse(input);
+  for (auto &f : data.items()) {
+    features.push_back({f.key(), f.value()["mean"].get<Double_t>(), f.value()["sdev"].get<Double_t>()});
+  }
+  return features;
+}
+
+// Reads the signal and background samples into per-event graphs and writes them for
+// gnn/lib/graph_dataset.py, shuffled so any range of events is a mix of both. The chunks read are
+// streamed into the output's spill files and the events shuffled by index as the file is
+// written, so they are never all in memory. The features and their normalization are those of
+// the csv files generate_csvs wrote into csvDir.
+bool build_graphs(std::string csvDir, std::string outputPath, Long64_t maxEvents) {
+  std::vector<gnn_feature> muonFeatures = read_normalization(csvDir + "/normalization_data.json");
+  std::vector<gnn_feature> jetFeatures = read_normalization(csvDir + "/normalization_data_jets.json");
+  if (muonFeatures.size() == 0) {
+    std::cout << "No normalization_data.json in " << csvDir << ", run generate_csvs with normalization first" << std::endl;
+    return false;
+  }
+
+  GraphFileWriter writer(outputPath, muonFeatures, jetFeatures);
+  Long64_t numMuons = 0, numJets = 0;
+  for (std::string path : {std::string(SIGNAL_FILE), std::string(BACKGROUND_FILE)}) {
+    std::string treeName;
+    {
+      InputSample input(path);
+      if (input.tree == NULL) {
+        std::cout << "Graphs are read from a TTree " << path << std::endl;
+        return false;
+      }
+      treeName = input.name;
+    }
+    TStopwatch watch;
+    bool ok = read_graph_chunks(path, treeName, muonFeatures, jetFeatures, path == SIGNAL_FILE ? SIGNAL_LABEL : BACKGROUND_LABEL,
+                                maxEvents, [&](const GraphArena &chunk) {
+      numMuons += chunk.numMuons();
+      numJets += chunk.numJets();
+      return writer.append(chunk);
+    });
+    if (!ok) {
+      return false;
+    }
+    watch.Stop();
+    std::cout << path << ": " << writer.numEvents() << " events so far, " << watch.RealTime() << " s" << std::endl;
+  }
+  std::vector<Long64_t> order(writer.numEvents());
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(SHUFFLE_SEED));
+
+  std::cout << numMuons << " muons, " << numJets << " jets, "
+            << (numMuons * muonFeatures.size() + numJets * jetFeatures.size()) * sizeof(Float_t) / 1e6 << " MB of node features" << std::endl;
+  return writer.finish(order);
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: " << argv[0] << " <csv directory> <output file> [max events per sample]" << std::endl;
+    return 1;
+  }
+  ThreadBudget::fromEnvironment().apply();
+  Long64_t maxEvents = argc > 3 ? std::stoll(argv[3]) : -1;
+  return build_graphs(argv[1], argv[2], maxEvents) ? 0 : 1;
+}
@@ -0,0 +1,373 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TStopwatch.h"
+#include "TApplication.h"
+#include "ROOT/TBufferMerger.hxx"
+#include <ROOT/RDataFrame.hxx>
+#include <ROOT/RVec.hxx>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "input_source.cpp"
+
+#define SIGNAL_FILE "signal_data.root"
+#define BACKGROUND_FILE "background_data.root"
+#define OUTPUT_DIR "features_output_dir/"
+
+// How many of the leading muons and jets get their own columns, and what the columns hold
+// when an event has fewer than that
+#define DERIVED_MUONS 2
+#define DERIVED_JETS 4
+#define FEATURE_PADDING -99
+
+#define MUON_MASS 0.1056583745
+
+// Events are gathered into batches of this many before the feature kernels run over them
+#define DERIVED_BATCH 4096
+
+typedef ROOT::VecOps::RVec<Double_t> rvec_d;
+
+// Value of the i-th object of a collection, or the padding if the event doesn't have that many
+float leading(const rvec_d &values, size_t i) {
+  return i < values.size() ? values[i] : FEATURE_PADDING;
+}
+
+// |phi1 - phi2| folded into [0, pi]
+inline Float_t abs_delta_phi(Float_t phi1, Float_t phi2) {
+  Float_t d = phi1 - phi2;
+  return std::abs(d - (Float_t)(2 * M_PI) * std::nearbyint(d / (Float_t)(2 * M_PI)));
+}
+
+// Every column of the flat output, in the order it's written
+std::vector<std::string> derived_columns() {
+  std::vector<std::string> columns = {"nMuons", "nJets", "nMuPairs"};
+  for (size_t i = 0; i < DERIVED_MUONS; i++) {
+    for (std::string field : {"pt", "eta", "phi"}) {
+      columns.push_back("muon" + std::to_string(i + 1) + "_" + field);
+    }
+  }
+  for (size_t i = 0; i < DERIVED_JETS; i++) {
+    for (std::string field : {"pt", "eta", "phi", "mass"}) {
+      columns.push_back("jet" + std::to_string(i + 1) + "_" + field);
+    }
+  }
+  for (std::string pair : {"mumu", "jj"}) {
+    for (std::string field : {"mass", "pt", "eta", "dR", "dEta", "dPhi"}) {
+      columns.push_back(pair + "_" + field);
+    }
+  }
+  for (std::string name : {"mumujj_mass", "mu_jet_min_dR", "HT", "met_pt", "met_phi", "met_sumEt",
+                           "mumu_met_dPhi", "muPairs_mass", "PU_wgt"}) {
+    columns.push_back(name);
+  }
+  return columns;
+}
+
+// One four vector per event of a batch, as columns of its cartesian components
+class Cartesian {
+  public:
+    std::vector<Double_t> px, py, pz, e;
+
+    Cartesian() : px(DERIVED_BATCH), py(DERIVED_BATCH), pz(DERIVED_BATCH), e(DERIVED_BATCH) {}
+
+    void set(size_t n, const Float_t *pt, const Float_t *eta, const Float_t *phi, const Float_t *mass) {
+      for (size_t i = 0; i < n; i++) {
+        this->px[i] = pt[i] * std::cos(phi[i]);
+        this->py[i] = pt[i] * std::sin(phi[i]);
+        this->pz[i] = pt[i] * std::sinh(eta[i]);
+        this->e[i] = std::sqrt(this->px[i] * this->px[i] + this->py[i] * this->py[i]
+                               + this->pz[i] * this->pz[i] + (Double_t)mass[i] * mass[i]);
+      }
+    }
+
+    void sum(size_t n, const Cartesian &a, const Cartesian &b) {
+      for (size_t i = 0; i < n; i++) {
+        this->px[i] = a.px[i] + b.px[i];
+        this->py[i] = a.py[i] + b.py[i];
+        this->pz[i] = a.pz[i] + b.pz[i];
+        this->e[i] = a.e[i] + b.e[i];
+      }
+    }
+
+    // Negative for spacelike vectors, like ROOT's M()
+    void mass(size_t n, Float_t *out) const {
+      for (size_t i = 0; i < n; i++) {
+        Double_t mm = this->e[i] * this->e[i] - this->px[i] * this->px[i]
+                      - this->py[i] * this->py[i] - this->pz[i] * this->pz[i];
+        out[i] = std::copysign(std::sqrt(std::abs(mm)), mm);
+      }
+    }
+
+    void pt(size_t n, Float_t *out) const {
+      for (size_t i = 0; i < n; i++) {
+        out[i] = std::sqrt(this->px[i] * this->px[i] + this->py[i] * this->py[i]);
+      }
+    }
+
+    void eta(size_t n, Float_t *out) const {
+      for (size_t i = 0; i < n; i++) {
+        Double_t pt = std::sqrt(this->px[i] * this->px[i] + this->py[i] * this->py[i]);
+        out[i] = std::asinh(this->pz[i] / std::max(pt, 1e-10));
+      }
+    }
+
+    void phi(size_t n, Float_t *out) const {
+      for (size_t i = 0; i < n; i++) {
+        out[i] = std::atan2(this->py[i], this->px[i]);
+      }
+    }
+};
+
+// Angular separations between two objects, for every event of a batch
+void separations(size_t n, const Float_t *eta1, const Float_t *phi1, const Float_t *eta2, const Float_t *phi2,
+                 Float_t *dR, Float_t *dEta, Float_t *dPhi) {
+  for (size_t i = 0; i < n; i++) {
+    dEta[i] = std::abs(eta1[i] - eta2[i]);
+    dPhi[i] = abs_delta_phi(phi1[i], phi2[i]);
+    dR[i] = std::sqrt(dEta[i] * dEta[i] + dPhi[i] * dPhi[i]);
+  }
+}
+
+// Replaces a feature by the padding in the events with fewer than `needed` objects
+void pad(size_t n, const Float_t *count, Float_t needed, Float_t *values) {
+  for (size_t i = 0; i < n; i++) {
+    values[i] = count[i] >= needed ? values[i] : (Float_t)FEATURE_PADDING;
+  }
+}
+
+// Events gathered column by column. Reading an event only copies its leading objects (padded)
+// and its per-event sums into the columns. Everything built from them is computed afterwards by
+// kernels that run along whole columns, one feature for every event of the batch at once, with
+// no per-event four vectors and no branches, so the compiler can vectorize them. Events without
+// enough objects are computed on the padding like the others and padded again at the end.
+class FeatureBatch {
+  public:
+    std::vector<std::string> names;
+    // [column][event]
+    std::vector<std::vector<Float_t>> values;
+    size_t size;
+
+    FeatureBatch() {
+      this->names = derived_columns();
+      this->values.assign(this->names.size(), std::vector<Float_t>(DERIVED_BATCH));
+      this->muonMass.assign(DERIVED_BATCH, MUON_MASS);
+      this->row.resize(this->names.size());
+      this->size = 0;
+      // Looked up once, reading an event just writes through these
+      this->muonColumns.resize(DERIVED_MUONS);
+      for (size_t i = 0; i < DERIVED_MUONS; i++) {
+        for (std::string field : {"pt", "eta", "phi"}) {
+          this->muonColumns[i].push_back(this->column("muon" + std::to_string(i + 1) + "_" + field));
+        }
+      }
+      this->jetColumns.resize(DERIVED_JETS);
+      for (size_t i = 0; i < DERIVED_JETS; i++) {
+        for (std::string field : {"pt", "eta", "phi", "mass"}) {
+          this->jetColumns[i].push_back(this->column("jet" + std::to_string(i + 1) + "_" + field));
+        }
+      }
+      for (std::string name : {"nMuons", "nJets", "nMuPairs", "mu_jet_min_dR", "HT", "met_pt", "met_phi",
+                               "met_sumEt", "muPairs_mass", "PU_wgt"}) {
+        this->eventColumns.push_back(this->column(name));
+      }
+    }
+
+    Float_t *column(std::string name) {
+      size_t c = std::find(this->names.begin(), this->names.end(), name) - this->names.begin();
+      return this->values[c].data();
+    }
+
+    // Creates the tree the batches are appended to, in the current directory
+    TTree *makeTree() {
+      TTree *tree = new TTree(INPUT_NAME, "Derived features");
+      for (size_t c = 0; c < this->names.size(); c++) {
+        tree->Branch(this->names[c].c_str(), &this->row[c], (this->names[c] + "/F").c_str());
+      }
+      return tree;
+    }
+
+    // Copies one event into the batch. True once the batch is full
+    bool add(const rvec_d &muonPt, const rvec_d &muonEta, const rvec_d &muonPhi,
+             const rvec_d &jetPt, const rvec_d &jetEta, const rvec_d &jetPhi, const rvec_d &jetMass,
+             const rvec_d &pairMass, Double_t metPt, Double_t metPhi, Double_t metSumEt, Float_t weight) {
+      size_t e = this->size;
+      for (size_t i = 0; i < DERIVED_MUONS; i++) {
+        this->muonColumns[i][0][e] = leading(muonPt, i);
+        this->muonColumns[i][1][e] = leading(muonEta, i);
+        this->muonColumns[i][2][e] = leading(muonPhi, i);
+      }
+      for (size_t i = 0; i < DERIVED_JETS; i++) {
+        this->jetColumns[i][0][e] = leading(jetPt, i);
+        this->jetColumns[i][1][e] = leading(jetEta, i);
+        this->jetColumns[i][2][e] = leading(jetPhi, i);
+        this->jetColumns[i][3][e] = leading(jetMass, i);
+      }
+
+      // Smallest separation between any of the leading muons and any jet, not just the leading ones
+      Float_t smallest = FEATURE_PADDING;
+      for (size_t m = 0; m < std::min<size_t>(muonPt.size(), DERIVED_MUONS); m++) {
+        for (size_t j = 0; j < jetPt.size(); j++) {
+          Float_t dEta = muonEta[m] - jetEta[j];
+          Float_t dPhi = abs_delta_phi(muonPhi[m], jetPhi[j]);
+          Float_t dR = std::sqrt(dEta * dEta + dPhi * dPhi);
+          if (smallest == FEATURE_PADDING || dR < smallest) {
+            smallest = dR;
+          }
+        }
+      }
+
+      // In the order of eventColumns. The leading pair's mass is what the mass window cuts are
+      // rewritten to use on these files (see formula_to_derived_expression)
+      Float_t perEvent[] = {(Float_t)muonPt.size(), (Float_t)jetPt.size(), (Float_t)pairMass.size(), smallest,
+                            (Float_t)ROOT::VecOps::Sum(jetPt), (Float_t)metPt, (Float_t)metPhi, (Float_t)metSumEt,
+                            leading(pairMass, 0), weight};
+      for (size_t c = 0; c < this->eventColumns.size(); c++) {
+        this->eventColumns[c][e] = perEvent[c];
+      }
+      return ++this->size == DERIVED_BATCH;
+    }
+
+    // Computes the features of the batch and appends it to the tree
+    void flush(TTree *tree) {
+      size_t n = this->size;
+      if (n == 0) {
+        return;
+      }
+      this->muon1.set(n, this->column("muon1_pt"), this->column("muon1_eta"), this->column("muon1_phi"), this->muonMass.data());
+      this->muon2.set(n, this->column("muon2_pt"), this->column("muon2_eta"), this->column("muon2_phi"), this->muonMass.data());
+      this->jet1.set(n, this->column("jet1_pt"), this->column("jet1_eta"), this->column("jet1_phi"), this->column("jet1_mass"));
+      this->jet2.set(n, this->column("jet2_pt"), this->column("jet2_eta"), this->column("jet2_phi"), this->column("jet2_mass"));
+      this->mumu.sum(n, this->muon1, this->muon2);
+      this->jj.sum(n, this->jet1, this->jet2);
+
+      // Pair systems of the two leading objects
+      for (std::string object : {"muon", "jet"}) {
+        std::string pair = object == "muon" ? "mumu" : "jj";
+        const Cartesian &system = object == "muon" ? this->mumu : this->jj;
+        system.mass(n, this->column(pair + "_mass"));
+        system.pt(n, this->column(pair + "_pt"));
+        system.eta(n, this->column(pair + "_eta"));
+        separations(n, this->column(object + "1_eta"), this->column(object + "1_phi"),
+                    this->column(object + "2_eta"), this->column(object + "2_phi"),
+                    this->column(pair + "_dR"), this->column(pair + "_dEta"), this->column(pair + "_dPhi"));
+        const Float_t *count = this->column(object == "muon" ? "nMuons" : "nJets");
+        for (std::string field : {"mass", "pt", "eta", "dR", "dEta", "dPhi"}) {
+          pad(n, count, 2, this->column(pair + "_" + field));
+        }
+      }
+
+      // Mass of the two leading muons together with the two leading jets (the VBF topology)
+      Float_t *mumujj = this->column("mumujj_mass");
+      this->all.sum(n, this->mumu, this->jj);
+      this->all.mass(n, mumujj);
+      pad(n, this->column("nJets"), 2, mumujj);
+      pad(n, this->column("nMuons"), 2, mumujj);
+
+      // Azimuthal separation between the dimuon system and the missing energy
+      Float_t *metDPhi = this->column("mumu_met_dPhi");
+      const Float_t *metPhi = this->column("met_phi");
+      this->mumu.phi(n, metDPhi);
+      for (size_t i = 0; i < n; i++) {
+        metDPhi[i] = abs_delta_phi(metDPhi[i], metPhi[i]);
+      }
+      pad(n, this->column("nMuons"), 2, metDPhi);
+
+      for (size_t e = 0; e < n; e++) {
+        for (size_t c = 0; c < this->names.size(); c++) {
+          this->row[c] = this->values[c][e];
+        }
+        tree->Fill();
+      }
+      this->size = 0;
+    }
+
+  private:
+    std::vector<Float_t> muonMass;
+    // Branch buffer of the output tree
+    std::vector<Float_t> row;
+    // [object][field] and the columns filled once per event, see the constructor
+    std::vector<std::vector<Float_t*>> muonColumns, jetColumns;
+    std::vector<Float_t*> eventColumns;
+    Cartesian muon1, muon2, jet1, jet2, mumu, jj, all;
+};
+
+// Computes the derived features of one sample in a multithreaded event loop and writes them as
+// a flat tree. Every thread gathers its events into its own batches and appends them to its own
+// part of the output, which the merger puts together. Returns the number of events written
+ULong64_t write_derived_features(std::string inputPath, std::string outputPath) {
+  InputSample input(inputPath);
+  if (input.name == "") {
+    return 0;
+  }
+  ROOT::RDataFrame df(input.name, input.path);
+  // PU_wgt is copied whatever type it is stored as
+  auto withWeight = df.Define("__weight", "(float)PU_wgt");
+
+  ROOT::TBufferMerger merger(outputPath.c_str());
+  unsigned numSlots = df.GetNSlots();
+  std::vector<std::unique_ptr<FeatureBatch>> batches;
+  std::vector<std::shared_ptr<ROOT::TBufferMergerFile>> files;
+  std::vector<TTree*> trees;
+  for (unsigned slot = 0; slot < numSlots; slot++) {
+    batches.emplace_back(new FeatureBatch());
+    files.push_back(merger.GetFile());
+    files[slot]->cd();
+    trees.push_back(batches[slot]->makeTree());
+  }
+
+  auto count = withWeight.Count();
+  withWeight.ForeachSlot([&](unsigned slot, const rvec_d &muonPt, const rvec_d &muonEta, const rvec_d &muonPhi,
+                             const rvec_d &jetPt, const rvec_d &jetEta, const rvec_d &jetPhi, const rvec_d &jetMass,
+                             const rvec_d &pairMass, Double_t metPt, Double_t metPhi, Double_t metSumEt, Float_t weight) {
+    if (batches[slot]->add(muonPt, muonEta, muonPhi, jetPt, jetEta, jetPhi, jetMass, pairMass, metPt, metPhi, metSumEt, weight)) {
+      batches[slot]->flush(trees[slot]);
+      // Writing hands what's been filled so far over to the merger and empties the tree
+      files[slot]->Write();
+    }
+  }, {"muons.pt", "muons.eta", "muons.phi", "jets.pt", "jets.eta", "jets.phi", "jets.mass",
+      "muPairs.mass", "met.pt", "met.phi", "met.sumEt", "__weight"});
+
+  for (unsigned slot = 0; slot < numSlots; slot++) {
+    batches[slot]->flush(trees[slot]);
+    files[slot]->Write();
+  }
+  return *count;
+}
+
+// Computes the derived features of the signal and background samples and writes them as flat
+// trees, which run_bulk --derived trains on with the DERIVED preset.
+void derived_features() {
+  ThreadBudget::fromEnvironment().apply();
+  gSystem->mkdir(OUTPUT_DIR, kTRUE);
+
+  std::vector<std::string> columns = derived_columns();
+  // The preset has to match what is written here
+  for (variable_tuple var : variable_preset_to_tuples(DERIVED)) {
+    if (std::find(columns.begin(), columns.end(), std::get<0>(var)) == columns.end()) {
+      std::cout << "DERIVED preset variable " << std::get<0>(var) << " is not written!" << std::endl;
+    }
+  }
+
+  std::vector<std::string> inputs = {SIGNAL_FILE, BACKGROUND_FILE};
+  std::vector<std::string> outputs = {"signal_features.root", "background_features.root"};
+  TStopwatch watch;
+  ULong64_t events = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    ULong64_t written = write_derived_features(inputs[i], std::string(OUTPUT_DIR) + outputs[i]);
+    events += written;
+    std::cout << "Wrote " << written << " events to " << OUTPUT_DIR << outputs[i] << std::endl;
+  }
+  watch.Stop();
+  std::cout << columns.size() << " columns in " << watch.RealTime() << " s ("
+            << events / watch.RealTime() << " events/s)" << std::endl;
+}
+
+int main(int argc, char ** argv) {
+    TApplication app("MyApp", &argc, argv);
+    derived_features();
+    return 0;
+}
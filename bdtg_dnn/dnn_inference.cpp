@@ -0,0 +1,431 @@
+#include "TXMLEngine.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "trained_model.cpp"
+
+#ifndef __DNN_INFERENCE
+#define __DNN_INFERENCE
+
+// Events scored together by one task. Activations of a whole batch stay in cache between layers
+#define DNN_BATCH_EVENTS 256
+// Rows of a layer's weight matrix unpacked at once when the weights aren't stored as floats
+#define DNN_WEIGHT_BLOCK 64
+// Epsilon TMVA's BNORM layer uses unless told otherwise
+#define DNN_BNORM_EPSILON 1e-4
+
+// How the weights of each layer are kept in memory. Smaller types are unpacked into floats
+// one block of rows at a time while scoring.
+typedef enum {
+  WEIGHTS_FLOAT32, WEIGHTS_FLOAT16, WEIGHTS_INT8
+} weight_precision;
+
+// Activation functions, numbered like TMVA::DNN::EActivationFunction in the weights file
+typedef enum {
+  ACTIVATION_IDENTITY, ACTIVATION_RELU, ACTIVATION_SIGMOID, ACTIVATION_TANH,
+  ACTIVATION_SYMM_RELU, ACTIVATION_SOFT_SIGN, ACTIVATION_GAUSS, ACTIVATION_FAST_TANH
+} dnn_activation;
+
+std::string precision_to_string(weight_precision p) {
+  switch(p) {
+    case WEIGHTS_FLOAT32:
+      return "float32";
+    case WEIGHTS_FLOAT16:
+      return "float16";
+    case WEIGHTS_INT8:
+      return "int8";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// IEEE half precision conversions, rounding to nearest even
+UShort_t float_to_half(Float_t value) {
+  UInt_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  UInt_t sign = (bits >> 16) & 0x8000;
+  UInt_t mantissa = bits & 0x7fffff;
+  Int_t exponent = (Int_t)((bits >> 23) & 0xff) - 127 + 15;
+  if (((bits >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+  }
+  if (exponent >= 31) {
+    return sign | 0x7c00;
+  }
+  UInt_t half, rest, halfway;
+  if (exponent <= 0) {
+    // Too small for a normal half, becomes subnormal (or zero)
+    if (exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    Int_t shift = 14 - exponent;
+    half = mantissa >> shift;
+    rest = mantissa & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+  } else {
+    half = (exponent << 10) | (mantissa >> 13);
+    rest = mantissa & 0x1fff;
+    halfway = 0x1000;
+  }
+  // A carry out of the mantissa correctly bumps the exponent
+  if (rest > halfway || (rest == halfway && (half & 1))) {
+    half++;
+  }
+  return sign | half;
+}
+
+Float_t half_to_float(UShort_t half) {
+  UInt_t sign = (UInt_t)(half & 0x8000) << 16;
+  UInt_t exponent = (half >> 10) & 0x1f;
+  UInt_t mantissa = half & 0x3ff;
+  UInt_t bits;
+  if (exponent == 0 && mantissa == 0) {
+    bits = sign;
+  } else if (exponent == 0) {
+    // Subnormal, shift it until it's a normal float
+    exponent = 127 - 15 + 1;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+  Float_t value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// A fully connected layer, output = activation(input * weights + biases). The weights are
+// stored transposed (numInputs rows of numOutputs), so the innermost loop runs over
+// consecutive outputs and vectorizes.
+class InferenceLayer {
+  public:
+    Int_t numInputs;
+    Int_t numOutputs;
+    dnn_activation activation;
+    weight_precision precision;
+    std::vector<Float_t> weights;
+    std::vector<UShort_t> halfWeights;
+    // Signed explicitly, plain char (Char_t) is unsigned on ARM
+    std::vector<SChar_t> quantizedWeights;
+    // int8 only: one scale per output, weight = quantized * scale
+    std::vector<Float_t> scales;
+    std::vector<Float_t> biases;
+
+    // weights[i * numOutputs + o] connects input i to output o
+    InferenceLayer(Int_t numInputs, Int_t numOutputs, std::vector<Float_t> weights, std::vector<Float_t> biases, dnn_activation activation) {
+      this->numInputs = numInputs;
+      this->numOutputs = numOutputs;
+      this->weights = weights;
+      this->biases = biases;
+      this->activation = activation;
+      this->precision = WEIGHTS_FLOAT32;
+    }
+
+    // Converts the stored weights, the float copy is dropped unless it's the one kept
+    void setPrecision(weight_precision precision) {
+      this->precision = precision;
+      if (precision == WEIGHTS_FLOAT16) {
+        this->halfWeights.resize(this->weights.size());
+        for (size_t i = 0; i < this->weights.size(); i++) {
+          this->halfWeights[i] = float_to_half(this->weights[i]);
+        }
+      } else if (precision == WEIGHTS_INT8) {
+        // Symmetric quantization with the largest weight of each output mapped to 127
+        this->scales.assign(this->numOutputs, 0);
+        for (Int_t i = 0; i < this->numInputs; i++) {
+          for (Int_t o = 0; o < this->numOutputs; o++) {
+            this->scales[o] = std::max(this->scales[o], std::abs(this->weights[i * this->numOutputs + o]) / 127);
+          }
+        }
+        this->quantizedWeights.resize(this->weights.size());
+        for (Int_t i = 0; i < this->numInputs; i++) {
+          for (Int_t o = 0; o < this->numOutputs; o++) {
+            Float_t scale = this->scales[o] > 0 ? this->scales[o] : 1;
+            this->quantizedWeights[i * this->numOutputs + o] = (SChar_t)std::lround(this->weights[i * this->numOutputs + o] / scale);
+          }
+        }
+      }
+      if (precision != WEIGHTS_FLOAT32) {
+        std::vector<Float_t>().swap(this->weights);
+      }
+    }
+
+    size_t weightBytes() const {
+      return this->weights.size() * sizeof(Float_t) + this->halfWeights.size() * sizeof(UShort_t)
+           + this->quantizedWeights.size() * sizeof(SChar_t) + (this->scales.size() + this->biases.size()) * sizeof(Float_t);
+    }
+
+    // Computes the layer for numEvents events at once. input holds numInputs values per event,
+    // output gets numOutputs values per event, scratch must hold DNN_WEIGHT_BLOCK * numOutputs floats.
+    void forward(const Float_t *input, Int_t numEvents, Float_t *output, Float_t *scratch) const {
+      const Int_t width = this->numOutputs;
+      for (Int_t e = 0; e < numEvents; e++) {
+        std::memcpy(output + e * width, this->biases.data(), width * sizeof(Float_t));
+      }
+      for (Int_t begin = 0; begin < this->numInputs; begin += DNN_WEIGHT_BLOCK) {
+        Int_t end = std::min(this->numInputs, begin + DNN_WEIGHT_BLOCK);
+        const Float_t *block = this->unpack(begin, end, scratch);
+        for (Int_t e = 0; e < numEvents; e++) {
+          const Float_t *in = input + e * this->numInputs;
+          Float_t *__restrict__ out = output + e * width;
+          for (Int_t i = begin; i < end; i++) {
+            const Float_t a = in[i];
+            const Float_t *__restrict__ row = block + (i - begin) * width;
+            for (Int_t o = 0; o < width; o++) {
+              out[o] += a * row[o];
+            }
+          }
+        }
+      }
+      this->activate(output, numEvents * width);
+    }
+
+  private:
+    // Rows begin..end of the weights as floats, unpacked into scratch if they're stored smaller
+    const Float_t *unpack(Int_t begin, Int_t end, Float_t *scratch) const {
+      const Int_t width = this->numOutputs;
+      if (this->precision == WEIGHTS_FLOAT32) {
+        return this->weights.data() + begin * width;
+      }
+      for (Int_t i = begin; i < end; i++) {
+        Float_t *row = scratch + (i - begin) * width;
+        if (this->precision == WEIGHTS_FLOAT16) {
+          const UShort_t *stored = this->halfWeights.data() + i * width;
+          for (Int_t o = 0; o < width; o++) {
+            row[o] = half_to_float(stored[o]);
+          }
+        } else {
+          const SChar_t *stored = this->quantizedWeights.data() + i * width;
+          for (Int_t o = 0; o < width; o++) {
+            row[o] = stored[o] * this->scales[o];
+          }
+        }
+      }
+      return scratch;
+    }
+
+    void activate(Float_t *values, Int_t size) const {
+      switch (this->activation) {
+        case ACTIVATION_IDENTITY:
+          break;
+        case ACTIVATION_RELU:
+          for (Int_t i = 0; i < size; i++) values[i] = values[i] > 0 ? values[i] : 0;
+          break;
+        case ACTIVATION_SIGMOID:
+          for (Int_t i = 0; i < size; i++) values[i] = 1 / (1 + std::exp(-values[i]));
+          break;
+        case ACTIVATION_TANH:
+        case ACTIVATION_FAST_TANH:
+          for (Int_t i = 0; i < size; i++) values[i] = std::tanh(values[i]);
+          break;
+        case ACTIVATION_SYMM_RELU:
+          for (Int_t i = 0; i < size; i++) values[i] = std::abs(values[i]);
+          break;
+        case ACTIVATION_SOFT_SIGN:
+          for (Int_t i = 0; i < size; i++) values[i] = values[i] / (1 + std::abs(values[i]));
+          break;
+        case ACTIVATION_GAUSS:
+          for (Int_t i = 0; i < size; i++) values[i] = std::exp(-values[i] * values[i]);
+          break;
+      }
+    }
+};
+
+// Reads a matrix TMVA wrote into the weights file (Rows, Columns and the values row by row)
+std::vector<Float_t> read_xml_matrix(TXMLEngine &xml, XMLNodePointer_t layer, std::string name, Int_t &rows, Int_t &columns) {
+  std::vector<Float_t> values;
+  rows = columns = 0;
+  for (XMLNodePointer_t node = xml.GetChild(layer); node != NULL; node = xml.GetNext(node)) {
+    if (name != xml.GetNodeName(node)) {
+      continue;
+    }
+    rows = xml.GetIntAttr(node, "Rows");
+    columns = xml.GetIntAttr(node, "Columns");
+    const char *content = xml.GetNodeContent(node);
+    std::istringstream stream(content != NULL ? content : "");
+    Double_t value;
+    while (stream >> value) {
+      values.push_back(value);
+    }
+  }
+  if ((Int_t)values.size() != rows * columns) {
+    values.clear();
+  }
+  return values;
+}
+
+// A trained TMVA DL classifier (our TMVA_DNN_GPU models) evaluated natively on the CPU, without
+// TMVA::Reader. The dense and batch normalization layers are read from the weights file, and
+// every batch normalization is folded into the dense layer after it: BNORM computes
+// gamma * (x - mean) / sqrt(var + eps) + beta, which is linear in x, so it just rescales the
+// next layer's weights and shifts its biases. What's left is a chain of dense layers,
+// evaluated a batch of events at a time over the thread pool.
+class DenseNetwork {
+  public:
+    std::vector<InferenceLayer> layers;
+    Int_t numInputs;
+    weight_precision precision;
+    Bool_t isValid;
+
+    DenseNetwork(TrainedModel &model, weight_precision precision = WEIGHTS_FLOAT32) {
+      this->numInputs = model.expressions.size();
+      this->precision = precision;
+      this->isValid = model.isValid && this->readWeights(model.weightsFile);
+      for (InferenceLayer &layer : this->layers) {
+        layer.setPrecision(precision);
+      }
+    }
+
+    size_t weightBytes() const {
+      size_t total = 0;
+      for (const InferenceLayer &layer : this->layers) {
+        total += layer.weightBytes();
+      }
+      return total;
+    }
+
+    // Scores numEvents events, inputs holds numInputs values per event. Scores are the
+    // sigmoid of the network output, which is what TMVA::Reader returns for these models.
+    void evaluate(const Float_t *inputs, Long64_t numEvents, Float_t *scores) const {
+      Int_t widest = this->numInputs;
+      for (const InferenceLayer &layer : this->layers) {
+        widest = std::max(widest, layer.numOutputs);
+      }
+      unsigned numBatches = (numEvents + DNN_BATCH_EVENTS - 1) / DNN_BATCH_EVENTS;
+      auto scoreBatch = [&](unsigned batch) {
+        Long64_t begin = (Long64_t)batch * DNN_BATCH_EVENTS;
+        Int_t size = std::min<Long64_t>(DNN_BATCH_EVENTS, numEvents - begin);
+        std::vector<Float_t> a(DNN_BATCH_EVENTS * widest), b(DNN_BATCH_EVENTS * widest), scratch(DNN_WEIGHT_BLOCK * widest);
+        const Float_t *in = inputs + begin * this->numInputs;
+        Float_t *out = a.data();
+        for (const InferenceLayer &layer : this->layers) {
+          layer.forward(in, size, out, scratch.data());
+          in = out;
+          out = out == a.data() ? b.data() : a.data();
+        }
+        for (Int_t e = 0; e < size; e++) {
+          scores[begin + e] = 1 / (1 + std::exp(-in[e]));
+        }
+      };
+      // A single batch isn't worth starting the pool for, small requests are latency bound
+      if (numBatches == 1) {
+        scoreBatch(0);
+        return;
+      }
+      ROOT::TThreadExecutor pool;
+      pool.Foreach(scoreBatch, ROOT::TSeqU(numBatches));
+    }
+
+    std::vector<Float_t> evaluate(const std::vector<Float_t> &inputs) const {
+      std::vector<Float_t> scores(inputs.size() / std::max(1, this->numInputs));
+      this->evaluate(inputs.data(), scores.size(), scores.data());
+      return scores;
+    }
+
+  private:
+    bool readWeights(std::string weightsFile) {
+      TXMLEngine xml;
+      XMLDocPointer_t doc = xml.ParseFile(weightsFile.c_str());
+      if (doc == NULL) {
+        std::cout << "Could not read " << weightsFile << std::endl;
+        return false;
+      }
+      XMLNodePointer_t weights = NULL;
+      for (XMLNodePointer_t node = xml.GetChild(xml.DocGetRootElement(doc)); node != NULL; node = xml.GetNext(node)) {
+        if (std::string(xml.GetNodeName(node)) == "Weights") {
+          weights = node;
+        }
+      }
+
+      // Batch normalization waiting to be folded into the next dense layer, as x * scale + shift
+      std::vector<Float_t> scale, shift;
+      Int_t width = this->numInputs;
+      bool ok = weights != NULL;
+      for (XMLNodePointer_t layer = weights != NULL ? xml.GetChild(weights) : NULL; ok && layer != NULL; layer = xml.GetNext(layer)) {
+        std::string kind = xml.GetNodeName(layer);
+        Int_t rows, columns;
+        if (kind == "DenseLayer") {
+          std::vector<Float_t> w = read_xml_matrix(xml, layer, "Weights", rows, columns);
+          std::vector<Float_t> bias = read_xml_matrix(xml, layer, "Biases", rows, columns);
+          Int_t outputs = bias.size();
+          if (w.size() == 0 || (Int_t)w.size() != outputs * width) {
+            std::cout << "Dense layer " << this->layers.size() << " of " << weightsFile << " doesn't fit its input" << std::endl;
+            ok = false;
+            break;
+          }
+          // TMVA stores outputs x inputs, we want it transposed. Fold in any pending BNORM
+          std::vector<Float_t> transposed(w.size());
+          for (Int_t o = 0; o < outputs; o++) {
+            for (Int_t i = 0; i < width; i++) {
+              Float_t value = w[o * width + i];
+              if (scale.size() > 0) {
+                bias[o] += value * shift[i];
+                value *= scale[i];
+              }
+              transposed[i * outputs + o] = value;
+            }
+          }
+          scale.clear();
+          shift.clear();
+          this->layers.push_back(InferenceLayer(width, outputs, transposed, bias, (dnn_activation)xml.GetIntAttr(layer, "ActivationFunction")));
+          width = outputs;
+        } else if (kind == "BatchNormLayer") {
+          std::vector<Float_t> mean = read_xml_matrix(xml, layer, "Training-mean", rows, columns);
+          std::vector<Float_t> variance = read_xml_matrix(xml, layer, "Training-variance", rows, columns);
+          std::vector<Float_t> gamma = read_xml_matrix(xml, layer, "Gamma", rows, columns);
+          std::vector<Float_t> beta = read_xml_matrix(xml, layer, "Beta", rows, columns);
+          if ((Int_t)mean.size() != width || variance.size() != mean.size() || gamma.size() != mean.size() || beta.size() != mean.size()) {
+            std::cout << "Batch normalization after layer " << this->layers.size() << " of " << weightsFile << " doesn't fit" << std::endl;
+            ok = false;
+            break;
+          }
+          Double_t epsilon = xml.HasAttr(layer, "Epsilon") ? std::stod(xml.GetAttr(layer, "Epsilon")) : DNN_BNORM_EPSILON;
+          std::vector<Float_t> newScale(width), newShift(width);
+          for (Int_t i = 0; i < width; i++) {
+            newScale[i] = gamma[i] / std::sqrt(variance[i] + epsilon);
+            newShift[i] = beta[i] - newScale[i] * mean[i];
+          }
+          // Two normalizations in a row compose into one
+          if (scale.size() > 0) {
+            for (Int_t i = 0; i < width; i++) {
+              newShift[i] += newScale[i] * shift[i];
+              newScale[i] *= scale[i];
+            }
+          }
+          scale = newScale;
+          shift = newShift;
+        } else {
+          std::cout << "Can't evaluate " << kind << " layers natively (" << weightsFile << ")" << std::endl;
+          ok = false;
+        }
+      }
+      xml.FreeDoc(doc);
+
+      // A trailing normalization has no dense layer to go into, it becomes a diagonal one
+      if (ok && scale.size() > 0) {
+        std::vector<Float_t> diagonal(width * width, 0);
+        for (Int_t i = 0; i < width; i++) {
+          diagonal[i * width + i] = scale[i];
+        }
+        this->layers.push_back(InferenceLayer(width, width, diagonal, shift, ACTIVATION_IDENTITY));
+      }
+      if (ok && (this->layers.size() == 0 || this->layers.back().numOutputs != 1)) {
+        std::cout << weightsFile << " isn't a network with a single output" << std::endl;
+        ok = false;
+      }
+      return ok;
+    }
+};
+#endif
@@ -0,0 +1,66 @@
+#include "TROOT.h"
+#include "TStopwatch.h"
+#include "ROOT/TBufferMerger.hxx"
+#include <iostream>
+#include <string>
+#include <vector>
+#include "thread_budget.cpp"
+#include "input_source.cpp"
+#include "fused_evaluator.cpp"
+
+#define SIGNAL_FILE "signal_data.root"
+#define BACKGROUND_FILE "background_data.root"
+
+// Scores every model of the given runs on the events of both samples passing the cut, in one
+// read of each, into a tree per sample (signal and background) with one branch per model and
+// a flag next to it saying whether the model trained on the event
+bool evaluate_models(std::string outputPath, std::vector<std::string> runDirs, std::string cut, Long64_t maxEntries) {
+  FusedEvaluator evaluator(runDirs);
+  if (evaluator.models.size() == 0) {
+    std::cout << "No trained models to evaluate" << std::endl;
+    return false;
+  }
+  std::cout << evaluator.models.size() << " models in " << evaluator.groups.size() << " groups of equal inputs, "
+            << evaluator.features.size() << " features read per event instead of " << evaluator.separateInputs() << std::endl;
+  for (size_t m = 0; m < evaluator.models.size(); m++) {
+    std::cout << "  - " << evaluator.branchNames[m] << ": " << evaluator.models[m].describe() << std::endl;
+  }
+
+  // The merger writes the output as the chunks finish, from the threads filling it
+  ROOT::EnableThreadSafety();
+  ROOT::TBufferMerger merger(outputPath.c_str(), "RECREATE");
+  for (std::string sample : {std::string("signal"), std::string("background")}) {
+    TStopwatch watch;
+    Long64_t entries = evaluator.evaluate(sample == "signal" ? SIGNAL_FILE : BACKGROUND_FILE, sample, merger, cut, maxEntries);
+    watch.Stop();
+    if (entries == 0) {
+      return false;
+    }
+    std::cout << sample << ": " << entries << " events in " << watch.RealTime() << " s, "
+              << entries / watch.RealTime() << " events/s, "
+              << entries * evaluator.models.size() / watch.RealTime() << " scores/s" << std::endl;
+  }
+  std::cout << "Scores written to " << outputPath << std::endl;
+  return true;
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: " << argv[0] << " <output file> <Run-N directory>... [-n <max events per sample>] [-c <cut>]" << std::endl;
+    return 1;
+  }
+  ThreadBudget::fromEnvironment().apply();
+  std::vector<std::string> runDirs;
+  std::string cut = "";
+  Long64_t maxEntries = -1;
+  for (int i = 2; i < argc; i++) {
+    if (std::string(argv[i]) == "-n" && i + 1 < argc) {
+      maxEntries = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "-c" && i + 1 < argc) {
+      cut = argv[++i];
+    } else {
+      runDirs.push_back(argv[i]);
+    }
+  }
+  return evaluate_models(argv[1], runDirs, cut, maxEntries) ? 0 : 1;
+}
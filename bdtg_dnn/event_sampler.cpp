@@ -0,0 +1,141 @@
+#include "TStopwatch.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+#include "input_source.cpp"
+#include "selection_index.cpp"
+
+#ifndef __EVENT_SAMPLER
+#define __EVENT_SAMPLER
+
+// Each thread works through this many chunks on average, so uneven chunks even out
+#define SAMPLER_CHUNKS_PER_THREAD 4
+
+// Random number in (0, 1) belonging to one event. It only depends on the seed and the entry
+// number (splitmix64 of the two), so the sample doesn't depend on how the entries were
+// divided between threads.
+Double_t event_uniform(UInt_t seed, Long64_t entry) {
+  ULong64_t x = ((ULong64_t)seed << 40) ^ (ULong64_t)entry;
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x = x ^ (x >> 31);
+  return ((x >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+// Entries drawn for training and testing, in increasing order
+class EventSample {
+  public:
+    std::vector<Long64_t> train;
+    std::vector<Long64_t> test;
+
+    SelectionBitmap trainBitmap(Long64_t numEntries) {
+      return to_bitmap(this->train, numEntries);
+    }
+    SelectionBitmap testBitmap(Long64_t numEntries) {
+      return to_bitmap(this->test, numEntries);
+    }
+
+  private:
+    static SelectionBitmap to_bitmap(std::vector<Long64_t> &entries, Long64_t numEntries) {
+      SelectionBitmap bitmap(numEntries);
+      for (Long64_t e : entries) {
+        bitmap.set(e);
+      }
+      return bitmap;
+    }
+};
+
+// Draws exact size uniform random samples out of the candidate events of one input in a
+// single parallel pass. Every event gets a random key, each chunk keeps the events with the
+// largest keys in a reservoir, and the reservoirs are merged at the end, so only the sample
+// itself is ever held in memory. Every candidate is equally likely, whatever its weight: the
+// event weights (PU_wgt) are applied by TMVA afterwards, exactly like with SplitMode=Random.
+class EventSampler {
+  public:
+    EventSampler(std::string path) {
+      this->path = path;
+    }
+
+    // Samples numTrain + numTest of the candidates and divides them into training and testing
+    // events. Nothing has to be read from the file; the candidates usually come out of a
+    // SelectionIndex, so the cut isn't evaluated again.
+    EventSample sample(const SelectionBitmap &candidates, Long64_t numTrain, Long64_t numTest, UInt_t seed) {
+      TStopwatch watch;
+      size_t wanted = numTrain + numTest;
+      typedef std::pair<Double_t, Long64_t> keyed_entry;
+
+      Long64_t numEntries = candidates.numEntries;
+      unsigned numChunks = std::max<unsigned>(1, ROOT::GetThreadPoolSize() * SAMPLER_CHUNKS_PER_THREAD);
+      Long64_t chunkSize = (numEntries + numChunks - 1) / numChunks;
+
+      auto sampleChunk = [&](unsigned chunk) {
+        // Smallest key on top, so it's the one to go when a better event comes along
+        std::priority_queue<keyed_entry, std::vector<keyed_entry>, std::greater<keyed_entry>> reservoir;
+        Long64_t begin = chunk * chunkSize;
+        Long64_t end = std::min(numEntries, begin + chunkSize);
+        for (Long64_t e = begin; e < end; e++) {
+          if (!candidates.test(e)) {
+            continue;
+          }
+          Double_t key = event_uniform(seed, e);
+          if (reservoir.size() < wanted) {
+            reservoir.push({key, e});
+          } else if (!reservoir.empty() && key > reservoir.top().first) {
+            reservoir.pop();
+            reservoir.push({key, e});
+          }
+        }
+
+        std::vector<keyed_entry> kept;
+        while (!reservoir.empty()) {
+          kept.push_back(reservoir.top());
+          reservoir.pop();
+        }
+        return kept;
+      };
+
+      ROOT::TThreadExecutor pool;
+      std::vector<std::vector<keyed_entry>> reservoirs = pool.Map(sampleChunk, ROOT::TSeqU(numChunks));
+
+      std::vector<keyed_entry> merged;
+      for (std::vector<keyed_entry> &r : reservoirs) {
+        merged.insert(merged.end(), r.begin(), r.end());
+      }
+      if (merged.size() > wanted) {
+        std::nth_element(merged.begin(), merged.begin() + wanted, merged.end(), std::greater<keyed_entry>());
+        merged.resize(wanted);
+      }
+      if (merged.size() < wanted) {
+        std::cout << "Only " << merged.size() << " candidate events in " << this->path << ", asked for "
+                  << numTrain << " training and " << numTest << " testing" << std::endl;
+      }
+
+      // Which of the drawn events are used for training is decided by a second, independent
+      // number, otherwise the training events would be the ones with the largest keys
+      UInt_t splitSeed = seed ^ 0x5bd1e995;
+      std::sort(merged.begin(), merged.end(), [splitSeed](keyed_entry a, keyed_entry b) {
+        return event_uniform(splitSeed, a.second) < event_uniform(splitSeed, b.second);
+      });
+      EventSample result;
+      for (size_t i = 0; i < merged.size(); i++) {
+        (i < (size_t)numTrain ? result.train : result.test).push_back(merged[i].second);
+      }
+      std::sort(result.train.begin(), result.train.end());
+      std::sort(result.test.begin(), result.test.end());
+
+      watch.Stop();
+      std::cout << "Sampled " << result.train.size() << " training and " << result.test.size() << " testing events out of "
+                << candidates.count() << " in " << this->path << " (" << watch.RealTime() << " s)" << std::endl;
+      return result;
+    }
+
+  private:
+    std::string path;
+};
+#endif
@@ -0,0 +1,111 @@
+#ifndef __FEATURE_SCHEMA
+#define __FEATURE_SCHEMA
+
+// The variable presets as typed schemas. Each preset lists its features once as
+//   FEATURE(name, expression, branch, type, index, missing)
+//  - name: identifier of the feature in the compiled reader
+//  - expression: the TTreeFormula string the preset has always used, which is what TMVA, the
+//    run metadata, the results index and the result cache keep seeing
+//  - branch, type: the leaf the compiled reader reads, and the type it is expected to have in
+//    the tree. The reader checks the leaf's actual type once per input and reads it as what it
+//    is (Float_t, Double_t or Int_t), reporting a leaf that isn't the expected type
+//  - index: the object of the collection to take, SCALAR_FEATURE for a leaf with one value
+//  - missing: the value when the event has fewer objects. 0 is what Alt$(...,0) in
+//    generateDataLoader gives, the ALL preset pads some features with its own value
+// A list expands to whatever the FEATURE macro given to it makes of every entry: the preset
+// strings in variable_preset_to_tuples and the readers in schema_reader.cpp come from the same
+// list, so the two can't disagree.
+#define SCALAR_FEATURE -1
+
+// Expands a feature to its expression, to build a list of strings
+#define SCHEMA_EXPRESSION(name, expression, branch, type, index, missing) expression,
+
+#define MUONS_SCHEMA(FEATURE) \
+  FEATURE(muons_charge, "muons.charge", "muons.charge", Int_t, 0, 0) \
+  FEATURE(muons_pt, "muons.pt", "muons.pt", Double_t, 0, 0) \
+  FEATURE(muons_eta, "muons.eta", "muons.eta", Double_t, 0, 0) \
+  FEATURE(muons_phi, "muons.phi", "muons.phi", Double_t, 0, 0)
+
+#define MUONPAIRS_SCHEMA(FEATURE) \
+  FEATURE(muPairs_mass, "muPairs.mass", "muPairs.mass", Double_t, 0, 0) \
+  FEATURE(muPairs_pt, "muPairs.pt", "muPairs.pt", Double_t, 0, 0) \
+  FEATURE(muPairs_eta, "muPairs.eta", "muPairs.eta", Double_t, 0, 0) \
+  FEATURE(muPairs_phi, "muPairs.phi", "muPairs.phi", Double_t, 0, 0)
+
+#define JETS_SCHEMA(FEATURE) \
+  FEATURE(jets_charge, "jets.charge", "jets.charge", Int_t, 0, 0) \
+  FEATURE(jets_pt, "jets.pt", "jets.pt", Double_t, 0, 0) \
+  FEATURE(jets_eta, "jets.eta", "jets.eta", Double_t, 0, 0) \
+  FEATURE(jets_mass, "jets.mass", "jets.mass", Double_t, 0, 0)
+
+#define MUONPAIRS_AND_JETS_SCHEMA(FEATURE) \
+  FEATURE(muPairs_mass, "muPairs.mass", "muPairs.mass", Double_t, 0, 0) \
+  FEATURE(muPairs_charge, "muPairs.charge", "muPairs.charge", Int_t, 0, 0) \
+  FEATURE(muPairs_pt, "muPairs.pt", "muPairs.pt", Double_t, 0, 0) \
+  FEATURE(muPairs_eta, "muPairs.eta", "muPairs.eta", Double_t, 0, 0) \
+  FEATURE(muPairs_phi, "muPairs.phi", "muPairs.phi", Double_t, 0, 0) \
+  FEATURE(jets_mass, "jets.mass", "jets.mass", Double_t, 0, 0) \
+  FEATURE(jets_charge, "jets.charge", "jets.charge", Int_t, 0, 0) \
+  FEATURE(jets_pt, "jets.pt", "jets.pt", Double_t, 0, 0) \
+  FEATURE(jets_eta, "jets.eta", "jets.eta", Double_t, 0, 0) \
+  FEATURE(jets_phi, "jets.phi", "jets.phi", Double_t, 0, 0)
+
+// So for some reason, muPairs.charge just doesnt work. It used to at one point (super early on),
+// but not anymore. muons.charge, the other muon and jet angles and the leading jet mass were left
+// out as well
+#define ALL_SCHEMA(FEATURE) \
+  FEATURE(muon1_pt, "Alt$(muons.pt[0],-99)", "muons.pt", Double_t, 0, -99) \
+  FEATURE(muon2_pt, "Alt$(muons.pt[1],-99)", "muons.pt", Double_t, 1, -99) \
+  FEATURE(muPairs_mass, "muPairs.mass", "muPairs.mass", Double_t, 0, 0) \
+  FEATURE(muPairs_pt, "muPairs.pt", "muPairs.pt", Double_t, 0, 0) \
+  FEATURE(muPairs_eta, "muPairs.eta", "muPairs.eta", Double_t, 0, 0) \
+  FEATURE(muPairs_phi, "muPairs.phi", "muPairs.phi", Double_t, 0, 0) \
+  FEATURE(muPairs_dR, "muPairs.dR", "muPairs.dR", Double_t, 0, 0) \
+  FEATURE(muPairs_dEta, "muPairs.dEta", "muPairs.dEta", Double_t, 0, 0) \
+  FEATURE(muPairs_dPhi, "muPairs.dPhi", "muPairs.dPhi", Double_t, 0, 0) \
+  FEATURE(muPairs_dPhiStar, "muPairs.dPhiStar", "muPairs.dPhiStar", Double_t, 0, 0) \
+  FEATURE(met_px, "met.px", "met.px", Double_t, SCALAR_FEATURE, 0) \
+  FEATURE(met_py, "met.py", "met.py", Double_t, SCALAR_FEATURE, 0) \
+  FEATURE(met_pt, "met.pt", "met.pt", Double_t, SCALAR_FEATURE, 0) \
+  FEATURE(met_phi, "met.phi", "met.phi", Double_t, SCALAR_FEATURE, 0) \
+  FEATURE(met_sumEt, "met.sumEt", "met.sumEt", Double_t, SCALAR_FEATURE, 0) \
+  FEATURE(jet1_pt, "jets.pt[0]", "jets.pt", Double_t, 0, 0) \
+  FEATURE(jetPairs_mass, "jetPairs.mass", "jetPairs.mass", Double_t, 0, 0) \
+  FEATURE(jetPairs_pt, "jetPairs.pt", "jetPairs.pt", Double_t, 0, 0) \
+  FEATURE(jetPairs_eta, "jetPairs.eta", "jetPairs.eta", Double_t, 0, 0) \
+  FEATURE(jetPairs_phi, "jetPairs.phi", "jetPairs.phi", Double_t, 0, 0) \
+  FEATURE(jetPairs_dR, "jetPairs.dR", "jetPairs.dR", Double_t, 0, 0) \
+  FEATURE(jetPairs_dEta, "jetPairs.dEta", "jetPairs.dEta", Double_t, 0, 0) \
+  FEATURE(jetPairs_dPhi, "jetPairs.dPhi", "jetPairs.dPhi", Double_t, 0, 0)
+
+// Flat columns written by derived_features, only available in its output files. They are all
+// written as floats, already padded
+#define DERIVED_SCHEMA(FEATURE) \
+  FEATURE(muon1_pt, "muon1_pt", "muon1_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(muon1_eta, "muon1_eta", "muon1_eta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(muon2_pt, "muon2_pt", "muon2_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(muon2_eta, "muon2_eta", "muon2_eta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_mass, "mumu_mass", "mumu_mass", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_pt, "mumu_pt", "mumu_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_eta, "mumu_eta", "mumu_eta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_dR, "mumu_dR", "mumu_dR", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_dEta, "mumu_dEta", "mumu_dEta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_dPhi, "mumu_dPhi", "mumu_dPhi", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(nJets, "nJets", "nJets", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jet1_pt, "jet1_pt", "jet1_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jet1_eta, "jet1_eta", "jet1_eta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jet2_pt, "jet2_pt", "jet2_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jet2_eta, "jet2_eta", "jet2_eta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jet3_pt, "jet3_pt", "jet3_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(HT, "HT", "HT", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jj_mass, "jj_mass", "jj_mass", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jj_pt, "jj_pt", "jj_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jj_dR, "jj_dR", "jj_dR", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jj_dEta, "jj_dEta", "jj_dEta", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(jj_dPhi, "jj_dPhi", "jj_dPhi", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumujj_mass, "mumujj_mass", "mumujj_mass", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mu_jet_min_dR, "mu_jet_min_dR", "mu_jet_min_dR", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(met_pt, "met_pt", "met_pt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(met_sumEt, "met_sumEt", "met_sumEt", Float_t, SCALAR_FEATURE, 0) \
+  FEATURE(mumu_met_dPhi, "mumu_met_dPhi", "mumu_met_dPhi", Float_t, SCALAR_FEATURE, 0)
+#endif
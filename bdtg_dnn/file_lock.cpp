@@ -0,0 +1,42 @@
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#ifndef __FILE_LOCK
+#define __FILE_LOCK
+
+// Advisory lock on a file shared between sweeps, held for as long as the object lives. The
+// index files are opened with UPDATE by every sweep (or forked worker) that adds to them, and
+// two of those writing at once leave a corrupt file behind. Writers lock exclusively, readers
+// shared so they never see a half written file. The lock is taken on a "<path>.lock" file
+// next to it, since ROOT opens and closes the file itself.
+class FileLock {
+  public:
+    FileLock(std::string path, bool exclusive) {
+      std::string lockPath = path + ".lock";
+      this->fd = open(lockPath.c_str(), O_RDWR | O_CREAT, 0644);
+      if (this->fd < 0) {
+        std::cout << "Could not open " << lockPath << ", using " << path << " without a lock" << std::endl;
+        return;
+      }
+      while (flock(this->fd, exclusive ? LOCK_EX : LOCK_SH) != 0 && errno == EINTR) {
+      }
+    }
+
+    ~FileLock() {
+      if (this->fd >= 0) {
+        flock(this->fd, LOCK_UN);
+        close(this->fd);
+      }
+    }
+
+    FileLock(const FileLock &) = delete;
+    FileLock &operator=(const FileLock &) = delete;
+
+  private:
+    int fd;
+};
+#endif
@@ -0,0 +1,280 @@
+#include "TFile.h"
+#include "TSystem.h"
+#include "TTree.h"
+#include "TTreeFormula.h"
+#include "TStopwatch.h"
+#include "TMVA/Reader.h"
+#include "ROOT/TBufferMerger.hxx"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <string>
+#include <vector>
+#include "input_source.cpp"
+#include "trained_model.cpp"
+#include "selection_index.cpp"
+#include "hist_gbdt.cpp"
+#include "training_events.cpp"
+
+#ifndef __FUSED_EVALUATOR
+#define __FUSED_EVALUATOR
+
+// Chunks of the sample per thread. Every chunk books its own readers, so more chunks balance
+// the load better but parse the weights files more often
+#define EVALUATION_CHUNKS_PER_THREAD 2
+
+// Models taking exactly the same inputs in the same order. They share one TMVA::Reader (and
+// its input buffer) per chunk, each booked under its own tag. A HGBDT forest isn't a TMVA
+// method, it is a group of its own that is loaded once and scored directly by every chunk.
+class ModelGroup {
+  public:
+    std::vector<std::string> expressions;
+    // Declared to the reader as the weights files ask, never evaluated
+    std::vector<std::string> spectators;
+    // Where each input is among the evaluator's features
+    std::vector<size_t> featureIndex;
+    // Indices into the evaluator's models
+    std::vector<size_t> models;
+    std::shared_ptr<HistGBDT> forest;
+};
+
+// Scores many trained models on the same events in a single read. The features every model
+// needs are evaluated once per event, whichever and however many models use them, then every
+// model is fed from them. The models' scores are written side by side, one branch per model
+// and one tree per sample, next to the entry number of the event in its sample. Every score
+// has a flag (the model's branch with _isTrain) saying whether the model trained on the
+// event: 1 if it did, 0 if not, and -1 if its run didn't record its training events for
+// this sample (runs older than training_events.cpp, or trained on other inputs).
+class FusedEvaluator {
+  public:
+    std::vector<TrainedModel> models;
+    // Branch of each model's scores in the output
+    std::vector<std::string> branchNames;
+    // Tag each model is booked under in its group's reader. Method names repeat between runs
+    std::vector<std::string> readerTags;
+    // Union of the inputs of all models, each evaluated once per event
+    std::vector<std::string> features;
+    std::vector<ModelGroup> groups;
+
+    // Every model trained in the given Run-N directories
+    FusedEvaluator(std::vector<std::string> runDirs) {
+      std::map<std::string, size_t> featureIndex;
+      // Models with the same inputs and spectators share a group
+      std::map<std::pair<std::vector<std::string>, std::vector<std::string>>, size_t> groupIndex;
+      for (std::string runDir : runDirs) {
+        for (TrainedModel &model : find_trained_models(runDir)) {
+          std::shared_ptr<HistGBDT> forest;
+          if (model.methodType == "HGBDT") {
+            forest = std::make_shared<HistGBDT>(model);
+            if (!forest->isValid) {
+              continue;
+            }
+          }
+          size_t m = this->models.size();
+          this->models.push_back(model);
+          this->branchNames.push_back(this->branchName(model));
+          this->readerTags.push_back(model.runDir + model.methodName);
+
+          std::pair<std::vector<std::string>, std::vector<std::string>> key(model.expressions, model.spectators);
+          if (forest != NULL || groupIndex.count(key) == 0) {
+            ModelGroup group;
+            group.expressions = model.expressions;
+            group.spectators = model.spectators;
+            group.forest = forest;
+            for (std::string expression : model.expressions) {
+              if (featureIndex.count(expression) == 0) {
+                featureIndex[expression] = this->features.size();
+                this->features.push_back(expression);
+              }
+              group.featureIndex.push_back(featureIndex[expression]);
+            }
+            if (forest == NULL) {
+              groupIndex[key] = this->groups.size();
+            }
+            this->groups.push_back(group);
+          }
+          size_t g = forest != NULL ? this->groups.size() - 1 : groupIndex[key];
+          this->groups[g].models.push_back(m);
+        }
+      }
+    }
+
+    // Inputs the models would read if each was evaluated on its own
+    size_t separateInputs() {
+      size_t inputs = 0;
+      for (TrainedModel &model : this->models) {
+        inputs += model.expressions.size();
+      }
+      return inputs;
+    }
+
+    // Scores every model on the events of a sample passing the cut, among its first maxEntries
+    // events (all of them if negative), and adds them to the output as a tree called outputTree
+    // along with the training flags.
+    // Returns the number of events scored. The chunks are read in parallel, each one filling
+    // its own part of the tree that the merger puts together.
+    Long64_t evaluate(std::string path, std::string outputTree, ROOT::TBufferMerger &merger,
+                      std::string cut = "", Long64_t maxEntries = -1) {
+      std::string treeName;
+      Long64_t numEntries;
+      SelectionBitmap selected;
+      std::vector<SelectionBitmap> trained(this->models.size());
+      std::vector<bool> trainingKnown(this->models.size());
+      {
+        InputSample input(path);
+        if (input.tree == NULL) {
+          std::cout << "Models are evaluated on a TTree " << path << std::endl;
+          return 0;
+        }
+        treeName = input.name;
+        numEntries = input.tree->GetEntries();
+        // Mass windows come out of the input's mass index without a pass over it
+        SelectionIndex selections(input.tree, input_identity(input, numEntries));
+        selected = selections.select(cut);
+        for (size_t m = 0; m < this->models.size(); m++) {
+          trainingKnown[m] = read_training_events(this->models[m].runDir, file_identity(input), trained[m]);
+          if (!trainingKnown[m]) {
+            std::cout << "No training events of " << this->branchNames[m] << " for " << path
+                      << ", its " << this->branchNames[m] << "_isTrain is -1" << std::endl;
+          }
+        }
+      }
+      if (maxEntries >= 0) {
+        numEntries = std::min(numEntries, maxEntries);
+      }
+      unsigned numChunks = std::max<unsigned>(1, ROOT::GetThreadPoolSize() * EVALUATION_CHUNKS_PER_THREAD);
+      Long64_t chunkSize = (numEntries + numChunks - 1) / numChunks;
+
+      ROOT::TThreadExecutor pool;
+      std::vector<Long64_t> scored = pool.Map([&](unsigned chunk) {
+        Long64_t begin = chunk * chunkSize;
+        Long64_t end = std::min(numEntries, begin + chunkSize);
+        if (begin >= end) {
+          return 0LL;
+        }
+        TFile *file = TFile::Open(path.c_str());
+        if (file == NULL || file->IsZombie()) {
+          std::cout << "Could not open " << path << " for events " << begin << " to " << end << std::endl;
+          delete file;
+          return 0LL;
+        }
+        Long64_t events = this->evaluateChunk(file->Get<TTree>(treeName.c_str()), begin, end, selected,
+                                              trained, trainingKnown, outputTree, merger);
+        file->Close();
+        delete file;
+        return events;
+      }, ROOT::TSeqU(numChunks));
+      return std::accumulate(scored.begin(), scored.end(), 0LL);
+    }
+
+  private:
+    // Run directory and method, e.g. Run_12_BDTG
+    std::string branchName(TrainedModel &model) {
+      std::string runDir = model.runDir.substr(0, model.runDir.size() - 1);
+      std::string name = to_identifier(std::string(gSystem->BaseName(runDir.c_str())) + "_" + model.methodName);
+      if (std::find(this->branchNames.begin(), this->branchNames.end(), name) != this->branchNames.end()) {
+        name += "_" + std::to_string(this->branchNames.size());
+      }
+      return name;
+    }
+
+    Long64_t evaluateChunk(TTree *tree, Long64_t begin, Long64_t end, const SelectionBitmap &selected,
+                           const std::vector<SelectionBitmap> &trained, const std::vector<bool> &trainingKnown,
+                           std::string outputTree, ROOT::TBufferMerger &merger) {
+      std::set<std::string> branches = referenced_branches(tree, this->features);
+      tree->SetBranchStatus("*", 0);
+      tree->SetCacheSize(MIN_CACHE_BYTES);
+      for (std::string branch : branches) {
+        tree->SetBranchStatus(branch.c_str(), 1);
+        tree->AddBranchToCache(branch.c_str(), true);
+      }
+      tree->SetCacheEntryRange(begin, end);
+
+      std::vector<TTreeFormula*> formulas;
+      for (std::string feature : this->features) {
+        formulas.push_back(new TTreeFormula("feature", feature.c_str(), tree));
+      }
+      std::vector<std::vector<Float_t>> groupInputs(this->groups.size());
+      std::vector<std::vector<Float_t>> groupSpectators(this->groups.size());
+      std::vector<TMVA::Reader*> readers;
+      for (size_t g = 0; g < this->groups.size(); g++) {
+        groupInputs[g].resize(this->groups[g].expressions.size());
+        if (this->groups[g].forest != NULL) {
+          readers.push_back(NULL);
+          continue;
+        }
+        TMVA::Reader *reader = new TMVA::Reader("!Color:Silent");
+        for (size_t i = 0; i < this->groups[g].expressions.size(); i++) {
+          reader->AddVariable(this->groups[g].expressions[i].c_str(), &groupInputs[g][i]);
+        }
+        groupSpectators[g].resize(this->groups[g].spectators.size());
+        for (size_t i = 0; i < this->groups[g].spectators.size(); i++) {
+          reader->AddSpectator(this->groups[g].spectators[i].c_str(), &groupSpectators[g][i]);
+        }
+        for (size_t m : this->groups[g].models) {
+          reader->BookMVA(this->readerTags[m].c_str(), this->models[m].weightsFile.c_str());
+        }
+        readers.push_back(reader);
+      }
+
+      auto output = merger.GetFile();
+      output->cd();
+      Long64_t entry;
+      std::vector<Float_t> values(this->features.size());
+      std::vector<Float_t> scores(this->models.size());
+      std::vector<Char_t> isTrain(this->models.size(), -1);
+      TTree *scoreTree = new TTree(outputTree.c_str(), "Scores of every model");
+      scoreTree->Branch("entry", &entry);
+      for (size_t m = 0; m < this->models.size(); m++) {
+        scoreTree->Branch(this->branchNames[m].c_str(), &scores[m])->SetTitle(this->models[m].describe().c_str());
+        std::string flag = this->branchNames[m] + "_isTrain";
+        scoreTree->Branch(flag.c_str(), &isTrain[m], (flag + "/B").c_str());
+      }
+
+      for (entry = begin; entry < end; entry++) {
+        if (!selected.test(entry)) {
+          continue;
+        }
+        tree->LoadTree(entry);
+        for (size_t f = 0; f < formulas.size(); f++) {
+          formulas[f]->GetNdata();
+          values[f] = formulas[f]->EvalInstance(0);
+        }
+        for (size_t g = 0; g < this->groups.size(); g++) {
+          for (size_t i = 0; i < groupInputs[g].size(); i++) {
+            groupInputs[g][i] = values[this->groups[g].featureIndex[i]];
+          }
+          if (this->groups[g].forest != NULL) {
+            scores[this->groups[g].models[0]] = this->groups[g].forest->response(groupInputs[g]);
+            continue;
+          }
+          for (size_t m : this->groups[g].models) {
+            scores[m] = readers[g]->EvaluateMVA(this->readerTags[m].c_str());
+          }
+        }
+        for (size_t m = 0; m < this->models.size(); m++) {
+          if (trainingKnown[m]) {
+            isTrain[m] = entry < trained[m].numEntries && trained[m].test(entry);
+          }
+        }
+        scoreTree->Fill();
+      }
+      // Writing hands the chunk's tree over to the merger and empties it
+      Long64_t scored = scoreTree->GetEntries();
+      output->Write();
+
+      for (TMVA::Reader *reader : readers) {
+        delete reader;
+      }
+      for (TTreeFormula *f : formulas) {
+        delete f;
+      }
+      return scored;
+    }
+};
+#endif
@@ -0,0 +1,334 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "graph_dataset.cpp"
+
+#ifndef __GNN_INFERENCE
+#define __GNN_INFERENCE
+
+// What gnn/lib/export_weights.py writes into a model directory
+#define GNN_WEIGHTS_FILE "gnn_weights.json"
+// Events scored together as one collated graph
+#define GNN_BATCH_EVENTS 4096
+// Output class of the signal ("Background" and "Signal" are sorted into 0 and 1)
+#define GNN_SIGNAL_CLASS 1
+// Slope GATConv uses for negative attention scores
+#define GAT_NEGATIVE_SLOPE 0.2
+
+// Edge types, named like the HeteroConv keys of gnn/lib/models.py
+#define MUON_MUON "muons__interacts__muons"
+#define MUON_JET "muons__interacts__jets"
+#define JET_JET "jets__interacts__jets"
+
+// Reads a tensor of the exported weights, checking its number of values
+std::vector<Float_t> read_tensor(nlohmann::json &tensors, std::string name, size_t expectedSize) {
+  if (!tensors.contains(name)) {
+    std::cout << "Exported weights are missing " << name << std::endl;
+    return {};
+  }
+  std::vector<Float_t> values = tensors[name]["data"].get<std::vector<Float_t>>();
+  if (expectedSize > 0 && values.size() != expectedSize) {
+    std::cout << name << " has " << values.size() << " values instead of " << expectedSize << std::endl;
+    return {};
+  }
+  return values;
+}
+
+// Output columns of a torch Linear weight (out x in)
+Int_t tensor_rows(nlohmann::json &tensors, std::string name) {
+  return tensors.contains(name) ? tensors[name]["shape"][0].get<Int_t>() : 0;
+}
+
+// x * weight^T (+ bias), weight being a torch Linear weight of out x x.columns
+NodeMatrix linear(const NodeMatrix &x, const std::vector<Float_t> &weight, Int_t outputs, const std::vector<Float_t> &bias = {}) {
+  NodeMatrix result(x.rows, outputs);
+  for (Int_t r = 0; r < x.rows; r++) {
+    const Float_t *in = x.row(r);
+    Float_t *out = result.row(r);
+    for (Int_t o = 0; o < outputs; o++) {
+      const Float_t *w = weight.data() + (size_t)o * x.columns;
+      Float_t sum = bias.size() > 0 ? bias[o] : 0;
+      for (Int_t i = 0; i < x.columns; i++) {
+        sum += in[i] * w[i];
+      }
+      out[o] = sum;
+    }
+  }
+  return result;
+}
+
+// One of the graph convolutions torch_geometric offers, evaluated like it does in eval mode
+class GraphConvolution {
+  public:
+    std::string kind;
+    Int_t outputs;
+    std::vector<Float_t> weight;
+    std::vector<Float_t> bias;
+    // GATConv: attention vectors of the sources and destinations, weight of the destinations
+    std::vector<Float_t> attentionSource;
+    std::vector<Float_t> attentionDestination;
+    std::vector<Float_t> destinationWeight;
+    // SAGEConv: weight applied to the destination node itself
+    std::vector<Float_t> rootWeight;
+    Bool_t isValid;
+
+    GraphConvolution() {
+      this->outputs = 0;
+      this->isValid = false;
+    }
+
+    GraphConvolution(nlohmann::json &layer, Int_t sourceFeatures, Int_t destinationFeatures) {
+      this->kind = layer["kind"].get<std::string>();
+      nlohmann::json &tensors = layer["tensors"];
+      if (this->kind == "GCNConv") {
+        this->outputs = tensor_rows(tensors, "lin.weight");
+        this->weight = read_tensor(tensors, "lin.weight", this->outputs * sourceFeatures);
+        this->bias = read_tensor(tensors, "bias", this->outputs);
+        this->isValid = this->weight.size() > 0 && this->bias.size() > 0;
+      } else if (this->kind == "SAGEConv") {
+        this->outputs = tensor_rows(tensors, "lin_l.weight");
+        this->weight = read_tensor(tensors, "lin_l.weight", this->outputs * sourceFeatures);
+        this->bias = read_tensor(tensors, "lin_l.bias", this->outputs);
+        this->rootWeight = read_tensor(tensors, "lin_r.weight", this->outputs * destinationFeatures);
+        this->isValid = this->weight.size() > 0 && this->bias.size() > 0 && this->rootWeight.size() > 0;
+      } else if (this->kind == "GATConv") {
+        // Only a single attention head, which is what models.py uses
+        std::string source = tensors.contains("lin_src.weight") ? "lin_src.weight" : "lin.weight";
+        this->outputs = tensor_rows(tensors, source);
+        this->weight = read_tensor(tensors, source, this->outputs * sourceFeatures);
+        if (tensors.contains("lin_dst.weight")) {
+          this->destinationWeight = read_tensor(tensors, "lin_dst.weight", this->outputs * destinationFeatures);
+        }
+        this->attentionSource = read_tensor(tensors, "att_src", this->outputs);
+        this->attentionDestination = read_tensor(tensors, "att_dst", this->outputs);
+        this->bias = read_tensor(tensors, "bias", this->outputs);
+        this->isValid = this->weight.size() > 0 && this->attentionSource.size() > 0
+                     && this->attentionDestination.size() > 0 && this->bias.size() > 0;
+      } else {
+        std::cout << "Can't evaluate " << this->kind << " layers" << std::endl;
+        this->isValid = false;
+      }
+    }
+
+    // Computes the convolution for every destination node. sameType is true when sources and
+    // destinations are the same nodes, which is when torch_geometric adds self loops.
+    NodeMatrix apply(const NodeMatrix &source, const NodeMatrix &destination, const CSRAdjacency &edges, bool sameType) const {
+      if (this->kind == "GCNConv") {
+        return this->gcn(source, edges);
+      }
+      if (this->kind == "SAGEConv") {
+        return this->sage(source, destination, edges);
+      }
+      return this->gat(source, destination, edges, sameType);
+    }
+
+  private:
+    // Symmetrically normalized sum over the neighbours and the node itself:
+    // out_i = sum_j h_j / sqrt(deg_i deg_j) + bias, deg counting the self loop
+    NodeMatrix gcn(const NodeMatrix &x, const CSRAdjacency &edges) const {
+      NodeMatrix h = linear(x, this->weight, this->outputs);
+      NodeMatrix out(x.rows, this->outputs);
+      for (Int_t i = 0; i < x.rows; i++) {
+        Float_t inverseRoot = 1 / std::sqrt((Float_t)edges.degree(i) + 1);
+        Float_t *o = out.row(i);
+        const Float_t *self = h.row(i);
+        for (Int_t c = 0; c < this->outputs; c++) {
+          o[c] = this->bias[c] + self[c] * inverseRoot * inverseRoot;
+        }
+        for (Int_t k = edges.offsets[i]; k < edges.offsets[i + 1]; k++) {
+          Int_t j = edges.indices[k];
+          Float_t norm = inverseRoot / std::sqrt((Float_t)edges.degree(j) + 1);
+          const Float_t *neighbour = h.row(j);
+          for (Int_t c = 0; c < this->outputs; c++) {
+            o[c] += norm * neighbour[c];
+          }
+        }
+      }
+      return out;
+    }
+
+    // out_i = lin_l(mean of the neighbours) + lin_r(x_i)
+    NodeMatrix sage(const NodeMatrix &source, const NodeMatrix &destination, const CSRAdjacency &edges) const {
+      NodeMatrix mean(destination.rows, source.columns);
+      for (Int_t i = 0; i < destination.rows; i++) {
+        Int_t degree = edges.degree(i);
+        Float_t *m = mean.row(i);
+        for (Int_t k = edges.offsets[i]; k < edges.offsets[i + 1]; k++) {
+          const Float_t *neighbour = source.row(edges.indices[k]);
+          for (Int_t c = 0; c < source.columns; c++) {
+            m[c] += neighbour[c] / degree;
+          }
+        }
+      }
+      NodeMatrix out = linear(mean, this->weight, this->outputs, this->bias);
+      out.add(linear(destination, this->rootWeight, this->outputs));
+      return out;
+    }
+
+    // Attention weighted sum, alpha_ij = softmax_j(leaky_relu(a_src . h_j + a_dst . h_i))
+    NodeMatrix gat(const NodeMatrix &source, const NodeMatrix &destination, const CSRAdjacency &edges, bool sameType) const {
+      NodeMatrix hSource = linear(source, this->weight, this->outputs);
+      NodeMatrix hDestination = this->destinationWeight.size() == 0
+                              ? hSource : linear(destination, this->destinationWeight, this->outputs);
+      std::vector<Float_t> scoreSource(source.rows), scoreDestination(destination.rows);
+      for (Int_t j = 0; j < source.rows; j++) {
+        for (Int_t c = 0; c < this->outputs; c++) scoreSource[j] += hSource.row(j)[c] * this->attentionSource[c];
+      }
+      for (Int_t i = 0; i < destination.rows; i++) {
+        for (Int_t c = 0; c < this->outputs; c++) scoreDestination[i] += hDestination.row(i)[c] * this->attentionDestination[c];
+      }
+
+      NodeMatrix out(destination.rows, this->outputs);
+      std::vector<Int_t> neighbours;
+      std::vector<Float_t> alpha;
+      for (Int_t i = 0; i < destination.rows; i++) {
+        neighbours.assign(edges.indices.begin() + edges.offsets[i], edges.indices.begin() + edges.offsets[i + 1]);
+        if (sameType) {
+          neighbours.push_back(i);
+        }
+        alpha.resize(neighbours.size());
+        Float_t largest = -INFINITY;
+        for (size_t k = 0; k < neighbours.size(); k++) {
+          Float_t s = scoreSource[neighbours[k]] + scoreDestination[i];
+          alpha[k] = s > 0 ? s : GAT_NEGATIVE_SLOPE * s;
+          largest = std::max(largest, alpha[k]);
+        }
+        Float_t sum = 0;
+        for (Float_t &a : alpha) {
+          a = std::exp(a - largest);
+          sum += a;
+        }
+        Float_t *o = out.row(i);
+        for (Int_t c = 0; c < this->outputs; c++) {
+          o[c] = this->bias[c];
+        }
+        for (size_t k = 0; k < neighbours.size(); k++) {
+          const Float_t *neighbour = hSource.row(neighbours[k]);
+          for (Int_t c = 0; c < this->outputs; c++) {
+            o[c] += alpha[k] / sum * neighbour[c];
+          }
+        }
+      }
+      return out;
+    }
+};
+
+// The heterogeneous muon/jet GNN of gnn/lib/models.py, loaded from the weights
+// gnn/lib/export_weights.py wrote. Like GCN.forward it runs the first HeteroConv (summing the
+// convolutions into each node type), a ReLU, and the final linear layer with a sigmoid.
+class HeteroGNN {
+  public:
+    std::vector<gnn_feature> muonFeatures;
+    std::vector<gnn_feature> jetFeatures;
+    Bool_t useJets;
+    std::map<std::string, GraphConvolution> convolutions;
+    std::vector<Float_t> outputWeight;
+    std::vector<Float_t> outputBias;
+    Int_t hidden;
+    Int_t numClasses;
+    Bool_t isValid;
+
+    HeteroGNN(std::string modelDir) {
+      this->isValid = false;
+      this->hidden = this->numClasses = 0;
+      if (modelDir.size() > 0 && modelDir.back() != '/') {
+        modelDir += "/";
+      }
+      std::ifstream input(modelDir + GNN_WEIGHTS_FILE);
+      if (!input.good()) {
+        std::cout << "No " << GNN_WEIGHTS_FILE << " in " << modelDir << ", run gnn/lib/export_weights.py on it first" << std::endl;
+        return;
+      }
+      nlohmann::json data = nlohmann::json::parse(input);
+      this->useJets = data["generate_jets"].get<bool>();
+      this->muonFeatures = features_from_json(data["muon_features"]);
+      this->jetFeatures = features_from_json(data["jet_features"]);
+
+      bool ok = true;
+      for (auto &layer : data["layers"].items()) {
+        std::string type = layer.key();
+        Int_t sourceFeatures = type.rfind("muons__", 0) == 0 ? this->muonFeatures.size() : this->jetFeatures.size();
+        Int_t destinationFeatures = type.find("__muons", type.size() - 7) != std::string::npos ? this->muonFeatures.size() : this->jetFeatures.size();
+        GraphConvolution conv(layer.value(), sourceFeatures, destinationFeatures);
+        ok = ok && conv.isValid && (this->hidden == 0 || conv.outputs == this->hidden);
+        this->hidden = conv.outputs;
+        this->convolutions[type] = conv;
+      }
+      this->numClasses = tensor_rows(data["lin"], "weight");
+      this->outputWeight = read_tensor(data["lin"], "weight", this->numClasses * this->hidden);
+      this->outputBias = read_tensor(data["lin"], "bias", this->numClasses);
+      this->isValid = ok && this->convolutions.count(MUON_MUON) && this->outputWeight.size() > 0 && this->outputBias.size() > 0;
+      if (!this->isValid) {
+        std::cout << "Could not load the GNN in " << modelDir << std::endl;
+      }
+    }
+
+    // Signal probability of every node, muons first then jets
+    std::pair<std::vector<Float_t>, std::vector<Float_t>> nodeScores(const EventGraphs &graphs) const {
+      NodeMatrix muons = this->convolutions.at(MUON_MUON).apply(graphs.muons, graphs.muons, graphs.muonMuon, true);
+      NodeMatrix jets(graphs.jets.rows, this->hidden);
+      if (this->useJets) {
+        for (std::pair<std::string, const CSRAdjacency*> type : {std::make_pair(std::string(MUON_JET), &graphs.muonJet),
+                                                                 std::make_pair(std::string(JET_JET), &graphs.jetJet)}) {
+          if (this->convolutions.count(type.first)) {
+            bool sameType = type.first == JET_JET;
+            jets.add(this->convolutions.at(type.first).apply(sameType ? graphs.jets : graphs.muons, graphs.jets, *type.second, sameType));
+          }
+        }
+      }
+      return {this->classify(muons), this->classify(jets)};
+    }
+
+    // One score per event, the mean signal probability of its muons (what the training labels)
+    std::vector<Float_t> eventScores(const EventGraphs &graphs) const {
+      std::vector<Float_t> muonScores = this->nodeScores(graphs).first;
+      std::vector<Float_t> scores(graphs.numEvents(), 0);
+      for (Long64_t e = 0; e < graphs.numEvents(); e++) {
+        Int_t first = graphs.muonOffsets[e], last = graphs.muonOffsets[e + 1];
+        for (Int_t m = first; m < last; m++) {
+          scores[e] += muonScores[m] / (last - first);
+        }
+      }
+      return scores;
+    }
+
+  private:
+    std::vector<Float_t> classify(NodeMatrix &h) const {
+      for (Float_t &v : h.values) {
+        v = v > 0 ? v : 0;
+      }
+      NodeMatrix out = linear(h, this->outputWeight, this->numClasses, this->outputBias);
+      Int_t signal = std::min(GNN_SIGNAL_CLASS, this->numClasses - 1);
+      std::vector<Float_t> scores(h.rows);
+      for (Int_t r = 0; r < h.rows; r++) {
+        scores[r] = 1 / (1 + std::exp(-out.row(r)[signal]));
+      }
+      return scores;
+    }
+};
+
+// Scores the events of a tree: reads their graphs in parallel, then scores mini-batches of
+// GNN_BATCH_EVENTS in parallel. The events aren't labelled. Returns the scored entries and their scores.
+std::pair<std::vector<Long64_t>, std::vector<Float_t>> score_events(const HeteroGNN &model, std::string path, std::string treeName, Long64_t maxEntries = -1) {
+  GraphArena arena = read_graphs(path, treeName, model.muonFeatures, model.useJets ? model.jetFeatures : std::vector<gnn_feature>(),
+                                 -1, maxEntries);
+  Long64_t numBatches = (arena.numEvents() + GNN_BATCH_EVENTS - 1) / GNN_BATCH_EVENTS;
+  std::vector<Float_t> scores(arena.numEvents());
+  ROOT::TThreadExecutor pool;
+  pool.Foreach([&](unsigned b) {
+    GraphSlice batch = arena.slice(b * GNN_BATCH_EVENTS, (b + 1) * GNN_BATCH_EVENTS);
+    std::vector<Float_t> batchScores = model.eventScores(batch.collate());
+    std::copy(batchScores.begin(), batchScores.end(), scores.begin() + batch.begin);
+  }, ROOT::TSeqU(numBatches));
+  return {arena.entries, scores};
+}
+#endif
@@ -0,0 +1,76 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TStopwatch.h"
+#include "TMVA/ROCCurve.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include "thread_budget.cpp"
+#include "input_source.cpp"
+#include "gnn_inference.cpp"
+
+#define SIGNAL_FILE "signal_data.root"
+#define BACKGROUND_FILE "background_data.root"
+#define SCORES_FILE "gnn_scores.root"
+
+// Scores the signal and background samples with a GNN trained by gnn/generate_model.py, without
+// python or torch. Writes the scores of every entry into SCORES_FILE in the model directory and
+// reports the throughput and how well the scores separate the samples.
+bool gnn_score(std::string modelDir, Long64_t maxEvents) {
+  HeteroGNN model(modelDir);
+  if (!model.isValid) {
+    return false;
+  }
+  std::vector<Float_t> allScores, weights;
+  std::vector<Bool_t> isSignal;
+  TFile *output = TFile::Open((modelDir + "/" + SCORES_FILE).c_str(), "RECREATE");
+  for (std::string path : {std::string(SIGNAL_FILE), std::string(BACKGROUND_FILE)}) {
+    std::string treeName;
+    {
+      InputSample input(path);
+      if (input.tree == NULL) {
+        std::cout << "GNN scoring reads its events from a TTree " << path << std::endl;
+        return false;
+      }
+      treeName = input.name;
+    }
+    TStopwatch watch;
+    auto scored = score_events(model, path, treeName, maxEvents);
+    watch.Stop();
+    std::cout << path << ": " << scored.first.size() << " events, "
+              << scored.first.size() / watch.RealTime() << " events/s" << std::endl;
+
+    output->cd();
+    Long64_t entry;
+    Float_t score;
+    TTree scores(path == SIGNAL_FILE ? "signal" : "background", "GNN scores");
+    scores.Branch("entry", &entry);
+    scores.Branch("score", &score);
+    for (size_t i = 0; i < scored.first.size(); i++) {
+      entry = scored.first[i];
+      score = scored.second[i];
+      scores.Fill();
+    }
+    scores.Write();
+
+    allScores.insert(allScores.end(), scored.second.begin(), scored.second.end());
+    isSignal.insert(isSignal.end(), scored.second.size(), path == SIGNAL_FILE);
+  }
+  output->Close();
+  delete output;
+
+  weights.assign(allScores.size(), 1);
+  TMVA::ROCCurve roc(allScores, isSignal, weights);
+  std::cout << "ROC integral: " << roc.GetROCIntegral() << std::endl;
+  return true;
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <model directory with " << GNN_WEIGHTS_FILE << "> [max events per sample]" << std::endl;
+    return 1;
+  }
+  ThreadBudget::fromEnvironment().apply();
+  Long64_t maxEvents = argc > 2 ? std::stoll(argv[2]) : -1;
+  return gnn_score(argv[1], maxEvents) ? 0 : 1;
+}
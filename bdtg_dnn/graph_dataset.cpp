@@ -0,0 +1,727 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TTreeFormula.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#ifndef __GRAPH_DATASET
+#define __GRAPH_DATASET
+
+// Identifies the files GraphArena::write makes, followed by GRAPH_FORMAT_VERSION
+#define GRAPH_MAGIC "CMSGRAPH"
+#define GRAPH_FORMAT_VERSION 1
+// Each thread reads or collates this many chunks of events on average
+#define GRAPH_CHUNKS_PER_THREAD 4
+// The training data only has events with exactly this many muons
+#define GNN_NUM_MUONS 2
+#define NUM_EDGE_TYPES 3
+
+// Node types the edges go between, in the order the arena stores them
+typedef enum { MUON_MUON_EDGES, MUON_JET_EDGES, JET_JET_EDGES } edge_type;
+
+// One input feature of a node type and the normalization it was trained with
+typedef struct {
+  std::string name;
+  Double_t mean;
+  Double_t sdev;
+} gnn_feature;
+
+// Features as [{name, mean, sdev}], the way export_weights.py and GraphArena::write store them
+std::vector<gnn_feature> features_from_json(nlohmann::json &list) {
+  std::vector<gnn_feature> features;
+  for (auto &f : list) {
+    features.push_back({f["name"].get<std::string>(), f["mean"].get<Double_t>(), f["sdev"].get<Double_t>()});
+  }
+  return features;
+}
+
+nlohmann::json features_to_json(const std::vector<gnn_feature> &features) {
+  nlohmann::json list = nlohmann::json::array();
+  for (const gnn_feature &f : features) {
+    list.push_back({{"name", f.name}, {"mean", f.mean}, {"sdev", f.sdev}});
+  }
+  return list;
+}
+
+// GRAPH_MAGIC and the header of sizes every graph file starts with
+void write_graph_header(std::ofstream &output, const std::vector<gnn_feature> &muonFeatures,
+                        const std::vector<gnn_feature> &jetFeatures, Long64_t numEvents, Long64_t numMuons,
+                        Long64_t numJets, const Long64_t numEdges[NUM_EDGE_TYPES]) {
+  Long64_t header[] = {GRAPH_FORMAT_VERSION, (Long64_t)muonFeatures.size(), (Long64_t)jetFeatures.size(),
+                       numEvents, numMuons, numJets,
+                       numEdges[MUON_MUON_EDGES], numEdges[MUON_JET_EDGES], numEdges[JET_JET_EDGES]};
+  output.write(GRAPH_MAGIC, strlen(GRAPH_MAGIC));
+  output.write((const char*)header, sizeof(header));
+}
+
+// The features of a graph file, written into <path>.json
+bool write_graph_description(std::string path, const std::vector<gnn_feature> &muonFeatures,
+                             const std::vector<gnn_feature> &jetFeatures) {
+  std::ofstream description(path + ".json");
+  description << nlohmann::json({{"muon_features", features_to_json(muonFeatures)},
+                                 {"jet_features", features_to_json(jetFeatures)}});
+  return description.good();
+}
+
+// Row-major matrix of node features, one row per node
+class NodeMatrix {
+  public:
+    Int_t rows;
+    Int_t columns;
+    std::vector<Float_t> values;
+
+    NodeMatrix(Int_t rows = 0, Int_t columns = 0) {
+      this->rows = rows;
+      this->columns = columns;
+      this->values.assign((size_t)rows * columns, 0);
+    }
+
+    Float_t *row(Int_t r) {
+      return this->values.data() + (size_t)r * this->columns;
+    }
+    const Float_t *row(Int_t r) const {
+      return this->values.data() + (size_t)r * this->columns;
+    }
+
+    void add(const NodeMatrix &other) {
+      for (size_t i = 0; i < this->values.size(); i++) {
+        this->values[i] += other.values[i];
+      }
+    }
+};
+
+// Edges into every destination node in compressed sparse row form: the sources of node i
+// are indices[offsets[i]] up to indices[offsets[i + 1]]
+class CSRAdjacency {
+  public:
+    std::vector<Int_t> offsets;
+    std::vector<Int_t> indices;
+
+    CSRAdjacency() {
+      this->offsets.push_back(0);
+    }
+
+    Int_t degree(Int_t node) const {
+      return this->offsets[node + 1] - this->offsets[node];
+    }
+};
+
+// A mini-batch of event graphs collated into one disconnected graph, nodes numbered from 0
+// within the batch. Muon nodes of event e are muonOffsets[e] up to muonOffsets[e + 1], same for jets.
+class EventGraphs {
+  public:
+    std::vector<Long64_t> entries;
+    std::vector<Int_t> labels;
+    std::vector<Int_t> muonOffsets;
+    std::vector<Int_t> jetOffsets;
+    NodeMatrix muons;
+    NodeMatrix jets;
+    CSRAdjacency muonMuon;
+    CSRAdjacency muonJet;
+    CSRAdjacency jetJet;
+
+    Long64_t numEvents() const {
+      return this->entries.size();
+    }
+};
+
+class GraphSlice;
+
+// Every event's graph stored back to back: the muon rows of all events in one block, the jet rows
+// in another, and the edges of each type in theirs, with per-event offsets into each of them.
+// Edges hold arena-wide node numbers and are grouped by destination node, so the events
+// begin..end are contiguous ranges of every array and a mini-batch is just a view into them.
+class GraphArena {
+  public:
+    std::vector<gnn_feature> muonFeatures;
+    std::vector<gnn_feature> jetFeatures;
+    std::vector<Long64_t> entries;
+    std::vector<Int_t> labels;
+    // muPairs.dR, which generate_csvs uses as the weight of every edge in the event
+    std::vector<Float_t> edgeWeights;
+    std::vector<Long64_t> muonOffsets;
+    std::vector<Long64_t> jetOffsets;
+    std::vector<Long64_t> edgeOffsets[NUM_EDGE_TYPES];
+    std::vector<Float_t> muons;
+    std::vector<Float_t> jets;
+    std::vector<Int_t> edgeSources[NUM_EDGE_TYPES];
+    std::vector<Int_t> edgeDestinations[NUM_EDGE_TYPES];
+
+    GraphArena(std::vector<gnn_feature> muonFeatures = {}, std::vector<gnn_feature> jetFeatures = {}) {
+      this->muonFeatures = muonFeatures;
+      this->jetFeatures = jetFeatures;
+      this->muonOffsets.push_back(0);
+      this->jetOffsets.push_back(0);
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        this->edgeOffsets[t].push_back(0);
+      }
+    }
+
+    Long64_t numEvents() const {
+      return this->entries.size();
+    }
+    Long64_t numMuons() const {
+      return this->muonOffsets.back();
+    }
+    Long64_t numJets() const {
+      return this->jetOffsets.back();
+    }
+
+    // Adds an event and connects its nodes the way gnn/lib/generate_csvs.py does: the muons with
+    // each other, every muon to every jet, and the jets with each other
+    void addEvent(Long64_t entry, Int_t label, Float_t edgeWeight, const Float_t *muonValues, Int_t numMuons,
+                  const Float_t *jetValues, Int_t numJets) {
+      Int_t m0 = this->numMuons(), j0 = this->numJets();
+      this->entries.push_back(entry);
+      this->labels.push_back(label);
+      this->edgeWeights.push_back(edgeWeight);
+      this->muons.insert(this->muons.end(), muonValues, muonValues + numMuons * this->muonFeatures.size());
+      this->jets.insert(this->jets.end(), jetValues, jetValues + numJets * this->jetFeatures.size());
+      this->muonOffsets.push_back(m0 + numMuons);
+      this->jetOffsets.push_back(j0 + numJets);
+      for (Int_t m = 0; m < numMuons; m++) {
+        for (Int_t other = 0; other < numMuons; other++) {
+          if (other != m) this->addEdge(MUON_MUON_EDGES, m0 + other, m0 + m);
+        }
+      }
+      for (Int_t j = 0; j < numJets; j++) {
+        for (Int_t m = 0; m < numMuons; m++) {
+          this->addEdge(MUON_JET_EDGES, m0 + m, j0 + j);
+        }
+        for (Int_t other = 0; other < numJets; other++) {
+          if (other != j) this->addEdge(JET_JET_EDGES, j0 + other, j0 + j);
+        }
+      }
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        this->edgeOffsets[t].push_back(this->edgeSources[t].size());
+      }
+    }
+
+    // Appends events of another arena with the same features, renumbering their nodes
+    void append(const GraphSlice &events);
+    void append(const GraphArena &other);
+
+    // The given events in the given order, e.g. to shuffle them
+    GraphArena select(const std::vector<Long64_t> &events) const;
+
+    GraphSlice slice(Long64_t begin, Long64_t end) const;
+
+    // Writes the arena as one binary file, GRAPH_MAGIC and a header of sizes followed by every
+    // array in the order of the members, and the features into <path>.json. gnn/lib/graph_dataset.py
+    // memory maps these files.
+    bool write(std::string path) const {
+      std::ofstream output(path, std::ios::binary);
+      if (!output.good()) {
+        std::cout << "Could not write " << path << std::endl;
+        return false;
+      }
+      Long64_t numEdges[NUM_EDGE_TYPES];
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        numEdges[t] = this->edgeSources[t].size();
+      }
+      write_graph_header(output, this->muonFeatures, this->jetFeatures, this->numEvents(), this->numMuons(),
+                         this->numJets(), numEdges);
+      write_array(output, this->entries);
+      write_array(output, this->labels);
+      write_array(output, this->edgeWeights);
+      write_array(output, this->muonOffsets);
+      write_array(output, this->jetOffsets);
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        write_array(output, this->edgeOffsets[t]);
+      }
+      write_array(output, this->muons);
+      write_array(output, this->jets);
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        write_array(output, this->edgeSources[t]);
+        write_array(output, this->edgeDestinations[t]);
+      }
+      output.close();
+      return output.good() && write_graph_description(path, this->muonFeatures, this->jetFeatures);
+    }
+
+  private:
+    void addEdge(edge_type type, Int_t source, Int_t destination) {
+      this->edgeSources[type].push_back(source);
+      this->edgeDestinations[type].push_back(destination);
+    }
+
+    template <typename T>
+    static void write_array(std::ofstream &output, const std::vector<T> &values) {
+      output.write((const char*)values.data(), values.size() * sizeof(T));
+    }
+};
+
+// The events begin..end of an arena, without copying any of them
+class GraphSlice {
+  public:
+    const GraphArena *arena;
+    Long64_t begin;
+    Long64_t end;
+
+    Long64_t numEvents() const {
+      return this->end - this->begin;
+    }
+
+    // Collates the slice into a mini-batch, renumbering its nodes from 0 and building the
+    // adjacency of every edge type
+    EventGraphs collate() const {
+      const GraphArena &a = *this->arena;
+      EventGraphs graphs;
+      graphs.entries.assign(a.entries.begin() + this->begin, a.entries.begin() + this->end);
+      graphs.labels.assign(a.labels.begin() + this->begin, a.labels.begin() + this->end);
+      Long64_t m0 = a.muonOffsets[this->begin], j0 = a.jetOffsets[this->begin];
+      for (Long64_t e = this->begin; e <= this->end; e++) {
+        graphs.muonOffsets.push_back(a.muonOffsets[e] - m0);
+        graphs.jetOffsets.push_back(a.jetOffsets[e] - j0);
+      }
+      graphs.muons = copy_rows(a.muons, a.muonFeatures.size(), m0, a.muonOffsets[this->end]);
+      graphs.jets = copy_rows(a.jets, a.jetFeatures.size(), j0, a.jetOffsets[this->end]);
+      graphs.muonMuon = this->adjacency(MUON_MUON_EDGES, m0, m0, graphs.muons.rows);
+      graphs.muonJet = this->adjacency(MUON_JET_EDGES, m0, j0, graphs.jets.rows);
+      graphs.jetJet = this->adjacency(JET_JET_EDGES, j0, j0, graphs.jets.rows);
+      return graphs;
+    }
+
+  private:
+    static NodeMatrix copy_rows(const std::vector<Float_t> &values, Int_t columns, Long64_t first, Long64_t last) {
+      NodeMatrix rows(last - first, columns);
+      std::copy(values.begin() + first * columns, values.begin() + last * columns, rows.values.begin());
+      return rows;
+    }
+
+    // Edges are already grouped by destination, so the CSR offsets are running degree counts
+    CSRAdjacency adjacency(edge_type type, Long64_t sourceShift, Long64_t destinationShift, Int_t numDestinations) const {
+      const GraphArena &a = *this->arena;
+      Long64_t first = a.edgeOffsets[type][this->begin], last = a.edgeOffsets[type][this->end];
+      CSRAdjacency csr;
+      csr.offsets.assign(numDestinations + 1, 0);
+      csr.indices.resize(last - first);
+      for (Long64_t k = first; k < last; k++) {
+        csr.offsets[a.edgeDestinations[type][k] - destinationShift + 1]++;
+        csr.indices[k - first] = a.edgeSources[type][k] - sourceShift;
+      }
+      for (Int_t i = 0; i < numDestinations; i++) {
+        csr.offsets[i + 1] += csr.offsets[i];
+      }
+      return csr;
+    }
+};
+
+GraphSlice GraphArena::slice(Long64_t begin, Long64_t end) const {
+  return {this, std::max(0LL, begin), std::min(this->numEvents(), end)};
+}
+
+void GraphArena::append(const GraphSlice &events) {
+  const GraphArena &other = *events.arena;
+  Long64_t first = events.begin, last = events.end;
+  Long64_t otherM0 = other.muonOffsets[first], otherJ0 = other.jetOffsets[first];
+  Long64_t muonShift = this->numMuons() - otherM0, jetShift = this->numJets() - otherJ0;
+  this->entries.insert(this->entries.end(), other.entries.begin() + first, other.entries.begin() + last);
+  this->labels.insert(this->labels.end(), other.labels.begin() + first, other.labels.begin() + last);
+  this->edgeWeights.insert(this->edgeWeights.end(), other.edgeWeights.begin() + first, other.edgeWeights.begin() + last);
+  this->muons.insert(this->muons.end(), other.muons.begin() + otherM0 * this->muonFeatures.size(),
+                     other.muons.begin() + other.muonOffsets[last] * this->muonFeatures.size());
+  this->jets.insert(this->jets.end(), other.jets.begin() + otherJ0 * this->jetFeatures.size(),
+                    other.jets.begin() + other.jetOffsets[last] * this->jetFeatures.size());
+  for (Long64_t e = first + 1; e <= last; e++) {
+    this->muonOffsets.push_back(other.muonOffsets[e] + muonShift);
+    this->jetOffsets.push_back(other.jetOffsets[e] + jetShift);
+  }
+  for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+    Long64_t sourceShift = t == JET_JET_EDGES ? jetShift : muonShift;
+    Long64_t destinationShift = t == MUON_MUON_EDGES ? muonShift : jetShift;
+    Long64_t edgeShift = (Long64_t)this->edgeSources[t].size() - other.edgeOffsets[t][first];
+    for (Long64_t k = other.edgeOffsets[t][first]; k < other.edgeOffsets[t][last]; k++) {
+      this->edgeSources[t].push_back(other.edgeSources[t][k] + sourceShift);
+      this->edgeDestinations[t].push_back(other.edgeDestinations[t][k] + destinationShift);
+    }
+    for (Long64_t e = first + 1; e <= last; e++) {
+      this->edgeOffsets[t].push_back(other.edgeOffsets[t][e] + edgeShift);
+    }
+  }
+}
+
+void GraphArena::append(const GraphArena &other) {
+  this->append(other.slice(0, other.numEvents()));
+}
+
+GraphArena GraphArena::select(const std::vector<Long64_t> &events) const {
+  GraphArena selected(this->muonFeatures, this->jetFeatures);
+  for (Long64_t e : events) {
+    selected.append(this->slice(e, e + 1));
+  }
+  return selected;
+}
+
+// Splits an arena into mini-batches of batchSize events and collates all of them in parallel
+std::vector<EventGraphs> collate_batches(const GraphArena &arena, Long64_t batchSize) {
+  Long64_t numBatches = (arena.numEvents() + batchSize - 1) / batchSize;
+  ROOT::TThreadExecutor pool;
+  return pool.Map([&](unsigned b) {
+    return arena.slice(b * batchSize, (b + 1) * batchSize).collate();
+  }, ROOT::TSeqU(numBatches));
+}
+
+// Writes a graph file of more events than fit in memory comfortably. Chunks of events are
+// appended as they are read: their node features and edges go straight into spill files next
+// to the output, only the per-event arrays and offsets stay in memory. finish then writes the
+// file with the events in any order, e.g. shuffled, copying each event's rows out of the
+// memory mapped spills and renumbering its nodes.
+class GraphFileWriter {
+  public:
+    GraphFileWriter(std::string path, std::vector<gnn_feature> muonFeatures, std::vector<gnn_feature> jetFeatures)
+      : events(muonFeatures, jetFeatures) {
+      this->path = path;
+      for (Int_t s = 0; s < NUM_SPILLS; s++) {
+        this->spills[s].open(this->spillPath(s), std::ios::binary);
+      }
+    }
+
+    ~GraphFileWriter() {
+      for (Int_t s = 0; s < NUM_SPILLS; s++) {
+        this->spills[s].close();
+        std::remove(this->spillPath(s).c_str());
+      }
+    }
+
+    Long64_t numEvents() const {
+      return this->events.numEvents();
+    }
+
+    // Adds the events of a chunk after those added so far
+    bool append(const GraphArena &chunk) {
+      GraphArena &all = this->events;
+      Long64_t muonShift = all.numMuons(), jetShift = all.numJets();
+      Long64_t edgeShift[NUM_EDGE_TYPES];
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        edgeShift[t] = all.edgeOffsets[t].back();
+      }
+      all.entries.insert(all.entries.end(), chunk.entries.begin(), chunk.entries.end());
+      all.labels.insert(all.labels.end(), chunk.labels.begin(), chunk.labels.end());
+      all.edgeWeights.insert(all.edgeWeights.end(), chunk.edgeWeights.begin(), chunk.edgeWeights.end());
+      for (Long64_t e = 1; e <= chunk.numEvents(); e++) {
+        all.muonOffsets.push_back(chunk.muonOffsets[e] + muonShift);
+        all.jetOffsets.push_back(chunk.jetOffsets[e] + jetShift);
+        for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+          all.edgeOffsets[t].push_back(chunk.edgeOffsets[t][e] + edgeShift[t]);
+        }
+      }
+      spill(this->spills[0], chunk.muons, 0);
+      spill(this->spills[1], chunk.jets, 0);
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        spill(this->spills[2 + 2 * t], chunk.edgeSources[t], t == JET_JET_EDGES ? jetShift : muonShift);
+        spill(this->spills[3 + 2 * t], chunk.edgeDestinations[t], t == MUON_MUON_EDGES ? muonShift : jetShift);
+      }
+      for (Int_t s = 0; s < NUM_SPILLS; s++) {
+        if (!this->spills[s].good()) {
+          std::cout << "Could not write " << this->spillPath(s) << std::endl;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Writes the file with the events in the given order, the same file GraphArena::write would
+    // make of GraphArena::select(order)
+    bool finish(const std::vector<Long64_t> &order) {
+      const GraphArena &a = this->events;
+      Int_t numMuonFeatures = a.muonFeatures.size(), numJetFeatures = a.jetFeatures.size();
+      std::vector<Long64_t> muonOffsets = {0}, jetOffsets = {0}, edgeOffsets[NUM_EDGE_TYPES];
+      std::vector<Long64_t> entries;
+      std::vector<Int_t> labels;
+      std::vector<Float_t> edgeWeights;
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        edgeOffsets[t].push_back(0);
+      }
+      for (Long64_t e : order) {
+        entries.push_back(a.entries[e]);
+        labels.push_back(a.labels[e]);
+        edgeWeights.push_back(a.edgeWeights[e]);
+        muonOffsets.push_back(muonOffsets.back() + a.muonOffsets[e + 1] - a.muonOffsets[e]);
+        jetOffsets.push_back(jetOffsets.back() + a.jetOffsets[e + 1] - a.jetOffsets[e]);
+        for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+          edgeOffsets[t].push_back(edgeOffsets[t].back() + a.edgeOffsets[t][e + 1] - a.edgeOffsets[t][e]);
+        }
+      }
+
+      for (Int_t s = 0; s < NUM_SPILLS; s++) {
+        this->spills[s].close();
+      }
+      const Float_t *muons = (const Float_t*)map_spill(this->spillPath(0), a.numMuons() * numMuonFeatures * sizeof(Float_t));
+      const Float_t *jets = (const Float_t*)map_spill(this->spillPath(1), a.numJets() * numJetFeatures * sizeof(Float_t));
+      if ((muons == NULL && a.numMuons() * numMuonFeatures > 0) || (jets == NULL && a.numJets() * numJetFeatures > 0)) {
+        std::cout << "Could not read back the node features of " << this->path << std::endl;
+        return false;
+      }
+      std::ofstream output(this->path, std::ios::binary);
+      if (!output.good()) {
+        std::cout << "Could not write " << this->path << std::endl;
+        return false;
+      }
+      Long64_t numEdges[NUM_EDGE_TYPES];
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        numEdges[t] = a.edgeOffsets[t].back();
+      }
+      write_graph_header(output, a.muonFeatures, a.jetFeatures, a.numEvents(), a.numMuons(), a.numJets(), numEdges);
+      write_values(output, entries.data(), entries.size());
+      write_values(output, labels.data(), labels.size());
+      write_values(output, edgeWeights.data(), edgeWeights.size());
+      write_values(output, muonOffsets.data(), muonOffsets.size());
+      write_values(output, jetOffsets.data(), jetOffsets.size());
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        write_values(output, edgeOffsets[t].data(), edgeOffsets[t].size());
+      }
+      for (Long64_t e : order) {
+        write_values(output, muons + a.muonOffsets[e] * numMuonFeatures, (a.muonOffsets[e + 1] - a.muonOffsets[e]) * numMuonFeatures);
+      }
+      for (Long64_t e : order) {
+        write_values(output, jets + a.jetOffsets[e] * numJetFeatures, (a.jetOffsets[e + 1] - a.jetOffsets[e]) * numJetFeatures);
+      }
+      unmap_spill(muons, a.numMuons() * numMuonFeatures * sizeof(Float_t));
+      unmap_spill(jets, a.numJets() * numJetFeatures * sizeof(Float_t));
+
+      // Node numbers follow their event to its new place
+      for (Int_t t = 0; t < NUM_EDGE_TYPES; t++) {
+        const std::vector<Long64_t> &sourceOffsets = t == JET_JET_EDGES ? a.jetOffsets : a.muonOffsets;
+        const std::vector<Long64_t> &destinationOffsets = t == MUON_MUON_EDGES ? a.muonOffsets : a.jetOffsets;
+        const std::vector<Long64_t> &newSourceOffsets = t == JET_JET_EDGES ? jetOffsets : muonOffsets;
+        const std::vector<Long64_t> &newDestinationOffsets = t == MUON_MUON_EDGES ? muonOffsets : jetOffsets;
+        for (Int_t side = 0; side < 2; side++) {
+          size_t bytes = numEdges[t] * sizeof(Int_t);
+          const Int_t *nodes = (const Int_t*)map_spill(this->spillPath(2 + 2 * t + side), bytes);
+          if (nodes == NULL && bytes > 0) {
+            std::cout << "Could not read back the edges of " << this->path << std::endl;
+            return false;
+          }
+          const std::vector<Long64_t> &offsets = side == 0 ? sourceOffsets : destinationOffsets;
+          const std::vector<Long64_t> &newOffsets = side == 0 ? newSourceOffsets : newDestinationOffsets;
+          std::vector<Int_t> renumbered;
+          for (size_t i = 0; i < order.size(); i++) {
+            Long64_t e = order[i];
+            Long64_t shift = newOffsets[i] - offsets[e];
+            renumbered.clear();
+            for (Long64_t k = a.edgeOffsets[t][e]; k < a.edgeOffsets[t][e + 1]; k++) {
+              renumbered.push_back(nodes[k] + shift);
+            }
+            write_values(output, renumbered.data(), renumbered.size());
+          }
+          unmap_spill(nodes, bytes);
+        }
+      }
+      output.close();
+      return output.good() && write_graph_description(this->path, a.muonFeatures, a.jetFeatures);
+    }
+
+  private:
+    // Muon rows, jet rows, then the sources and destinations of every edge type
+    static const Int_t NUM_SPILLS = 2 + 2 * NUM_EDGE_TYPES;
+
+    std::string path;
+    // Every array of the added events but the node features and edges
+    GraphArena events;
+    std::ofstream spills[NUM_SPILLS];
+
+    std::string spillPath(Int_t spill) const {
+      return this->path + ".spill" + std::to_string(spill);
+    }
+
+    template <typename T>
+    static void spill(std::ofstream &output, const std::vector<T> &values, Long64_t shift) {
+      if (shift == 0) {
+        write_values(output, values.data(), values.size());
+        return;
+      }
+      std::vector<T> shifted(values);
+      for (T &v : shifted) {
+        v += shift;
+      }
+      write_values(output, shifted.data(), shifted.size());
+    }
+
+    template <typename T>
+    static void write_values(std::ofstream &output, const T *values, Long64_t count) {
+      output.write((const char*)values, count * sizeof(T));
+    }
+
+    // The spill's contents, read by the OS as they are needed. NULL if it is empty
+    static const void *map_spill(std::string path, size_t bytes) {
+      if (bytes == 0) {
+        return NULL;
+      }
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return NULL;
+      }
+      void *data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      return data == MAP_FAILED ? NULL : data;
+    }
+
+    static void unmap_spill(const void *data, size_t bytes) {
+      if (data != NULL) {
+        munmap((void*)data, bytes);
+      }
+    }
+};
+
+// Builds the graphs of events straight from dimuons/tree. A node feature "muons.pt" is element
+// k of that branch for muon k, or its first element if the branch is shorter (muPairs.*), which
+// is how gnn/lib/generate_csvs.py fills them. Only events with two muons are used.
+class GraphReader {
+  public:
+    GraphReader(TTree *tree, const std::vector<gnn_feature> &muonFeatures, const std::vector<gnn_feature> &jetFeatures) {
+      this->tree = tree;
+      this->muonFeatures = muonFeatures;
+      this->jetFeatures = jetFeatures;
+      this->muonCount = new TTreeFormula("muonCount", "Length$(muons.pt)", tree);
+      this->jetCount = new TTreeFormula("jetCount", "nJets", tree);
+      this->edgeWeight = new TTreeFormula("edgeWeight", "muPairs.dR", tree);
+      for (const gnn_feature &f : muonFeatures) {
+        this->muonFormulas.push_back(new TTreeFormula("muon", f.name.c_str(), tree));
+      }
+      for (const gnn_feature &f : jetFeatures) {
+        this->jetFormulas.push_back(new TTreeFormula("jet", f.name.c_str(), tree));
+      }
+    }
+
+    ~GraphReader() {
+      delete this->muonCount;
+      delete this->jetCount;
+      delete this->edgeWeight;
+      for (TTreeFormula *f : this->muonFormulas) delete f;
+      for (TTreeFormula *f : this->jetFormulas) delete f;
+    }
+
+    // Adds the usable events among entries begin..end to an arena, all with the same label
+    void read(GraphArena &arena, Long64_t begin, Long64_t end, Int_t label) {
+      std::vector<Float_t> muonValues, jetValues;
+      for (Long64_t e = begin; e < end; e++) {
+        this->tree->LoadTree(e);
+        this->muonCount->GetNdata();
+        if ((Int_t)this->muonCount->EvalInstance(0) != GNN_NUM_MUONS) {
+          continue;
+        }
+        muonValues.clear();
+        for (Int_t m = 0; m < GNN_NUM_MUONS; m++) {
+          for (size_t f = 0; f < this->muonFormulas.size(); f++) {
+            muonValues.push_back(feature(this->muonFormulas[f], m, this->muonFeatures[f]));
+          }
+        }
+        jetValues.clear();
+        Int_t numJets = 0;
+        if (this->jetFormulas.size() > 0) {
+          this->jetCount->GetNdata();
+          numJets = std::max(0, (Int_t)this->jetCount->EvalInstance(0));
+          for (Int_t j = 0; j < numJets; j++) {
+            for (size_t f = 0; f < this->jetFormulas.size(); f++) {
+              jetValues.push_back(feature(this->jetFormulas[f], j, this->jetFeatures[f]));
+            }
+          }
+        }
+        this->edgeWeight->GetNdata();
+        arena.addEvent(e, label, this->edgeWeight->EvalInstance(0), muonValues.data(), GNN_NUM_MUONS,
+                       jetValues.data(), numJets);
+      }
+    }
+
+  private:
+    TTree *tree;
+    std::vector<gnn_feature> muonFeatures;
+    std::vector<gnn_feature> jetFeatures;
+    TTreeFormula *muonCount;
+    TTreeFormula *jetCount;
+    TTreeFormula *edgeWeight;
+    std::vector<TTreeFormula*> muonFormulas;
+    std::vector<TTreeFormula*> jetFormulas;
+
+    static Float_t feature(TTreeFormula *formula, Int_t index, const gnn_feature &f) {
+      Int_t instances = formula->GetNdata();
+      Double_t value = instances > 0 ? formula->EvalInstance(std::min(index, instances - 1)) : 0;
+      return (value - f.mean) / f.sdev;
+    }
+};
+
+// Reads the graphs of a tree, chunks of entries in parallel, each through its own file handle,
+// and hands the chunks to consume in entry order. Only one chunk per thread is held at a time.
+// False if the file can't be read or consume returns false.
+bool read_graph_chunks(std::string path, std::string treeName, const std::vector<gnn_feature> &muonFeatures,
+                       const std::vector<gnn_feature> &jetFeatures, Int_t label, Long64_t maxEntries,
+                       std::function<bool(const GraphArena&)> consume) {
+  Long64_t numEntries = 0;
+  {
+    TFile *file = TFile::Open(path.c_str());
+    TTree *tree = file != NULL && !file->IsZombie() ? file->Get<TTree>(treeName.c_str()) : NULL;
+    if (tree == NULL) {
+      std::cout << "Could not read " << treeName << " from " << path << std::endl;
+      delete file;
+      return false;
+    }
+    numEntries = tree->GetEntries();
+    file->Close();
+    delete file;
+  }
+  if (maxEntries >= 0) {
+    numEntries = std::min(numEntries, maxEntries);
+  }
+  unsigned numThreads = std::max<unsigned>(1, ROOT::GetThreadPoolSize());
+  unsigned numChunks = numThreads * GRAPH_CHUNKS_PER_THREAD;
+  Long64_t chunkSize = (numEntries + numChunks - 1) / numChunks;
+
+  ROOT::TThreadExecutor pool;
+  for (unsigned first = 0; first < numChunks; first += numThreads) {
+    unsigned numRead = std::min(numThreads, numChunks - first);
+    std::vector<Int_t> opened(numRead, 1);
+    std::vector<GraphArena> chunks = pool.Map([&](unsigned c) {
+      GraphArena arena(muonFeatures, jetFeatures);
+      Long64_t begin = (first + c) * chunkSize;
+      Long64_t end = std::min(numEntries, begin + chunkSize);
+      if (begin >= end) {
+        return arena;
+      }
+      TFile *file = TFile::Open(path.c_str());
+      if (file == NULL || file->IsZombie()) {
+        std::cout << "Could not open " << path << std::endl;
+        delete file;
+        opened[c] = 0;
+        return arena;
+      }
+      {
+        GraphReader reader(file->Get<TTree>(treeName.c_str()), muonFeatures, jetFeatures);
+        reader.read(arena, begin, end, label);
+      }
+      file->Close();
+      delete file;
+      return arena;
+    }, ROOT::TSeqU(numRead));
+    for (unsigned c = 0; c < numRead; c++) {
+      if (!opened[c] || !consume(chunks[c])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Reads the graphs of a tree into an arena, in entry order. Empty if the file can't be read
+GraphArena read_graphs(std::string path, std::string treeName, const std::vector<gnn_feature> &muonFeatures,
+                       const std::vector<gnn_feature> &jetFeatures, Int_t label, Long64_t maxEntries = -1) {
+  GraphArena all(muonFeatures, jetFeatures);
+  bool ok = read_graph_chunks(path, treeName, muonFeatures, jetFeatures, label, maxEntries, [&](const GraphArena &chunk) {
+    all.append(chunk);
+    return true;
+  });
+  return ok ? all : GraphArena(muonFeatures, jetFeatures);
+}
+#endif
@@ -0,0 +1,677 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TH1.h"
+#include "TRandom3.h"
+#include "TStopwatch.h"
+#include "TSystem.h"
+#include "TXMLEngine.h"
+#include "TMVA/Config.h"
+#include "TMVA/DataLoader.h"
+#include "TMVA/DataSet.h"
+#include "TMVA/DataSetInfo.h"
+#include "TMVA/Event.h"
+#include "TMVA/ROCCurve.h"
+#include "TMVA/Types.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "trained_model.cpp"
+
+#ifndef __HIST_GBDT
+#define __HIST_GBDT
+
+// Same settings the BDTG is booked with in RunProperties::fillFactory, so the two can be
+// compared directly
+#define HGBDT_CUTS 20
+#define HGBDT_SHRINKAGE 0.10
+#define HGBDT_BAGGED_FRACTION 0.5
+#define HGBDT_MIN_NODE_FRACTION 0.025
+
+// Nodes with fewer events than this build their histograms on one thread, splitting them up
+// costs more than it saves
+#define HGBDT_PARALLEL_EVENTS 20000
+
+// Feature values of a set of events, one column per variable
+class FeatureColumns {
+  public:
+    std::vector<std::vector<Float_t>> columns;
+    std::vector<Bool_t> isSignal;
+    std::vector<Float_t> weights;
+    // PU_wgt of every event, when the dataset has it as a spectator
+    std::vector<Float_t> pileupWeights;
+
+    Long64_t size() const {
+      return this->weights.size();
+    }
+};
+
+// Copies the training or testing events of a TMVA dataset into columns. The weights already
+// include TMVA's normalization (NormMode), exactly what its own methods train with.
+FeatureColumns dataset_columns(TMVA::DataSetInfo &info, TMVA::Types::ETreeType type) {
+  TMVA::DataSet *data = info.GetDataSet();
+  Long64_t numEvents = data->GetNEvents(type);
+  UInt_t numVariables = info.GetNVariables();
+  Int_t pileupSpectator = -1;
+  for (UInt_t s = 0; s < info.GetNSpectators(); s++) {
+    if (info.GetSpectatorInfo(s).GetExpression() == "PU_wgt") {
+      pileupSpectator = s;
+    }
+  }
+  FeatureColumns result;
+  result.columns.assign(numVariables, std::vector<Float_t>(numEvents));
+  result.isSignal.resize(numEvents);
+  result.weights.resize(numEvents);
+  for (Long64_t e = 0; e < numEvents; e++) {
+    const TMVA::Event *event = data->GetEvent(e, type);
+    for (UInt_t v = 0; v < numVariables; v++) {
+      result.columns[v][e] = event->GetValue(v);
+    }
+    result.isSignal[e] = info.IsSignal(event);
+    result.weights[e] = event->GetWeight();
+    if (pileupSpectator >= 0) {
+      result.pileupWeights.push_back(event->GetSpectator(pileupSpectator));
+    }
+  }
+  return result;
+}
+
+// Feature matrix quantized to one byte per value. Values are stored feature by feature, so
+// filling the histogram of one feature walks its bins in order.
+class QuantizedFeatures {
+  public:
+    Int_t numFeatures;
+    Long64_t numEvents;
+    // Bin b of feature f holds the values in [cuts[f][b-1], cuts[f][b])
+    std::vector<std::vector<Float_t>> cuts;
+    std::vector<UChar_t> bins;
+
+    // Picks up to numCuts cut points per feature at the quantiles of its values
+    static std::vector<std::vector<Float_t>> quantileCuts(const FeatureColumns &data, int numCuts) {
+      std::vector<std::vector<Float_t>> cuts(data.columns.size());
+      for (size_t f = 0; f < data.columns.size(); f++) {
+        std::vector<Float_t> sorted = data.columns[f];
+        std::sort(sorted.begin(), sorted.end());
+        for (int c = 1; c <= numCuts && sorted.size() > 0; c++) {
+          Float_t cut = sorted[std::min(sorted.size() - 1, (size_t)(c * sorted.size() / (numCuts + 1)))];
+          if (cuts[f].size() == 0 || cut > cuts[f].back()) {
+            cuts[f].push_back(cut);
+          }
+        }
+      }
+      return cuts;
+    }
+
+    // Bin of a value, the number of cut points at or below it
+    static UChar_t bin(const std::vector<Float_t> &featureCuts, Float_t value) {
+      return std::upper_bound(featureCuts.begin(), featureCuts.end(), value) - featureCuts.begin();
+    }
+
+    QuantizedFeatures(const FeatureColumns &data, std::vector<std::vector<Float_t>> cuts) {
+      this->numFeatures = data.columns.size();
+      this->numEvents = data.size();
+      this->cuts = cuts;
+      this->bins.resize(this->numFeatures * this->numEvents);
+      ROOT::TThreadExecutor pool;
+      pool.Foreach([&](unsigned f) {
+        UChar_t *column = &this->bins[f * this->numEvents];
+        for (Long64_t e = 0; e < this->numEvents; e++) {
+          column[e] = bin(this->cuts[f], data.columns[f][e]);
+        }
+      }, ROOT::TSeqU(this->numFeatures));
+    }
+
+    UChar_t at(Int_t feature, Long64_t event) const {
+      return this->bins[feature * this->numEvents + event];
+    }
+};
+
+// Gradient, hessian and weight summed over the events falling into one bin
+typedef struct {
+  Double_t gradient;
+  Double_t hessian;
+  Double_t weight;
+} bin_sums;
+
+// One regression tree of the forest, stored as flat arrays of nodes. Node 0 is the root,
+// leaves have feature -1.
+class HistTree {
+  public:
+    std::vector<Int_t> feature;
+    std::vector<UChar_t> splitBin;
+    std::vector<Float_t> threshold;
+    std::vector<Int_t> left;
+    std::vector<Int_t> right;
+    std::vector<Double_t> value;
+
+    Int_t addNode() {
+      this->feature.push_back(-1);
+      this->splitBin.push_back(0);
+      this->threshold.push_back(0);
+      this->left.push_back(-1);
+      this->right.push_back(-1);
+      this->value.push_back(0);
+      return this->feature.size() - 1;
+    }
+
+    // Response for an event of the quantized training data
+    Double_t respond(const QuantizedFeatures &data, Long64_t event) const {
+      Int_t node = 0;
+      while (this->feature[node] >= 0) {
+        node = data.at(this->feature[node], event) <= this->splitBin[node] ? this->left[node] : this->right[node];
+      }
+      return this->value[node];
+    }
+
+    // Response for raw feature values
+    Double_t respond(const Float_t *values) const {
+      Int_t node = 0;
+      while (this->feature[node] >= 0) {
+        node = values[this->feature[node]] < this->threshold[node] ? this->left[node] : this->right[node];
+      }
+      return this->value[node];
+    }
+};
+
+// Space separated values, as the forest's arrays are stored in its weights file
+template<typename T>
+std::string join_values(const std::vector<T> &values) {
+  std::ostringstream out;
+  out.precision(17);
+  for (size_t i = 0; i < values.size(); i++) {
+    out << (i == 0 ? "" : " ") << values[i];
+  }
+  return out.str();
+}
+
+template<typename T>
+std::vector<T> split_values(const char *text) {
+  std::vector<T> values;
+  std::istringstream in(text != NULL ? text : "");
+  T value;
+  while (in >> value) {
+    values.push_back(value);
+  }
+  return values;
+}
+
+// Gradient boosted decision trees built from histograms of quantized features, a much faster
+// replacement for TMVA's kBDT with BoostType=Grad. It uses the same binomial log-likelihood
+// loss and the same response (2/(1+exp(-2F)) - 1), and supports shrinkage and bagging.
+//
+// The features are quantized once. Each node then only needs a histogram of its events'
+// gradients per feature, filled feature by feature in parallel, and its best split is found by
+// scanning the histogram bins. The larger child's histogram is the parent's minus the smaller child's.
+//
+// The trained forest (bin cuts and trees) is saved as a weights file next to TMVA's, which
+// TrainedModel lists like any other method and which loads back into a HistGBDT for scoring.
+class HistGBDT {
+  public:
+    Int_t numTrees;
+    Int_t maxDepth;
+    Int_t numCuts;
+    Double_t shrinkage;
+    Double_t baggedFraction;
+    Double_t minNodeFraction;
+    UInt_t seed;
+    std::vector<std::vector<Float_t>> cuts;
+    std::vector<HistTree> forest;
+    // Number of inputs the forest takes
+    Int_t numInputs;
+    Bool_t isValid;
+
+    // Untrained, bagging with the given seed (the run's splitSeed)
+    HistGBDT(Int_t numTrees, Int_t maxDepth, UInt_t seed) {
+      this->numTrees = numTrees;
+      this->maxDepth = maxDepth;
+      this->numCuts = HGBDT_CUTS;
+      this->shrinkage = HGBDT_SHRINKAGE;
+      this->baggedFraction = HGBDT_BAGGED_FRACTION;
+      this->minNodeFraction = HGBDT_MIN_NODE_FRACTION;
+      this->seed = seed;
+      this->numInputs = 0;
+      this->isValid = true;
+    }
+
+    // A forest trained earlier, from its weights file (see save)
+    HistGBDT(TrainedModel &model) : HistGBDT(0, 0, 0) {
+      this->numInputs = model.expressions.size();
+      this->isValid = model.isValid && model.methodType == "HGBDT" && this->readWeights(model.weightsFile);
+    }
+
+    void train(const FeatureColumns &data) {
+      this->numInputs = data.columns.size();
+      this->cuts = QuantizedFeatures::quantileCuts(data, this->numCuts);
+      QuantizedFeatures quantized(data, this->cuts);
+      Long64_t numEvents = data.size();
+      this->numBins = this->numCuts + 1;
+      this->forest.clear();
+
+      std::vector<Double_t> boosted(numEvents, 0);
+      std::vector<Double_t> gradients(numEvents), hessians(numEvents);
+      Double_t totalWeight = 0;
+      for (Float_t w : data.weights) {
+        totalWeight += w;
+      }
+      TRandom3 random(this->seed);
+      ROOT::TThreadExecutor pool;
+      unsigned numChunks = std::max<unsigned>(1, ROOT::GetThreadPoolSize() * 4);
+      Long64_t chunkSize = (numEvents + numChunks - 1) / numChunks;
+
+      for (Int_t t = 0; t < this->numTrees; t++) {
+        // Residuals of the binomial log-likelihood and their curvature
+        pool.Foreach([&](unsigned chunk) {
+          for (Long64_t e = chunk * chunkSize; e < std::min(numEvents, (chunk + 1) * chunkSize); e++) {
+            Double_t p = 1.0 / (1.0 + std::exp(-2.0 * boosted[e]));
+            Double_t r = (data.isSignal[e] ? 1.0 : 0.0) - p;
+            gradients[e] = r * data.weights[e];
+            hessians[e] = std::abs(r) * (1 - std::abs(r)) * data.weights[e];
+          }
+        }, ROOT::TSeqU(numChunks));
+
+        // Each tree only sees a random part of the events
+        std::vector<Long64_t> bag;
+        bag.reserve(numEvents * this->baggedFraction * 1.1);
+        for (Long64_t e = 0; e < numEvents; e++) {
+          if (random.Rndm() < this->baggedFraction) {
+            bag.push_back(e);
+          }
+        }
+        Double_t minNodeWeight = this->minNodeFraction * totalWeight * this->baggedFraction;
+        HistTree tree = this->growTree(pool, quantized, bag, gradients, hessians, data.weights, minNodeWeight);
+
+        pool.Foreach([&](unsigned chunk) {
+          for (Long64_t e = chunk * chunkSize; e < std::min(numEvents, (chunk + 1) * chunkSize); e++) {
+            boosted[e] += tree.respond(quantized, e);
+          }
+        }, ROOT::TSeqU(numChunks));
+        this->forest.push_back(tree);
+      }
+    }
+
+    // Same scale as TMVA's BDTG response, between -1 (background) and 1 (signal)
+    Double_t response(const Float_t *values) const {
+      Double_t sum = 0;
+      for (const HistTree &tree : this->forest) {
+        sum += tree.respond(values);
+      }
+      return 2.0 / (1.0 + std::exp(-2.0 * sum)) - 1;
+    }
+
+    Double_t response(const std::vector<Float_t> &values) const {
+      return this->response(values.data());
+    }
+
+    // Scores numEvents events, inputs holds numInputs values per event
+    void evaluate(const Float_t *inputs, Long64_t numEvents, Float_t *scores) const {
+      for (Long64_t e = 0; e < numEvents; e++) {
+        scores[e] = this->response(inputs + e * this->numInputs);
+      }
+    }
+
+    std::vector<Float_t> responses(const FeatureColumns &data) const {
+      std::vector<Float_t> scores(data.size());
+      ROOT::TThreadExecutor pool;
+      unsigned numChunks = std::max<unsigned>(1, ROOT::GetThreadPoolSize() * 4);
+      Long64_t chunkSize = (data.size() + numChunks - 1) / numChunks;
+      pool.Foreach([&](unsigned chunk) {
+        std::vector<Float_t> values(data.columns.size());
+        for (Long64_t e = chunk * chunkSize; e < std::min(data.size(), (chunk + 1) * chunkSize); e++) {
+          for (size_t f = 0; f < values.size(); f++) {
+            values[f] = data.columns[f][e];
+          }
+          scores[e] = this->response(values);
+        }
+      }, ROOT::TSeqU(numChunks));
+      return scores;
+    }
+
+    // Writes the forest as a weights file. It lists the inputs the way TMVA's weights files do,
+    // under <MethodSetup Method="HGBDT::<name>">, so TrainedModel finds and reads it like the
+    // others, followed by the bin cuts and every tree's node arrays.
+    void save(std::string weightsFile, std::string name, std::vector<std::string> expressions, std::vector<std::string> labels) const {
+      TXMLEngine xml;
+      XMLNodePointer_t root = xml.NewChild(0, 0, "MethodSetup");
+      xml.NewAttr(root, 0, "Method", ("HGBDT::" + name).c_str());
+      XMLNodePointer_t variables = xml.NewChild(root, 0, "Variables");
+      xml.NewIntAttr(variables, "NVar", expressions.size());
+      for (size_t v = 0; v < expressions.size(); v++) {
+        XMLNodePointer_t variable = xml.NewChild(variables, 0, "Variable");
+        xml.NewIntAttr(variable, "VarIndex", v);
+        xml.NewAttr(variable, 0, "Expression", expressions[v].c_str());
+        xml.NewAttr(variable, 0, "Label", labels[v].c_str());
+      }
+
+      XMLNodePointer_t forest = xml.NewChild(root, 0, "Forest");
+      xml.NewIntAttr(forest, "NTrees", this->forest.size());
+      xml.NewIntAttr(forest, "MaxDepth", this->maxDepth);
+      xml.NewIntAttr(forest, "NCuts", this->numCuts);
+      xml.NewIntAttr(forest, "Seed", this->seed);
+      xml.NewAttr(forest, 0, "Shrinkage", std::to_string(this->shrinkage).c_str());
+      for (const std::vector<Float_t> &featureCuts : this->cuts) {
+        xml.NewChild(forest, 0, "Cuts", join_values(featureCuts).c_str());
+      }
+      for (const HistTree &tree : this->forest) {
+        XMLNodePointer_t node = xml.NewChild(forest, 0, "Tree");
+        xml.NewChild(node, 0, "Feature", join_values(tree.feature).c_str());
+        xml.NewChild(node, 0, "SplitBin", join_values(std::vector<Int_t>(tree.splitBin.begin(), tree.splitBin.end())).c_str());
+        xml.NewChild(node, 0, "Threshold", join_values(tree.threshold).c_str());
+        xml.NewChild(node, 0, "Left", join_values(tree.left).c_str());
+        xml.NewChild(node, 0, "Right", join_values(tree.right).c_str());
+        xml.NewChild(node, 0, "Value", join_values(tree.value).c_str());
+      }
+
+      XMLDocPointer_t doc = xml.NewDoc();
+      xml.DocSetRootElement(doc, root);
+      xml.SaveDoc(doc, weightsFile.c_str());
+      xml.FreeDoc(doc);
+    }
+
+  private:
+    Int_t numBins;
+
+    // Reads what save wrote. Every node has to point inside its tree and at an input
+    bool readWeights(std::string weightsFile) {
+      TXMLEngine xml;
+      XMLDocPointer_t doc = xml.ParseFile(weightsFile.c_str());
+      if (doc == NULL) {
+        std::cout << "Could not read " << weightsFile << std::endl;
+        return false;
+      }
+      XMLNodePointer_t forest = NULL;
+      for (XMLNodePointer_t node = xml.GetChild(xml.DocGetRootElement(doc)); node != NULL; node = xml.GetNext(node)) {
+        if (std::string(xml.GetNodeName(node)) == "Forest") {
+          forest = node;
+        }
+      }
+      bool ok = forest != NULL;
+      if (ok) {
+        this->maxDepth = xml.GetIntAttr(forest, "MaxDepth");
+        this->numCuts = xml.GetIntAttr(forest, "NCuts");
+        this->seed = xml.GetIntAttr(forest, "Seed");
+      }
+      for (XMLNodePointer_t node = ok ? xml.GetChild(forest) : NULL; ok && node != NULL; node = xml.GetNext(node)) {
+        std::string kind = xml.GetNodeName(node);
+        if (kind == "Cuts") {
+          this->cuts.push_back(split_values<Float_t>(xml.GetNodeContent(node)));
+          continue;
+        }
+        if (kind != "Tree") {
+          continue;
+        }
+        HistTree tree;
+        for (XMLNodePointer_t array = xml.GetChild(node); array != NULL; array = xml.GetNext(array)) {
+          std::string name = xml.GetNodeName(array);
+          const char *content = xml.GetNodeContent(array);
+          if (name == "Feature") tree.feature = split_values<Int_t>(content);
+          if (name == "SplitBin") {
+            std::vector<Int_t> bins = split_values<Int_t>(content);
+            tree.splitBin.assign(bins.begin(), bins.end());
+          }
+          if (name == "Threshold") tree.threshold = split_values<Float_t>(content);
+          if (name == "Left") tree.left = split_values<Int_t>(content);
+          if (name == "Right") tree.right = split_values<Int_t>(content);
+          if (name == "Value") tree.value = split_values<Double_t>(content);
+        }
+        Int_t numNodes = tree.feature.size();
+        ok = numNodes > 0 && (Int_t)tree.splitBin.size() == numNodes && (Int_t)tree.threshold.size() == numNodes
+             && (Int_t)tree.left.size() == numNodes && (Int_t)tree.right.size() == numNodes && (Int_t)tree.value.size() == numNodes;
+        for (Int_t n = 0; ok && n < numNodes; n++) {
+          ok = tree.feature[n] < this->numInputs
+               && (tree.feature[n] < 0 || (tree.left[n] > n && tree.left[n] < numNodes && tree.right[n] > n && tree.right[n] < numNodes));
+        }
+        this->forest.push_back(tree);
+      }
+      xml.FreeDoc(doc);
+      if (!ok || this->forest.size() == 0) {
+        std::cout << "No valid forest in " << weightsFile << std::endl;
+        this->forest.clear();
+        return false;
+      }
+      this->numTrees = this->forest.size();
+      return true;
+    }
+
+    // Histogram of every feature over a set of events, histogram[feature * numBins + bin]
+    std::vector<bin_sums> histogram(ROOT::TThreadExecutor &pool, const QuantizedFeatures &data, const std::vector<Long64_t> &events,
+                                    const std::vector<Double_t> &gradients, const std::vector<Double_t> &hessians, const std::vector<Float_t> &weights) {
+      std::vector<bin_sums> sums(data.numFeatures * this->numBins, bin_sums{0, 0, 0});
+      auto fill = [&](unsigned f) {
+        bin_sums *featureSums = &sums[f * this->numBins];
+        const UChar_t *column = &data.bins[f * data.numEvents];
+        for (Long64_t e : events) {
+          bin_sums &s = featureSums[column[e]];
+          s.gradient += gradients[e];
+          s.hessian += hessians[e];
+          s.weight += weights[e];
+        }
+      };
+      if ((Long64_t)events.size() * data.numFeatures < HGBDT_PARALLEL_EVENTS) {
+        for (Int_t f = 0; f < data.numFeatures; f++) {
+          fill(f);
+        }
+      } else {
+        pool.Foreach(fill, ROOT::TSeqU(data.numFeatures));
+      }
+      return sums;
+    }
+
+    // Grows one tree level by level up to maxDepth
+    HistTree growTree(ROOT::TThreadExecutor &pool, const QuantizedFeatures &data, std::vector<Long64_t> rootEvents,
+                      const std::vector<Double_t> &gradients, const std::vector<Double_t> &hessians, const std::vector<Float_t> &weights,
+                      Double_t minNodeWeight) {
+      HistTree tree;
+      typedef struct {
+        Int_t node;
+        Int_t depth;
+        std::vector<Long64_t> events;
+        std::vector<bin_sums> sums;
+      } open_node;
+
+      std::vector<open_node> open;
+      open.push_back({tree.addNode(), 0, rootEvents, this->histogram(pool, data, rootEvents, gradients, hessians, weights)});
+      while (open.size() > 0) {
+        open_node current = std::move(open.back());
+        open.pop_back();
+
+        // Totals of the node, from any one feature's histogram
+        bin_sums total = {0, 0, 0};
+        for (Int_t b = 0; b < this->numBins; b++) {
+          total.gradient += current.sums[b].gradient;
+          total.hessian += current.sums[b].hessian;
+          total.weight += current.sums[b].weight;
+        }
+        tree.value[current.node] = total.hessian > 0 ? this->shrinkage * total.gradient / total.hessian : 0;
+        if (current.depth >= this->maxDepth || total.weight < 2 * minNodeWeight) {
+          continue;
+        }
+
+        // Best split per feature, each feature scanned on its own thread
+        typedef struct {
+          Double_t gain;
+          Int_t bin;
+        } feature_split;
+        auto bestOf = [&](unsigned f) {
+          feature_split best = {0, -1};
+          Double_t parentScore = total.hessian > 0 ? total.gradient * total.gradient / total.hessian : 0;
+          bin_sums leftSums = {0, 0, 0};
+          // Features with few distinct values have fewer cut points than numCuts
+          for (Int_t b = 0; b < (Int_t)this->cuts[f].size(); b++) {
+            const bin_sums &s = current.sums[f * this->numBins + b];
+            leftSums.gradient += s.gradient;
+            leftSums.hessian += s.hessian;
+            leftSums.weight += s.weight;
+            Double_t rightWeight = total.weight - leftSums.weight;
+            Double_t rightHessian = total.hessian - leftSums.hessian;
+            if (leftSums.weight < minNodeWeight || rightWeight < minNodeWeight || leftSums.hessian <= 0 || rightHessian <= 0) {
+              continue;
+            }
+            Double_t rightGradient = total.gradient - leftSums.gradient;
+            Double_t gain = leftSums.gradient * leftSums.gradient / leftSums.hessian
+                          + rightGradient * rightGradient / rightHessian - parentScore;
+            if (gain > best.gain) {
+              best = {gain, b};
+            }
+          }
+          return best;
+        };
+        std::vector<feature_split> splits = pool.Map(bestOf, ROOT::TSeqU(data.numFeatures));
+        Int_t bestFeature = -1;
+        for (Int_t f = 0; f < data.numFeatures; f++) {
+          if (splits[f].bin >= 0 && (bestFeature < 0 || splits[f].gain > splits[bestFeature].gain)) {
+            bestFeature = f;
+          }
+        }
+        if (bestFeature < 0) {
+          continue;
+        }
+
+        Int_t bin = splits[bestFeature].bin;
+        tree.feature[current.node] = bestFeature;
+        tree.splitBin[current.node] = bin;
+        tree.threshold[current.node] = this->cuts[bestFeature][bin];
+        Int_t leftNode = tree.addNode();
+        Int_t rightNode = tree.addNode();
+        tree.left[current.node] = leftNode;
+        tree.right[current.node] = rightNode;
+
+        std::vector<Long64_t> leftEvents, rightEvents;
+        for (Long64_t e : current.events) {
+          (data.at(bestFeature, e) <= bin ? leftEvents : rightEvents).push_back(e);
+        }
+
+        // Only the smaller child gets its own histogram filled
+        bool leftSmaller = leftEvents.size() < rightEvents.size();
+        std::vector<bin_sums> smallSums = this->histogram(pool, data, leftSmaller ? leftEvents : rightEvents, gradients, hessians, weights);
+        std::vector<bin_sums> largeSums = current.sums;
+        for (size_t i = 0; i < largeSums.size(); i++) {
+          largeSums[i].gradient -= smallSums[i].gradient;
+          largeSums[i].hessian -= smallSums[i].hessian;
+          largeSums[i].weight -= smallSums[i].weight;
+        }
+        open.push_back({leftNode, current.depth + 1, leftEvents, leftSmaller ? smallSums : largeSums});
+        open.push_back({rightNode, current.depth + 1, rightEvents, leftSmaller ? largeSums : smallSums});
+      }
+      return tree;
+    }
+};
+
+// Writes a method's scores into TMVA.root the way TMVA does for its own methods: the score
+// distributions, the background rejection vs signal efficiency curve under
+// dataset/<directory>/<method>/, and per-event TrainTree/TestTree for the overtraining checks
+// (with PU_wgt for the significance scan, if the events have it). Returns the ROC integral of
+// the testing events.
+Double_t write_method_outputs(TFile *outputFile, std::string directory, std::string method,
+                              const FeatureColumns &train, const std::vector<Float_t> &trainScores,
+                              const FeatureColumns &test, const std::vector<Float_t> &testScores) {
+  TDirectory *previous = gDirectory;
+  TDirectory *dir = outputFile->mkdir(("dataset/" + directory + "/" + method).c_str(), "", true);
+  dir->cd();
+
+  const char *kinds[2] = {"Train", "Test"};
+  const FeatureColumns *sets[2] = {&train, &test};
+  const std::vector<Float_t> *scores[2] = {&trainScores, &testScores};
+  for (int k = 0; k < 2; k++) {
+    std::string prefix = "MVA_" + method + (k == 0 ? "_Train" : "");
+    TH1D *sig = new TH1D((prefix + "_S").c_str(), (method + " signal").c_str(), 40, -1, 1);
+    TH1D *bgd = new TH1D((prefix + "_B").c_str(), (method + " background").c_str(), 40, -1, 1);
+    char className[64];
+    Float_t weight, score, pileupWeight;
+    bool withPileup = sets[k]->pileupWeights.size() > 0;
+    TTree *tree = new TTree((std::string(kinds[k]) + "Tree").c_str(), (std::string(kinds[k]) + "ing events").c_str());
+    tree->Branch("className", className, "className/C");
+    tree->Branch("weight", &weight, "weight/F");
+    tree->Branch(method.c_str(), &score, (method + "/F").c_str());
+    if (withPileup) {
+      tree->Branch("PU_wgt", &pileupWeight, "PU_wgt/F");
+    }
+    for (Long64_t e = 0; e < sets[k]->size(); e++) {
+      std::strncpy(className, sets[k]->isSignal[e] ? "Signal" : "Background", sizeof(className));
+      weight = sets[k]->weights[e];
+      pileupWeight = withPileup ? sets[k]->pileupWeights[e] : 0;
+      score = (*scores[k])[e];
+      (sets[k]->isSignal[e] ? sig : bgd)->Fill(score, weight);
+      tree->Fill();
+    }
+    tree->Write();
+    sig->Write();
+    bgd->Write();
+  }
+
+  // Background rejection at each signal efficiency, from the testing events
+  std::vector<std::pair<Float_t, Long64_t>> order;
+  Double_t totalS = 0, totalB = 0;
+  for (Long64_t e = 0; e < test.size(); e++) {
+    order.push_back({testScores[e], e});
+    (test.isSignal[e] ? totalS : totalB) += test.weights[e];
+  }
+  std::sort(order.begin(), order.end(), std::greater<std::pair<Float_t, Long64_t>>());
+  TH1D *rejBvsS = new TH1D(("MVA_" + method + "_rejBvsS").c_str(), (method + " background rejection vs signal efficiency").c_str(), 100, 0, 1);
+  Double_t passS = 0, passB = 0;
+  Int_t filled = 0;
+  for (auto &scored : order) {
+    Long64_t e = scored.second;
+    (test.isSignal[e] ? passS : passB) += test.weights[e];
+    while (totalS > 0 && filled < 100 && passS / totalS >= (filled + 0.5) / 100) {
+      rejBvsS->SetBinContent(++filled, totalB > 0 ? 1 - passB / totalB : 1);
+    }
+  }
+  rejBvsS->Write();
+  previous->cd();
+
+  std::vector<Float_t> testWeights(test.weights.begin(), test.weights.end());
+  TMVA::ROCCurve roc(testScores, test.isSignal, testWeights);
+  return roc.GetROCIntegral();
+}
+
+// Times and metrics of one HistGBDT run
+class HistGBDTRun {
+  public:
+    Double_t rocIntegral;
+    Double_t trainTime;
+    Double_t testTime;
+};
+
+// Trains and tests a HistGBDT on exactly the events TMVA uses for this run's dataloader,
+// writes its outputs into the run's TMVA.root next to the TMVA methods and saves the forest
+// in the dataloader's weights directory, where TMVA keeps the weights of its methods
+HistGBDTRun train_hist_gbdt(TMVA::DataLoader *dataloader, RunProperties &properties, TFile *outputFile) {
+  HistGBDTRun run;
+  TMVA::DataSetInfo &info = dataloader->GetDataSetInfo();
+  FeatureColumns train = dataset_columns(info, TMVA::Types::kTraining);
+  FeatureColumns test = dataset_columns(info, TMVA::Types::kTesting);
+
+  TStopwatch trainWatch;
+  HistGBDT gbdt(properties.numTrees, properties.maxDepth, properties.splitSeed);
+  gbdt.train(train);
+  trainWatch.Stop();
+  run.trainTime = trainWatch.RealTime();
+
+  std::vector<std::string> expressions, labels;
+  for (UInt_t v = 0; v < info.GetNVariables(); v++) {
+    expressions.push_back(info.GetVariableInfo(v).GetExpression().Data());
+    labels.push_back(info.GetVariableInfo(v).GetLabel().Data());
+  }
+  std::string weightsDir = std::string(dataloader->GetName()) + "/" + TMVA::gConfig().GetIONames().fWeightFileDir.Data() + "/";
+  gSystem->mkdir(weightsDir.c_str(), kTRUE);
+  gbdt.save(weightsDir + WEIGHTS_PREFIX + method_to_tmva_name(HGBDT) + WEIGHTS_SUFFIX, method_to_tmva_name(HGBDT), expressions, labels);
+
+  TStopwatch testWatch;
+  std::vector<Float_t> trainScores = gbdt.responses(train);
+  std::vector<Float_t> testScores = gbdt.responses(test);
+  testWatch.Stop();
+  run.testTime = testWatch.RealTime();
+
+  run.rocIntegral = write_method_outputs(outputFile, method_to_tmva_directory(HGBDT), method_to_tmva_name(HGBDT),
+                                         train, trainScores, test, testScores);
+  std::cout << method_to_tmva_name(HGBDT) << ": " << gbdt.forest.size() << " trees in " << run.trainTime
+            << " s, ROC integral " << run.rocIntegral << std::endl;
+  return run;
+}
+#endif
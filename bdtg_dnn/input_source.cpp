@@ -0,0 +1,343 @@
+#include "TFile.h"
+#include "TKey.h"
+#include "TTree.h"
+#include "TH1.h"
+#include "TPad.h"
+#include "TRandom3.h"
+#include "TUUID.h"
+#include "TMVA/DataLoader.h"
+#include "TMVA/Types.h"
+#include <ROOT/RDataFrame.hxx>
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+#include <regex>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "read_cache.cpp"
+
+#ifndef __INPUT_SOURCE
+#define __INPUT_SOURCE
+
+// Where the dataset lives inside an input file. The original ntuples keep it in a
+// "dimuons" directory, the sliced outputs of slice_up_tree write it at the top level.
+#define INPUT_DIRECTORY "dimuons"
+#define INPUT_NAME "tree"
+
+// Name of the flat column slice_up_tree writes for one object of a branch (or a branch with a
+// single value, index -1): the leading object keeps the branch's name, the others get their index
+//   ("muPairs.mass", 0) -> "muPairs_mass",  ("muons.pt", 1) -> "muons_pt_1"
+std::string flat_column(std::string branch, int index) {
+  std::string column = std::regex_replace(branch, std::regex("\\."), "_");
+  return index > 0 ? column + "_" + std::to_string(index) : column;
+}
+
+// Turns a TTreeFormula style expression (what the presets and cuts are written in) into one
+// that RDataFrame understands on the flat columns that slice_up_tree writes:
+//   "Alt$(muPairs.mass,0)" -> "(muPairs_mass)",  "jets.pt[0]" -> "jets_pt",
+//   "Alt$(muons.pt[1],-99)" -> "(muons_pt_1)"
+// The sliced columns already hold the object (or the preset's missing value if there is
+// none), which is why the indices and Alt$ go away.
+std::string formula_to_column_expression(std::string formula) {
+  // Alt$(value,default) only matters for missing entries in jagged branches
+  std::string withoutAlt;
+  size_t pos = 0;
+  while (true) {
+    size_t alt = formula.find("Alt$(", pos);
+    if (alt == std::string::npos) {
+      withoutAlt += formula.substr(pos);
+      break;
+    }
+    withoutAlt += formula.substr(pos, alt - pos) + "(";
+    // Copy the first argument, then skip the default value
+    size_t i = alt + 5;
+    int depth = 0;
+    for (; i < formula.size(); i++) {
+      char c = formula[i];
+      if (c == '(') depth++;
+      if (c == ')') depth--;
+      if (depth == 0 && c == ',') break;
+      withoutAlt += c;
+    }
+    for (depth = 0; i < formula.size(); i++) {
+      char c = formula[i];
+      if (c == '(') depth++;
+      if (c == ')') {
+        if (depth == 0) break;
+        depth--;
+      }
+    }
+    withoutAlt += ")";
+    pos = i + 1;
+  }
+
+  std::string noIndex = std::regex_replace(withoutAlt, std::regex("\\[0\\]"), "");
+  noIndex = std::regex_replace(noIndex, std::regex("\\[([1-9][0-9]*)\\]"), "_$1");
+  return std::regex_replace(noIndex, std::regex("([A-Za-z_][A-Za-z0-9_]*)\\.([A-Za-z_][A-Za-z0-9_]*)"), "$1_$2");
+}
+
+// Turns a cut on the original ntuples into the same cut on the flat files that derived_features
+// writes, where the mass window reads the leading pair's mass and the number of pairs:
+//   "Length$(muPairs.mass) == 1 && muPairs.mass[0] < 140" -> "nMuPairs == 1 && muPairs_mass < 140"
+// A window on muPairs.mass without an index passes if any pair is inside it. Only the leading
+// pair is kept in the derived files, so there it is checked on the leading pair alone.
+std::string formula_to_derived_expression(std::string formula) {
+  std::string counted = std::regex_replace(formula, std::regex("Length\\$\\(\\s*muPairs\\.mass\\s*\\)"), "nMuPairs");
+  return std::regex_replace(counted, std::regex("muPairs\\.mass(\\[0\\])?"), "muPairs_mass");
+}
+
+// Makes a name usable as a branch and variable name
+std::string to_identifier(std::string name) {
+  return std::regex_replace(name, std::regex("[^A-Za-z0-9_]"), "_");
+}
+
+// Turns 0 training or testing events into what TMVA makes of them: with both 0 the available
+// events are split in half, with one of them 0 that one gets every event the other doesn't take
+void resolve_split(Long64_t available, Long64_t &numTrain, Long64_t &numTest) {
+  if (numTrain == 0 && numTest == 0) {
+    numTrain = available / 2;
+    numTest = available - numTrain;
+  } else if (numTrain == 0) {
+    numTrain = std::max<Long64_t>(0, available - numTest);
+  } else if (numTest == 0) {
+    numTest = std::max<Long64_t>(0, available - numTrain);
+  }
+}
+
+// One input sample (signal or background), stored either as a TTree or as an RNTuple.
+// TTrees keep going through TMVA exactly like before. RNTuples are read directly with
+// RDataFrame, without ever being converted into a TTree on disk.
+class InputSample {
+  public:
+    std::string path;
+    std::string name;
+    Bool_t isRNTuple;
+    TFile *file;
+    TTree *tree;
+
+    // Opens a sample, looking in the dimuons directory first and then at the top level
+    InputSample(std::string path) {
+      this->path = path;
+      this->isRNTuple = false;
+      this->tree = NULL;
+      this->file = TFile::Open(path.c_str());
+      if (this->file == NULL || this->file->IsZombie()) {
+        std::cout << "Could not open " << path << std::endl;
+        return;
+      }
+
+      for (std::string candidate : {std::string(INPUT_DIRECTORY) + "/" + INPUT_NAME, std::string(INPUT_NAME)}) {
+        TKey *key = NULL;
+        if (candidate.find('/') != std::string::npos) {
+          auto dir = this->file->Get<TDirectoryFile>(INPUT_DIRECTORY);
+          key = dir != NULL ? dir->GetKey(INPUT_NAME) : NULL;
+        } else {
+          key = this->file->GetKey(INPUT_NAME);
+        }
+        if (key == NULL) {
+          continue;
+        }
+        this->name = candidate;
+        // ROOT::RNTuple once it left experimental, ROOT::Experimental::RNTuple before that
+        this->isRNTuple = std::string(key->GetClassName()).find("RNTuple") != std::string::npos;
+        if (!this->isRNTuple) {
+          this->tree = this->file->Get<TTree>(candidate.c_str());
+        }
+        break;
+      }
+      if (this->name == "") {
+        std::cout << "No " << INPUT_NAME << " found in " << path << std::endl;
+      }
+    }
+
+    // Opens the sample again, with a file descriptor of its own. A forked process must, it
+    // shares the parent's descriptors and with them the file offsets. False if that fails
+    bool reopen() {
+      InputSample reopened(this->path);
+      if (reopened.name != this->name || (!this->isRNTuple && reopened.tree == NULL)) {
+        return false;
+      }
+      this->file = reopened.file;
+      this->tree = reopened.tree;
+      return true;
+    }
+
+    Long64_t GetEntries() {
+      if (!this->isRNTuple) {
+        return this->tree->GetEntries();
+      }
+      return *this->dataFrame().Count();
+    }
+
+    // Dataframe over this sample. RDataFrame picks the right reader for TTrees and RNTuples
+    ROOT::RDataFrame dataFrame() {
+      return ROOT::RDataFrame(this->name, this->path);
+    }
+
+    // Expression in the syntax this sample's reader understands
+    std::string expression(std::string formula) {
+      return this->isRNTuple ? formula_to_column_expression(formula) : formula;
+    }
+
+    // Caches and prefetches only what the given expressions read (see optimize_reads). Does
+    // nothing for RNTuples, which prefetch clusters by default.
+    void optimizeReads(std::vector<std::string> formulas) {
+      if (this->isRNTuple || this->tree == NULL) {
+        return;
+      }
+      optimize_reads(this->tree, formulas, this->path);
+    }
+
+    // Columns of an RNTuple that the given expressions need but it doesn't have, e.g. because it
+    // was sliced for another preset. Names of functions aren't columns
+    std::vector<std::string> missingColumns(std::vector<std::string> formulas) {
+      std::vector<std::string> missing;
+      if (!this->isRNTuple) {
+        return missing;
+      }
+      std::vector<std::string> columns = this->dataFrame().GetColumnNames();
+      std::regex identifier("\\b[A-Za-z_][A-Za-z0-9_]*\\b(?!\\s*\\()");
+      for (std::string formula : formulas) {
+        std::string expression = this->expression(formula);
+        for (auto it = std::sregex_iterator(expression.begin(), expression.end(), identifier); it != std::sregex_iterator(); ++it) {
+          std::string name = it->str();
+          if (std::find(columns.begin(), columns.end(), name) == columns.end()
+              && std::find(missing.begin(), missing.end(), name) == missing.end()) {
+            missing.push_back(name);
+          }
+        }
+      }
+      return missing;
+    }
+
+    // Mean and standard deviation of a variable, used for normalization
+    std::pair<Double_t, Double_t> meanAndStdDev(std::string formula) {
+      if (!this->isRNTuple) {
+        // Same thing that was always done for trees: draw it and ask the histogram
+        this->tree->Draw(formula.c_str());
+        auto histo = (TH1D*)gPad->GetPrimitive("htemp");
+        return {histo->GetMean(), histo->GetStdDev()};
+      }
+      auto df = this->dataFrame().Define("__value", "(double)(" + this->expression(formula) + ")");
+      auto mean = df.Mean<double>("__value");
+      auto sdev = df.StdDev<double>("__value");
+      return {*mean, *sdev};
+    }
+
+    // Reads the variables of a run (after the cut) into in-memory trees, split randomly
+    // into numTrain training and numTest testing events (0 meaning what it means to TMVA, see
+    // resolve_split). Every event also keeps its PU_wgt. The number of events passing the cut
+    // goes into numSelected if given. Only used for RNTuple inputs.
+    std::pair<TTree*, TTree*> readSplit(std::vector<variable_tuple> variables, TString cut, TString weight,
+                                       int numTrain, int numTest, UInt_t seed, std::string label,
+                                       Long64_t *numSelected = NULL) {
+      ROOT::RDF::RNode df = this->dataFrame();
+      if (cut != "") {
+        df = df.Filter(this->expression(cut.Data()));
+      }
+      std::vector<ROOT::RDF::RResultPtr<std::vector<double>>> columns;
+      for (size_t i = 0; i < variables.size(); i++) {
+        std::string column = "__var" + std::to_string(i);
+        df = df.Define(column, "(double)(" + this->expression(std::get<0>(variables[i])) + ")");
+      }
+      df = df.Define("__weight", weight == "" ? "1.0" : "(double)(" + this->expression(weight.Data()) + ")");
+      df = df.Define("__pileup", "(double)(" + this->expression("PU_wgt") + ")");
+      for (size_t i = 0; i < variables.size(); i++) {
+        columns.push_back(df.Take<double>("__var" + std::to_string(i)));
+      }
+      auto weights = df.Take<double>("__weight");
+      auto pileupWeights = df.Take<double>("__pileup");
+
+      // The event loop runs once here, filling every column together
+      Long64_t available = weights->size();
+      if (numSelected != NULL) {
+        *numSelected = available;
+      }
+      std::vector<Long64_t> order(available);
+      std::iota(order.begin(), order.end(), 0);
+      TRandom3 random(seed);
+      for (Long64_t i = available - 1; i > 0; i--) {
+        std::swap(order[i], order[random.Integer(i + 1)]);
+      }
+      Long64_t wantedTrain = numTrain, wantedTest = numTest;
+      resolve_split(available, wantedTrain, wantedTest);
+      if (wantedTrain + wantedTest > available) {
+        std::cout << "Only " << available << " events available in " << this->path << " after the cut, asked for "
+                  << numTrain << " training and " << numTest << " testing" << std::endl;
+      }
+
+      std::vector<Float_t> values(variables.size());
+      Float_t eventWeight, pileupWeight;
+      TTree *split[2];
+      Long64_t bounds[3] = {0, std::min<Long64_t>(wantedTrain, available), std::min<Long64_t>(wantedTrain + wantedTest, available)};
+      const char *kinds[2] = {"Train", "Test"};
+      for (int s = 0; s < 2; s++) {
+        split[s] = new TTree((label + kinds[s]).c_str(), (label + " " + kinds[s] + " events").c_str());
+        split[s]->SetDirectory(0);
+        for (size_t i = 0; i < variables.size(); i++) {
+          std::string branch = to_identifier(std::get<1>(variables[i]));
+          split[s]->Branch(branch.c_str(), &values[i], (branch + "/F").c_str());
+        }
+        split[s]->Branch("weight", &eventWeight, "weight/F");
+        split[s]->Branch("PU_wgt", &pileupWeight, "PU_wgt/F");
+        for (Long64_t e = bounds[s]; e < bounds[s + 1]; e++) {
+          Long64_t event = order[e];
+          for (size_t i = 0; i < variables.size(); i++) {
+            values[i] = (*columns[i])[event];
+          }
+          eventWeight = (*weights)[event];
+          pileupWeight = (*pileupWeights)[event];
+          split[s]->Fill();
+        }
+        split[s]->ResetBranchAddresses();
+      }
+      return {split[0], split[1]};
+    }
+};
+
+// Fills a dataloader straight from RNTuple inputs. The events are split here (rather than by
+// TMVA) so the dataloader is given explicit training and testing trees, and the weights
+// (PU_wgt for background) come along as a branch. PU_wgt is a spectator, like with
+// generateDataLoader. The numbers of events passing the cut go into the selected counts.
+TMVA::DataLoader *dataloader_from_rntuple(RunProperties &properties, std::string path, InputSample &signal, InputSample &background,
+                                          Long64_t *signalSelected = NULL, Long64_t *backgroundSelected = NULL) {
+  TMVA::DataLoader *dataloader = new TMVA::DataLoader(path);
+  for (auto it = properties.variables.begin(); it != properties.variables.end(); ++it) {
+    dataloader->AddVariable(to_identifier(std::get<1>(*it)), std::get<1>(*it), std::get<2>(*it), std::get<3>(*it));
+  }
+  dataloader->AddSpectator("PU_wgt", "PU_wgt");
+
+  auto sig = signal.readSplit(properties.variables, properties.cut, "", properties.numSignalTrain, properties.numSignalTest,
+                              properties.splitSeed, "signal", signalSelected);
+  auto bgd = background.readSplit(properties.variables, properties.cut, "PU_wgt", properties.numBackgroundTrain, properties.numBackgroundTest,
+                                  properties.splitSeed, "background", backgroundSelected);
+  dataloader->AddSignalTree(sig.first, 1.0, TMVA::Types::kTraining);
+  dataloader->AddSignalTree(sig.second, 1.0, TMVA::Types::kTesting);
+  dataloader->AddBackgroundTree(bgd.first, 1.0, TMVA::Types::kTraining);
+  dataloader->AddBackgroundTree(bgd.second, 1.0, TMVA::Types::kTesting);
+  dataloader->SetSignalWeightExpression("weight");
+  dataloader->SetBackgroundWeightExpression("weight");
+
+  // Everything has already been cut and split, so TMVA just takes all of it
+  dataloader->PrepareTrainingAndTestTree("", "", "SplitMode=Block:NormMode=NumEvents:!V");
+  return dataloader;
+}
+
+// Identifies the file of an input: its UUID is set when it's created, so copies of one file
+// match but a regenerated file doesn't
+std::string file_identity(InputSample &input) {
+  std::string identity = input.name + "@";
+  if (input.file != NULL) {
+    identity += std::string(input.file->GetUUID().AsString()) + ":" + std::to_string(input.file->GetSize());
+  } else {
+    identity += input.path;
+  }
+  return identity;
+}
+
+// Identifies the events a run is trained on: the file itself and how much of it is used
+std::string input_identity(InputSample &input, Long64_t entriesUsed) {
+  return file_identity(input) + ":" + std::to_string(entriesUsed);
+}
+#endif
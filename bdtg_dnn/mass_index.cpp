@@ -0,0 +1,235 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TMD5.h"
+#include "TStopwatch.h"
+#include "TSystem.h"
+#include "TTreeFormula.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <regex>
+#include <string>
+#include <vector>
+#include "file_lock.cpp"
+
+#ifndef __MASS_INDEX
+#define __MASS_INDEX
+
+#define MASS_BRANCH "muPairs.mass"
+// Multiplicities are stored capped at this, anything above only has to be told apart from one
+#define MAX_STORED_PAIRS 127
+
+// A muPairs.mass window as the cuts write it, e.g. "120 < muPairs.mass && muPairs.mass < 150"
+// or "Length$(muPairs.mass) == 1 && muPairs.mass[0] < 140 && muPairs.mass[0] > 110"
+class MassWindow {
+  public:
+    Double_t low;
+    Double_t high;
+    Bool_t lowInclusive;
+    Bool_t highInclusive;
+    // Some comparison is on muPairs.mass without an index, which passes if any pair does
+    Bool_t anyPair;
+    // Length$(muPairs.mass) == 1, only events with exactly one pair
+    Bool_t singlePair;
+
+    MassWindow() {
+      this->low = -INFINITY;
+      this->high = INFINITY;
+      this->lowInclusive = this->highInclusive = true;
+      this->anyPair = this->singlePair = false;
+    }
+
+    // Reads a window out of the given && terms. False if any of them is anything other than a
+    // comparison of the mass against a number or the single pair requirement.
+    bool parse(std::vector<std::string> terms) {
+      std::string number = "([-+]?(?:[0-9]+\\.?[0-9]*|\\.[0-9]+)(?:[eE][-+]?[0-9]+)?)";
+      std::string mass = "(muPairs\\.mass(?:\\[0\\])?)";
+      std::regex massFirst("^" + mass + "\\s*(<=|>=|<|>)\\s*" + number + "$");
+      std::regex numberFirst("^" + number + "\\s*(<=|>=|<|>)\\s*" + mass + "$");
+      std::regex single("^Length\\$\\(muPairs\\.mass\\)\\s*==\\s*1$");
+      for (std::string term : terms) {
+        std::smatch match;
+        if (std::regex_match(term, single)) {
+          this->singlePair = true;
+          continue;
+        }
+        std::string variable, op;
+        Double_t value;
+        if (std::regex_match(term, match, massFirst)) {
+          variable = match[1];
+          op = match[2];
+          value = std::stod(match[3]);
+        } else if (std::regex_match(term, match, numberFirst)) {
+          // "120 < mass" is "mass > 120"
+          variable = match[3];
+          op = match[2];
+          op[0] = op[0] == '<' ? '>' : '<';
+          value = std::stod(match[1]);
+        } else {
+          return false;
+        }
+        if (variable == MASS_BRANCH) {
+          this->anyPair = true;
+        }
+        bool inclusive = op.size() == 2;
+        if (op[0] == '>' && (value > this->low || (value == this->low && !inclusive))) {
+          this->low = value;
+          this->lowInclusive = inclusive;
+        }
+        if (op[0] == '<' && (value < this->high || (value == this->high && !inclusive))) {
+          this->high = value;
+          this->highInclusive = inclusive;
+        }
+      }
+      return terms.size() > 0;
+    }
+};
+
+// Events of an input sorted by their leading muPairs.mass, so the events of any mass window
+// are a contiguous range found by binary search instead of a pass over the input. Events
+// without any pair aren't in it, no window selects them. The number of pairs of each event
+// is kept too: for events with more than one pair a window on muPairs.mass can also be passed
+// by a pair other than the leading one.
+// Built in one pass over the mass branch and kept in the selection index file, keyed by the
+// identity of the input like the selection bitmaps.
+class MassIndex {
+  public:
+    Long64_t numEntries;
+    std::vector<Float_t> masses;
+    // Entry of the event at each position
+    std::vector<Long64_t> entries;
+    // Pairs of the event at each position, up to MAX_STORED_PAIRS
+    std::vector<Char_t> pairs;
+    // Entries of the events with more than one pair, in entry order
+    std::vector<Long64_t> multiPairEntries;
+    Bool_t isValid;
+
+    MassIndex(TTree *tree, std::string identity, std::string path) {
+      this->numEntries = tree->GetEntries();
+      this->isValid = false;
+      std::string k = this->key(identity);
+      if (!this->load(path, k)) {
+        if (!this->build(tree)) {
+          return;
+        }
+        this->store(path, k);
+      }
+      for (size_t i = 0; i < this->entries.size(); i++) {
+        if (this->pairs[i] > 1) {
+          this->multiPairEntries.push_back(this->entries[i]);
+        }
+      }
+      std::sort(this->multiPairEntries.begin(), this->multiPairEntries.end());
+      this->isValid = true;
+    }
+
+    // Positions [first, second) of the events whose leading mass is inside the window
+    std::pair<size_t, size_t> range(const MassWindow &window) {
+      auto begin = window.lowInclusive
+        ? std::lower_bound(this->masses.begin(), this->masses.end(), window.low)
+        : std::upper_bound(this->masses.begin(), this->masses.end(), window.low);
+      auto end = window.highInclusive
+        ? std::upper_bound(this->masses.begin(), this->masses.end(), window.high)
+        : std::lower_bound(this->masses.begin(), this->masses.end(), window.high);
+      size_t first = begin - this->masses.begin();
+      return {first, std::max<size_t>(first, end - this->masses.begin())};
+    }
+
+  private:
+    std::string key(std::string identity) {
+      std::string s = identity + "|" + MASS_BRANCH;
+      TMD5 md5;
+      md5.Update((const UChar_t*)s.data(), s.size());
+      md5.Final();
+      return std::string("mass_index_") + md5.AsString();
+    }
+
+    bool load(std::string path, std::string k) {
+      // AccessPathName is true when the file is NOT there
+      if (gSystem->AccessPathName(path.c_str())) {
+        return false;
+      }
+      FileLock lock(path, false);
+      TFile *file = TFile::Open(path.c_str());
+      if (file == NULL) {
+        return false;
+      }
+      std::vector<Float_t> *masses = NULL;
+      std::vector<Long64_t> *entries = NULL;
+      std::vector<Char_t> *pairs = NULL;
+      file->GetObject((k + "_masses").c_str(), masses);
+      file->GetObject((k + "_entries").c_str(), entries);
+      file->GetObject((k + "_pairs").c_str(), pairs);
+      bool loaded = masses != NULL && entries != NULL && pairs != NULL
+                    && masses->size() == entries->size() && pairs->size() == entries->size();
+      if (loaded) {
+        this->masses = *masses;
+        this->entries = *entries;
+        this->pairs = *pairs;
+      }
+      delete masses;
+      delete entries;
+      delete pairs;
+      file->Close();
+      delete file;
+      return loaded;
+    }
+
+    void store(std::string path, std::string k) {
+      FileLock lock(path, true);
+      TFile *file = TFile::Open(path.c_str(), "UPDATE");
+      if (file == NULL) {
+        return;
+      }
+      file->WriteObject(&this->masses, (k + "_masses").c_str());
+      file->WriteObject(&this->entries, (k + "_entries").c_str());
+      file->WriteObject(&this->pairs, (k + "_pairs").c_str());
+      file->Close();
+      delete file;
+    }
+
+    // The one pass over the input, reading nothing but the mass
+    bool build(TTree *tree) {
+      if (tree->GetBranch("muPairs") == NULL && tree->GetBranch(MASS_BRANCH) == NULL) {
+        return false;
+      }
+      TStopwatch watch;
+      TTreeFormula formula("mass", MASS_BRANCH, tree);
+      if (formula.GetNdim() == 0) {
+        return false;
+      }
+      std::vector<Float_t> masses;
+      std::vector<Long64_t> entries;
+      std::vector<Char_t> pairs;
+      for (Long64_t e = 0; e < this->numEntries; e++) {
+        tree->LoadTree(e);
+        Int_t instances = formula.GetNdata();
+        if (instances == 0) {
+          continue;
+        }
+        // A NaN mass fails every comparison, and couldn't be sorted
+        Float_t mass = formula.EvalInstance(0);
+        if (std::isnan(mass)) {
+          continue;
+        }
+        masses.push_back(mass);
+        entries.push_back(e);
+        pairs.push_back(std::min(instances, MAX_STORED_PAIRS));
+      }
+
+      std::vector<size_t> order(masses.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return masses[a] < masses[b]; });
+      for (size_t i : order) {
+        this->masses.push_back(masses[i]);
+        this->entries.push_back(entries[i]);
+        this->pairs.push_back(pairs[i]);
+      }
+      watch.Stop();
+      std::cout << "Indexed the " MASS_BRANCH " of " << this->entries.size() << "/" << this->numEntries << " events of "
+                << tree->GetName() << " in " << watch.RealTime() << " s" << std::endl;
+      return true;
+    }
+};
+#endif
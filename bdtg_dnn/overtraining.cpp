@@ -0,0 +1,249 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TMath.h"
+#include "TStopwatch.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef __OVERTRAINING
+#define __OVERTRAINING
+
+// Class name TMVA gives signal events in its TrainTree and TestTree
+#define SIGNAL_CLASS "Signal"
+
+// A score together with the weight of its event
+typedef std::pair<Double_t, Double_t> weighted_score;
+
+// Train vs test comparison of one method's scores. All numbers are p-values, small values
+// mean the training events are scored differently from the testing events (overtraining).
+// -1 when they couldn't be computed.
+class OvertrainingResult {
+  public:
+    Double_t kolS;
+    Double_t kolB;
+    Double_t adS;
+    Double_t adB;
+
+    OvertrainingResult() {
+      this->kolS = this->kolB = this->adS = this->adB = -1;
+    }
+};
+
+// Number of unweighted events carrying the same statistical power, (sum w)^2 / sum w^2
+Double_t effective_entries(const std::vector<weighted_score> &scores) {
+  Double_t sum = 0, sumSquares = 0;
+  for (const weighted_score &s : scores) {
+    sum += s.second;
+    sumSquares += s.second * s.second;
+  }
+  return sumSquares > 0 ? sum * sum / sumSquares : 0;
+}
+
+Double_t total_weight(const std::vector<weighted_score> &scores) {
+  Double_t sum = 0;
+  for (const weighted_score &s : scores) {
+    sum += s.second;
+  }
+  return sum;
+}
+
+// Walks two samples sorted by score together, calling step(Fa, Fb, groupWeight) after every
+// distinct score with the weighted empirical CDFs of both samples at that score
+template<typename Step>
+void walk_cdfs(const std::vector<weighted_score> &a, const std::vector<weighted_score> &b, Step step) {
+  Double_t totalA = total_weight(a), totalB = total_weight(b);
+  Double_t cumulativeA = 0, cumulativeB = 0;
+  size_t i = 0, j = 0;
+  while (i < a.size() || j < b.size()) {
+    Double_t value = j >= b.size() || (i < a.size() && a[i].first <= b[j].first) ? a[i].first : b[j].first;
+    Double_t group = 0;
+    for (; i < a.size() && a[i].first == value; i++) {
+      cumulativeA += a[i].second;
+      group += a[i].second;
+    }
+    for (; j < b.size() && b[j].first == value; j++) {
+      cumulativeB += b[j].second;
+      group += b[j].second;
+    }
+    step(cumulativeA / totalA, cumulativeB / totalB, group);
+  }
+}
+
+// Weighted two sample Kolmogorov-Smirnov probability. Both samples have to be sorted by score.
+// The largest distance between the weighted CDFs is turned into a probability using the
+// effective number of entries of each sample.
+Double_t weighted_ks_prob(const std::vector<weighted_score> &a, const std::vector<weighted_score> &b) {
+  if (a.size() == 0 || b.size() == 0) {
+    return -1;
+  }
+  Double_t distance = 0;
+  walk_cdfs(a, b, [&distance](Double_t fa, Double_t fb, Double_t) {
+    distance = std::max(distance, std::abs(fa - fb));
+  });
+  Double_t na = effective_entries(a), nb = effective_entries(b);
+  return TMath::KolmogorovProb(distance * std::sqrt(na * nb / (na + nb)));
+}
+
+// Weighted two sample Anderson-Darling statistic A^2. Unlike KS it weighs differences in the
+// tails of the distributions as much as those in the middle, which is where overtrained
+// classifiers tend to differ. Both samples have to be sorted by score.
+Double_t weighted_ad_statistic(const std::vector<weighted_score> &a, const std::vector<weighted_score> &b) {
+  Double_t totalA = total_weight(a), totalB = total_weight(b);
+  Double_t total = totalA + totalB;
+  Double_t integral = 0, pooled = 0;
+  walk_cdfs(a, b, [&](Double_t fa, Double_t fb, Double_t group) {
+    pooled += group / total;
+    if (pooled < 1 - 1e-12) {
+      integral += (fa - fb) * (fa - fb) / (pooled * (1 - pooled)) * (group / total);
+    }
+  });
+  Double_t na = effective_entries(a), nb = effective_entries(b);
+  return na * nb / (na + nb) * integral;
+}
+
+// Range of p-values the table of critical values below covers
+#define AD_PROB_MIN 0.01
+#define AD_PROB_MAX 0.25
+
+// Probability of a two sample A^2 at least this large if both come from one distribution.
+// A^2 is standardized with its asymptotic mean (1) and variance (2(pi^2 - 9)/3), and the
+// p-value is interpolated from the critical values of Scholz and Stephens (1987) in log odds.
+// Outside of the table there is nothing to interpolate from, so the p-value is clamped to its
+// bounds: AD_PROB_MIN means it is 0.01 or less, AD_PROB_MAX that it is 0.25 or more (see
+// format_ad_prob).
+Double_t ad_prob(Double_t statistic) {
+  static const Double_t t[] = {0.326, 1.225, 1.960, 2.719, 3.752};
+  static const Double_t alpha[] = {AD_PROB_MAX, 0.10, 0.05, 0.025, AD_PROB_MIN};
+  const int points = 5;
+  Double_t standardized = (statistic - 1) / std::sqrt(2 * (TMath::Pi() * TMath::Pi() - 9) / 3);
+  if (standardized <= t[0]) {
+    return AD_PROB_MAX;
+  }
+  if (standardized >= t[points - 1]) {
+    return AD_PROB_MIN;
+  }
+  int segment = 0;
+  while (standardized > t[segment + 1]) {
+    segment++;
+  }
+  auto logOdds = [](Double_t p) {return std::log(p / (1 - p));};
+  Double_t slope = (logOdds(alpha[segment + 1]) - logOdds(alpha[segment])) / (t[segment + 1] - t[segment]);
+  Double_t odds = std::exp(logOdds(alpha[segment]) + slope * (standardized - t[segment]));
+  return odds / (1 + odds);
+}
+
+// An Anderson-Darling p-value for printing, with the clamped bounds shown as "<0.01" and ">0.25"
+std::string format_ad_prob(Double_t p) {
+  std::ostringstream out;
+  if (p >= 0 && p <= AD_PROB_MIN) {
+    out << "<" << AD_PROB_MIN;
+  } else if (p >= AD_PROB_MAX) {
+    out << ">" << AD_PROB_MAX;
+  } else {
+    out << p;
+  }
+  return out.str();
+}
+
+Double_t weighted_ad_prob(const std::vector<weighted_score> &a, const std::vector<weighted_score> &b) {
+  if (a.size() == 0 || b.size() == 0) {
+    return -1;
+  }
+  return ad_prob(weighted_ad_statistic(a, b));
+}
+
+// Reads the scores of one method out of TMVA's TrainTree or TestTree, split by class and
+// sorted, each with the event's value of weightBranch (TMVA's weight unless asked for another,
+// e.g. the PU_wgt spectator). Only the three branches needed are read.
+bool read_scores(TFile *file, std::string treeName, std::string method, std::vector<weighted_score> &signal,
+                 std::vector<weighted_score> &background, std::string weightBranch = "weight") {
+  TTree *tree = file->Get<TTree>(treeName.c_str());
+  if (tree == NULL || tree->GetBranch(method.c_str()) == NULL || tree->GetBranch(weightBranch.c_str()) == NULL) {
+    return false;
+  }
+  Float_t weight, score;
+  tree->SetBranchStatus("*", 0);
+  for (std::string branch : {std::string("className"), weightBranch, method}) {
+    tree->SetBranchStatus(branch.c_str(), 1);
+  }
+  // className is a C string leaf, read from the leaf's own buffer (sized by ROOT to the
+  // longest name) instead of one of ours
+  TLeaf *classLeaf = tree->GetLeaf("className");
+  tree->SetBranchAddress(weightBranch.c_str(), &weight);
+  tree->SetBranchAddress(method.c_str(), &score);
+  Long64_t entries = tree->GetEntries();
+  signal.reserve(entries);
+  background.reserve(entries);
+  for (Long64_t e = 0; e < entries; e++) {
+    tree->GetEntry(e);
+    std::string className = classLeaf != NULL ? (const char*)classLeaf->GetValuePointer() : "";
+    (className == SIGNAL_CLASS ? signal : background).push_back({score, weight});
+  }
+  tree->ResetBranchAddresses();
+  std::sort(signal.begin(), signal.end());
+  std::sort(background.begin(), background.end());
+  return true;
+}
+
+// Methods trained outside the factory (hist_gbdt.cpp) keep their TrainTree and TestTree in
+// their own directory, dataset/Method_<name>/<name>/
+std::string method_tree(std::string method, std::string tree) {
+  return "dataset/Method_" + method + "/" + method + "/" + tree;
+}
+
+// Scores of a method from TMVA's tree of that name ("TrainTree" or "TestTree"), or from the
+// method's own one if it was trained outside the factory
+bool read_method_scores(TFile *file, std::string tree, std::string method, std::vector<weighted_score> &signal,
+                        std::vector<weighted_score> &background, std::string weightBranch = "weight") {
+  return read_scores(file, std::string("dataset/") + tree, method, signal, background, weightBranch)
+      || read_scores(file, method_tree(method, tree), method, signal, background, weightBranch);
+}
+
+// Overtraining diagnostics of one method, from an open TMVA.root
+OvertrainingResult diagnose_overtraining(TFile *file, std::string method) {
+  OvertrainingResult result;
+  std::vector<weighted_score> trainS, trainB, testS, testB;
+  bool found = read_method_scores(file, "TrainTree", method, trainS, trainB) && read_method_scores(file, "TestTree", method, testS, testB);
+  if (found) {
+    result.kolS = weighted_ks_prob(trainS, testS);
+    result.kolB = weighted_ks_prob(trainB, testB);
+    result.adS = weighted_ad_prob(trainS, testS);
+    result.adB = weighted_ad_prob(trainB, testB);
+  } else {
+    std::cout << "No " << method << " scores in " << file->GetName() << std::endl;
+  }
+  return result;
+}
+
+// Overtraining diagnostics of one method of a trained run, from its TMVA.root
+OvertrainingResult diagnose_overtraining(std::string tmvaFile, std::string method) {
+  TFile *file = TFile::Open(tmvaFile.c_str(), "READ");
+  if (file == NULL || file->IsZombie()) {
+    std::cout << "Could not open " << tmvaFile << " for overtraining diagnostics" << std::endl;
+    return OvertrainingResult();
+  }
+  OvertrainingResult result = diagnose_overtraining(file, method);
+  file->Close();
+  delete file;
+  return result;
+}
+
+// Diagnoses many runs at once, one task per (file, method) pair spread over the thread pool
+std::vector<OvertrainingResult> diagnose_overtraining(std::vector<std::string> tmvaFiles, std::vector<std::string> methods) {
+  TStopwatch watch;
+  ROOT::TThreadExecutor pool;
+  std::vector<OvertrainingResult> results = pool.Map([&](unsigned i) {
+    return diagnose_overtraining(tmvaFiles[i], methods[i]);
+  }, ROOT::TSeqU(tmvaFiles.size()));
+  watch.Stop();
+  std::cout << "Overtraining diagnostics of " << tmvaFiles.size() << " methods took " << watch.RealTime() << " s" << std::endl;
+  return results;
+}
+#endif
@@ -1,4 +1,6 @@
 #include "TFile.h"
+#include "TKey.h"
+#include "TH1.h"
 #include "TTree.h"
 #include "TGraph.h"
 #include "TTimeStamp.h"
@@ -8,17 +10,39 @@
 #include "TMVA/Factory.h"
 #include "TMVA/Reader.h"
 #include "TMVA/TMVAGui.h"
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <string>
-#include "running_properties.cpp"
+#include "run_properties.cpp"
+#include "thread_budget.cpp"
+#include "overtraining.cpp"
+#include "significance.cpp"
 
 #define SIGNAL_FILE "signal_data.root"
 #define BACKGROUND_FILE "background_data.root"
 #define OUTPUT_DIR "mass_output_dir/"
+// How many runs the rankings list
+#define RANKED_RUNS 10
+
+// Prints the best runs by some measure, highest first
+void print_ranking(std::string title, std::vector<RunningResults> &results, std::vector<size_t> runs,
+                   std::vector<std::string> &names, std::function<Double_t(RunningResults&)> measure) {
+  std::sort(runs.begin(), runs.end(), [&](size_t a, size_t b) {
+    return measure(results[a]) > measure(results[b]);
+  });
+  std::cout << "Best runs by " << title << ":" << std::endl;
+  for (size_t r = 0; r < std::min<size_t>(RANKED_RUNS, runs.size()); r++) {
+    RunningResults &res = results[runs[r]];
+    std::cout << "  " << r + 1 << ". Run-" << names[runs[r]] << ": ROC integral " << res.rocIntegral << ", Z_A " << res.asimovZ
+              << " at score > " << res.threshold << ", best S/sqrt(B) " << res.simpleZ << std::endl;
+  }
+}
 
 void process_mass() {
-   // Makes root use multithreading where possible, speeds up program
-   ROOT::EnableImplicitMT();
+   // Makes root use multithreading where possible, speeds up program. Thread count and
+   // pinning come from BDTG_DNN_THREADS / BDTG_DNN_NUMA_NODE / BDTG_DNN_CPUS
+   ThreadBudget::fromEnvironment().apply();
 
    // Set the file which is going to be accessed to process all of its contents
    TString *toProcessDir = new TString("mass_output_dir/178-13-16-MASS-DNN/");
@@ -36,8 +60,15 @@ void process_mass() {
    // Storage for all ROCs generated in this particular run
    std::vector<TH1D*> allROCs;
 
-   // Store all general running results
+   // Store all general running results, and the name of the run each came from
    std::vector<RunningResults> results;
+   std::vector<std::string> runNames;
+
+   // TMVA.root and method of every run that made it, for the overtraining diagnostics and
+   // the significance scan
+   std::vector<std::string> diagnosedFiles;
+   std::vector<std::string> diagnosedMethods;
+   std::vector<size_t> diagnosedResults;
 
    // Iterate through all files in directory
    while ((key = static_cast<TKey*>(nextkey()))) {
@@ -45,6 +76,11 @@ void process_mass() {
      gDirectory->cd();
      gSystem->cd(originalPhysDir->c_str());
 
+     // The results index is stored in the same file, it isn't one of the runs
+     if (std::string(key->GetClassName()) == "TTree") {
+       continue;
+     }
+
      // Get running properties in map form
      std::map<std::string, std::string> *runningprop_map = NULL;
      file->GetObject(key->GetName(), runningprop_map);
@@ -72,20 +108,14 @@ void process_mass() {
 
      TDirectoryFile *dir = NULL;
      TH1D *rocCurve = NULL;
-     // Detect if this particular run has a BDTG or a DNN or both
-     auto hasBDTG = std::find(properties->methods.begin(), properties->methods.end(), BDTG) != properties->methods.end();
-     auto hasDNN = std::find(properties->methods.begin(), properties->methods.end(), DNN) != properties->methods.end();
+     // For now, I'll only deal with one method per run (prioritizing BDTG, then HGBDT). But, theoretically, we could have several
+     ml_method method = properties->containsMethod(BDTG) ? BDTG : properties->containsMethod(HGBDT) ? HGBDT : DNN;
+     std::string methodName = method_to_tmva_name(method);
 
      // Collect the ROC curve
      try {
-       // For now, I'll only deal with one or the other (prioritizing BDTG). But, theoretically, we could have both
-       if (hasBDTG) {
-        dir = file->Get<TDirectoryFile>("dataset")->Get<TDirectoryFile>("Method_BDT")->Get<TDirectoryFile>("BDTG");
-        rocCurve = dir->Get<TH1D>("MVA_BDTG_rejBvsS");
-       } else if (hasDNN){
-        dir = file->Get<TDirectoryFile>("dataset")->Get<TDirectoryFile>("Method_DNN")->Get<TDirectoryFile>("DNN_CPU");
-        rocCurve = dir->Get<TH1D>("MVA_DNN_CPU_rejBvsS");
-       }
+       dir = file->Get<TDirectoryFile>("dataset")->Get<TDirectoryFile>(method_to_tmva_directory(method).c_str())->Get<TDirectoryFile>(methodName.c_str());
+       rocCurve = dir->Get<TH1D>(("MVA_" + methodName + "_rejBvsS").c_str());
        // Combine all ROCs together for later
        allROCs.insert(allROCs.end(), rocCurve);
 
@@ -93,53 +123,62 @@ void process_mass() {
        res.rocIntegral = rocCurve->Integral(rocCurve->FindFixBin(0), rocCurve->FindFixBin(1), "");
        std::cout << key->GetName() << ": " << res.rocIntegral << std::endl;
 
-       // Collect all of the relevant histograms (ROOT loves histograms)
-       TH1* sig = NULL;
-       TH1* bgd = NULL;
-       TH1* sigOv = NULL;
-       TH1* bgdOv = NULL;
-       // Again, we could do both but I only do one or the other (prioritizing BDTG)
-       if(hasBDTG) {
-         sig = dir->Get<TH1D>("MVA_BDTG_S");
-         bgd = dir->Get<TH1D>("MVA_BDTG_B");
-         sigOv = dir->Get<TH1D>("MVA_BDTG_Train_S");
-         bgdOv = dir->Get<TH1D>("MVA_BDTG_Train_B");
-       } else if (hasDNN) {
-         sig = dir->Get<TH1D>("MVA_DNN_CPU_S");
-         bgd = dir->Get<TH1D>("MVA_DNN_CPU_B");
-         sigOv = dir->Get<TH1D>("MVA_DNN_CPU_Train_S");
-         bgdOv = dir->Get<TH1D>("MVA_DNN_CPU_Train_B");
-       }
-
-       // Compute Kolmogorov Test (overtraining check)
-       res.kolS = sig->KolmogorovTest( sig, "X" );
-       res.kolB = bgd->KolmogorovTest( bgd, "X" );
+       // The overtraining check compares the per-event train and test scores. It's done for
+       // all runs together after this loop
+       diagnosedFiles.push_back(std::string(runDir->Data()) + "TMVA.root");
+       diagnosedMethods.push_back(methodName);
+       diagnosedResults.push_back(results.size());
 
        results.insert(results.end(), res);
+       runNames.push_back(key->GetName());
      } catch(...) {
        // If something fails, let us know!
        std::cout << "Failed to process run " << key->GetName() << "!" << std::endl;
-       results.insert(results.end(), RunningResults(false));
+       results.insert(results.end(), RunningResults(true));
+       runNames.push_back(key->GetName());
      }
-     delete map;
+     delete runningprop_map;
+  }
+  gSystem->cd(originalPhysDir->c_str());
+
+  // Overtraining diagnostics of every run, in parallel
+  std::vector<OvertrainingResult> overtraining = diagnose_overtraining(diagnosedFiles, diagnosedMethods);
+  for (size_t i = 0; i < overtraining.size(); i++) {
+    RunningResults &res = results[diagnosedResults[i]];
+    res.kolS = overtraining[i].kolS;
+    res.kolB = overtraining[i].kolB;
+    std::cout << diagnosedFiles[i] << ": kolS=" << overtraining[i].kolS << " kolB=" << overtraining[i].kolB
+              << " adS=" << format_ad_prob(overtraining[i].adS) << " adB=" << format_ad_prob(overtraining[i].adB) << std::endl;
   }
 
+  // Expected significance of every run at its best score cut, in parallel. Yields are
+  // normalized with the cross sections and luminosity from the environment (ExpectedYields)
+  std::vector<SignificanceResult> significance = scan_significance(diagnosedFiles, diagnosedMethods);
+  for (size_t i = 0; i < significance.size(); i++) {
+    RunningResults &res = results[diagnosedResults[i]];
+    res.asimovZ = significance[i].asimovZ;
+    res.simpleZ = significance[i].simpleZ;
+    res.threshold = significance[i].asimovThreshold;
+  }
+  print_ranking("Asimov significance", results, diagnosedResults, runNames, [](RunningResults &res) { return res.asimovZ; });
+  print_ranking("ROC integral", results, diagnosedResults, runNames, [](RunningResults &res) { return res.rocIntegral; });
+
   // Print all of the ROC curves
-  allROCs[0]->Draw();
-  std::vector<TH1D*>::iterator it = allROCs.begin();
-  std::advance(it, 1);
-  while(it != allROCs.end()) {
-    (*it)->Draw("SAME");
-    ++it;
+  for (std::vector<TH1D*>::iterator it = allROCs.begin(); it != allROCs.end(); ++it) {
+    (*it)->Draw(it == allROCs.begin() ? "" : "SAME");
   }
 
   // Pick out the best run of all of them
-  RunningResults *best = &results[0];
-  for(RunningResults res : results) {
-    if (!res.failed) {
-      best = res.rocIntegral > best->rocIntegral ? &res : best;
+  RunningResults *best = NULL;
+  for(RunningResults &res : results) {
+    if (!res.failed && (best == NULL || res.rocIntegral > best->rocIntegral)) {
+      best = &res;
     }
   }
+  if (best == NULL) {
+    std::cout << "No run succeeded!" << std::endl;
+    return;
+  }
 
   // Print the properties associated with the best run
   std::cout << "Best found running result with integral " << best->rocIntegral << std::endl;
@@ -0,0 +1,56 @@
+#include "TFile.h"
+#include "TTree.h"
+#include <iostream>
+#include <string>
+#include "results_index.cpp"
+
+// Searches the results index of one or more sweep directories.
+//
+//   query_results [-n N] [-o orderBy] [--ascending] [--merge out.root] "selection" dir1 [dir2 ...]
+//
+// The selection uses the same syntax as cuts, over the columns of the index, e.g.
+//   query_results -n 5 'method=="BDTG" && maxDepth<=3 && isSuccess' mass_output_dir/*BULK/
+void query_results(std::string selection, std::vector<std::string> dirs, int n, std::string orderBy, bool descending, std::string mergeTo) {
+  ResultsIndex index(dirs);
+  std::cout << "Searching " << index.size() << " results in " << dirs.size() << " sweeps" << std::endl;
+
+  if (mergeTo != "") {
+    index.merge(mergeTo);
+    std::cout << "Merged index written to " << mergeTo << std::endl;
+  }
+
+  std::vector<ResultRow> rows = index.query(selection, n, orderBy, descending);
+  std::cout << "Best " << rows.size() << " runs for '" << selection << "' by " << orderBy << ":" << std::endl;
+  for (ResultRow row : rows) {
+    row.Print();
+  }
+}
+
+int main(int argc, char ** argv) {
+  int n = 10;
+  std::string orderBy = "rocIntegral";
+  bool descending = true;
+  std::string mergeTo = "";
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      n = std::stoi(argv[++i]);
+    } else if (arg == "-o" && i + 1 < argc) {
+      orderBy = argv[++i];
+    } else if (arg == "--ascending") {
+      descending = false;
+    } else if (arg == "--merge" && i + 1 < argc) {
+      mergeTo = argv[++i];
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() < 2) {
+    std::cout << "Usage: " << argv[0] << " [-n N] [-o orderBy] [--ascending] [--merge out.root] \"selection\" dir1 [dir2 ...]" << std::endl;
+    return 1;
+  }
+  std::vector<std::string> dirs(positional.begin() + 1, positional.end());
+  query_results(positional[0], dirs, n, orderBy, descending, mergeTo);
+  return 0;
+}
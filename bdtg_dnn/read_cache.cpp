@@ -0,0 +1,102 @@
+#include "TBranch.h"
+#include "TEnv.h"
+#include "TLeaf.h"
+#include "TTree.h"
+#include "TTreeFormula.h"
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifndef __READ_CACHE
+#define __READ_CACHE
+
+// How many clusters of the needed branches the read cache holds. One is being read by TMVA
+// while the next ones are fetched and decompressed in the background.
+#define CACHE_CLUSTERS 3
+#define MIN_CACHE_BYTES (10 * 1024 * 1024)
+#define MAX_CACHE_BYTES (2048LL * 1024 * 1024)
+
+// Makes the TTreeCaches created afterwards fetch their baskets on a background thread. A cache
+// only looks at this setting when it gets created, so this has to come before optimize_reads
+// (or anything else calling SetCacheSize).
+void enable_async_prefetch() {
+  gEnv->SetValue("TFile.AsyncPrefetching", 1);
+}
+
+// Branches of a tree the given TTreeFormula expressions read, including the count branches
+// of any jagged collections they use (muPairs for muPairs.mass)
+std::set<std::string> referenced_branches(TTree *tree, std::vector<std::string> formulas) {
+  std::set<std::string> branches;
+  for (std::string f : formulas) {
+    if (f == "") {
+      continue;
+    }
+    TTreeFormula formula("references", f.c_str(), tree);
+    for (Int_t i = 0; i < formula.GetNcodes(); i++) {
+      TLeaf *leaf = formula.GetLeaf(i);
+      if (leaf == NULL) {
+        continue;
+      }
+      branches.insert(leaf->GetBranch()->GetName());
+      if (leaf->GetLeafCount() != NULL) {
+        branches.insert(leaf->GetLeafCount()->GetBranch()->GetName());
+      }
+    }
+  }
+  return branches;
+}
+
+// Sets up reading of a file backed tree so it never waits on I/O: only the branches the given
+// expressions read go into the TTreeCache, the cache is sized to hold a few clusters of just
+// those branches, and baskets are decompressed ahead of time on the thread pool. Combined with
+// enable_async_prefetch() the next clusters are already in memory (and unzipped) by the time
+// they are read. Can be called again with other expressions, the cache is then resized for
+// those and loses whatever else it had.
+void optimize_reads(TTree *tree, std::vector<std::string> formulas, std::string label) {
+  if (tree->GetCurrentFile() == NULL) {
+    return;
+  }
+  std::set<std::string> branches = referenced_branches(tree, formulas);
+  Long64_t entries = std::max<Long64_t>(1, tree->GetEntries());
+
+  // Compressed bytes per entry of the branches we need
+  Double_t bytesPerEntry = 0;
+  for (std::string name : branches) {
+    TBranch *branch = tree->GetBranch(name.c_str());
+    if (branch != NULL) {
+      bytesPerEntry += (Double_t)branch->GetZipBytes("*") / entries;
+    }
+  }
+  auto clusters = tree->GetClusterIterator(0);
+  Long64_t clusterStart = clusters();
+  Long64_t clusterEntries = std::max<Long64_t>(1, clusters.GetNextEntry() - clusterStart);
+  Long64_t cacheBytes = bytesPerEntry * clusterEntries * CACHE_CLUSTERS;
+  cacheBytes = std::min<Long64_t>(MAX_CACHE_BYTES, std::max<Long64_t>(MIN_CACHE_BYTES, cacheBytes));
+
+  // Parallel unzip has to be chosen before the cache gets created
+  tree->SetParallelUnzip(kTRUE);
+  tree->SetCacheSize(cacheBytes);
+  tree->SetCacheLearnEntries(0);
+  tree->DropBranchFromCache("*", kTRUE);
+  for (std::string name : branches) {
+    tree->AddBranchToCache(name.c_str(), kFALSE);
+  }
+  tree->StopCacheLearningPhase();
+
+  std::cout << label << ": caching " << branches.size() << " branches, "
+            << cacheBytes / (1024 * 1024) << " MB (" << CACHE_CLUSTERS << " clusters of "
+            << clusterEntries << " entries)" << std::endl;
+}
+
+// Turns off every branch the given expressions don't read, so CloneTree only copies (and
+// reads) those
+void keep_only_branches(TTree *tree, std::vector<std::string> formulas) {
+  std::set<std::string> branches = referenced_branches(tree, formulas);
+  tree->SetBranchStatus("*", 0);
+  for (std::string name : branches) {
+    tree->SetBranchStatus(name.c_str(), 1);
+  }
+}
+#endif
@@ -0,0 +1,183 @@
+#include "TFile.h"
+#include "TMD5.h"
+#include "TParameter.h"
+#include "TSystem.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "results_index.cpp"
+#include "input_source.cpp"
+#include "run_writer.cpp"
+
+#ifndef __RESULT_CACHE
+#define __RESULT_CACHE
+
+// Where finished runs are kept so later sweeps can reuse them. BDTG_DNN_CACHE_DIR overrides
+// the location, setting it to "none" turns the cache off.
+#define RESULT_CACHE_ENV "BDTG_DNN_CACHE_DIR"
+#define RESULT_CACHE_DIR "result_cache/"
+
+// Part of every hash. Bump it whenever a change to the training code means old results
+// shouldn't be reused anymore.
+#define RESULT_CACHE_VERSION "5"
+// The output mode (run_output) an entry was written with, stored in its metadata.root
+#define CACHED_OUTPUT_MODE "outputMode"
+
+// Canonical hash of everything that decides the outcome of a run: its variables (including the
+// normalization), cut, event counts, method options and split seed, plus the inputs. The thread
+// budget only changes how fast a run goes, so runs on the process budget leave it out. A run
+// with a budget of its own keeps it, otherwise sweeping the budget would only ever time the
+// first one and link the rest in from the cache.
+std::string run_hash(RunProperties &properties, std::string inputs) {
+  std::map<std::string, std::string> m = properties.to_map();
+  m.erase("isSuccess");
+  if (properties.numThreads <= 0) {
+    m.erase("numThreads");
+  }
+  if (properties.numaNode < 0) {
+    m.erase("numaNode");
+  }
+  // Runs with the batch size every run had before it could be set keep the hash they always had
+  if (m.count("batchSize") && m["batchSize"] == std::to_string(DEFAULT_BATCH_SIZE)) {
+    m.erase("batchSize");
+  }
+  m["inputs"] = inputs;
+  m["cacheVersion"] = RESULT_CACHE_VERSION;
+
+  // std::map is ordered, so the same properties always give the same string
+  std::string canonical;
+  for (auto const &entry : m) {
+    canonical += entry.first + "=" + entry.second + "\n";
+  }
+  TMD5 md5;
+  md5.Update((const UChar_t*)canonical.data(), canonical.size());
+  md5.Final();
+  return md5.AsString();
+}
+
+// Directory shared between sweeps holding one finished run per hash, laid out exactly like a
+// Run-N directory (TMVA.root, dataset/weights) with a metadata.root holding its result rows and
+// the output mode it was written with. Sweeps link their Run-N directories to the entries, so
+// nothing is copied. The output mode isn't part of the hash: an entry is reused by any sweep
+// that keeps as much or less of a run's outputs, and replaced by a more complete one.
+class ResultCache {
+  public:
+    std::string dir;
+    Bool_t enabled;
+
+    ResultCache() {
+      const char *fromEnv = std::getenv(RESULT_CACHE_ENV);
+      std::string location = fromEnv != NULL && fromEnv[0] != '\0' ? fromEnv : RESULT_CACHE_DIR;
+      this->enabled = location != "none";
+      if (!this->enabled) {
+        return;
+      }
+      // Links have to keep working from inside the sweep directories
+      if (!gSystem->IsAbsoluteFileName(location.c_str())) {
+        location = std::string(gSystem->pwd()) + "/" + location;
+      }
+      if (location.back() != '/') {
+        location += "/";
+      }
+      this->dir = location;
+      gSystem->mkdir(this->dir.c_str(), kTRUE);
+    }
+
+    std::string entryDir(std::string hash) {
+      return this->dir + hash;
+    }
+
+    // Whether a finished run with this hash is in the cache, with at least the outputs the mode keeps
+    bool has(std::string hash, run_output outputMode) {
+      // AccessPathName is true when the file is NOT there
+      if (!this->enabled || gSystem->AccessPathName((this->entryDir(hash) + "/" + METADATA_FILE).c_str())) {
+        return false;
+      }
+      return output_completeness(this->storedOutputMode(this->entryDir(hash))) >= output_completeness(outputMode);
+    }
+
+    // The result rows stored with a cached run
+    std::vector<ResultRow> rows(std::string hash) {
+      return read_rows_file(this->entryDir(hash));
+    }
+
+    // Points runDir at a cached run instead of training it again
+    bool link(std::string hash, std::string runDir) {
+      if (gSystem->Symlink(this->entryDir(hash).c_str(), runDir.c_str()) != 0) {
+        perror(("Could not link " + runDir + " to the result cache").c_str());
+        return false;
+      }
+      return true;
+    }
+
+    // Moves a finished run into the cache together with its rows and output mode, leaving a
+    // link behind. An entry with less of the outputs is replaced, if another sweep got there
+    // first with at least as much the run just stays where it is.
+    bool store(std::string hash, std::string runDir, std::vector<ResultRow> rows, run_output outputMode) {
+      if (!this->enabled) {
+        return false;
+      }
+      if (!write_rows_file(runDir, rows) || !this->writeOutputMode(runDir, outputMode)) {
+        return false;
+      }
+
+      // rename is atomic, so a half-written entry is never visible to other sweeps
+      std::string entry = this->entryDir(hash);
+      if (std::rename(runDir.c_str(), entry.c_str()) != 0) {
+        if (errno != EEXIST && errno != ENOTEMPTY) {
+          perror(("Could not move " + runDir + " into the result cache").c_str());
+          return false;
+        }
+        if (output_completeness(this->storedOutputMode(entry)) >= output_completeness(outputMode)) {
+          return false;
+        }
+        // Links to the entry see the more complete run from now on
+        std::string replaced = entry + ".replaced." + std::to_string(gSystem->GetPid());
+        if (std::rename(entry.c_str(), replaced.c_str()) != 0 || std::rename(runDir.c_str(), entry.c_str()) != 0) {
+          perror(("Could not replace " + entry + " in the result cache").c_str());
+          return false;
+        }
+        std::error_code error;
+        std::filesystem::remove_all(replaced, error);
+      }
+      return this->link(hash, runDir);
+    }
+
+  private:
+    bool writeOutputMode(std::string dir, run_output outputMode) {
+      TFile *metadata = TFile::Open((dir + "/" + METADATA_FILE).c_str(), "UPDATE");
+      if (metadata == NULL) {
+        return false;
+      }
+      TParameter<Int_t> stored(CACHED_OUTPUT_MODE, outputMode);
+      metadata->WriteObject(&stored, CACHED_OUTPUT_MODE);
+      metadata->Close();
+      delete metadata;
+      return true;
+    }
+
+    // The output mode of an entry, the least complete one if it has none
+    run_output storedOutputMode(std::string dir) {
+      run_output outputMode = LEAN_OUTPUT;
+      TFile *metadata = TFile::Open((dir + "/" + METADATA_FILE).c_str());
+      if (metadata == NULL) {
+        return outputMode;
+      }
+      TParameter<Int_t> *stored = NULL;
+      metadata->GetObject(CACHED_OUTPUT_MODE, stored);
+      if (stored != NULL) {
+        outputMode = (run_output)stored->GetVal();
+        delete stored;
+      }
+      metadata->Close();
+      delete metadata;
+      return outputMode;
+    }
+};
+#endif
@@ -0,0 +1,433 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TChain.h"
+#include "TTreeFormula.h"
+#include "TStopwatch.h"
+#include "TTimeStamp.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "overtraining.cpp"
+
+#ifndef __RESULTS_INDEX
+#define __RESULTS_INDEX
+
+// The index lives next to the per-run maps inside metadata.root
+#define RESULTS_INDEX_TREE "results"
+#define METADATA_FILE "metadata.root"
+// Rows appended between saves of the index tree's header. Every save rewrites it, the rows
+// since the last one are lost if the sweep crashes
+#define RESULTS_INDEX_SAVE_ROWS 50
+
+// Size of the fixed char buffers used for the method column. It's a plain C string on
+// purpose so selections can compare it directly (method=="BDTG")
+#define METHOD_NAME_SIZE 16
+
+// One row of the results index. There is one row per trained method of a run, so a run
+// using ALL_METHODS produces a BDTG row and a DNN row with the same runId.
+class ResultRow {
+  public:
+    std::string sweepDir;
+    Int_t runId;
+    char method[METHOD_NAME_SIZE];
+    std::vector<std::string> variables;
+    Int_t numVariables;
+    std::string cut;
+    Int_t numSignalTrain;
+    Int_t numBackgroundTrain;
+    Int_t numSignalTest;
+    Int_t numBackgroundTest;
+    // BDTG only, -1 for other methods
+    Int_t numTrees;
+    Int_t maxDepth;
+    // DNN only, -1 / empty for other methods
+    Int_t numLayers;
+    Int_t convergenceSteps;
+    Int_t batchSize;
+    std::string layerString;
+    std::string learningRate;
+    Int_t numThreads;
+    Int_t numaNode;
+    Bool_t isSuccess;
+    // Metrics, -1 when they weren't computed
+    Double_t rocIntegral;
+    Double_t kolS;
+    Double_t kolB;
+    // Anderson-Darling train vs test probabilities
+    Double_t adS;
+    Double_t adB;
+    // Wall clock seconds spent in each stage, by this method alone. TMVA evaluates all methods of
+    // a run together, that time is on the first method's row (BDTG before DNN), -1 on the others
+    Double_t trainTime;
+    Double_t testTime;
+    Double_t evaluateTime;
+    // When the row was written (seconds since epoch)
+    Long64_t timestamp;
+
+    ResultRow() {
+      this->runId = -1;
+      std::memset(this->method, 0, METHOD_NAME_SIZE);
+      this->numVariables = 0;
+      this->numSignalTrain = this->numBackgroundTrain = this->numSignalTest = this->numBackgroundTest = -1;
+      this->numTrees = this->maxDepth = this->numLayers = this->convergenceSteps = this->batchSize = -1;
+      this->numThreads = 0;
+      this->numaNode = -1;
+      this->isSuccess = false;
+      this->rocIntegral = this->kolS = this->kolB = this->adS = this->adB = -1;
+      this->trainTime = this->testTime = this->evaluateTime = -1;
+      this->timestamp = 0;
+    }
+
+    // Builds the row for one method of a run from its properties
+    ResultRow(RunProperties &properties, ml_method m, std::string sweepDir, int runId) : ResultRow() {
+      this->sweepDir = sweepDir;
+      this->runId = runId;
+      std::strncpy(this->method, method_to_string(m).c_str(), METHOD_NAME_SIZE - 1);
+      std::transform(properties.variables.begin(), properties.variables.end(), back_inserter(this->variables),
+        [](variable_tuple tup) {return std::get<0>(tup);});
+      this->numVariables = this->variables.size();
+      this->cut = properties.cut.Data();
+      this->numSignalTrain = properties.numSignalTrain;
+      this->numBackgroundTrain = properties.numBackgroundTrain;
+      this->numSignalTest = properties.numSignalTest;
+      this->numBackgroundTest = properties.numBackgroundTest;
+      if (m == BDTG || m == HGBDT) {
+        this->numTrees = properties.numTrees;
+        this->maxDepth = properties.maxDepth;
+      }
+      if (m == DNN) {
+        this->numLayers = properties.numLayers;
+        this->convergenceSteps = properties.convergenceSteps;
+        this->batchSize = properties.batchSize;
+        this->layerString = properties.layerString.Data();
+        this->learningRate = properties.learningRate.Data();
+      }
+      this->numThreads = properties.numThreads;
+      this->numaNode = properties.numaNode;
+      this->isSuccess = properties.isSuccess;
+      this->timestamp = TTimeStamp().GetSec();
+    }
+
+    // Connects every field of this row to a branch of the tree. When create is true the
+    // branches are made, otherwise the existing ones are read into this row.
+    void bind(TTree *tree, bool create) {
+      // ROOT wants the address of a pointer for object branches when reading
+      this->sweepDirPtr = &this->sweepDir;
+      this->variablesPtr = &this->variables;
+      this->cutPtr = &this->cut;
+      this->layerStringPtr = &this->layerString;
+      this->learningRatePtr = &this->learningRate;
+      if (create) {
+        tree->Branch("sweepDir", &this->sweepDir);
+        tree->Branch("runId", &this->runId, "runId/I");
+        tree->Branch("method", this->method, "method/C");
+        tree->Branch("variables", &this->variables);
+        tree->Branch("numVariables", &this->numVariables, "numVariables/I");
+        tree->Branch("cut", &this->cut);
+        tree->Branch("numSignalTrain", &this->numSignalTrain, "numSignalTrain/I");
+        tree->Branch("numBackgroundTrain", &this->numBackgroundTrain, "numBackgroundTrain/I");
+        tree->Branch("numSignalTest", &this->numSignalTest, "numSignalTest/I");
+        tree->Branch("numBackgroundTest", &this->numBackgroundTest, "numBackgroundTest/I");
+        tree->Branch("numTrees", &this->numTrees, "numTrees/I");
+        tree->Branch("maxDepth", &this->maxDepth, "maxDepth/I");
+        tree->Branch("numLayers", &this->numLayers, "numLayers/I");
+        tree->Branch("convergenceSteps", &this->convergenceSteps, "convergenceSteps/I");
+        tree->Branch("batchSize", &this->batchSize, "batchSize/I");
+        tree->Branch("layerString", &this->layerString);
+        tree->Branch("learningRate", &this->learningRate);
+        tree->Branch("numThreads", &this->numThreads, "numThreads/I");
+        tree->Branch("numaNode", &this->numaNode, "numaNode/I");
+        tree->Branch("isSuccess", &this->isSuccess, "isSuccess/O");
+        tree->Branch("rocIntegral", &this->rocIntegral, "rocIntegral/D");
+        tree->Branch("kolS", &this->kolS, "kolS/D");
+        tree->Branch("kolB", &this->kolB, "kolB/D");
+        tree->Branch("adS", &this->adS, "adS/D");
+        tree->Branch("adB", &this->adB, "adB/D");
+        tree->Branch("trainTime", &this->trainTime, "trainTime/D");
+        tree->Branch("testTime", &this->testTime, "testTime/D");
+        tree->Branch("evaluateTime", &this->evaluateTime, "evaluateTime/D");
+        tree->Branch("timestamp", &this->timestamp, "timestamp/L");
+      } else {
+        tree->SetBranchAddress("sweepDir", &this->sweepDirPtr);
+        tree->SetBranchAddress("runId", &this->runId);
+        tree->SetBranchAddress("method", this->method);
+        tree->SetBranchAddress("variables", &this->variablesPtr);
+        tree->SetBranchAddress("numVariables", &this->numVariables);
+        tree->SetBranchAddress("cut", &this->cutPtr);
+        tree->SetBranchAddress("numSignalTrain", &this->numSignalTrain);
+        tree->SetBranchAddress("numBackgroundTrain", &this->numBackgroundTrain);
+        tree->SetBranchAddress("numSignalTest", &this->numSignalTest);
+        tree->SetBranchAddress("numBackgroundTest", &this->numBackgroundTest);
+        tree->SetBranchAddress("numTrees", &this->numTrees);
+        tree->SetBranchAddress("maxDepth", &this->maxDepth);
+        tree->SetBranchAddress("numLayers", &this->numLayers);
+        tree->SetBranchAddress("convergenceSteps", &this->convergenceSteps);
+        tree->SetBranchAddress("layerString", &this->layerStringPtr);
+        tree->SetBranchAddress("learningRate", &this->learningRatePtr);
+        tree->SetBranchAddress("numThreads", &this->numThreads);
+        tree->SetBranchAddress("numaNode", &this->numaNode);
+        tree->SetBranchAddress("isSuccess", &this->isSuccess);
+        tree->SetBranchAddress("rocIntegral", &this->rocIntegral);
+        tree->SetBranchAddress("kolS", &this->kolS);
+        tree->SetBranchAddress("kolB", &this->kolB);
+        // Indices written before the batch size could be set don't have it
+        if (tree->GetBranch("batchSize") != NULL) {
+          tree->SetBranchAddress("batchSize", &this->batchSize);
+        }
+        // Indices written before the Anderson-Darling columns existed don't have them
+        if (tree->GetBranch("adS") != NULL) {
+          tree->SetBranchAddress("adS", &this->adS);
+          tree->SetBranchAddress("adB", &this->adB);
+        }
+        tree->SetBranchAddress("trainTime", &this->trainTime);
+        tree->SetBranchAddress("testTime", &this->testTime);
+        tree->SetBranchAddress("evaluateTime", &this->evaluateTime);
+        tree->SetBranchAddress("timestamp", &this->timestamp);
+      }
+    }
+
+    // Turns this row back into a RunProperties object
+    RunProperties toProperties() {
+      std::vector<variable_tuple> vars;
+      std::transform(this->variables.begin(), this->variables.end(), back_inserter(vars), get_tuple_from_string);
+      RunProperties properties(vars, this->numSignalTrain, this->numBackgroundTrain, this->cut, {get_method_from_string(this->method)});
+      properties.numSignalTest = this->numSignalTest;
+      properties.numBackgroundTest = this->numBackgroundTest;
+      properties.numTrees = this->numTrees;
+      properties.maxDepth = this->maxDepth;
+      properties.numLayers = this->numLayers;
+      properties.convergenceSteps = this->convergenceSteps;
+      if (this->batchSize > 0) {
+        properties.batchSize = this->batchSize;
+      }
+      properties.layerString = this->layerString;
+      properties.learningRate = this->learningRate;
+      properties.numThreads = this->numThreads;
+      properties.numaNode = this->numaNode;
+      properties.isSuccess = this->isSuccess;
+      return properties;
+    }
+
+    // Print the row to standard out on a single line
+    void Print() {
+      std::cout << this->sweepDir << "Run-" << this->runId << " [" << this->method << "]"
+                << " roc=" << this->rocIntegral << " kolS=" << this->kolS << " kolB=" << this->kolB
+                << " adS=" << format_ad_prob(this->adS) << " adB=" << format_ad_prob(this->adB);
+      if (this->numTrees >= 0) {
+        std::cout << " numTrees=" << this->numTrees << " maxDepth=" << this->maxDepth;
+      }
+      if (this->numLayers >= 0) {
+        std::cout << " numLayers=" << this->numLayers << " layer=" << this->layerString << " lr=" << this->learningRate
+                  << " batch=" << this->batchSize;
+      }
+      std::cout << " train=" << this->trainTime << "s" << (this->isSuccess ? "" : " (FAILED)") << std::endl;
+    }
+
+  private:
+    std::string *sweepDirPtr;
+    std::vector<std::string> *variablesPtr;
+    std::string *cutPtr;
+    std::string *layerStringPtr;
+    std::string *learningRatePtr;
+};
+
+// The rows of a run, one per method it trained, filled in with the measured metrics
+std::vector<ResultRow> result_rows(RunProperties &properties, std::string sweepDir, int runId, std::map<ml_method, ResultRow> metrics = {}) {
+  std::vector<ResultRow> rows;
+  for (ml_method m : {BDTG, DNN, HGBDT}) {
+    if (!properties.containsMethod(m)) {
+      continue;
+    }
+    ResultRow r(properties, m, sweepDir, runId);
+    if (metrics.count(m)) {
+      ResultRow &measured = metrics[m];
+      r.rocIntegral = measured.rocIntegral;
+      r.kolS = measured.kolS;
+      r.kolB = measured.kolB;
+      r.adS = measured.adS;
+      r.adB = measured.adB;
+      r.trainTime = measured.trainTime;
+      r.testTime = measured.testTime;
+      r.evaluateTime = measured.evaluateTime;
+    }
+    rows.push_back(r);
+  }
+  return rows;
+}
+
+// Typed, columnar table of every run of a sweep, stored as a TTree inside metadata.root.
+// Rows are appended as runs finish, and many sweep directories can be chained together
+// and searched without deserializing the per-run maps.
+class ResultsIndex {
+  public:
+    // Starts a new index inside an already open (writable) metadata file
+    ResultsIndex(TFile *file) {
+      this->file = file;
+      this->chain = NULL;
+      TDirectory *previous = gDirectory;
+      file->cd();
+      this->tree = new TTree(RESULTS_INDEX_TREE, "Results of every run in this sweep");
+      this->row.bind(this->tree, true);
+      previous->cd();
+    }
+
+    // Opens the indices of one or more sweep directories together for searching
+    ResultsIndex(std::vector<std::string> sweepDirs) {
+      this->file = NULL;
+      this->tree = NULL;
+      this->chain = new TChain(RESULTS_INDEX_TREE);
+      for (std::string dir : sweepDirs) {
+        if (dir.size() > 0 && dir.back() != '/') {
+          dir += "/";
+        }
+        std::string path = dir.find(".root") == std::string::npos ? dir + METADATA_FILE : dir;
+        if (this->chain->Add(path.c_str(), 0) == 0) {
+          std::cout << "No results index in " << path << std::endl;
+        }
+      }
+      this->row.bind(this->chain, false);
+    }
+
+    ~ResultsIndex() {
+      delete this->chain;
+    }
+
+    // Appends a row, saving the tree header every RESULTS_INDEX_SAVE_ROWS rows so most of the
+    // index survives if a later run crashes. Write() saves the rest
+    void append(ResultRow r) {
+      this->row = r;
+      this->tree->Fill();
+      if (this->tree->GetEntries() % RESULTS_INDEX_SAVE_ROWS == 0) {
+        this->tree->AutoSave("SaveSelf");
+      }
+    }
+
+    // Appends one row per method that the run trained
+    void append(RunProperties &properties, std::string sweepDir, int runId, std::map<ml_method, ResultRow> metrics = {}) {
+      for (ResultRow r : result_rows(properties, sweepDir, runId, metrics)) {
+        this->append(r);
+      }
+    }
+
+    // Number of rows across every chained sweep
+    Long64_t size() {
+      return this->chain != NULL ? this->chain->GetEntries() : this->tree->GetEntries();
+    }
+
+    // Reads a single row
+    ResultRow get(Long64_t entry) {
+      TTree *source = this->chain != NULL ? (TTree*)this->chain : this->tree;
+      source->GetEntry(entry);
+      return this->row;
+    }
+
+    // Finds the best n rows passing a selection, ordered by any column or expression, e.g.
+    //   query("method==\"BDTG\" && maxDepth<=3 && isSuccess", 10, "rocIntegral")
+    // Only the branches used by the selection and ordering are read while scanning, the
+    // rest of a row is only loaded for the rows that are returned.
+    std::vector<ResultRow> query(TString selection, int n, TString orderBy = "rocIntegral", bool descending = true) {
+      std::vector<ResultRow> found;
+      TTree *source = this->chain != NULL ? (TTree*)this->chain : this->tree;
+      if (source == NULL || source->GetEntries() == 0) {
+        return found;
+      }
+
+      TTreeFormula select("select", selection == "" ? "1" : selection, source);
+      TTreeFormula order("order", orderBy, source);
+      if (select.GetNdim() == 0 || order.GetNdim() == 0) {
+        std::cout << "Invalid query: " << selection << " ordered by " << orderBy << std::endl;
+        return found;
+      }
+
+      // Keep the n best entries seen so far, with the worst of them on top
+      typedef std::pair<Double_t, Long64_t> scored_entry;
+      auto worse = [descending](scored_entry a, scored_entry b) {return descending ? a.first > b.first : a.first < b.first;};
+      std::priority_queue<scored_entry, std::vector<scored_entry>, decltype(worse)> best(worse);
+
+      Int_t treeNumber = -1;
+      Long64_t entries = source->GetEntries();
+      for (Long64_t entry = 0; entry < entries; entry++) {
+        if (source->LoadTree(entry) < 0) {
+          break;
+        }
+        if (source->GetTreeNumber() != treeNumber) {
+          treeNumber = source->GetTreeNumber();
+          select.UpdateFormulaLeaves();
+          order.UpdateFormulaLeaves();
+        }
+        if (select.GetNdata() == 0 || select.EvalInstance(0) == 0) {
+          continue;
+        }
+        order.GetNdata();
+        best.push({order.EvalInstance(0), entry});
+        if ((int)best.size() > n) {
+          best.pop();
+        }
+      }
+
+      while (!best.empty()) {
+        found.push_back(this->get(best.top().second));
+        best.pop();
+      }
+      std::reverse(found.begin(), found.end());
+      return found;
+    }
+
+    // Writes every row of the chained sweeps into a single index file
+    void merge(std::string outputFile) {
+      if (this->chain == NULL) {
+        std::cout << "Only opened indices can be merged" << std::endl;
+        return;
+      }
+      this->chain->Merge(outputFile.c_str());
+    }
+
+    // Saves the index into the metadata file
+    void Write() {
+      if (this->tree != NULL) {
+        TDirectory *previous = gDirectory;
+        this->file->cd();
+        this->tree->Write("", TObject::kOverwrite);
+        previous->cd();
+      }
+    }
+
+  private:
+    TFile *file;
+    TTree *tree;
+    TChain *chain;
+    ResultRow row;
+};
+// Writes the rows of a single run into <dir>/metadata.root, so they travel with the run
+// directory (result cache entries, runs trained by forked workers)
+bool write_rows_file(std::string dir, std::vector<ResultRow> rows) {
+  TFile *metadata = TFile::Open((dir + "/" + METADATA_FILE).c_str(), "RECREATE");
+  if (metadata == NULL) {
+    return false;
+  }
+  {
+    ResultsIndex index(metadata);
+    for (ResultRow r : rows) {
+      index.append(r);
+    }
+    index.Write();
+  }
+  metadata->Close();
+  delete metadata;
+  return true;
+}
+
+// The rows written by write_rows_file
+std::vector<ResultRow> read_rows_file(std::string dir) {
+  std::vector<ResultRow> found;
+  ResultsIndex index(std::vector<std::string>{dir});
+  for (Long64_t i = 0; i < index.size(); i++) {
+    found.push_back(index.get(i));
+  }
+  return found;
+}
+#endif
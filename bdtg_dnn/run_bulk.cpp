@@ -1,4 +1,5 @@
 #include "TFile.h"
+#include "TMemFile.h"
 #include "TBufferJSON.h"
 #include "TTree.h"
 #include "TGraph.h"
@@ -7,15 +8,43 @@
 #include "TApplication.h"
 #include "TMVA/DataLoader.h"
 #include "TMVA/Factory.h"
+#include "TMVA/MethodBase.h"
 #include "TMVA/Reader.h"
 #include "TMVA/TMVAGui.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <tuple>
 #include "run_properties.cpp"
+#include "results_index.cpp"
+#include "input_source.cpp"
+#include "staged_bdt.cpp"
+#include "result_cache.cpp"
+#include "selection_index.cpp"
+#include "event_sampler.cpp"
+#include "overtraining.cpp"
+#include "hist_gbdt.cpp"
+#include "run_writer.cpp"
+#include "schema_reader.cpp"
+#include "training_events.cpp"
 
 #define SIGNAL_FILE "signal_data.root"
 #define BACKGROUND_FILE "background_data.root"
+// What slice_up_tree --rntuple writes, read by run_bulk --rntuple
+#define SIGNAL_RNTUPLE_FILE "tree_output_dir/signal_data_rntuple.root"
+#define BACKGROUND_RNTUPLE_FILE "tree_output_dir/background_data_rntuple.root"
+// What derived_features writes, read by run_bulk --derived
+#define SIGNAL_DERIVED_FILE "features_output_dir/signal_features.root"
+#define BACKGROUND_DERIVED_FILE "features_output_dir/background_features.root"
 #define OUTPUT_DIR "mass_output_dir/"
+// Number of forked workers training runs in parallel, unset or 0 trains them one by one in this process
+#define WORKERS_ENV "BDTG_DNN_WORKERS"
 
 #ifndef __MAIN
 #define __MAIN
@@ -61,21 +90,524 @@ std::pair<vec_s, vec_i> pickBasedOnIndex(vecvec_s options_s, vecvec_i options_i,
   return std::make_pair(res_s, res_i);
 }
 
-void run_bulk() {
-  // Enable multithreading, gives us a speed boost
-  ROOT::EnableImplicitMT();
+// Everything the runs of a sweep share: the opened inputs with their selections and
+// samplers, the result cache, and where the runs go
+class SweepContext {
+  public:
+    InputSample &signalInput;
+    InputSample &backgroundInput;
+    TTree *signaltree;
+    TTree *backgroundtree;
+    bool useRNTuple;
+    bool streamSampling;
+    // Whether the trees are read from their files, so every run gets a read cache of its own
+    bool cacheReads;
+    std::vector<std::string> neededFormulas;
+    SelectionIndex *signalSelections;
+    SelectionIndex *backgroundSelections;
+    EventSampler &signalSampler;
+    EventSampler &backgroundSampler;
+    ResultCache &resultCache;
+    // What runs keep on disk, and the thread writing it. Without a writer runs write it themselves
+    run_output outputMode;
+    AsyncWriter *writer;
+    // Threads of one run that doesn't ask for its own budget
+    ThreadBudget workerBudget;
+    // What every normalized variable is, by its expression, for runs that flatten their inputs
+    std::map<std::string, NormalizedFeature> normalizedFeatures;
+    std::string output_dir_prefix;
+    std::string originalPhysDir;
+
+    SweepContext(InputSample &signalInput, InputSample &backgroundInput, EventSampler &signalSampler,
+                 EventSampler &backgroundSampler, ResultCache &resultCache)
+      : signalInput(signalInput), backgroundInput(backgroundInput), signalSampler(signalSampler),
+        backgroundSampler(backgroundSampler), resultCache(resultCache) {
+      this->signaltree = this->backgroundtree = NULL;
+      this->useRNTuple = this->streamSampling = this->cacheReads = false;
+      this->signalSelections = this->backgroundSelections = NULL;
+      this->outputMode = FULL_OUTPUT;
+      this->writer = NULL;
+    }
+};
+
+// What a run reads of the inputs: its variables, its cut and the background weight
+std::vector<std::string> run_formulas(RunProperties &properties) {
+  std::vector<std::string> formulas = {"PU_wgt", properties.cut.Data()};
+  for (variable_tuple var : properties.variables) {
+    formulas.push_back(std::get<0>(var));
+  }
+  return formulas;
+}
+
+// Branches the run's variables get in a flattened tree, named like the RNTuple path names them
+std::vector<std::string> flat_branches(RunProperties &properties) {
+  std::vector<std::string> branches;
+  for (variable_tuple var : properties.variables) {
+    branches.push_back(to_identifier(std::get<1>(var)));
+  }
+  return branches;
+}
+
+// The given events of a tree with the run's variables in plain branches (see flatten_features),
+// if its variables are a normalized preset the tree matches. NULL otherwise
+TTree *flat_run_tree(SweepContext &sweep, RunProperties &properties, TTree *tree, const SelectionBitmap &entries,
+                     std::string name) {
+  std::vector<NormalizedFeature> features;
+  for (variable_tuple var : properties.variables) {
+    if (sweep.normalizedFeatures.count(std::get<0>(var)) == 0) {
+      return NULL;
+    }
+    features.push_back(sweep.normalizedFeatures[std::get<0>(var)]);
+  }
+  return flatten_features(tree, features, flat_branches(properties), entries.entries(), name);
+}
+
+// flat_run_tree of every tree with its events and name, or none at all if one of them can't be
+std::vector<TTree*> flat_run_trees(SweepContext &sweep, RunProperties &properties,
+                                   std::vector<std::tuple<TTree*, SelectionBitmap, std::string>> parts) {
+  std::vector<TTree*> trees;
+  for (auto &part : parts) {
+    TTree *flat = flat_run_tree(sweep, properties, std::get<0>(part), std::get<1>(part), std::get<2>(part));
+    if (flat == NULL) {
+      for (TTree *t : trees) {
+        delete t;
+      }
+      return {};
+    }
+    trees.push_back(flat);
+  }
+  return trees;
+}
+
+// Trains, tests and evaluates one run in its own Run-N directory and returns its result rows.
+// properties.isSuccess says whether it worked. TMVA.root is only built in memory, writing it out
+// and moving successful runs into the result cache is left to the sweep's writer.
+std::vector<ResultRow> execute_run(SweepContext &sweep, RunProperties &properties, int i, std::string hash) {
+  std::string runDir = sweep.output_dir_prefix + "Run-" + std::to_string(i);
+
+  // Give this run its own pool (and node) if it asks for one. Pinning before the DataLoader
+  // builds its dataset means the run's copy of the events is first touched on that node
+  properties.threadBudget(sweep.workerBudget).apply();
+
+  gSystem->mkdir(runDir.c_str(), kTRUE);
+
+  // Move into the directory of the new run
+  gSystem->cd(runDir.c_str());
+
+  // Create objects for run
+  TMVA::Factory *factory = NULL;
+  TMVA::DataLoader *dataloader = NULL;
+  std::map<ml_method, ResultRow> metrics;
+  std::vector<ResultRow> runRows;
+  std::vector<TTree*> runTrees;
+  TMemFile *outputFile = NULL;
+  std::shared_ptr<std::vector<char>> image = std::make_shared<std::vector<char>>();
+  std::shared_ptr<std::vector<LeanMethodOutput>> leanOutputs = std::make_shared<std::vector<LeanMethodOutput>>();
+  // Events of each class passing the run's cut, which its test sample is drawn from
+  Long64_t selectedSignal = -1, selectedBackground = -1;
+  // Events of the inputs in the trees TMVA is given for training, in the same order
+  SelectionBitmap signalRead, backgroundRead;
+  // Whether TMVA reads the variables from flat branches rather than evaluating them
+  bool flattened = false;
+  try {
+    // Save outputs of ML run
+    TString *outfileName = new TString("TMVA.root");
+
+    std::cout << "Writing to " << *outfileName << "!" << std::endl;
+    outputFile = new TMemFile(*outfileName, "RECREATE");
+    
+    // Create the factory which TMVA uses to allocate runs. Lean runs don't keep the plots of
+    // the variable transformations, so they aren't made
+    std::string transformations = sweep.outputMode == FULL_OUTPUT ? "I;D;P;G,D" : "I";
+    factory = new TMVA::Factory( "TMVAClassification", outputFile,
+       ("!Silent:Color:DrawProgressBar:Transformations=" + transformations + ":AnalysisType=Classification").c_str() );
+
+    dataloader=NULL;
+
+    TString *path = new TString("dataset");
+    std::string path_as_str(path->Data());
+
+    // The read cache only holds (and is only as large as) what this run reads
+    if (sweep.cacheReads) {
+      sweep.signalInput.optimizeReads(run_formulas(properties));
+      sweep.backgroundInput.optimizeReads(run_formulas(properties));
+    }
+
+    if (sweep.useRNTuple) {
+      dataloader = dataloader_from_rntuple(properties, path_as_str, sweep.signalInput, sweep.backgroundInput,
+                                           &selectedSignal, &selectedBackground);
+    } else if (sweep.streamSampling) {
+      // Only the sampled events are copied, the cut comes from the selection index
+      SelectionBitmap sigCandidates = sweep.signalSelections->select(properties.cut.Data());
+      SelectionBitmap bgdCandidates = sweep.backgroundSelections->select(properties.cut.Data());
+      selectedSignal = sigCandidates.count();
+      selectedBackground = bgdCandidates.count();
+      // 0 training or testing events means the same as it does to TMVA
+      Long64_t sigTrain = properties.numSignalTrain, sigTest = properties.numSignalTest;
+      Long64_t bgdTrain = properties.numBackgroundTrain, bgdTest = properties.numBackgroundTest;
+      resolve_split(sigCandidates.count(), sigTrain, sigTest);
+      resolve_split(bgdCandidates.count(), bgdTrain, bgdTest);
+      EventSample sig = sweep.signalSampler.sample(sigCandidates, sigTrain, sigTest, properties.splitSeed);
+      EventSample bgd = sweep.backgroundSampler.sample(bgdCandidates, bgdTrain, bgdTest, properties.splitSeed);
+      signalRead = sig.trainBitmap(sweep.signaltree->GetEntries());
+      backgroundRead = bgd.trainBitmap(sweep.backgroundtree->GetEntries());
+      SelectionBitmap signalTest = sig.testBitmap(sweep.signaltree->GetEntries());
+      SelectionBitmap backgroundTest = bgd.testBitmap(sweep.backgroundtree->GetEntries());
+      // The variables of a preset are flattened by its compiled reader, anything else is
+      // copied for TMVA to evaluate
+      runTrees = flat_run_trees(sweep, properties, {
+        {sweep.signaltree, signalRead, "signalTrain"}, {sweep.signaltree, signalTest, "signalTest"},
+        {sweep.backgroundtree, backgroundRead, "backgroundTrain"}, {sweep.backgroundtree, backgroundTest, "backgroundTest"},
+      });
+      flattened = runTrees.size() > 0;
+      if (!flattened) {
+        runTrees = {
+          copy_entries(sweep.signaltree, signalRead, sweep.neededFormulas),
+          copy_entries(sweep.signaltree, signalTest, sweep.neededFormulas),
+          copy_entries(sweep.backgroundtree, backgroundRead, sweep.neededFormulas),
+          copy_entries(sweep.backgroundtree, backgroundTest, sweep.neededFormulas),
+        };
+      }
+      dataloader = properties.generateDataLoader(path_as_str, flattened ? flat_branches(properties) : std::vector<std::string>());
+      dataloader->AddSignalTree(runTrees[0], 1.0, TMVA::Types::kTraining);
+      dataloader->AddSignalTree(runTrees[1], 1.0, TMVA::Types::kTesting);
+      dataloader->AddBackgroundTree(runTrees[2], 1.0, TMVA::Types::kTraining);
+      dataloader->AddBackgroundTree(runTrees[3], 1.0, TMVA::Types::kTesting);
+
+      // Events were drawn uniformly, so background is weighted by PU_wgt like with TMVA's split.
+      // The events are already cut and split, TMVA just takes all of them
+      dataloader->SetBackgroundWeightExpression("PU_wgt");
+      dataloader->PrepareTrainingAndTestTree("", "", "SplitMode=Block:NormMode=NumEvents:!V");
+    } else {
+      Double_t signalWeight     = 1.0;
+      Double_t backgroundWeight = 1.0;
+
+      // The cut has already been applied to the selected trees, so TMVA gets none
+      RunProperties loaderProperties = properties.clone();
+      signalRead = SelectionBitmap(sweep.signaltree->GetEntries());
+      backgroundRead = SelectionBitmap(sweep.backgroundtree->GetEntries());
+      signalRead.setAll();
+      backgroundRead.setAll();
+      if (properties.cut != "") {
+        signalRead = sweep.signalSelections->select(properties.cut.Data());
+        backgroundRead = sweep.backgroundSelections->select(properties.cut.Data());
+        loaderProperties.cut = "";
+      }
+
+      // The variables of a preset are flattened by its compiled reader. Anything else is read
+      // from the tree itself, or a copy of the events passing the cut
+      runTrees = flat_run_trees(sweep, properties, {
+        {sweep.signaltree, signalRead, "signal"}, {sweep.backgroundtree, backgroundRead, "background"},
+      });
+      flattened = runTrees.size() > 0;
+      TTree *signalSelection = sweep.signaltree;
+      TTree *backgroundSelection = sweep.backgroundtree;
+      if (flattened) {
+        signalSelection = runTrees[0];
+        backgroundSelection = runTrees[1];
+      } else if (properties.cut != "") {
+        signalSelection = sweep.signalSelections->selectedTree(properties.cut.Data(), sweep.neededFormulas);
+        backgroundSelection = sweep.backgroundSelections->selectedTree(properties.cut.Data(), sweep.neededFormulas);
+      }
+      dataloader = properties.generateDataLoader(path_as_str, flattened ? flat_branches(properties) : std::vector<std::string>());
+
+      dataloader->AddSignalTree    ( signalSelection,     signalWeight );
+      dataloader->AddBackgroundTree( backgroundSelection, backgroundWeight );
+      selectedSignal = signalSelection->GetEntries();
+      selectedBackground = backgroundSelection->GetEntries();
+
+      dataloader->SetBackgroundWeightExpression( "PU_wgt" );
+
+      loaderProperties.fillDataLoaderForTree(dataloader);
+    }
+
+    properties.fillFactory(factory, dataloader);
+
+    TStopwatch trainWatch, testWatch, evaluateWatch;
+    trainWatch.Start();
+    factory->TrainAllMethods();
+    trainWatch.Stop();
+    testWatch.Start();
+    factory->TestAllMethods();
+    testWatch.Stop();
+    evaluateWatch.Start();
+    factory->EvaluateAllMethods();
+    evaluateWatch.Stop();
+
+    // Keep the numbers for the results index. TMVA times the training and testing of every
+    // method on its own, EvaluateAllMethods can't be split up so all of it goes to the first
+    // method of the run and the others get none (-1)
+    bool isFirstMethod = true;
+    for (ml_method m : {BDTG, DNN}) {
+      if (!properties.containsMethod(m)) {
+        continue;
+      }
+      metrics[m].rocIntegral = factory->GetROCIntegral(dataloader, method_to_tmva_name(m));
+      TMVA::MethodBase *method = dynamic_cast<TMVA::MethodBase*>(factory->GetMethod(dataloader->GetName(), method_to_tmva_name(m)));
+      metrics[m].trainTime = method != NULL ? method->GetTrainTime() : trainWatch.RealTime();
+      metrics[m].testTime = method != NULL ? method->GetTestTime() : testWatch.RealTime();
+      metrics[m].evaluateTime = isFirstMethod ? evaluateWatch.RealTime() : -1;
+      isFirstMethod = false;
+    }
+
+    // Evaluate the smaller forests this run stands in for. Each one is its own row in the
+    // results index, the full size one (the last stage, however many trees it ended up with)
+    // is the normal row. Training time can't be split up between the stages, they have none
+    for (StagedResult staged : evaluate_staged_run(factory, dataloader, properties)) {
+      if (staged.numTrees >= properties.numTrees) {
+        continue;
+      }
+      ResultRow row(properties, BDTG, sweep.output_dir_prefix, i);
+      row.numTrees = staged.numTrees;
+      row.isSuccess = true;
+      row.rocIntegral = staged.rocIntegral;
+      row.kolS = staged.kolS;
+      row.kolB = staged.kolB;
+      row.adS = staged.adS;
+      row.adB = staged.adB;
+      runRows.push_back(row);
+    }
+
+    // The histogram BDT isn't a TMVA method, it trains on the dataset the factory just used
+    // and writes its outputs into the same file
+    if (properties.containsMethod(HGBDT)) {
+      HistGBDTRun hgbdt = train_hist_gbdt(dataloader, properties, outputFile);
+      metrics[HGBDT].rocIntegral = hgbdt.rocIntegral;
+      metrics[HGBDT].trainTime = hgbdt.trainTime;
+      metrics[HGBDT].testTime = hgbdt.testTime;
+    }
+    // Readers evaluate the variables on the inputs, so the weights get their expressions back
+    if (flattened) {
+      std::vector<std::string> branches = flat_branches(properties);
+      std::map<std::string, std::string> expressions;
+      for (size_t v = 0; v < branches.size(); v++) {
+        expressions[branches[v]] = "Alt$(" + std::get<0>(properties.variables[v]) + ",0)";
+      }
+      restore_expressions("", expressions);
+    }
+    write_selected_events(outputFile, selectedSignal, selectedBackground);
+    // Which events the run trained on, for scoring its models on the inputs later. TMVA
+    // picks them itself, so they come out of its dataset
+    if (!sweep.useRNTuple) {
+      TMVA::DataSetInfo &info = dataloader->GetDataSetInfo();
+      write_training_events(TRAINING_EVENTS_FILE,
+                            file_identity(sweep.signalInput), training_events(info, true, signalRead),
+                            file_identity(sweep.backgroundInput), training_events(info, false, backgroundRead));
+    }
+    *image = close_memory_file(outputFile);
+    outputFile = NULL;
+
+    // Train vs test comparison of every method's scores, now that TMVA.root is complete, and
+    // the parts a lean TMVA.root keeps. Read in place, a copy would double the image
+    TMemFile written(*outfileName, TMemFile::ZeroCopyView_t(image->data(), image->size()));
+    for (ml_method m : {BDTG, DNN, HGBDT}) {
+      if (!properties.containsMethod(m)) {
+        continue;
+      }
+      OvertrainingResult overtraining = diagnose_overtraining(&written, method_to_tmva_name(m));
+      metrics[m].kolS = overtraining.kolS;
+      metrics[m].kolB = overtraining.kolB;
+      metrics[m].adS = overtraining.adS;
+      metrics[m].adB = overtraining.adB;
+      if (sweep.outputMode != FULL_OUTPUT) {
+        leanOutputs->push_back(lean_method_output(&written, method_to_tmva_name(m), method_to_tmva_directory(m),
+                                                  sweep.outputMode == LEAN_OUTPUT_WITH_SCORES));
+      }
+    }
+    written.Close();
+    
+    properties.isSuccess = true;
+
+    std::cout << "==> TMVAClassification is done!" << std::endl;
+  } catch (...) {
+    std::cout << "This run failed! " << std::endl;
+  }
+  // A failed run still leaves whatever it got to for a look
+  if (outputFile != NULL) {
+    *image = close_memory_file(outputFile);
+  }
+  
+  for (ResultRow r : result_rows(properties, sweep.output_dir_prefix, i, metrics)) {
+    runRows.push_back(r);
+  }
+  delete factory;
+  delete dataloader;
+  for (TTree *t : runTrees) {
+    delete t;
+  }
+
+  // Write TMVA.root and keep successful runs around for later sweeps. The main thread moves on
+  // to other directories meanwhile, so the writer only gets absolute paths
+  gSystem->cd(sweep.originalPhysDir.c_str());
+  std::string absoluteRunDir = sweep.originalPhysDir + "/" + runDir;
+  run_output outputMode = sweep.outputMode;
+  ResultCache *resultCache = &sweep.resultCache;
+  bool isSuccess = properties.isSuccess;
+  // A lean TMVA.root doesn't need the full one, which is dropped before the write waits
+  Long64_t heldBytes = image->size();
+  if (outputMode != FULL_OUTPUT && isSuccess) {
+    std::vector<char>().swap(*image);
+    heldBytes = 0;
+    for (LeanMethodOutput &m : *leanOutputs) {
+      heldBytes += m.testTree != NULL ? m.testTree->GetTotBytes() : 0;
+    }
+  }
+  std::function<void()> write = [=]() {
+    if (outputMode == FULL_OUTPUT || !isSuccess) {
+      write_file_image(*image, absoluteRunDir + "/TMVA.root");
+    } else {
+      write_lean_output(*leanOutputs, selectedSignal, selectedBackground, absoluteRunDir + "/TMVA.root");
+    }
+    if (isSuccess) {
+      resultCache->store(hash, absoluteRunDir, runRows, outputMode);
+    }
+  };
+  if (sweep.writer != NULL) {
+    sweep.writer->push(write, heldBytes);
+  } else {
+    write();
+  }
+  return runRows;
+}
+
+// Gives a forked worker inputs of its own. The parent's files share their descriptors, and
+// with them the file offsets, with every worker, so reading through them at the same time
+// would mix up the reads. Sliced inputs are copies in memory and never read the files.
+bool reopen_inputs(SweepContext &sweep) {
+  if (!sweep.cacheReads) {
+    return true;
+  }
+  if (!sweep.signalInput.reopen() || !sweep.backgroundInput.reopen()) {
+    std::cout << "Could not open the inputs again!" << std::endl;
+    return false;
+  }
+  sweep.signaltree = sweep.signalInput.tree;
+  sweep.backgroundtree = sweep.backgroundInput.tree;
+  sweep.signalSelections->setTree(sweep.signaltree);
+  sweep.backgroundSelections->setTree(sweep.backgroundtree);
+  return true;
+}
+
+// Trains the given runs in forked worker processes, at most numWorkers at a time and one run
+// per worker. The parent evaluates every cut before forking, so the workers share the
+// selections copy-on-write instead of each evaluating them again, and each worker opens the
+// inputs again for its own reads. A worker that crashes (TMVA likes to abort) only takes its
+// own run with it. Workers leave their rows in their run directory, where the parent picks
+// them up and records them.
+void train_in_workers(SweepContext &sweep, std::vector<RunProperties> &runs, std::vector<int> toTrain,
+                      std::map<int, std::string> hashes, int numWorkers,
+                      std::function<void(RunProperties&, int, std::vector<ResultRow>&)> record) {
+  if (!sweep.useRNTuple) {
+    for (int i : toTrain) {
+      sweep.signalSelections->select(runs[i].cut.Data());
+      sweep.backgroundSelections->select(runs[i].cut.Data());
+    }
+  }
+
+  std::map<pid_t, int> running;
+  size_t next = 0;
+  while (next < toTrain.size() || running.size() > 0) {
+    if (next < toTrain.size() && running.size() < (size_t)numWorkers) {
+      int i = toTrain[next++];
+      // Anything still buffered would be printed by the worker as well
+      std::cout.flush();
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        RunProperties properties = runs[i];
+        std::vector<ResultRow> rows = result_rows(properties, sweep.output_dir_prefix, i);
+        record(properties, i, rows);
+        continue;
+      }
+      if (pid == 0) {
+        if (!reopen_inputs(sweep)) {
+          _exit(1);
+        }
+        RunProperties properties = runs[i];
+        std::string runDir = sweep.output_dir_prefix + "Run-" + std::to_string(i);
+        std::vector<ResultRow> rows = execute_run(sweep, properties, i, hashes[i]);
+        // Runs stored in the result cache have their rows written already. AccessPathName is
+        // true when the file is NOT there
+        if (gSystem->AccessPathName((runDir + "/" + METADATA_FILE).c_str())) {
+          write_rows_file(runDir, rows);
+        }
+        std::cout.flush();
+        // Skip the exit handlers, they would close the parent's files
+        _exit(properties.isSuccess ? 0 : 1);
+      }
+      std::cout << "Run " << i << " is training in worker " << pid << std::endl;
+      running[pid] = i;
+      continue;
+    }
+
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      perror("waitpid");
+      break;
+    }
+    if (running.count(pid) == 0) {
+      continue;
+    }
+    int i = running[pid];
+    running.erase(pid);
+
+    RunProperties properties = runs[i];
+    std::string runDir = sweep.output_dir_prefix + "Run-" + std::to_string(i);
+    std::vector<ResultRow> rows;
+    properties.isSuccess = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFEXITED(status) && !gSystem->AccessPathName((runDir + "/" + METADATA_FILE).c_str())) {
+      rows = read_rows_file(runDir);
+    }
+    if (WIFSIGNALED(status)) {
+      std::cout << "Worker " << pid << " (run " << i << ") was killed by signal " << WTERMSIG(status) << "!" << std::endl;
+    }
+    if (rows.size() == 0) {
+      properties.isSuccess = false;
+      rows = result_rows(properties, sweep.output_dir_prefix, i);
+    }
+    record(properties, i, rows);
+  }
+}
+
+// fromRNTuple trains on the RNTuple slices of slice_up_tree --rntuple instead of the ntuples,
+// fromDerived on the flat features of derived_features with the DERIVED preset
+void run_bulk(bool fromRNTuple, bool fromDerived) {
+  // Enable multithreading, gives us a speed boost. The budget comes from BDTG_DNN_THREADS,
+  // BDTG_DNN_NUMA_NODE and BDTG_DNN_CPUS so two jobs on one node don't fight over cores.
+  // This happens before the inputs are opened so they get allocated on the pinned node.
+  // With BDTG_DNN_WORKERS set, runs are trained in that many forked workers. The thread
+  // pool doesn't survive a fork, so then only the workers build one
+  int numWorkers = int_from_env(WORKERS_ENV, 0);
+  ThreadBudget processBudget = ThreadBudget::fromEnvironment();
+  if (numWorkers > 0) {
+    processBudget.pin();
+  } else {
+    processBudget.apply();
+  }
   TTimeStamp timestamp;
 
-  // open file and retrieve trees
-  auto siginputfile = TFile::Open(SIGNAL_FILE);
-  auto bginputfile = TFile::Open(BACKGROUND_FILE);
-  auto sigdirectory = siginputfile->Get<TDirectoryFile>("dimuons");
-  auto bgdirectory = bginputfile->Get<TDirectoryFile>("dimuons");
-  auto unsliced_backgroundtree = bgdirectory->Get<TTree>("tree");
-  auto unsliced_signaltree = sigdirectory->Get<TTree>("tree");
+  // open file and retrieve trees. Inputs can either be TTrees or RNTuples (see slice_up_tree --rntuple)
+  // The prefetching thread wouldn't survive a fork either
+  if (numWorkers == 0) {
+    enable_async_prefetch();
+  }
+  InputSample signalInput(fromRNTuple ? SIGNAL_RNTUPLE_FILE : fromDerived ? SIGNAL_DERIVED_FILE : SIGNAL_FILE);
+  InputSample backgroundInput(fromRNTuple ? BACKGROUND_RNTUPLE_FILE : fromDerived ? BACKGROUND_DERIVED_FILE : BACKGROUND_FILE);
+  if (signalInput.name == "" || backgroundInput.name == "") {
+    return;
+  }
+  bool useRNTuple = signalInput.isRNTuple && backgroundInput.isRNTuple;
+  if (signalInput.isRNTuple != backgroundInput.isRNTuple) {
+    std::cout << "Signal and background have to be stored the same way (both TTree or both RNTuple)!" << std::endl;
+    return;
+  }
+  auto unsliced_backgroundtree = backgroundInput.tree;
+  auto unsliced_signaltree = signalInput.tree;
 
-  int nBackground = unsliced_backgroundtree->GetEntries();
-  int nSignal = unsliced_signaltree->GetEntries();
+  int nBackground = backgroundInput.GetEntries();
+  int nSignal = signalInput.GetEntries();
   
   // All tuneable parameters for runs. These are all runs which will be completed,
   // adding more to the list means more events will be run. WARNING: It runs one run
@@ -97,22 +629,41 @@ void run_bulk() {
   // DNN settings
   std::vector<int> numLayers = {5};
   std::vector<int> convergenceSteps = {30};
+  // Mini-batch sizes of the DNN, each one its own run
+  std::vector<int> batchSizes = {DEFAULT_BATCH_SIZE};
   std::vector<std::string> layerString = {"DENSE|100|RELU"};
   std::vector<std::string> learningRate = {"1e-3"};
 
+  // Thread settings for each run, swept like the rest. 0 threads / node -1 means the run just
+  // uses the process budget
+  std::vector<int> toTryNumThreads = {0};
+  std::vector<int> toTryNumaNode = {-1};
+
+  // Draw each run's training and testing events with the streaming sampler instead of TMVA's
+  // SplitMode=Random, copying only the drawn events. Only for TTree inputs
+  bool streamSampling = false;
+
+  // What every run keeps on disk besides its weights (see run_writer.cpp). Thousand run sweeps
+  // want LEAN_OUTPUT, a full TMVA.root is hundreds of MB
+  run_output outputMode = FULL_OUTPUT;
+
+  // The derived files only have the DERIVED columns, and the mass window cuts are rewritten
+  // to read the mass and number of pairs that derived_features keeps
+  if (fromDerived) {
+    todo = DERIVED;
+    for (std::string &cut : cutOptions) {
+      cut = formula_to_derived_expression(cut);
+    }
+  }
+
   // Only take some number of events to actually process. divier = 1 means that every
-  // event will be used
+  // event will be used. RNTuple inputs are always read whole, slice them with slice_up_tree instead
+  if (useRNTuple && divider != 1) {
+    std::cout << "RNTuple inputs are always read whole, set divider to 1 or train on the TTrees" << std::endl;
+    return;
+  }
   int toTake = nBackground/divider;
-  TTree *backgroundtree = NULL;
-  TTree *signaltree = NULL;
   std::cout << "Only using " << toTake << " events!" << std::endl;
-  if(toTake == nBackground) {
-    backgroundtree = unsliced_backgroundtree;
-    signaltree = unsliced_signaltree;
-  } else {
-    backgroundtree = unsliced_backgroundtree->CloneTree(toTake);
-    signaltree = unsliced_signaltree->CloneTree(toTake);
-  }
   
   // Choose name for output directory, I decided to use the timestamp to differentiate them
   // by default.
@@ -124,7 +675,7 @@ void run_bulk() {
   std::string output_dir_prefix = outputDir + timestampString + "BULK/";
 
   // Generate output directory
-  gSystem->Exec(("mkdir " + output_dir_prefix).c_str());
+  gSystem->mkdir(output_dir_prefix.c_str(), kTRUE);
 
   RunProperties originalProperties(todo, 1000, 10000, "", {DNN});
 
@@ -132,6 +683,9 @@ void run_bulk() {
   std::string metaFileName = output_dir_prefix + "metadata.root";
   TFile *metaFile = TFile::Open(metaFileName.c_str(), "RECREATE");
 
+  // Typed table of every run and its metrics, stored alongside the maps in metadata.root
+  ResultsIndex resultsIndex(metaFile);
+
   std::vector<RunProperties> propertiesToRun = {};
 
   // This big loop is a bit complicated. It's just to generate all possible
@@ -156,7 +710,10 @@ void run_bulk() {
         toTrySignalNumTest,
         toTryBackgroundNumTest,
         numLayers,
-        convergenceSteps
+        convergenceSteps,
+        batchSizes,
+        toTryNumThreads,
+        toTryNumaNode
       };
       // Find the full number of combinations here
       int fullSize = computeFullSize(std::make_pair(optS, optI));
@@ -177,11 +734,14 @@ void run_bulk() {
         properties.numBackgroundTest = p.second[5];
         properties.numLayers = p.second[6];
         properties.convergenceSteps = p.second[7];
+        properties.batchSize = p.second[8];
+        properties.numThreads = p.second[9];
+        properties.numaNode = p.second[10];
 
         properties.methods = {method};
         propertiesToRun.insert(propertiesToRun.end(), properties);
       }
-    } else if(method == BDTG) {
+    } else if(method == BDTG || method == HGBDT) {
       // All of the options which are string-valued
       vecvec_s optS = {
         cutOptions,
@@ -193,7 +753,9 @@ void run_bulk() {
         toTrySignalNumTrain, 
         toTryBackgroundNumTrain, 
         toTrySignalNumTest,
-        toTryBackgroundNumTest
+        toTryBackgroundNumTest,
+        toTryNumThreads,
+        toTryNumaNode
       };
 
       // Find the full number of combinations here
@@ -211,6 +773,8 @@ void run_bulk() {
         properties.numBackgroundTrain = p.second[3];
         properties.numSignalTest = p.second[4];
         properties.numBackgroundTest = p.second[5];
+        properties.numThreads = p.second[6];
+        properties.numaNode = p.second[7];
 
         properties.methods = {method};
         propertiesToRun.insert(propertiesToRun.end(), properties);
@@ -229,7 +793,10 @@ void run_bulk() {
         toTrySignalNumTest,
         toTryBackgroundNumTest,
         numLayers,
-        convergenceSteps
+        convergenceSteps,
+        batchSizes,
+        toTryNumThreads,
+        toTryNumaNode
       };
       //std::pair<vecvec_s, vecvec_i> optPair = std::make_pair(optS, optI);
 
@@ -250,6 +817,9 @@ void run_bulk() {
         properties.numBackgroundTest = p.second[3];
         properties.numLayers = p.second[4];
         properties.convergenceSteps = p.second[5];
+        properties.batchSize = p.second[6];
+        properties.numThreads = p.second[7];
+        properties.numaNode = p.second[8];
 
         properties.methods = {method};
         propertiesToRun.insert(propertiesToRun.end(), properties);
@@ -257,10 +827,64 @@ void run_bulk() {
     }
   }
 
+  // BDTG runs that only differ in numTrees are trained once with the most trees, and
+  // evaluated at the smaller counts from the same forest
+  propertiesToRun = merge_tree_count_runs(propertiesToRun);
+
+  // Only read (and prefetch) the branches some run actually needs. Once the runs start each
+  // one caches just its own. A slice only copies those branches out of the files
+  std::vector<std::string> neededFormulas;
+  for (RunProperties p : propertiesToRun) {
+    for (std::string formula : run_formulas(p)) {
+      neededFormulas.push_back(formula);
+    }
+  }
+  // An RNTuple slice only has the columns of the preset it was sliced for
+  for (InputSample *input : {&signalInput, &backgroundInput}) {
+    std::vector<std::string> missing = input->missingColumns(neededFormulas);
+    if (missing.size() > 0) {
+      std::cout << input->path << " has no column " << missing[0] << (missing.size() > 1 ? " (and " + std::to_string(missing.size() - 1) + " more)" : "")
+                << ", slice it again with slice_up_tree --rntuple --preset for the preset the runs use" << std::endl;
+      return;
+    }
+  }
+  signalInput.optimizeReads(neededFormulas);
+  backgroundInput.optimizeReads(neededFormulas);
+  TTree *backgroundtree = unsliced_backgroundtree;
+  TTree *signaltree = unsliced_signaltree;
+  if (toTake != nBackground && !useRNTuple) {
+    keep_only_branches(unsliced_backgroundtree, neededFormulas);
+    keep_only_branches(unsliced_signaltree, neededFormulas);
+    backgroundtree = unsliced_backgroundtree->CloneTree(toTake);
+    signaltree = unsliced_signaltree->CloneTree(toTake);
+  }
+
   // Turn off histogram visualization
   gROOT->SetBatch(true);
 
-  // Normalize all of the data
+  // Normalize all of the data, using the (possibly sliced) signal sample
+  if (!useRNTuple) {
+    signalInput.tree = signaltree;
+  }
+  // The variables of a preset are read by its compiled reader, all of them in one pass over
+  // the tree. Anything else (and RNTuples) is drawn below, one variable at a time
+  std::map<std::string, std::pair<Double_t, Double_t>> presetStats;
+  std::map<std::string, NormalizedFeature> normalizedFeatures;
+  for (int i = 0; i < propertiesToRun.size() && !useRNTuple; i++) {
+    std::vector<std::string> expressions;
+    for (variable_tuple var : propertiesToRun[i].variables) {
+      expressions.push_back(std::get<0>(var));
+    }
+    bool known = std::all_of(expressions.begin(), expressions.end(),
+                             [&](std::string e) { return presetStats.count(e) > 0; });
+    std::vector<FeatureMoments> moments;
+    if (known || !compiled_moments(signaltree, expressions, moments)) {
+      continue;
+    }
+    for (size_t j = 0; j < expressions.size(); j++) {
+      presetStats[expressions[j]] = moments[j].meanAndStdDev();
+    }
+  }
   for(int i = 0; i < propertiesToRun.size(); i++) {
     RunProperties p = propertiesToRun[i];
 
@@ -269,12 +893,12 @@ void run_bulk() {
     for(int j = 0; j < p.variables.size(); j++) {
       variable_tuple var = p.variables[j];
       std::string varname = std::get<0>(var);
-      signaltree->Draw(varname.c_str());
-      auto histo = (TH1D*)gPad->GetPrimitive("htemp");
-      auto sdev = histo->GetStdDev()/2;
-      auto mean = histo->GetMean();
+      std::pair<Double_t, Double_t> stats = presetStats.count(varname) ? presetStats[varname] : signalInput.meanAndStdDev(varname);
+      std::string sdev = TString::Format("%.10g", stats.second/2).Data();
+      std::string mean = TString::Format("%.10g", stats.first).Data();
       std::get<0>(var) = "(" + varname + " - (" + mean + "))/(" + sdev + ")";
       std::get<1>(var) = "Norm_" + varname;
+      normalizedFeatures[std::get<0>(var)] = {varname, std::stod(mean), std::stod(sdev)};
       propertiesToRun[i].variables[j] = var;
     }
   }
@@ -282,10 +906,67 @@ void run_bulk() {
   // Turn on histogram visualization
   gROOT->SetBatch(false);
 
+  // Runs that were already trained by an earlier sweep (same settings, same inputs) are
+  // linked in from the shared result cache instead of being trained again
+  ResultCache resultCache;
+  std::string inputs = input_identity(signalInput, useRNTuple ? nSignal : signaltree->GetEntries()) + ";"
+                     + input_identity(backgroundInput, useRNTuple ? nBackground : backgroundtree->GetEntries());
+  if (streamSampling && !useRNTuple) {
+    inputs += ";sampled-uniform";
+  }
+
+  // Every distinct cut is evaluated once per input (and remembered across sweeps), runs then
+  // get a copy of just the passing events instead of TMVA scanning the whole tree again
+  SelectionIndex *signalSelections = NULL;
+  SelectionIndex *backgroundSelections = NULL;
+  if (!useRNTuple) {
+    signalSelections = new SelectionIndex(signaltree, input_identity(signalInput, signaltree->GetEntries()));
+    backgroundSelections = new SelectionIndex(backgroundtree, input_identity(backgroundInput, backgroundtree->GetEntries()));
+  }
+  EventSampler signalSampler(signalInput.path);
+  EventSampler backgroundSampler(backgroundInput.path);
+
   // Save the original directory, as we're going to be moving around a bit
   TDirectory* originalDir = gDirectory;
   std::string *originalPhysDir = new std::string(gSystem->pwd());
 
+  SweepContext sweep(signalInput, backgroundInput, signalSampler, backgroundSampler, resultCache);
+  sweep.signaltree = signaltree;
+  sweep.backgroundtree = backgroundtree;
+  sweep.useRNTuple = useRNTuple;
+  sweep.streamSampling = streamSampling;
+  sweep.cacheReads = !useRNTuple && signaltree == unsliced_signaltree;
+  sweep.neededFormulas = neededFormulas;
+  sweep.normalizedFeatures = normalizedFeatures;
+  sweep.signalSelections = signalSelections;
+  sweep.backgroundSelections = backgroundSelections;
+  sweep.output_dir_prefix = output_dir_prefix;
+  sweep.originalPhysDir = *originalPhysDir;
+  sweep.outputMode = outputMode;
+  sweep.workerBudget = processBudget;
+  if (numWorkers > 0 && processBudget.numThreads <= 0) {
+    // Split the cores between the workers instead of every worker taking all of them
+    sweep.workerBudget.numThreads = std::max(1, processBudget.resolvedThreads() / numWorkers);
+  }
+
+  // Saves a finished run's properties and rows in the sweep's metadata file
+  auto record = [&](RunProperties &properties, int i, std::vector<ResultRow> &rows) {
+    std::map<std::string, std::string> properties_map = properties.to_map();
+    metaFile->WriteObject(&properties_map, std::to_string(i).c_str());
+    for (ResultRow r : rows) {
+      resultsIndex.append(r);
+    }
+  };
+
+  // Runs trained in this process hand their outputs to a writer thread. Forked workers write
+  // their own, a thread can't be forked along
+  AsyncWriter *writer = numWorkers == 0 ? new AsyncWriter() : NULL;
+  sweep.writer = writer;
+
+  // Runs left for the forked workers, with their hashes
+  std::vector<int> toTrain;
+  std::map<int, std::string> hashes;
+
   for(int i = 0; i < propertiesToRun.size(); i++) {
     // Move into the directory of this particular run
     gDirectory->cd();
@@ -297,67 +978,41 @@ void run_bulk() {
     properties.Print();
 
     // Make the directory for this particular run
-    TString *runDir = new TString(output_dir_prefix + "Run-" + std::to_string(i));
-    std::string runDirAsString = std::string(runDir->Data());
-    gSystem->Exec(("mkdir " + runDirAsString + "/").c_str());
-
-    // Move into the directory of the new run
-    gSystem->cd(*runDir);
-
-    // Create objects for run
-    TMVA::Factory *factory;
-    TMVA::DataLoader *dataloader;
-    try {
-      // Save outputs of ML run
-      TString *outfileName = new TString("TMVA.root");
-  
-      std::cout << "Writing to " << *outfileName << "!" << std::endl;
-      TFile *outputFile = TFile::Open( *outfileName, "RECREATE" );
-      
-      // Create the factory which TMVA uses to allocate runs
-      factory = new TMVA::Factory( "TMVAClassification", outputFile,
-         "!Silent:Color:DrawProgressBar:Transformations=I;D;P;G,D:AnalysisType=Classification" );
-  
-      dataloader=NULL;
+    std::string runDirAsString = output_dir_prefix + "Run-" + std::to_string(i);
 
-      TString *path = new TString("dataset");
-      std::string path_as_str(path->Data());
-  
-      dataloader = properties.generateDataLoader(path_as_str);
-  
-      Double_t signalWeight     = 1.0;
-      Double_t backgroundWeight = 1.0;
-  
-      dataloader->AddSignalTree    ( signaltree,     signalWeight );
-      dataloader->AddBackgroundTree( backgroundtree, backgroundWeight );
-  
-      dataloader->SetBackgroundWeightExpression( "PU_wgt" );
-  
-      properties.fillDataLoaderForTree(dataloader);
-  
-      properties.fillFactory(factory, dataloader);
-  
-      factory->TrainAllMethods();
-      factory->TestAllMethods();
-      factory->EvaluateAllMethods();
-      outputFile->Close();
-      
-      properties.isSuccess = true;
+    std::string hash = run_hash(properties, inputs);
+    if (resultCache.has(hash, outputMode) && resultCache.link(hash, runDirAsString)) {
+      std::cout << "Already trained as " << hash << ", reusing it" << std::endl;
+      std::vector<ResultRow> rows = resultCache.rows(hash);
+      for (ResultRow &r : rows) {
+        r.sweepDir = output_dir_prefix;
+        r.runId = i;
+        properties.isSuccess = r.isSuccess;
+      }
+      record(properties, i, rows);
+      continue;
+    }
 
-      std::cout << "==> Wrote root file: " << outputFile->GetName() << std::endl;
-      std::cout << "==> TMVAClassification is done!" << std::endl;
-    } catch (...) {
-      std::cout << "This run failed! " << std::endl;
+    if (numWorkers > 0) {
+      toTrain.push_back(i);
+      hashes[i] = hash;
+      continue;
     }
-    
-    std::map<std::string, std::string> properties_map = properties.to_map();
-    metaFile->WriteObject(&properties_map, std::to_string(i).c_str());
-    delete factory;
-    delete dataloader;
+    std::vector<ResultRow> runRows = execute_run(sweep, properties, i, hash);
+    record(properties, i, runRows);
+  }
+  if (writer != NULL) {
+    writer->drain();
+  }
+
+  if (toTrain.size() > 0) {
+    train_in_workers(sweep, propertiesToRun, toTrain, hashes, numWorkers, record);
   }
 
   gDirectory->cd();
   gSystem->cd(originalPhysDir->c_str());
+  resultsIndex.Write();
+  delete writer;
 
   std::cout << "Completed run! Directory: " << output_dir_prefix << std::endl;
 
@@ -368,8 +1023,22 @@ void run_bulk() {
 }
 
 int main(int argc, char ** argv) {
+    bool fromRNTuple = false;
+    bool fromDerived = false;
+    for (int i = 1; i < argc; i++) {
+      if (std::string(argv[i]) == "--rntuple") {
+        fromRNTuple = true;
+      }
+      if (std::string(argv[i]) == "--derived") {
+        fromDerived = true;
+      }
+    }
+    if (fromRNTuple && fromDerived) {
+      std::cout << "--rntuple and --derived are different inputs, pick one" << std::endl;
+      return 1;
+    }
     TApplication app("MyApp", &argc, argv);
-    run_bulk();
+    run_bulk(fromRNTuple, fromDerived);
     return 0;
 }
 #endif
@@ -12,20 +12,34 @@
 #include <string>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include "thread_budget.cpp"
+#include "feature_schema.cpp"
 
 #ifndef __RUNNING_PROPERTIES
 #define __RUNNING_PROPERTIES
 
 using json = nlohmann::json;
 
+// TMVA's own default seed for splitting events into training and testing
+#define DEFAULT_SPLIT_SEED 100
+// DNN mini-batch size of runs that don't set one, which is what every run used before it could be set
+#define DEFAULT_BATCH_SIZE 10
+// Entry number of every event in the tree it was read from, carried along as two spectators
+// (see training_events.cpp). TMVA keeps spectators as floats, which only hold whole numbers
+// up to 2^24 exactly, so it's split at ENTRY_SPLIT
+#define ENTRY_SPLIT 1048576
+#define ENTRY_HIGH_SPECTATOR "entryHigh"
+#define ENTRY_LOW_SPECTATOR "entryLow"
+
 // All presets of variables for use later
 typedef enum {
-  MUONS, JETS, MUONPAIRS, MUONPAIRS_AND_JETS, ALL
+  MUONS, JETS, MUONPAIRS, MUONPAIRS_AND_JETS, ALL, DERIVED
 } variable_preset;
 
-// Methods to use in factory, ALL_METHODS just does both
+// Methods to use in factory, ALL_METHODS just does both TMVA methods. HGBDT is the
+// histogram based BDT of hist_gbdt.cpp, trained next to the factory rather than booked in it
 typedef enum {
-  BDTG, DNN, ALL_METHODS
+  BDTG, DNN, ALL_METHODS, HGBDT
 } ml_method;
 
 // Finds an element in a list and returns pointer to it
@@ -71,6 +85,36 @@ std::string method_to_string(ml_method m) {
       return "BDTG";
     case DNN:
       return "DNN";
+    case HGBDT:
+      return "HGBDT";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// Name a method is booked under in the TMVA factory (see fillFactory)
+std::string method_to_tmva_name(ml_method m) {
+  switch(m) {
+    case BDTG:
+      return "BDTG";
+    case DNN:
+      return "TMVA_DNN_GPU";
+    case HGBDT:
+      return "HGBDT";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// Directory of TMVA.root holding a method's outputs (dataset/<directory>/<tmva name>)
+std::string method_to_tmva_directory(ml_method m) {
+  switch(m) {
+    case BDTG:
+      return "Method_BDT";
+    case DNN:
+      return "Method_DL";
+    case HGBDT:
+      return "Method_HGBDT";
     default:
       return "UNKNOWN";
   }
@@ -80,7 +124,8 @@ std::string method_to_string(ml_method m) {
 ml_method get_method_from_string(std::string str) {
    if(str == "BDTG") return BDTG;
    if(str == "DNN") return DNN;
-   if(str == "ALL_METHODS") return ALL_METHODS;
+   if(str == "HGBDT") return HGBDT;
+   if(str == "ALL_METHODS" || str == "ALL") return ALL_METHODS;
    return BDTG;
 }
 
@@ -92,9 +137,9 @@ variable_tuple get_tuple_from_string(std::string str) {
    return {str, str, "units", 'F'};
 }
 
-// Turns a string from JSON into its boolean value (T/F)
+// Turns a string from JSON into its boolean value (T/F). Older metadata wrote "1"/"0"
 bool stob(std::string str) {
-  return str == "true";
+  return str == "true" || str == "1";
 }
 
 // Turns a boolean into its string for use in JSON
@@ -103,36 +148,29 @@ std::string btos(bool b) {
 }
 
 // Turns variable_preset elements into a vector of variables for use in TMVA. This just expands out the 
-// presets into their parts.
+// presets into their parts, the expressions of their schemas in feature_schema.cpp.
 std::vector<variable_tuple> variable_preset_to_tuples(variable_preset set) {
   std::vector<variable_tuple> toReturn;
   std::vector<std::string> collection;
   switch (set) {
     case MUONS:
-      collection = {"muons.charge", "muons.pt", "muons.eta", "muons.phi"};
+      collection = {MUONS_SCHEMA(SCHEMA_EXPRESSION)};
       break;
     case MUONPAIRS:
-      collection = {"muPairs.mass", "muPairs.pt", "muPairs.eta", "muPairs.phi"};
+      collection = {MUONPAIRS_SCHEMA(SCHEMA_EXPRESSION)};
       break;
     case JETS:
-      collection = {"jets.charge", "jets.pt", "jets.eta", "jets.mass"};
+      collection = {JETS_SCHEMA(SCHEMA_EXPRESSION)};
       break;
     case MUONPAIRS_AND_JETS:
-      collection = {
-        "muPairs.mass", "muPairs.charge", "muPairs.pt", "muPairs.eta", "muPairs.phi",
-        "jets.mass", "jets.charge", "jets.pt", "jets.eta", "jets.phi",
-      };
+      collection = {MUONPAIRS_AND_JETS_SCHEMA(SCHEMA_EXPRESSION)};
       break;
     case ALL:
-      // So for some reason, muPairs.charge just doesnt work. It used to at one point (super early on), but not anymore. That's fine I guess
-      collection = {
-        /*"muons.charge"*/"Alt$(muons.pt[0],-99)",//, "Alt$(muons.eta[0],-99)", "Alt$(muons.phi[0],-99)", 
-        "Alt$(muons.pt[1],-99)",//, "Alt$(muons.eta[1],-99)", "Alt$(muons.phi[1],-99)",
-        "muPairs.mass", "muPairs.pt", /*"muPairs.charge",*/ "muPairs.eta", "muPairs.phi", "muPairs.dR", "muPairs.dEta", "muPairs.dPhi", "muPairs.dPhiStar",
-          "met.px", "met.py", "met.pt", "met.phi", "met.sumEt",
-        /*"jets.mass[0]", "jets.charge",*/ "jets.pt[0]",//, "jets.eta[0]" "jets.phi[0]",
-        "jetPairs.mass","jetPairs.pt", "jetPairs.eta", "jetPairs.phi", "jetPairs.dR", "jetPairs.dEta", "jetPairs.dPhi",
-      };
+      collection = {ALL_SCHEMA(SCHEMA_EXPRESSION)};
+      break;
+    case DERIVED:
+      // Flat columns written by derived_features, only available in its output files
+      collection = {DERIVED_SCHEMA(SCHEMA_EXPRESSION)};
       break;
     default:
       perror("Unimplemented todo");
@@ -157,10 +195,19 @@ class RunProperties : public TObject {
     Int_t maxDepth;
     Int_t numLayers;
     Int_t convergenceSteps;
+    Int_t batchSize;
     TString layerString;
     TString learningRate;
     TString cut;
     Bool_t isSuccess;
+    // Threads this run may use (0 = whatever the process has) and the NUMA node to pin it to (-1 = none)
+    Int_t numThreads;
+    Int_t numaNode;
+    // BDTG only: extra forest sizes to evaluate from this run's forest, which is trained
+    // once with numTrees (the largest). Empty for normal runs.
+    std::vector<Int_t> stagedNumTrees;
+    // Seed TMVA uses to pick the training and testing events
+    Int_t splitSeed;
 
     // Turns the properties stored in this object into a string for use in TMVA
     TString produceDNNString() {
@@ -174,7 +221,7 @@ class RunProperties : public TObject {
       layoutString = layoutString + "DENSE|1|LINEAR";
 
       TString trainingString1("LearningRate=" + learningRate + ",Momentum=0.9,Repetitions=1,"
-                              "ConvergenceSteps=" + TString(std::to_string(this->convergenceSteps)) + ",BatchSize=10,TestRepetitions=1,"
+                              "ConvergenceSteps=" + TString(std::to_string(this->convergenceSteps)) + ",BatchSize=" + TString(std::to_string(this->batchSize)) + ",TestRepetitions=1,"
                               "MaxEpochs=20,WeightDecay=1e-4,Regularization=None,"
                               "Optimizer=ADAM,DropConfig=0.0+0.0+0.0+0.");
        
@@ -194,10 +241,15 @@ class RunProperties : public TObject {
 
     // Convenience function to see if this RunProperties is supposed to run a given method
     bool containsMethod(ml_method m) {
-      return (std::find(this->methods.begin(), this->methods.end(), ALL_METHODS) != this->methods.end()) 
+      return (m != HGBDT && std::find(this->methods.begin(), this->methods.end(), ALL_METHODS) != this->methods.end()) 
           || (std::find(this->methods.begin(), this->methods.end(), m) != this->methods.end());
     }
 
+    // Whether numTrees and maxDepth mean anything for this run
+    bool containsForest() {
+      return this->containsMethod(BDTG) || this->containsMethod(HGBDT);
+    }
+
     // Base constructor for RunProperties object
     RunProperties(std::vector<variable_tuple> variables, int numSignalTrain, int numBackgroundTrain, TString cut, std::vector<ml_method> methods = {BDTG, DNN, ALL_METHODS}) {
      this->numBackgroundTrain = numBackgroundTrain;
@@ -206,6 +258,16 @@ class RunProperties : public TObject {
      this->variables = variables;
      this->cut = TString(cut);
      this->isSuccess = false;
+     this->numSignalTest = 0;
+     this->numBackgroundTest = 0;
+     this->numTrees = 0;
+     this->maxDepth = 0;
+     this->numLayers = 0;
+     this->convergenceSteps = 0;
+     this->batchSize = DEFAULT_BATCH_SIZE;
+     this->numThreads = 0;
+     this->numaNode = -1;
+     this->splitSeed = DEFAULT_SPLIT_SEED;
     }
     
     // Constructor for RunProperties using a variable preset
@@ -224,7 +286,7 @@ class RunProperties : public TObject {
       this->numBackgroundTrain = stoi(data["numBackgroundTrain"]);
       this->numSignalTest = stoi(data["numSignalTest"]);
       this->numBackgroundTest = stoi(data["numBackgroundTest"]);
-      if (this->containsMethod(BDTG)) {
+      if (this->containsForest()) {
         this->numTrees = stoi(data["numTrees"]);
         this->maxDepth = stoi(data["maxDepth"]);
       } 
@@ -234,12 +296,24 @@ class RunProperties : public TObject {
         this->layerString = TString(data["layerString"]);
         this->learningRate = TString(data["learningRate"]);
       }
+      // Older metadata files all trained with the same batch size
+      this->batchSize = data.count("batchSize") ? stoi(data["batchSize"]) : DEFAULT_BATCH_SIZE;
 
-      if (data["performMassCut"] != NULL) {
+      // The oldest metadata files only had a flag for the mass window
+      if (data.count("cut")) {
+        this->cut = data["cut"];
+      } else if (data.count("performMassCut")) {
         this->cut = stob(data["performMassCut"]) ? "120 < muPairs.mass && muPairs.mass < 150" : "";
       }
-      this->cut = data["cut"];
       this->isSuccess = stob(data["isSuccess"]);
+      // Older metadata files don't have a thread budget
+      this->numThreads = data.count("numThreads") ? stoi(data["numThreads"]) : 0;
+      this->numaNode = data.count("numaNode") ? stoi(data["numaNode"]) : -1;
+      // Older metadata files were all split with TMVA's default seed
+      this->splitSeed = data.count("splitSeed") ? stoi(data["splitSeed"]) : DEFAULT_SPLIT_SEED;
+      if (data.count("stagedNumTrees")) {
+        this->stagedNumTrees = json::parse(data["stagedNumTrees"]).get<std::vector<Int_t>>();
+      }
 
       std::string variablesTString = data["variables"];
 
@@ -255,12 +329,32 @@ class RunProperties : public TObject {
     RunProperties clone() {
       RunProperties rp(this->variables, this->numSignalTrain, this->numBackgroundTrain, this->cut.Data(), this->methods);
       rp.numTrees = this->numTrees;
-      rp.numTrees = this->maxDepth;
+      rp.maxDepth = this->maxDepth;
+      rp.numLayers = this->numLayers;
+      rp.convergenceSteps = this->convergenceSteps;
+      rp.batchSize = this->batchSize;
+      rp.layerString = this->layerString;
+      rp.learningRate = this->learningRate;
       rp.numSignalTest = this->numSignalTest;
       rp.numBackgroundTest = this->numBackgroundTest;
+      rp.numThreads = this->numThreads;
+      rp.numaNode = this->numaNode;
+      rp.stagedNumTrees = this->stagedNumTrees;
+      rp.splitSeed = this->splitSeed;
       return rp;
     }
   
+    // The thread budget this run should execute with. Runs without their own budget
+    // inherit the one the process was started with
+    ThreadBudget threadBudget(ThreadBudget processBudget) {
+      if (this->numThreads <= 0 && this->numaNode < 0) {
+        return processBudget;
+      }
+      return ThreadBudget(this->numThreads > 0 ? this->numThreads : processBudget.numThreads,
+                          this->numaNode >= 0 ? this->numaNode : processBudget.numaNode,
+                          this->numaNode >= 0 ? "" : processBudget.cpuList);
+    }
+
     // Include a particular variable in the set of variables here
     void include_variable(variable_tuple tup) {
       this->variables.insert(this->variables.begin(), tup);
@@ -301,12 +395,20 @@ class RunProperties : public TObject {
     }
      
     // Creates a Dataloader object and fills it with the contents of this
-    // RunProperties object
-    TMVA::DataLoader *generateDataLoader(std::string path) {
+    // RunProperties object. PU_wgt comes along as a spectator, so every event of the
+    // TestTree has it for the significance scan whatever weight TMVA gave it. So does the
+    // entry number, which tells which events the run trained on. Given flat branches (see
+    // flatten_features), the variables are read from those instead of their expressions
+    TMVA::DataLoader *generateDataLoader(std::string path, std::vector<std::string> flatBranches = {}) {
       TMVA::DataLoader *dataloader = new TMVA::DataLoader(path);
-      for (auto it = this->variables.begin(); it != this->variables.end(); ++it) {
-        dataloader->AddVariable("Alt$(" + std::get<0>(*it) + ",0)", std::get<1>(*it), std::get<2>(*it), std::get<3>(*it));
+      for (size_t i = 0; i < this->variables.size(); i++) {
+        variable_tuple &var = this->variables[i];
+        std::string expression = flatBranches.size() > 0 ? flatBranches[i] : "Alt$(" + std::get<0>(var) + ",0)";
+        dataloader->AddVariable(expression, std::get<1>(var), std::get<2>(var), std::get<3>(var));
       }
+      dataloader->AddSpectator("PU_wgt", "PU_wgt");
+      dataloader->AddSpectator(ENTRY_HIGH_SPECTATOR " := int(Entry$/" + std::to_string(ENTRY_SPLIT) + ")", ENTRY_HIGH_SPECTATOR);
+      dataloader->AddSpectator(ENTRY_LOW_SPECTATOR " := Entry$%" + std::to_string(ENTRY_SPLIT), ENTRY_LOW_SPECTATOR);
       return dataloader;
     }
 
@@ -314,10 +416,10 @@ class RunProperties : public TObject {
     // TMVA to actually use these methods
     void fillFactory(TMVA::Factory *factory, TMVA::DataLoader *dataloader) {
       if (this->containsMethod(BDTG)) {
-        factory->BookMethod( dataloader, TMVA::Types::kBDT, "BDTG", "!H:!V:NTrees=" + std::to_string(this->numTrees) + ":MinNodeSize=2.5%:BoostType=Grad:Shrinkage=0.10:UseBaggedBoost:BaggedSampleFraction=0.5:nCuts=20:MaxDepth="  + std::to_string(this->maxDepth));
+        factory->BookMethod( dataloader, TMVA::Types::kBDT, method_to_tmva_name(BDTG), "!H:!V:NTrees=" + std::to_string(this->numTrees) + ":MinNodeSize=2.5%:BoostType=Grad:Shrinkage=0.10:UseBaggedBoost:BaggedSampleFraction=0.5:nCuts=20:MaxDepth="  + std::to_string(this->maxDepth));
       } 
       if (this->containsMethod(DNN)){
-        factory->BookMethod(dataloader, TMVA::Types::kDL, "TMVA_DNN_GPU", produceDNNString() + ":Architecture=GPU");
+        factory->BookMethod(dataloader, TMVA::Types::kDL, method_to_tmva_name(DNN), produceDNNString() + ":Architecture=GPU");
      }
    }
 
@@ -331,7 +433,7 @@ class RunProperties : public TObject {
      TCut mycuts = baseCondition + TCut(this->cut), mycutb = baseCondition + TCut(this->cut);
 
      dataloader->PrepareTrainingAndTestTree( mycuts, mycutb,
-      "nTrain_Signal=" + std::to_string(this->numSignalTrain) + ":nTrain_Background=" + std::to_string(this->numBackgroundTrain) + ":nTest_Signal=" + std::to_string(this->numSignalTest) + ":nTest_Background=" + std::to_string(this->numBackgroundTest) + ":SplitMode=Random:NormMode=NumEvents:!V" );
+      "nTrain_Signal=" + std::to_string(this->numSignalTrain) + ":nTrain_Background=" + std::to_string(this->numBackgroundTrain) + ":nTest_Signal=" + std::to_string(this->numSignalTest) + ":nTest_Background=" + std::to_string(this->numBackgroundTest) + ":SplitMode=Random:SplitSeed=" + std::to_string(this->splitSeed) + ":NormMode=NumEvents:!V" );
    }
 
    // Turns this RunProperties to a map for use in JSON to be able to save it
@@ -351,28 +453,35 @@ class RunProperties : public TObject {
        {"numSignalTest",std::to_string(this->numSignalTest)},
        {"numBackgroundTest",std::to_string(this->numBackgroundTest)},
        {"cut",this->cut.Data()},
-       {"isSuccess",std::to_string(this->isSuccess)},
+       {"isSuccess",btos(this->isSuccess)},
+       {"numThreads",std::to_string(this->numThreads)},
+       {"numaNode",std::to_string(this->numaNode)},
+       {"splitSeed",std::to_string(this->splitSeed)},
        {"methods",methodsTString.Data()},
        {"variables",variablesTString.Data()},
      };
 
      std::map<std::string, std::string> addition;
-     if(this->containsMethod(BDTG)) {
-       addition = {
+     if(this->containsForest()) {
+       addition.insert({
          {"numTrees",std::to_string(this->numTrees)},
          {"maxDepth",std::to_string(this->maxDepth)},
-       };
+       });
+       if (this->stagedNumTrees.size() > 0) {
+         addition["stagedNumTrees"] = json(this->stagedNumTrees).dump();
+       }
      } 
      if(this->containsMethod(DNN)) {
-       addition = {
+       addition.insert({
          {"numLayers", std::to_string(this->numLayers)},
          {"convergenceSteps", std::to_string(this->convergenceSteps)},
+         {"batchSize", std::to_string(this->batchSize)},
          {"layerString", this->layerString.Data()},
          {"learningRate", this->learningRate.Data()},
-      };
+      });
      }
      addition.insert(data.begin(), data.end());
-     return data;
+     return addition;
    }
 
    // Print the RunProperties object to standard out
@@ -399,13 +508,25 @@ class RunProperties : public TObject {
      } 
      std::cout << "\n  - numSignalTrain: " << this->numSignalTrain << "\n  - numBackgroundTrain: " << this->numBackgroundTrain;
      std::cout << "\n  - numSignalTest: " << this->numSignalTest <<   "\n  - numBackgroundTest: " << this->numBackgroundTest;
+     std::cout << "\n  - splitSeed: " << this->splitSeed;
+     std::cout << "\n  - numThreads: " << (this->numThreads > 0 ? std::to_string(this->numThreads) : "process default");
+     if (this->numaNode >= 0) {
+       std::cout << "\n  - numaNode: " << this->numaNode;
+     }
      if(this->containsMethod(BDTG)) {
        std::cout << "\n  - BDTG:";
        std::cout << "\n    - numTrees: " << this->numTrees << "\n    - maxDepth: " << this->maxDepth;
+       if (this->stagedNumTrees.size() > 0) {
+         std::cout << "\n    - also evaluated at numTrees: " << json(this->stagedNumTrees).dump();
+       }
      } 
+     if(this->containsMethod(HGBDT)) {
+       std::cout << "\n  - HGBDT:";
+       std::cout << "\n    - numTrees: " << this->numTrees << "\n    - maxDepth: " << this->maxDepth;
+     }
      if(this->containsMethod(DNN)) {
        std::cout << "\n  - DNN:";
-       std::cout << "\n    - numLayers: " << this->numLayers << "\n  - convergenceSteps: " << this->convergenceSteps << "\n    - layerString: " << this->layerString << "\n    - learningRate: " << this->learningRate << "\n    - dnn string: " << this->produceDNNString();
+       std::cout << "\n    - numLayers: " << this->numLayers << "\n  - convergenceSteps: " << this->convergenceSteps << "\n    - batchSize: " << this->batchSize << "\n    - layerString: " << this->layerString << "\n    - learningRate: " << this->learningRate << "\n    - dnn string: " << this->produceDNNString();
      }
      std::cout << "\n  - isSuccess: " << btos(this->isSuccess) << std::endl;
    }
@@ -416,16 +537,24 @@ class RunningResults {
     Double_t rocIntegral;
     Double_t kolS;
     Double_t kolB;
+    // Best expected significance on the test sample and the score cut giving it
+    Double_t asimovZ;
+    Double_t simpleZ;
+    Double_t threshold;
     RunProperties *associatedProperties;
     Bool_t failed;
     RunningResults(Double_t rocIntegral, Double_t kolS, Double_t kolB, RunProperties *associatedProperties) {
       this->rocIntegral = rocIntegral;
       this->kolS = kolS;
       this->kolB = kolB;
+      this->asimovZ = this->simpleZ = this->threshold = -1;
       this->associatedProperties = associatedProperties;
       this->failed = false;
     }
     RunningResults(Bool_t failed) {
+      this->rocIntegral = this->kolS = this->kolB = 0;
+      this->asimovZ = this->simpleZ = this->threshold = -1;
+      this->associatedProperties = NULL;
       this->failed = failed;
     }
 };
@@ -10,6 +10,9 @@
 #include "TMVA/TMVAGui.h"
 #include <iostream>
 #include <string>
+#include <vector>
+#include "thread_budget.cpp"
+#include "read_cache.cpp"
 
 #define SIGNAL_FILE "signal_data.root"
 #define BACKGROUND_FILE "background_data.root"
@@ -21,10 +24,11 @@ enum {
 };
 
 void run_single() {
-   ROOT::EnableImplicitMT();
+   ThreadBudget::fromEnvironment().apply();
    TTimeStamp timestamp;
 
-   // open file and retrieve trees
+   // open file and retrieve trees. Prefetching has to be on before the read caches are made
+   enable_async_prefetch();
    auto siginputfile = TFile::Open(SIGNAL_FILE);
    auto bginputfile = TFile::Open(BACKGROUND_FILE);
    auto sigdirectory = siginputfile->Get<TDirectoryFile>("dimuons");
@@ -33,8 +37,6 @@ void run_single() {
    auto unsliced_backgroundtree = bgdirectory->Get<TTree>("tree");
    auto unsliced_signaltree = sigdirectory->Get<TTree>("tree");
 
-   auto backgroundtree = unsliced_backgroundtree->CloneTree(10000);
-   auto signaltree = unsliced_signaltree->CloneTree(1000);
    int todo = MUONPAIRS;
 
    TString *outputDir = new TString(OUTPUT_DIR);
@@ -129,6 +131,21 @@ void run_single() {
        return;
    }
 
+   // Only what the variables and the weight read is cached and copied into the slices
+   std::vector<std::string> formulas = {"PU_wgt"};
+   for (TString expression : dataloader->GetDataSetInfo().GetListOfVariables()) {
+     formulas.push_back(expression.Data());
+   }
+   optimize_reads(unsliced_signaltree, formulas, SIGNAL_FILE);
+   optimize_reads(unsliced_backgroundtree, formulas, BACKGROUND_FILE);
+   keep_only_branches(unsliced_signaltree, formulas);
+   keep_only_branches(unsliced_backgroundtree, formulas);
+   // The slices stay with the inputs, they don't belong in the output file
+   bginputfile->cd();
+   auto backgroundtree = unsliced_backgroundtree->CloneTree(10000);
+   auto signaltree = unsliced_signaltree->CloneTree(1000);
+   outputFile->cd();
+
    Double_t signalWeight     = 1.0;
    Double_t backgroundWeight = 1.0;
 
@@ -0,0 +1,212 @@
+#include "TFile.h"
+#include "TH1.h"
+#include "TMemFile.h"
+#include "TROOT.h"
+#include "TTree.h"
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "overtraining.cpp"
+#include "significance.cpp"
+
+#ifndef __RUN_WRITER
+#define __RUN_WRITER
+
+// Bytes of output the writes handed to the writer thread (waiting or being written) may hold
+// before a run has to wait for them. Every write of a full run holds its whole TMVA.root in
+// memory, so this caps the memory on top of the run being trained. One write larger than this
+// still goes ahead, alone.
+#define WRITE_QUEUE_BYTES (1LL << 30)
+
+// What a run keeps on disk. The weights in dataset/weights are always written by TMVA.
+//  - FULL_OUTPUT: everything TMVA writes into TMVA.root (every tree, histogram and plot)
+//  - LEAN_OUTPUT: only the ROC curve of every method, at the same place in TMVA.root
+//  - LEAN_OUTPUT_WITH_SCORES: that and the per-event test scores, as each method's own TestTree
+typedef enum { FULL_OUTPUT, LEAN_OUTPUT, LEAN_OUTPUT_WITH_SCORES } run_output;
+
+// How much of a run's outputs a mode keeps. Every mode keeps all of what the ones below it do
+int output_completeness(run_output mode) {
+  switch (mode) {
+    case FULL_OUTPUT:
+      return 2;
+    case LEAN_OUTPUT_WITH_SCORES:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Runs writes on a background thread in the order they were handed over, so training doesn't
+// stall on the disk. The writes handed over hold at most WRITE_QUEUE_BYTES between them, handing
+// over more blocks until enough of them are done.
+class AsyncWriter {
+  public:
+    AsyncWriter() {
+      // The writer does ROOT I/O next to the thread training the next run
+      ROOT::EnableThreadSafety();
+      this->busy = this->stopping = false;
+      this->heldBytes = 0;
+      this->thread = std::thread([this]() { this->work(); });
+    }
+
+    ~AsyncWriter() {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+      }
+      this->changed.notify_all();
+      this->thread.join();
+    }
+
+    // Hands over a write holding the given number of bytes until it is done
+    void push(std::function<void()> write, Long64_t bytes) {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->changed.wait(lock, [&]() { return this->heldBytes == 0 || this->heldBytes + bytes <= WRITE_QUEUE_BYTES; });
+      this->queue.push_back({write, bytes});
+      this->heldBytes += bytes;
+      this->changed.notify_all();
+    }
+
+    // Waits until everything handed over so far is written
+    void drain() {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->changed.wait(lock, [this]() { return this->queue.size() == 0 && !this->busy; });
+    }
+
+  private:
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::pair<std::function<void()>, Long64_t>> queue;
+    // Of the writes waiting and the one being written
+    Long64_t heldBytes;
+    bool busy;
+    bool stopping;
+
+    void work() {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      while (true) {
+        this->changed.wait(lock, [this]() { return this->queue.size() > 0 || this->stopping; });
+        if (this->queue.size() == 0) {
+          return;
+        }
+        std::pair<std::function<void()>, Long64_t> write = this->queue.front();
+        this->queue.pop_front();
+        this->busy = true;
+        this->changed.notify_all();
+        lock.unlock();
+        write.first();
+        // Whatever the write held goes with it
+        write.first = nullptr;
+        lock.lock();
+        this->heldBytes -= write.second;
+        this->busy = false;
+        this->changed.notify_all();
+      }
+    }
+};
+
+// Closes an in-memory TMVA.root and returns it exactly as it would be on disk
+std::vector<char> close_memory_file(TMemFile *file) {
+  file->Close();
+  std::vector<char> image(file->GetSize());
+  image.resize(file->CopyTo(image.data(), image.size()));
+  delete file;
+  return image;
+}
+
+void write_file_image(const std::vector<char> &image, std::string path) {
+  std::ofstream output(path, std::ios::binary);
+  output.write(image.data(), image.size());
+  if (!output.good()) {
+    std::cout << "Could not write " << path << std::endl;
+  }
+}
+
+// The parts of one method's outputs a lean TMVA.root keeps
+class LeanMethodOutput {
+  public:
+    std::string name;
+    std::string directory;
+    TH1 *rocCurve;
+    // The method's test events with only className, weight, PU_wgt and the score. NULL
+    // unless the scores are kept
+    TTree *testTree;
+};
+
+// Picks what a lean TMVA.root keeps of a method out of the full one. Takes copies, so the full
+// file can be deleted right away.
+LeanMethodOutput lean_method_output(TFile *file, std::string name, std::string directory, bool withScores) {
+  LeanMethodOutput output;
+  output.name = name;
+  output.directory = directory;
+  output.rocCurve = NULL;
+  output.testTree = NULL;
+  TH1 *rocCurve = file->Get<TH1>(("dataset/" + directory + "/" + name + "/MVA_" + name + "_rejBvsS").c_str());
+  if (rocCurve != NULL) {
+    output.rocCurve = (TH1*)rocCurve->Clone();
+    output.rocCurve->SetDirectory(NULL);
+  }
+  if (!withScores) {
+    return output;
+  }
+  // TMVA's TestTree, or the method's own if it was trained outside the factory
+  TTree *tree = file->Get<TTree>("dataset/TestTree");
+  if (tree == NULL || tree->GetBranch(name.c_str()) == NULL) {
+    tree = file->Get<TTree>(method_tree(name, "TestTree").c_str());
+  }
+  if (tree == NULL || tree->GetBranch(name.c_str()) == NULL) {
+    return output;
+  }
+  tree->SetBranchStatus("*", 0);
+  for (std::string branch : {std::string("className"), std::string("weight"), std::string("PU_wgt"), name}) {
+    if (tree->GetBranch(branch.c_str()) != NULL) {
+      tree->SetBranchStatus(branch.c_str(), 1);
+    }
+  }
+  TDirectory *previous = gDirectory;
+  gROOT->cd();
+  output.testTree = tree->CloneTree(-1);
+  output.testTree->SetDirectory(NULL);
+  previous->cd();
+  return output;
+}
+
+// Writes a lean TMVA.root: the ROC curves where TMVA puts them, the test scores in each
+// method's own TestTree (className, weight, PU_wgt and the score, like TMVA's), where
+// read_method_scores finds them, and the selected event counts of the significance scan
+void write_lean_output(std::vector<LeanMethodOutput> &methods, Long64_t selectedSignal, Long64_t selectedBackground,
+                       std::string path) {
+  TFile *file = TFile::Open(path.c_str(), "RECREATE");
+  if (file == NULL || file->IsZombie()) {
+    std::cout << "Could not write " << path << std::endl;
+    return;
+  }
+  for (LeanMethodOutput &m : methods) {
+    if (m.rocCurve != NULL) {
+      file->mkdir(("dataset/" + m.directory + "/" + m.name).c_str(), "", true)->WriteTObject(m.rocCurve);
+      delete m.rocCurve;
+    }
+    if (m.testTree == NULL) {
+      continue;
+    }
+    std::string treePath = method_tree(m.name, "TestTree");
+    TDirectory *dir = file->mkdir(treePath.substr(0, treePath.rfind('/')).c_str(), "", true);
+    m.testTree->SetName("TestTree");
+    m.testTree->SetDirectory(dir);
+    dir->WriteTObject(m.testTree);
+    delete m.testTree;
+  }
+  if (selectedSignal >= 0 && selectedBackground >= 0) {
+    write_selected_events(file, selectedSignal, selectedBackground);
+  }
+  file->Close();
+  delete file;
+}
+#endif
@@ -0,0 +1,438 @@
+#include "TLeaf.h"
+#include "TTree.h"
+#include "TTreeReader.h"
+#include "TTreeReaderArray.h"
+#include "TTreeReaderValue.h"
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "run_properties.cpp"
+#include "feature_schema.cpp"
+
+#ifndef __SCHEMA_READER
+#define __SCHEMA_READER
+
+// Numeric leaf types a feature can be read from
+enum leaf_type {
+  FLOAT_LEAF, DOUBLE_LEAF, INT_LEAF, UNSUPPORTED_LEAF
+};
+
+leaf_type to_leaf_type(std::string typeName) {
+  if (typeName == "Float_t" || typeName == "float" || typeName == "Float16_t") {
+    return FLOAT_LEAF;
+  }
+  if (typeName == "Double_t" || typeName == "double" || typeName == "Double32_t") {
+    return DOUBLE_LEAF;
+  }
+  if (typeName == "Int_t" || typeName == "int") {
+    return INT_LEAF;
+  }
+  return UNSUPPORTED_LEAF;
+}
+
+// The sums a histogram keeps of the values it is filled with (see TH1::GetStats), so the mean
+// and standard deviation come out as drawing the expression and asking the histogram gives them
+class FeatureMoments {
+  public:
+    Double_t sumw;
+    Double_t sumwx;
+    Double_t sumwx2;
+
+    FeatureMoments() {
+      this->sumw = this->sumwx = this->sumwx2 = 0;
+    }
+
+    void fill(Double_t x) {
+      this->sumw += 1;
+      this->sumwx += x;
+      this->sumwx2 += x * x;
+    }
+
+    std::pair<Double_t, Double_t> meanAndStdDev() const {
+      if (this->sumw == 0) {
+        return {0, 0};
+      }
+      Double_t mean = this->sumwx / this->sumw;
+      return {mean, std::sqrt(std::abs(this->sumwx2 / this->sumw - mean * mean))};
+    }
+};
+
+// Reads one feature of a schema. Whether it is a single value (TTreeReaderValue) or an object
+// of a collection (TTreeReaderArray) is fixed at compile time by the schema. The leaf's type is
+// looked up in the tree when binding, and the reader of that type is used: the schema's type is
+// what the leaf is expected to be, a leaf of another numeric type is reported but still read.
+template <int index>
+class FeatureSlot {
+  public:
+    template <typename T>
+    using reader_type = typename std::conditional<(index < 0), TTreeReaderValue<T>, TTreeReaderArray<T>>::type;
+
+    std::string branch;
+    std::string typeName;
+    std::string leafTypeName;
+    leaf_type type;
+    // What drawing the preset expression fills per event: every object of the collection (the
+    // expression is the bare leaf), the object or the missing value (Alt$), or the object only
+    // when there is one
+    bool allObjects;
+    bool padded;
+
+    void bind(TTreeReader &treeReader, const char *branch, const char *typeName, const char *expression) {
+      this->branch = branch;
+      this->typeName = typeName;
+      TTree *tree = treeReader.GetTree();
+      TLeaf *leaf = tree != NULL ? tree->GetLeaf(branch) : NULL;
+      this->leafTypeName = leaf != NULL ? leaf->GetTypeName() : typeName;
+      this->type = to_leaf_type(this->leafTypeName);
+      this->allObjects = std::string(expression) == branch;
+      this->padded = std::string(expression).rfind("Alt$(", 0) == 0;
+      this->floatReader.reset();
+      this->doubleReader.reset();
+      this->intReader.reset();
+      switch (this->type) {
+        case FLOAT_LEAF:
+          this->floatReader.reset(new reader_type<Float_t>(treeReader, branch));
+          break;
+        case DOUBLE_LEAF:
+          this->doubleReader.reset(new reader_type<Double_t>(treeReader, branch));
+          break;
+        case INT_LEAF:
+          this->intReader.reset(new reader_type<Int_t>(treeReader, branch));
+          break;
+        default:
+          break;
+      }
+    }
+
+    // Whether the leaf exists and can be read, once an entry was loaded
+    bool isValid() {
+      if (this->type == UNSUPPORTED_LEAF) {
+        std::cout << "Schema leaf " << this->branch << " is " << this->leafTypeName << ", which can't be read as a feature" << std::endl;
+        return false;
+      }
+      Int_t status = this->setupStatus();
+      if (status < 0) {
+        std::cout << "Schema leaf " << this->branch << " is missing or can't be read as " << this->leafTypeName
+                  << " (status " << status << ")" << std::endl;
+        return false;
+      }
+      if (this->type != to_leaf_type(this->typeName)) {
+        std::cout << "Schema leaf " << this->branch << " is " << this->leafTypeName << ", not " << this->typeName
+                  << " as the schema has it" << std::endl;
+      }
+      return true;
+    }
+
+    Double_t read(Float_t missing) {
+      switch (this->type) {
+        case FLOAT_LEAF:
+          return value(*this->floatReader, missing);
+        case DOUBLE_LEAF:
+          return value(*this->doubleReader, missing);
+        default:
+          return value(*this->intReader, missing);
+      }
+    }
+
+    // Whether the loaded entry has the object read: always for single values and padded features
+    bool present() {
+      if (this->padded) {
+        return true;
+      }
+      switch (this->type) {
+        case FLOAT_LEAF:
+          return hasObject(*this->floatReader);
+        case DOUBLE_LEAF:
+          return hasObject(*this->doubleReader);
+        default:
+          return hasObject(*this->intReader);
+      }
+    }
+
+    // Fills what drawing the preset expression would for the loaded entry
+    void fill(FeatureMoments &moments, Float_t missing) {
+      switch (this->type) {
+        case FLOAT_LEAF:
+          return this->fillFrom(*this->floatReader, moments, missing);
+        case DOUBLE_LEAF:
+          return this->fillFrom(*this->doubleReader, moments, missing);
+        default:
+          return this->fillFrom(*this->intReader, moments, missing);
+      }
+    }
+
+  private:
+    std::unique_ptr<reader_type<Float_t>> floatReader;
+    std::unique_ptr<reader_type<Double_t>> doubleReader;
+    std::unique_ptr<reader_type<Int_t>> intReader;
+
+    Int_t setupStatus() {
+      if (this->floatReader != NULL) {
+        return this->floatReader->GetSetupStatus();
+      }
+      if (this->doubleReader != NULL) {
+        return this->doubleReader->GetSetupStatus();
+      }
+      return this->intReader->GetSetupStatus();
+    }
+
+    template <typename R>
+    static Double_t value(R &reader, Double_t missing) {
+      if constexpr (index < 0) {
+        return *reader;
+      } else {
+        return reader.GetSize() > index ? (Double_t)reader[index] : missing;
+      }
+    }
+
+    template <typename R>
+    static bool hasObject(R &reader) {
+      if constexpr (index < 0) {
+        return true;
+      } else {
+        return reader.GetSize() > index;
+      }
+    }
+
+    template <typename R>
+    void fillFrom(R &reader, FeatureMoments &moments, Double_t missing) {
+      if constexpr (index < 0) {
+        moments.fill(*reader);
+      } else if (this->allObjects) {
+        for (size_t i = 0; i < reader.GetSize(); i++) {
+          moments.fill(reader[i]);
+        }
+      } else if (this->padded || reader.GetSize() > index) {
+        moments.fill(value(reader, missing));
+      }
+    }
+};
+
+// The features of a preset read by compiled code instead of TTreeFormula: no expression is
+// parsed or interpreted per event, every value is a typed read out of the loaded baskets.
+// One per thread, TTreeReaders aren't shared.
+class CompiledFeatures {
+  public:
+    virtual ~CompiledFeatures() {}
+    // The preset expressions these features are, in order
+    virtual std::vector<std::string> expressions() = 0;
+    virtual void bind(TTreeReader &reader) = 0;
+    // Checks every leaf after the first entry is loaded, reporting the ones that don't match
+    virtual bool validate() = 0;
+    // Writes the features of the loaded entry into row, one value per expression
+    virtual void read(Float_t *row) = 0;
+    // Same as read at the leaves' precision, and whether the entry has each feature's object
+    virtual void readExact(Double_t *row, Bool_t *present) = 0;
+    // Adds the loaded entry to the sums of every feature, one per expression
+    virtual void fill(FeatureMoments *moments) = 0;
+};
+
+#define SCHEMA_SLOT(name, expression, branch, type, index, missing) FeatureSlot<index> name;
+#define SCHEMA_BIND(name, expression, branch, type, index, missing) this->name.bind(reader, branch, #type, expression);
+#define SCHEMA_VALIDATE(name, expression, branch, type, index, missing) valid = this->name.isValid() && valid;
+#define SCHEMA_READ(name, expression, branch, type, index, missing) *row++ = this->name.read(missing);
+#define SCHEMA_READ_EXACT(name, expression, branch, type, index, missing) \
+  *row++ = this->name.read(missing); \
+  *present++ = this->name.present();
+#define SCHEMA_FILL(name, expression, branch, type, index, missing) this->name.fill(*moments++, missing);
+
+// Generates the compiled reader of a schema
+#define DEFINE_SCHEMA_READER(ClassName, SCHEMA) \
+  class ClassName : public CompiledFeatures { \
+    public: \
+      std::vector<std::string> expressions() { \
+        return {SCHEMA(SCHEMA_EXPRESSION)}; \
+      } \
+      void bind(TTreeReader &reader) { \
+        SCHEMA(SCHEMA_BIND) \
+      } \
+      bool validate() { \
+        bool valid = true; \
+        SCHEMA(SCHEMA_VALIDATE) \
+        return valid; \
+      } \
+      void read(Float_t *row) { \
+        SCHEMA(SCHEMA_READ) \
+      } \
+      void readExact(Double_t *row, Bool_t *present) { \
+        SCHEMA(SCHEMA_READ_EXACT) \
+      } \
+      void fill(FeatureMoments *moments) { \
+        SCHEMA(SCHEMA_FILL) \
+      } \
+    private: \
+      SCHEMA(SCHEMA_SLOT) \
+  };
+
+DEFINE_SCHEMA_READER(MuonsFeatures, MUONS_SCHEMA)
+DEFINE_SCHEMA_READER(MuonPairsFeatures, MUONPAIRS_SCHEMA)
+DEFINE_SCHEMA_READER(JetsFeatures, JETS_SCHEMA)
+DEFINE_SCHEMA_READER(MuonPairsAndJetsFeatures, MUONPAIRS_AND_JETS_SCHEMA)
+DEFINE_SCHEMA_READER(AllFeatures, ALL_SCHEMA)
+DEFINE_SCHEMA_READER(DerivedFeatures, DERIVED_SCHEMA)
+
+// Where one feature of a schema is read from, for code that builds its own reads of it
+class SchemaFeature {
+  public:
+    std::string expression;
+    std::string branch;
+    Int_t index;
+    Float_t missing;
+};
+
+#define SCHEMA_FEATURE(name, expression, branch, type, index, missing) {expression, branch, index, missing},
+
+// The features of a preset, in order
+std::vector<SchemaFeature> schema_features(variable_preset set) {
+  switch (set) {
+    case MUONS:
+      return {MUONS_SCHEMA(SCHEMA_FEATURE)};
+    case MUONPAIRS:
+      return {MUONPAIRS_SCHEMA(SCHEMA_FEATURE)};
+    case JETS:
+      return {JETS_SCHEMA(SCHEMA_FEATURE)};
+    case MUONPAIRS_AND_JETS:
+      return {MUONPAIRS_AND_JETS_SCHEMA(SCHEMA_FEATURE)};
+    case ALL:
+      return {ALL_SCHEMA(SCHEMA_FEATURE)};
+    case DERIVED:
+      return {DERIVED_SCHEMA(SCHEMA_FEATURE)};
+    default:
+      return {};
+  }
+}
+
+// Compiled reader of a preset, to be deleted by the caller
+CompiledFeatures *compiled_features(variable_preset set) {
+  switch (set) {
+    case MUONS:
+      return new MuonsFeatures();
+    case MUONPAIRS:
+      return new MuonPairsFeatures();
+    case JETS:
+      return new JetsFeatures();
+    case MUONPAIRS_AND_JETS:
+      return new MuonPairsAndJetsFeatures();
+    case ALL:
+      return new AllFeatures();
+    case DERIVED:
+      return new DerivedFeatures();
+    default:
+      return NULL;
+  }
+}
+
+// Compiled reader for a list of expressions, if they are exactly a preset's (as the preset has
+// them, or wrapped in Alt$(...,0) the way generateDataLoader does). NULL for anything else, like
+// ad-hoc lists and normalized expressions, which stay with TTreeFormula.
+CompiledFeatures *compiled_features(std::vector<std::string> expressions) {
+  for (variable_preset set : {MUONS, JETS, MUONPAIRS, MUONPAIRS_AND_JETS, ALL, DERIVED}) {
+    CompiledFeatures *features = compiled_features(set);
+    std::vector<std::string> schema = features->expressions();
+    bool matches = schema.size() == expressions.size();
+    for (size_t i = 0; matches && i < schema.size(); i++) {
+      matches = expressions[i] == schema[i] || expressions[i] == "Alt$(" + schema[i] + ",0)";
+    }
+    if (matches) {
+      return features;
+    }
+    delete features;
+  }
+  return NULL;
+}
+
+// Sums of every feature over all entries of a tree, read in one pass by the compiled reader of
+// the preset the expressions are, as the preset has them. Each feature gets the values drawing
+// its expression would fill. False if the expressions aren't a preset's or the tree doesn't
+// match its schema.
+bool compiled_moments(TTree *tree, std::vector<std::string> expressions, std::vector<FeatureMoments> &moments) {
+  CompiledFeatures *features = compiled_features(expressions);
+  Long64_t entries = tree->GetEntries();
+  if (features == NULL || features->expressions() != expressions || entries == 0) {
+    delete features;
+    return false;
+  }
+  TTreeReader reader(tree);
+  features->bind(reader);
+  reader.SetEntry(0);
+  bool valid = features->validate();
+  if (valid) {
+    moments.assign(expressions.size(), FeatureMoments());
+    for (Long64_t e = 0; e < entries; e++) {
+      reader.SetEntry(e);
+      features->fill(moments.data());
+    }
+  } else {
+    std::cout << "Reading the variables of " << tree->GetName() << " with TTreeFormula" << std::endl;
+  }
+  delete features;
+  return valid;
+}
+
+// A run variable that is a preset feature normalized as (value - mean) / scale, with the
+// numbers exactly as they are written in the run's expression
+class NormalizedFeature {
+  public:
+    // The preset's expression, without the normalization
+    std::string expression;
+    Double_t mean;
+    Double_t scale;
+};
+
+// In-memory copy of the given entries of a tree, in order, with a plain Float_t branch per
+// feature and the PU_wgt of every event, for a DataLoader to read instead of evaluating the
+// expressions itself. The features are read by the compiled reader of their preset, which
+// checks the tree's leaves first. Each value is what Alt$(normalized expression,0) gives on
+// the input: the normalized value of the feature's object, or 0 if the event has none. NULL
+// if the features aren't a whole preset in order or the tree doesn't match its schema.
+TTree *flatten_features(TTree *tree, std::vector<NormalizedFeature> features, std::vector<std::string> branches,
+                        const std::vector<Long64_t> &entries, std::string name) {
+  std::vector<std::string> expressions;
+  for (NormalizedFeature &f : features) {
+    expressions.push_back(f.expression);
+  }
+  CompiledFeatures *compiled = compiled_features(expressions);
+  if (compiled == NULL || compiled->expressions() != expressions || entries.size() == 0) {
+    delete compiled;
+    return NULL;
+  }
+  TTreeReader reader(tree);
+  compiled->bind(reader);
+  // PU_wgt isn't part of any schema, whatever type it is in the tree is expected
+  FeatureSlot<SCALAR_FEATURE> pileup;
+  TLeaf *pileupLeaf = tree->GetLeaf("PU_wgt");
+  pileup.bind(reader, "PU_wgt", pileupLeaf != NULL ? pileupLeaf->GetTypeName() : "Float_t", "PU_wgt");
+  reader.SetEntry(entries[0]);
+  if (!compiled->validate() || !pileup.isValid()) {
+    std::cout << "Reading the variables of " << tree->GetName() << " with TTreeFormula" << std::endl;
+    delete compiled;
+    return NULL;
+  }
+
+  std::vector<Double_t> raw(features.size());
+  std::unique_ptr<Bool_t[]> present(new Bool_t[features.size()]);
+  std::vector<Float_t> values(features.size());
+  Float_t pileupWeight;
+  TTree *flat = new TTree(name.c_str(), (name + " events of " + tree->GetName()).c_str());
+  flat->SetDirectory(0);
+  for (size_t i = 0; i < features.size(); i++) {
+    flat->Branch(branches[i].c_str(), &values[i], (branches[i] + "/F").c_str());
+  }
+  flat->Branch("PU_wgt", &pileupWeight, "PU_wgt/F");
+  for (Long64_t entry : entries) {
+    reader.SetEntry(entry);
+    compiled->readExact(raw.data(), present.get());
+    for (size_t i = 0; i < features.size(); i++) {
+      values[i] = present[i] ? (raw[i] - features[i].mean) / features[i].scale : 0;
+    }
+    pileupWeight = pileup.read(0);
+    flat->Fill();
+  }
+  flat->ResetBranchAddresses();
+  delete compiled;
+  return flat;
+}
+#endif
@@ -0,0 +1,107 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "score_protocol.cpp"
+
+#ifndef __SCORE_CLIENT
+#define __SCORE_CLIENT
+
+// Client for a running score_server. One client holds one connection and is meant to be used
+// from a single thread; open one per thread to get requests batched together on the server.
+//
+//   ScoreClient client;
+//   std::vector<float> scores = client.score(0, values, numVariables);
+class ScoreClient {
+  public:
+    ScoreClient(std::string socketPath = SCORE_SOCKET_PATH) {
+      struct sockaddr_un address;
+      if (!socket_address(socketPath, &address)) {
+        throw std::runtime_error("Socket path too long: " + socketPath);
+      }
+      this->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (this->fd < 0 || connect(this->fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        if (this->fd >= 0) {
+          close(this->fd);
+        }
+        throw std::runtime_error("Could not connect to score_server at " + socketPath);
+      }
+    }
+
+    ~ScoreClient() {
+      close(this->fd);
+    }
+
+    ScoreClient(const ScoreClient&) = delete;
+    ScoreClient &operator=(const ScoreClient&) = delete;
+
+    // Scores events with a model. values holds numVariables floats per event, in the order
+    // given by describe(). Returns one score per event.
+    std::vector<float> score(uint32_t model, const std::vector<float> &values, uint32_t numVariables) {
+      if (numVariables == 0 || values.size() % numVariables != 0) {
+        throw std::runtime_error("values is not a whole number of events");
+      }
+      uint32_t numEvents = values.size() / numVariables;
+      std::vector<char> payload = this->request(SCORE_EVENTS, model, numEvents, numVariables, values.data(), values.size() * sizeof(float));
+      std::vector<float> scores(payload.size() / sizeof(float));
+      std::memcpy(scores.data(), payload.data(), scores.size() * sizeof(float));
+      return scores;
+    }
+
+    // Human readable list of the models the server has, with their variables
+    std::string describe() {
+      std::vector<char> payload = this->request(DESCRIBE_MODELS, 0, 0, 0, NULL, 0);
+      return std::string(payload.begin(), payload.end());
+    }
+
+    // How many variables a model takes, 0 if the server doesn't have it
+    uint32_t numVariables(uint32_t model) {
+      std::stringstream lines(this->describe());
+      std::string line;
+      while (std::getline(lines, line)) {
+        size_t first = line.find('\t');
+        size_t second = line.find('\t', first + 1);
+        if (first != std::string::npos && second != std::string::npos && std::stoul(line.substr(0, first)) == model) {
+          return std::stoul(line.substr(first + 1, second - first - 1));
+        }
+      }
+      return 0;
+    }
+
+    // Latency percentiles and batching numbers of the server
+    score_server_stats stats() {
+      std::vector<char> payload = this->request(SERVER_STATS, 0, 0, 0, NULL, 0);
+      score_server_stats result;
+      std::memset(&result, 0, sizeof(result));
+      std::memcpy(&result, payload.data(), std::min(payload.size(), sizeof(result)));
+      return result;
+    }
+
+  private:
+    int fd;
+
+    std::vector<char> request(uint32_t type, uint32_t model, uint32_t numEvents, uint32_t numVariables, const void *body, size_t bodyBytes) {
+      score_request_header header = {SCORE_MAGIC, type, model, numEvents, numVariables};
+      if (!write_fully(this->fd, &header, sizeof(header)) || (bodyBytes > 0 && !write_fully(this->fd, body, bodyBytes))) {
+        throw std::runtime_error("Lost connection to score_server");
+      }
+      score_response_header response;
+      if (!read_fully(this->fd, &response, sizeof(response))) {
+        throw std::runtime_error("Lost connection to score_server");
+      }
+      std::vector<char> payload(response.payloadBytes);
+      if (response.payloadBytes > 0 && !read_fully(this->fd, payload.data(), payload.size())) {
+        throw std::runtime_error("Lost connection to score_server");
+      }
+      if (response.status != 0) {
+        throw std::runtime_error("score_server: " + std::string(payload.begin(), payload.end()));
+      }
+      return payload;
+    }
+};
+#endif
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "score_client.cpp"
+
+// Hammers a running score_server with concurrent clients and reports throughput and the
+// latencies seen by the clients, next to the numbers the server measured itself.
+//
+//   score_loadgen [--socket path] [-m model] [-c clients] [-e eventsPerRequest] [-d seconds]
+void score_loadgen(std::string socketPath, uint32_t model, int clients, int eventsPerRequest, double seconds) {
+  uint32_t numVariables;
+  {
+    ScoreClient probe(socketPath);
+    std::cout << probe.describe();
+    numVariables = probe.numVariables(model);
+  }
+  if (numVariables == 0) {
+    std::cout << "Server has no model " << model << std::endl;
+    return;
+  }
+
+  std::mutex resultsMutex;
+  std::vector<double> latencies;
+  std::vector<std::string> errors;
+  std::atomic<uint64_t> events(0);
+  auto start = std::chrono::steady_clock::now();
+  auto stop = start + std::chrono::duration<double>(seconds);
+
+  std::vector<std::thread> threads;
+  for (int c = 0; c < clients; c++) {
+    threads.emplace_back([&, c] {
+      // Normalized inputs are roughly unit gaussians, so that's what we send
+      std::mt19937 random(c);
+      std::normal_distribution<float> gauss(0, 1);
+      std::vector<float> values(eventsPerRequest * numVariables);
+      std::vector<double> mine;
+      std::string error;
+      // A client that loses its connection stops, the others keep going
+      try {
+        ScoreClient client(socketPath);
+        while (std::chrono::steady_clock::now() < stop) {
+          for (float &v : values) {
+            v = gauss(random);
+          }
+          auto sent = std::chrono::steady_clock::now();
+          client.score(model, values, numVariables);
+          mine.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+          events += eventsPerRequest;
+        }
+      } catch (std::exception &e) {
+        error = "client " + std::to_string(c) + ": " + e.what();
+      }
+      std::lock_guard<std::mutex> lock(resultsMutex);
+      latencies.insert(latencies.end(), mine.begin(), mine.end());
+      if (error != "") {
+        errors.push_back(error);
+      }
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (std::string error : errors) {
+    std::cout << "Failed: " << error << std::endl;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double q) {
+    return latencies.size() == 0 ? 0 : latencies[std::min(latencies.size() - 1, (size_t)(q * latencies.size()))];
+  };
+  std::cout << clients << " clients x " << eventsPerRequest << " events/request for " << elapsed << " s" << std::endl;
+  std::cout << "  - requests:   " << latencies.size() << " (" << latencies.size() / elapsed << "/s)" << std::endl;
+  std::cout << "  - throughput: " << events / elapsed << " events/s" << std::endl;
+  std::cout << "  - client latency p50/p99: " << percentile(0.50) << " / " << percentile(0.99) << " us" << std::endl;
+
+  ScoreClient probe(socketPath);
+  score_server_stats stats = probe.stats();
+  std::cout << "  - server latency p50/p99/max: " << stats.p50LatencyUs << " / " << stats.p99LatencyUs << " / " << stats.maxLatencyUs << " us" << std::endl;
+  std::cout << "  - server batches: " << stats.batches << " (" << stats.meanBatchEvents << " events each on average)" << std::endl;
+}
+
+int main(int argc, char ** argv) {
+  std::string socketPath = SCORE_SOCKET_PATH;
+  uint32_t model = 0;
+  int clients = 8;
+  int eventsPerRequest = 1000;
+  double seconds = 10;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--socket") {
+      socketPath = argv[i + 1];
+    } else if (arg == "-m") {
+      model = std::stoul(argv[i + 1]);
+    } else if (arg == "-c") {
+      clients = std::stoi(argv[i + 1]);
+    } else if (arg == "-e") {
+      eventsPerRequest = std::stoi(argv[i + 1]);
+    } else if (arg == "-d") {
+      seconds = std::stod(argv[i + 1]);
+    } else {
+      std::cout << "Usage: " << argv[0] << " [--socket path] [-m model] [-c clients] [-e eventsPerRequest] [-d seconds]" << std::endl;
+      return 1;
+    }
+  }
+  try {
+    score_loadgen(socketPath, model, clients, eventsPerRequest, seconds);
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstring>
+#include <string>
+
+#ifndef __SCORE_PROTOCOL
+#define __SCORE_PROTOCOL
+
+// Wire format shared by score_server and its clients. Everything is sent in native byte
+// order, which is fine because both ends always live on the same machine.
+#define SCORE_SOCKET_PATH "/tmp/bdtg_dnn_score.sock"
+#define SCORE_MAGIC 0x53434f52
+
+// What a request asks the server to do
+typedef enum : uint32_t {
+  // Score numEvents events of numVariables floats each with one model
+  SCORE_EVENTS = 1,
+  // List the loaded models as text, one line each: "index<TAB>numVariables<TAB>description"
+  DESCRIBE_MODELS = 2,
+  // Latency and batching numbers, as a score_server_stats
+  SERVER_STATS = 3
+} score_request_type;
+
+// Sent by the client, followed by numEvents * numVariables floats for SCORE_EVENTS
+typedef struct {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t model;
+  uint32_t numEvents;
+  uint32_t numVariables;
+} score_request_header;
+
+// Sent back by the server, followed by payloadBytes bytes. For SCORE_EVENTS the payload
+// is one float per event. On failure the payload is the error message.
+typedef struct {
+  int32_t status;
+  uint32_t payloadBytes;
+} score_response_header;
+
+// Numbers reported for SERVER_STATS. Latencies are in microseconds, measured from the moment
+// the server has read a request until its scores are ready to send back.
+typedef struct {
+  uint64_t requests;
+  uint64_t events;
+  uint64_t batches;
+  double meanBatchEvents;
+  double p50LatencyUs;
+  double p99LatencyUs;
+  double maxLatencyUs;
+} score_server_stats;
+
+// Reads exactly size bytes, false if the other side went away
+bool read_fully(int fd, void *buffer, size_t size) {
+  char *at = (char*)buffer;
+  while (size > 0) {
+    ssize_t got = read(fd, at, size);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    at += got;
+    size -= got;
+  }
+  return true;
+}
+
+// Writes exactly size bytes, false if the other side went away
+bool write_fully(int fd, const void *buffer, size_t size) {
+  const char *at = (const char*)buffer;
+  while (size > 0) {
+    ssize_t sent = send(fd, at, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    at += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// Fills in the address of a unix domain socket, false if the path is too long
+bool socket_address(std::string path, struct sockaddr_un *address) {
+  std::memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address->sun_path)) {
+    return false;
+  }
+  std::strncpy(address->sun_path, path.c_str(), sizeof(address->sun_path) - 1);
+  return true;
+}
+#endif
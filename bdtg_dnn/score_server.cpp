@@ -0,0 +1,409 @@
+#include "TROOT.h"
+#include "TMVA/Reader.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "score_protocol.cpp"
+#include "trained_model.cpp"
+#include "dnn_inference.cpp"
+#include "hist_gbdt.cpp"
+
+// A batch is scored as soon as it has this many events...
+#define MAX_BATCH_EVENTS 4096
+// ...or when its oldest request has waited this long
+#define MAX_BATCH_WAIT_US 200
+// How many of the most recent request latencies the percentiles are computed over
+#define LATENCY_WINDOW 100000
+// Largest request we accept, to keep a broken client from making us allocate everything
+#define MAX_REQUEST_VALUES (64 * 1024 * 1024)
+
+typedef std::chrono::steady_clock score_clock;
+
+// A SCORE_EVENTS request waiting for its batch to be scored
+class PendingRequest {
+  public:
+    std::vector<float> values;
+    uint32_t numEvents;
+    std::vector<float> scores;
+    score_clock::time_point received;
+    std::promise<void> done;
+};
+
+// Keeps the latency and batching numbers reported for SERVER_STATS
+class ServerStats {
+  public:
+    ServerStats() {
+      this->requests = this->events = this->batches = 0;
+      this->latencies.reserve(LATENCY_WINDOW);
+      this->next = 0;
+    }
+
+    void recordBatch(uint32_t numEvents) {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->batches++;
+      this->events += numEvents;
+    }
+
+    void recordRequest(double latencyUs) {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->requests++;
+      if (this->latencies.size() < LATENCY_WINDOW) {
+        this->latencies.push_back(latencyUs);
+      } else {
+        this->latencies[this->next] = latencyUs;
+        this->next = (this->next + 1) % LATENCY_WINDOW;
+      }
+    }
+
+    score_server_stats snapshot() {
+      std::vector<double> window;
+      score_server_stats stats;
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        window = this->latencies;
+        stats.requests = this->requests;
+        stats.events = this->events;
+        stats.batches = this->batches;
+      }
+      stats.meanBatchEvents = stats.batches > 0 ? (double)stats.events / stats.batches : 0;
+      stats.p50LatencyUs = percentile(window, 0.50);
+      stats.p99LatencyUs = percentile(window, 0.99);
+      stats.maxLatencyUs = window.size() > 0 ? *std::max_element(window.begin(), window.end()) : 0;
+      return stats;
+    }
+
+  private:
+    std::mutex mutex;
+    uint64_t requests;
+    uint64_t events;
+    uint64_t batches;
+    std::vector<double> latencies;
+    size_t next;
+
+    static double percentile(std::vector<double> &values, double q) {
+      if (values.size() == 0) {
+        return 0;
+      }
+      size_t at = std::min(values.size() - 1, (size_t)(q * values.size()));
+      std::nth_element(values.begin(), values.begin() + at, values.end());
+      return values[at];
+    }
+};
+
+// One loaded model and the thread that scores batches for it. Concurrent requests for the
+// same model are queued up and scored together: DNNs go through the native network in one
+// call for the whole batch (spread over the thread pool), everything else through a TMVA
+// reader, which isn't thread safe and only scores one event at a time, so every model has
+// exactly one thread using it.
+class ModelWorker {
+  public:
+    TrainedModel model;
+
+    ModelWorker(TrainedModel model, ServerStats *stats) : model(model) {
+      this->stats = stats;
+      this->pendingEvents = 0;
+      this->stopping = false;
+      this->reader = NULL;
+      this->network = NULL;
+      this->forest = NULL;
+      if (this->model.methodType == "DL") {
+        this->network = new DenseNetwork(this->model);
+        if (!this->network->isValid) {
+          delete this->network;
+          this->network = NULL;
+        }
+      }
+      // A HGBDT forest isn't a TMVA method, a reader can't load it
+      if (this->model.methodType == "HGBDT") {
+        this->forest = new HistGBDT(this->model);
+        if (!this->forest->isValid) {
+          delete this->forest;
+          this->forest = NULL;
+        }
+      } else if (this->network == NULL) {
+        this->reader = this->model.makeReader(this->inputs);
+      }
+      this->worker = std::thread(&ModelWorker::loop, this);
+    }
+
+    // Scores whatever is still queued, then stops the thread
+    ~ModelWorker() {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+      }
+      this->wakeup.notify_one();
+      this->worker.join();
+      delete this->reader;
+      delete this->network;
+      delete this->forest;
+    }
+
+    bool isNative() const {
+      return this->network != NULL || this->forest != NULL;
+    }
+
+    // False if the model couldn't be loaded at all, it has nothing to score with then
+    bool isLoaded() const {
+      return this->isNative() || this->reader != NULL;
+    }
+
+    // Queues a request, its promise is fulfilled once it has been scored
+    void submit(PendingRequest *request) {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.push_back(request);
+        this->pendingEvents += request->numEvents;
+      }
+      this->wakeup.notify_one();
+    }
+
+  private:
+    ServerStats *stats;
+    TMVA::Reader *reader;
+    DenseNetwork *network;
+    HistGBDT *forest;
+    std::vector<Float_t> inputs;
+    // The values and scores of a batch of several requests, back to back
+    std::vector<Float_t> batchValues;
+    std::vector<Float_t> batchScores;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<PendingRequest*> queue;
+    uint64_t pendingEvents;
+    bool stopping;
+    std::thread worker;
+
+    void loop() {
+      while (true) {
+        std::deque<PendingRequest*> batch;
+        {
+          std::unique_lock<std::mutex> lock(this->mutex);
+          this->wakeup.wait(lock, [this] {return !this->queue.empty() || this->stopping;});
+          if (this->queue.empty()) {
+            return;
+          }
+          // Give other requests a moment to join, unless the batch is already full
+          auto deadline = this->queue.front()->received + std::chrono::microseconds(MAX_BATCH_WAIT_US);
+          this->wakeup.wait_until(lock, deadline, [this] {return this->pendingEvents >= MAX_BATCH_EVENTS || this->stopping;});
+          batch.swap(this->queue);
+          this->pendingEvents = 0;
+        }
+
+        uint32_t batchEvents = 0;
+        for (PendingRequest *request : batch) {
+          request->scores.resize(request->numEvents);
+          batchEvents += request->numEvents;
+        }
+        if (this->isNative()) {
+          this->scoreNative(batch, batchEvents);
+        } else {
+          this->scoreWithReader(batch);
+        }
+        this->stats->recordBatch(batchEvents);
+
+        auto now = score_clock::now();
+        for (PendingRequest *request : batch) {
+          this->stats->recordRequest(std::chrono::duration<double, std::micro>(now - request->received).count());
+          request->done.set_value();
+        }
+      }
+    }
+
+    // The whole batch in one pass through the network or the forest
+    void evaluateNative(const Float_t *values, uint32_t numEvents, Float_t *scores) {
+      if (this->network != NULL) {
+        this->network->evaluate(values, numEvents, scores);
+      } else {
+        this->forest->evaluate(values, numEvents, scores);
+      }
+    }
+
+    void scoreNative(std::deque<PendingRequest*> &batch, uint32_t batchEvents) {
+      if (batch.size() == 1) {
+        this->evaluateNative(batch[0]->values.data(), batchEvents, batch[0]->scores.data());
+        return;
+      }
+      size_t numVariables = this->model.expressions.size();
+      this->batchValues.resize(batchEvents * numVariables);
+      this->batchScores.resize(batchEvents);
+      Float_t *values = this->batchValues.data();
+      for (PendingRequest *request : batch) {
+        values = std::copy(request->values.begin(), request->values.end(), values);
+      }
+      this->evaluateNative(this->batchValues.data(), batchEvents, this->batchScores.data());
+      const Float_t *scores = this->batchScores.data();
+      for (PendingRequest *request : batch) {
+        std::copy(scores, scores + request->numEvents, request->scores.begin());
+        scores += request->numEvents;
+      }
+    }
+
+    void scoreWithReader(std::deque<PendingRequest*> &batch) {
+      size_t numVariables = this->inputs.size();
+      for (PendingRequest *request : batch) {
+        const float *values = request->values.data();
+        for (uint32_t e = 0; e < request->numEvents; e++) {
+          std::copy(values + e * numVariables, values + (e + 1) * numVariables, this->inputs.begin());
+          request->scores[e] = this->reader->EvaluateMVA(this->model.methodName.c_str());
+        }
+      }
+    }
+};
+
+// Global state for the signal handler
+std::string socketPath = SCORE_SOCKET_PATH;
+
+void stop_server(int) {
+  unlink(socketPath.c_str());
+  _exit(0);
+}
+
+// Sends a response, an error if status isn't 0
+bool respond(int fd, int32_t status, const void *payload, uint32_t bytes) {
+  score_response_header header = {status, bytes};
+  return write_fully(fd, &header, sizeof(header)) && (bytes == 0 || write_fully(fd, payload, bytes));
+}
+
+bool respond_error(int fd, std::string message) {
+  return respond(fd, 1, message.data(), message.size());
+}
+
+// Serves one client connection until it closes
+void serve_connection(int fd, std::vector<std::unique_ptr<ModelWorker>> *workers, ServerStats *stats) {
+  score_request_header header;
+  while (read_fully(fd, &header, sizeof(header))) {
+    if (header.magic != SCORE_MAGIC) {
+      respond_error(fd, "bad magic number, is this a score_client?");
+      break;
+    }
+
+    bool ok = true;
+    if (header.type == SCORE_EVENTS) {
+      size_t numValues = (size_t)header.numEvents * header.numVariables;
+      if (numValues > MAX_REQUEST_VALUES) {
+        respond_error(fd, "request too large, split it up");
+        break;
+      }
+      PendingRequest request;
+      request.values.resize(numValues);
+      if (numValues > 0 && !read_fully(fd, request.values.data(), numValues * sizeof(float))) {
+        break;
+      }
+      if (header.model >= workers->size()) {
+        ok = respond_error(fd, "no model " + std::to_string(header.model));
+      } else if (header.numVariables != (*workers)[header.model]->model.expressions.size()) {
+        ok = respond_error(fd, "model " + std::to_string(header.model) + " takes "
+                           + std::to_string((*workers)[header.model]->model.expressions.size()) + " variables");
+      } else {
+        request.numEvents = header.numEvents;
+        request.received = score_clock::now();
+        std::future<void> scored = request.done.get_future();
+        (*workers)[header.model]->submit(&request);
+        scored.wait();
+        ok = respond(fd, 0, request.scores.data(), request.scores.size() * sizeof(float));
+      }
+    } else if (header.type == DESCRIBE_MODELS) {
+      std::string text;
+      for (size_t i = 0; i < workers->size(); i++) {
+        text += std::to_string(i) + "\t" + std::to_string((*workers)[i]->model.expressions.size()) + "\t" + (*workers)[i]->model.describe() + "\n";
+      }
+      ok = respond(fd, 0, text.data(), text.size());
+    } else if (header.type == SERVER_STATS) {
+      score_server_stats snapshot = stats->snapshot();
+      ok = respond(fd, 0, &snapshot, sizeof(snapshot));
+    } else {
+      ok = respond_error(fd, "unknown request type " + std::to_string(header.type));
+    }
+    if (!ok) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+// Loads the models of the given Run-N directories once and scores events for any number of
+// local clients over a unix domain socket, batching concurrent requests per model.
+//
+//   score_server [--socket path] mass_output_dir/178-13-16-BULK/Run-3 [more Run-N dirs...]
+void score_server(std::vector<std::string> runDirs) {
+  gROOT->SetBatch(true);
+  ServerStats stats;
+
+  std::vector<std::unique_ptr<ModelWorker>> workers;
+  for (std::string runDir : runDirs) {
+    for (TrainedModel model : find_trained_models(runDir)) {
+      std::cout << "Loading model " << workers.size() << ": " << model.describe() << std::endl;
+      workers.emplace_back(new ModelWorker(model, &stats));
+      if (!workers.back()->isLoaded()) {
+        std::cout << "  could not be loaded, skipping it" << std::endl;
+        workers.pop_back();
+        continue;
+      }
+      std::cout << "  scored " << (workers.back()->isNative() ? "natively in batches" : "by TMVA::Reader") << std::endl;
+    }
+  }
+  if (workers.size() == 0) {
+    std::cout << "No models found, nothing to serve!" << std::endl;
+    return;
+  }
+
+  struct sockaddr_un address;
+  if (!socket_address(socketPath, &address)) {
+    std::cout << "Socket path too long: " << socketPath << std::endl;
+    return;
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath.c_str());
+  if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+    perror("Could not listen on socket");
+    return;
+  }
+  signal(SIGINT, stop_server);
+  signal(SIGTERM, stop_server);
+  std::cout << "Serving " << workers.size() << " models on " << socketPath << std::endl;
+
+  while (true) {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("accept");
+      break;
+    }
+    std::thread(serve_connection, client, &workers, &stats).detach();
+  }
+  close(listener);
+  unlink(socketPath.c_str());
+}
+
+int main(int argc, char ** argv) {
+  std::vector<std::string> runDirs;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--socket" && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else {
+      runDirs.push_back(arg);
+    }
+  }
+  if (runDirs.size() == 0) {
+    std::cout << "Usage: " << argv[0] << " [--socket path] Run-N [Run-M ...]" << std::endl;
+    return 1;
+  }
+  score_server(runDirs);
+  return 0;
+}
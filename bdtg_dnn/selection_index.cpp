@@ -0,0 +1,373 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include "TMD5.h"
+#include "TSystem.h"
+#include "TEntryList.h"
+#include "TTreeFormula.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "input_source.cpp"
+#include "mass_index.cpp"
+#include "file_lock.cpp"
+
+#ifndef __SELECTION_INDEX
+#define __SELECTION_INDEX
+
+// Where evaluated selections are kept between sweeps. ROOT compresses the bitmaps when
+// writing them, which makes the rarely passing cuts take next to no space.
+#define SELECTION_INDEX_FILE "selection_index.root"
+// How many selected copies (see SelectionIndex::selectedTree) are kept for reuse. Each one is
+// a whole in-memory copy of the events passing a cut
+#define SELECTED_TREES_KEPT 2
+
+// One bit per event of an input, set when the event passes a selection
+class SelectionBitmap {
+  public:
+    Long64_t numEntries;
+    std::vector<ULong64_t> words;
+
+    SelectionBitmap(Long64_t numEntries = 0) {
+      this->numEntries = numEntries;
+      this->words.assign((numEntries + 63) / 64, 0);
+    }
+
+    void set(Long64_t entry) {
+      this->words[entry / 64] |= 1ULL << (entry % 64);
+    }
+
+    // Every event passes. Bits past the last event stay clear
+    void setAll() {
+      std::fill(this->words.begin(), this->words.end(), ~0ULL);
+      if (this->numEntries % 64 != 0) {
+        this->words.back() = (1ULL << (this->numEntries % 64)) - 1;
+      }
+    }
+
+    bool test(Long64_t entry) const {
+      return (this->words[entry / 64] >> (entry % 64)) & 1;
+    }
+
+    // Number of passing events
+    Long64_t count() const {
+      Long64_t total = 0;
+      for (ULong64_t w : this->words) {
+        total += __builtin_popcountll(w);
+      }
+      return total;
+    }
+
+    SelectionBitmap operator&(const SelectionBitmap &other) const {
+      SelectionBitmap result = *this;
+      for (size_t i = 0; i < result.words.size(); i++) {
+        result.words[i] &= other.words[i];
+      }
+      return result;
+    }
+
+    SelectionBitmap operator|(const SelectionBitmap &other) const {
+      SelectionBitmap result = *this;
+      for (size_t i = 0; i < result.words.size(); i++) {
+        result.words[i] |= other.words[i];
+      }
+      return result;
+    }
+
+    // The passing events as an entry list of a tree
+    TEntryList *toEntryList(TTree *tree) const {
+      TEntryList *list = new TEntryList("selection", "selection", tree);
+      for (Long64_t entry : this->entries()) {
+        list->Enter(entry);
+      }
+      return list;
+    }
+
+    // Entry numbers of the passing events, in increasing order
+    std::vector<Long64_t> entries() const {
+      std::vector<Long64_t> result;
+      for (size_t i = 0; i < this->words.size(); i++) {
+        ULong64_t w = this->words[i];
+        while (w != 0) {
+          result.push_back(i * 64 + __builtin_ctzll(w));
+          w &= w - 1;
+        }
+      }
+      return result;
+    }
+};
+
+// In-memory copy of the events of a tree set in a bitmap, with only the branches the given
+// expressions need
+TTree *copy_entries(TTree *tree, const SelectionBitmap &entries, std::vector<std::string> formulas) {
+  TEntryList *list = entries.toEntryList(tree);
+  tree->SetBranchStatus("*", 0);
+  for (std::string branch : referenced_branches(tree, formulas)) {
+    tree->SetBranchStatus(branch.c_str(), 1);
+  }
+  tree->SetEntryList(list);
+  TDirectory *previous = gDirectory;
+  gROOT->cd();
+  TTree *copy = tree->CopyTree("");
+  previous->cd();
+  tree->SetEntryList(NULL);
+  tree->SetBranchStatus("*", 1);
+  delete list;
+  return copy;
+}
+
+// Splits an expression at every top level occurrence of op ("&&" or "||"), leaving anything
+// inside parentheses alone. Returns the whole expression if op doesn't appear at the top level.
+std::vector<std::string> split_top_level(std::string expression, std::string op) {
+  std::vector<std::string> parts;
+  int depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i < expression.size(); i++) {
+    if (expression[i] == '(') depth++;
+    if (expression[i] == ')') depth--;
+    if (depth == 0 && expression.compare(i, op.size(), op) == 0) {
+      parts.push_back(expression.substr(start, i - start));
+      start = i + op.size();
+      i += op.size() - 1;
+    }
+  }
+  parts.push_back(expression.substr(start));
+  return parts;
+}
+
+// Trims whitespace and parentheses wrapping the whole expression
+std::string strip_expression(std::string expression) {
+  while (true) {
+    size_t first = expression.find_first_not_of(" \t");
+    size_t last = expression.find_last_not_of(" \t");
+    if (first == std::string::npos) {
+      return "";
+    }
+    expression = expression.substr(first, last - first + 1);
+    if (expression.front() != '(' || expression.back() != ')') {
+      return expression;
+    }
+    // Only strip if the opening parenthesis is closed by the very last character
+    int depth = 0;
+    for (size_t i = 0; i < expression.size(); i++) {
+      if (expression[i] == '(') depth++;
+      if (expression[i] == ')') depth--;
+      if (depth == 0 && i + 1 < expression.size()) {
+        return expression;
+      }
+    }
+    expression = expression.substr(1, expression.size() - 2);
+  }
+}
+
+// Evaluates each distinct selection over an input only once. Cuts are split into their
+// && and || terms, every term is evaluated into a bitmap (or read back from the index file
+// if an earlier sweep already did), and the bitmaps are combined to get a run's events.
+// Bitmaps are keyed by the term and the identity of the input, so a changed input never
+// reuses stale selections. Cuts that are only a muPairs.mass window are looked up in the
+// input's MassIndex instead, so every other window costs no pass over the input either.
+class SelectionIndex {
+  public:
+    SelectionIndex(TTree *tree, std::string identity, std::string path = SELECTION_INDEX_FILE) {
+      this->tree = tree;
+      this->identity = identity;
+      this->path = path;
+      this->massIndex = NULL;
+    }
+
+    ~SelectionIndex() {
+      delete this->massIndex;
+      for (auto &copy : this->trees) {
+        delete copy.second;
+      }
+    }
+
+    // Reads the same events through another tree from now on, e.g. after the input was opened
+    // again. Selections evaluated so far are kept
+    void setTree(TTree *tree) {
+      this->tree = tree;
+    }
+
+    // Events passing a full cut expression
+    SelectionBitmap select(std::string cut) {
+      cut = strip_expression(cut);
+      if (cut == "") {
+        SelectionBitmap all(this->tree->GetEntries());
+        all.setAll();
+        return all;
+      }
+      SelectionBitmap window;
+      if (this->selectMassWindow(cut, window)) {
+        return window;
+      }
+
+      // With jagged collections "a && b" is true if one object passes both, which isn't the
+      // same as one object passing a and another passing b. Those cuts stay whole.
+      TTreeFormula whole("whole", cut.c_str(), this->tree);
+      if (whole.GetMultiplicity() == 0) {
+        for (std::string op : {"||", "&&"}) {
+          std::vector<std::string> parts = split_top_level(cut, op);
+          if (parts.size() < 2) {
+            continue;
+          }
+          SelectionBitmap combined = this->select(parts[0]);
+          for (size_t i = 1; i < parts.size(); i++) {
+            combined = op == "||" ? combined | this->select(parts[i]) : combined & this->select(parts[i]);
+          }
+          return combined;
+        }
+      }
+      return this->term(cut);
+    }
+
+    // An in-memory copy of the tree with only the events passing the cut and only the branches
+    // the given expressions need. TMVA gets this with an empty cut, so it doesn't have to
+    // evaluate the cut itself. Copies are shared between runs with the same cut, but only the
+    // SELECTED_TREES_KEPT most recently used ones are kept: a copy is deleted once that many
+    // other cuts have been selected since, so it must not be used past its run.
+    TTree *selectedTree(std::string cut, std::vector<std::string> formulas) {
+      if (this->trees.count(cut)) {
+        this->recentCuts.erase(std::find(this->recentCuts.begin(), this->recentCuts.end(), cut));
+        this->recentCuts.push_back(cut);
+        return this->trees[cut];
+      }
+      while (this->trees.size() >= SELECTED_TREES_KEPT) {
+        std::string oldest = this->recentCuts.front();
+        this->recentCuts.erase(this->recentCuts.begin());
+        delete this->trees[oldest];
+        this->trees.erase(oldest);
+      }
+      SelectionBitmap selected = this->select(cut);
+      TTree *copy = copy_entries(this->tree, selected, formulas);
+
+      std::cout << "Selected " << selected.count() << "/" << selected.numEntries << " events of "
+                << this->tree->GetName() << " with \"" << cut << "\"" << std::endl;
+      this->trees[cut] = copy;
+      this->recentCuts.push_back(cut);
+      return copy;
+    }
+
+  private:
+    TTree *tree;
+    std::string identity;
+    std::string path;
+    std::map<std::string, SelectionBitmap> bitmaps;
+    std::map<std::string, TTree*> trees;
+    // Cuts of the kept copies, least recently used first
+    std::vector<std::string> recentCuts;
+    MassIndex *massIndex;
+
+    // Events of a cut that is a mass window, from the binary searched range of the mass index.
+    // Only events with more than one pair are evaluated, and only when the window is on any
+    // pair's mass. False if the cut is something else or the input has no mass to index.
+    bool selectMassWindow(std::string cut, SelectionBitmap &selected) {
+      std::vector<std::string> terms;
+      for (std::string term : split_top_level(cut, "&&")) {
+        terms.push_back(strip_expression(term));
+      }
+      MassWindow window;
+      if (!window.parse(terms)) {
+        return false;
+      }
+      if (this->massIndex == NULL) {
+        this->massIndex = new MassIndex(this->tree, this->identity, this->path);
+      }
+      if (!this->massIndex->isValid) {
+        return false;
+      }
+
+      MassIndex &index = *this->massIndex;
+      selected = SelectionBitmap(index.numEntries);
+      std::pair<size_t, size_t> range = index.range(window);
+      for (size_t p = range.first; p < range.second; p++) {
+        if (index.pairs[p] == 1 || (!window.singlePair && !window.anyPair)) {
+          selected.set(index.entries[p]);
+        }
+      }
+      if (window.anyPair && !window.singlePair) {
+        TTreeFormula formula("window", cut.c_str(), this->tree);
+        for (Long64_t e : index.multiPairEntries) {
+          this->tree->LoadTree(e);
+          Int_t instances = formula.GetNdata();
+          for (Int_t i = 0; i < instances; i++) {
+            if (formula.EvalInstance(i) != 0) {
+              selected.set(e);
+              break;
+            }
+          }
+        }
+      }
+      return true;
+    }
+
+    std::string key(std::string term) {
+      std::string s = this->identity + "|" + term;
+      TMD5 md5;
+      md5.Update((const UChar_t*)s.data(), s.size());
+      md5.Final();
+      return std::string("selection_") + md5.AsString();
+    }
+
+    // Bitmap of a single term: from memory, from the index file, or evaluated now
+    SelectionBitmap term(std::string expression) {
+      std::string k = this->key(expression);
+      if (this->bitmaps.count(k)) {
+        return this->bitmaps[k];
+      }
+      Long64_t entries = this->tree->GetEntries();
+      SelectionBitmap bitmap(entries);
+
+      // AccessPathName is true when the file is NOT there
+      if (!gSystem->AccessPathName(this->path.c_str())) {
+        FileLock lock(this->path, false);
+        TFile *file = TFile::Open(this->path.c_str());
+        std::vector<ULong64_t> *stored = NULL;
+        if (file != NULL) {
+          file->GetObject(k.c_str(), stored);
+        }
+        if (stored != NULL && stored->size() == bitmap.words.size()) {
+          bitmap.words = *stored;
+          delete stored;
+          file->Close();
+          this->bitmaps[k] = bitmap;
+          return bitmap;
+        }
+        if (file != NULL) {
+          file->Close();
+        }
+      }
+
+      // An event passes if any instance of the formula does, which is what TMVA does with cuts
+      TTreeFormula formula("term", expression.c_str(), this->tree);
+      if (formula.GetNdim() == 0) {
+        std::cout << "Invalid selection: " << expression << std::endl;
+        return bitmap;
+      }
+      for (Long64_t e = 0; e < entries; e++) {
+        this->tree->LoadTree(e);
+        Int_t instances = formula.GetNdata();
+        for (Int_t i = 0; i < instances; i++) {
+          if (formula.EvalInstance(i) != 0) {
+            bitmap.set(e);
+            break;
+          }
+        }
+      }
+
+      {
+        FileLock lock(this->path, true);
+        TFile *file = TFile::Open(this->path.c_str(), "UPDATE");
+        if (file != NULL) {
+          file->WriteObject(&bitmap.words, k.c_str());
+          file->Close();
+          delete file;
+        }
+      }
+      this->bitmaps[k] = bitmap;
+      return bitmap;
+    }
+};
+#endif
@@ -0,0 +1,210 @@
+#include "TFile.h"
+#include "TParameter.h"
+#include "TStopwatch.h"
+#include "ROOT/TSeq.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "overtraining.cpp"
+
+#ifndef __SIGNIFICANCE
+#define __SIGNIFICANCE
+
+// Thresholds leaving fewer background test events than this are skipped, the weighted yield
+// of a handful of events is too noisy to pick a working point on
+#define MIN_BACKGROUND_EVENTS 10
+
+// Normalization of the samples to expected yields: the integrated luminosity (in 1/pb) and,
+// for each sample, its cross section (in pb) and how many events were generated for it
+#define LUMINOSITY_ENV "BDTG_DNN_LUMINOSITY"
+#define SIGNAL_XSEC_ENV "BDTG_DNN_SIGNAL_XSEC"
+#define SIGNAL_GENERATED_ENV "BDTG_DNN_SIGNAL_GENERATED"
+#define BACKGROUND_XSEC_ENV "BDTG_DNN_BACKGROUND_XSEC"
+#define BACKGROUND_GENERATED_ENV "BDTG_DNN_BACKGROUND_GENERATED"
+
+// Where TMVA.root keeps how many events of each class passed the run's cut
+#define SELECTED_EVENTS_DIRECTORY "dataset"
+#define SELECTED_SIGNAL_NAME "SelectedSignal"
+#define SELECTED_BACKGROUND_NAME "SelectedBackground"
+
+// Reads a number from the environment, -1 if it isn't set or isn't a number
+Double_t double_from_env(const char *name) {
+  const char *value = std::getenv(name);
+  if (value == NULL || std::string(value) == "") {
+    return -1;
+  }
+  try {
+    return std::stod(value);
+  } catch (...) {
+    std::cout << "Ignoring invalid value " << value << " for " << name << std::endl;
+    return -1;
+  }
+}
+
+// Expected events per unit of PU_wgt in each class, sigma * L / N_generated
+class ExpectedYields {
+  public:
+    Double_t signalScale;
+    Double_t backgroundScale;
+
+    static ExpectedYields fromEnvironment() {
+      ExpectedYields yields;
+      Double_t luminosity = double_from_env(LUMINOSITY_ENV);
+      Double_t signalGenerated = double_from_env(SIGNAL_GENERATED_ENV);
+      Double_t backgroundGenerated = double_from_env(BACKGROUND_GENERATED_ENV);
+      yields.signalScale = yields.backgroundScale = -1;
+      if (luminosity > 0 && signalGenerated > 0 && backgroundGenerated > 0) {
+        yields.signalScale = double_from_env(SIGNAL_XSEC_ENV) * luminosity / signalGenerated;
+        yields.backgroundScale = double_from_env(BACKGROUND_XSEC_ENV) * luminosity / backgroundGenerated;
+      }
+      return yields;
+    }
+
+    bool isValid() const {
+      return this->signalScale > 0 && this->backgroundScale > 0;
+    }
+};
+
+// Writes how many events of each class passed a run's cut into its TMVA.root. The test sample is
+// drawn from those, so this scales its yields up to those of the whole selection
+void write_selected_events(TFile *file, Long64_t signal, Long64_t background) {
+  TDirectory *dir = file->mkdir(SELECTED_EVENTS_DIRECTORY, "", true);
+  TParameter<Long64_t> selectedSignal(SELECTED_SIGNAL_NAME, signal);
+  TParameter<Long64_t> selectedBackground(SELECTED_BACKGROUND_NAME, background);
+  dir->WriteTObject(&selectedSignal);
+  dir->WriteTObject(&selectedBackground);
+}
+
+// What write_selected_events wrote. False for files written before it was
+bool read_selected_events(TFile *file, Long64_t &signal, Long64_t &background) {
+  std::string dir = std::string(SELECTED_EVENTS_DIRECTORY) + "/";
+  auto selectedSignal = file->Get<TParameter<Long64_t>>((dir + SELECTED_SIGNAL_NAME).c_str());
+  auto selectedBackground = file->Get<TParameter<Long64_t>>((dir + SELECTED_BACKGROUND_NAME).c_str());
+  if (selectedSignal == NULL || selectedBackground == NULL) {
+    return false;
+  }
+  signal = selectedSignal->GetVal();
+  background = selectedBackground->GetVal();
+  return true;
+}
+
+// Best working point of one method, from its test sample. The signal and background yields are
+// the expected numbers of events scoring above the threshold: each test event counts its PU_wgt
+// times sigma * L / N_generated of its sample, times how many selected events of its class it
+// stands for (selected / test events). TMVA's own TestTree weights can't be used, NormMode
+// rescales them to the number of events. -1 when they couldn't be computed.
+class SignificanceResult {
+  public:
+    Double_t asimovZ;
+    Double_t asimovThreshold;
+    Double_t signal;
+    Double_t background;
+    Double_t simpleZ;
+    Double_t simpleThreshold;
+
+    SignificanceResult() {
+      this->asimovZ = this->asimovThreshold = this->signal = this->background = -1;
+      this->simpleZ = this->simpleThreshold = -1;
+    }
+};
+
+// Median discovery significance for s signal over b background events,
+// sqrt(2((s + b) ln(1 + s/b) - s)). Approaches s/sqrt(b) for s << b.
+Double_t asimov_significance(Double_t s, Double_t b) {
+  if (s <= 0 || b <= 0) {
+    return 0;
+  }
+  return std::sqrt(2 * ((s + b) * std::log1p(s / b) - s));
+}
+
+// Scans every threshold in one pass from the highest score down over both sorted samples (as
+// read_scores returns them), keeping the threshold with the highest Asimov Z and the one with
+// the highest S/sqrt(B)
+SignificanceResult scan_significance(const std::vector<weighted_score> &signal, const std::vector<weighted_score> &background) {
+  SignificanceResult result;
+  Double_t s = 0, b = 0;
+  Long64_t backgroundEvents = 0;
+  Long64_t i = signal.size() - 1, j = background.size() - 1;
+  while (i >= 0 || j >= 0) {
+    // Everything at the next score goes in together, a cut can't split ties
+    Double_t score = std::max(i >= 0 ? signal[i].first : -INFINITY, j >= 0 ? background[j].first : -INFINITY);
+    for (; i >= 0 && signal[i].first == score; i--) {
+      s += signal[i].second;
+    }
+    for (; j >= 0 && background[j].first == score; j--) {
+      b += background[j].second;
+      backgroundEvents++;
+    }
+    if (backgroundEvents < MIN_BACKGROUND_EVENTS || b <= 0) {
+      continue;
+    }
+    Double_t asimov = asimov_significance(s, b);
+    if (asimov > result.asimovZ) {
+      result.asimovZ = asimov;
+      result.asimovThreshold = score;
+      result.signal = s;
+      result.background = b;
+    }
+    Double_t simple = s / std::sqrt(b);
+    if (simple > result.simpleZ) {
+      result.simpleZ = simple;
+      result.simpleThreshold = score;
+    }
+  }
+  return result;
+}
+
+// Turns the PU_wgt of every test event into its share of the expected yield of its class
+void scale_to_yield(std::vector<weighted_score> &scores, Double_t scale, Long64_t selected) {
+  Double_t perEvent = scale * selected / std::max<size_t>(1, scores.size());
+  for (weighted_score &s : scores) {
+    s.second *= perEvent;
+  }
+}
+
+// Significance scan of one method of a trained run, over its test sample in TMVA.root
+SignificanceResult scan_significance(std::string tmvaFile, std::string method, const ExpectedYields &yields) {
+  SignificanceResult result;
+  TFile *file = TFile::Open(tmvaFile.c_str(), "READ");
+  if (file == NULL || file->IsZombie()) {
+    std::cout << "Could not open " << tmvaFile << " for the significance scan" << std::endl;
+    return result;
+  }
+  std::vector<weighted_score> signal, background;
+  Long64_t selectedSignal, selectedBackground;
+  if (!read_method_scores(file, "TestTree", method, signal, background, "PU_wgt")) {
+    std::cout << "No " << method << " scores with PU_wgt in " << tmvaFile << std::endl;
+  } else if (!read_selected_events(file, selectedSignal, selectedBackground)) {
+    std::cout << "No selected event counts in " << tmvaFile << std::endl;
+  } else {
+    scale_to_yield(signal, yields.signalScale, selectedSignal);
+    scale_to_yield(background, yields.backgroundScale, selectedBackground);
+    result = scan_significance(signal, background);
+  }
+  file->Close();
+  delete file;
+  return result;
+}
+
+// Scans many runs at once, one task per (file, method) pair spread over the thread pool. The
+// normalization comes from the environment, without it there is nothing to scan
+std::vector<SignificanceResult> scan_significance(std::vector<std::string> tmvaFiles, std::vector<std::string> methods) {
+  ExpectedYields yields = ExpectedYields::fromEnvironment();
+  if (!yields.isValid()) {
+    std::cout << "Set " << LUMINOSITY_ENV << ", " << SIGNAL_XSEC_ENV << ", " << SIGNAL_GENERATED_ENV << ", "
+              << BACKGROUND_XSEC_ENV << " and " << BACKGROUND_GENERATED_ENV << " for the significance scan" << std::endl;
+    return std::vector<SignificanceResult>(tmvaFiles.size());
+  }
+  TStopwatch watch;
+  ROOT::TThreadExecutor pool;
+  std::vector<SignificanceResult> results = pool.Map([&](unsigned i) {
+    return scan_significance(tmvaFiles[i], methods[i], yields);
+  }, ROOT::TSeqU(tmvaFiles.size()));
+  watch.Stop();
+  std::cout << "Significance scan of " << tmvaFiles.size() << " methods took " << watch.RealTime() << " s" << std::endl;
+  return results;
+}
+#endif
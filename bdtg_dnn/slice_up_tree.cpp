@@ -5,9 +5,14 @@
 #include "TStopwatch.h"
 #include "TApplication.h"
 #include <ROOT/RDataFrame.hxx>
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <string>
-#include "running_properties.cpp"
+#include "input_source.cpp"
+#include "selection_index.cpp"
+#include "event_sampler.cpp"
+#include "schema_reader.cpp"
 
 #define SIGNAL_FILE "signal_data.root"
 #define BACKGROUND_FILE "background_data.root"
@@ -15,57 +20,102 @@
 
 #define TO_TAKE 100000
 
-void slice_up_tree() {
-   //ROOT::EnableImplicitMT();
+// Adds a flat column for every feature of a preset: the feature's object of its branch, or the
+// preset's missing value when the event has fewer objects. These are the columns
+// formula_to_column_expression turns the preset's expressions into. The columns are given
+// back in columns, each once.
+ROOT::RDF::RNode define_preset_columns(ROOT::RDF::RNode df, variable_preset preset, std::vector<std::string> &columns) {
+   std::vector<std::string> aliased;
+   for (SchemaFeature feature : schema_features(preset)) {
+     std::string column = flat_column(feature.branch, feature.index);
+     if (std::find(columns.begin(), columns.end(), column) != columns.end()) {
+       continue;
+     }
+     // The branch under a plain name, jitted expressions can't call methods on dotted names
+     std::string source = "__" + to_identifier(feature.branch);
+     if (std::find(aliased.begin(), aliased.end(), source) == aliased.end()) {
+       df = df.Alias(source, feature.branch);
+       aliased.push_back(source);
+     }
+     std::string value = source;
+     if (feature.index >= 0) {
+       std::string index = std::to_string(feature.index);
+       value = source + ".size() > " + index + " ? " + source + "[" + index + "] : " + std::to_string(feature.missing);
+     }
+     df = df.Define(column, "(float)(" + value + ")");
+     columns.push_back(column);
+   }
+   return df;
+}
 
+// Writes the sliced signal/background samples with the flat columns of a preset and PU_wgt,
+// everything run_bulk needs to train on that preset. With asRNTuple the outputs are RNTuples
+// (signal_data_rntuple.root / background_data_rntuple.root) instead of TTrees, which
+// run_bulk --rntuple reads directly.
+void slice_up_tree(bool asRNTuple, variable_preset preset) {
    // open file and retrieve trees
-   auto siginputfile = TFile::Open(SIGNAL_FILE);
-   auto bginputfile = TFile::Open(BACKGROUND_FILE);
-   auto sigdirectory = siginputfile->Get<TDirectoryFile>("dimuons");
-   auto bgdirectory = bginputfile->Get<TDirectoryFile>("dimuons");
-   auto unsliced_backgroundtree = bgdirectory->Get<TTree>("tree");
-   auto unsliced_signaltree = sigdirectory->Get<TTree>("tree");
-   
-   std::vector<std::pair<std::string, std::string>> columnsToKeep = {
-     {"muPairs", "mass"},
-     {"muPairs", "charge"},
-     {"muPairs", "pt"},
-   };
-
-   std::vector<std::string> combinedOldToKeep = {};
-   std::transform(columnsToKeep.begin(), columnsToKeep.end(), std::back_inserter(combinedOldToKeep), [](std::pair<std::string, std::string> p) {return p.first + "." + p.second;});
-  
-   std::vector<std::string> combinedNewToKeep = {};
-   std::transform(columnsToKeep.begin(), columnsToKeep.end(), std::back_inserter(combinedNewToKeep), [](std::pair<std::string, std::string> p) {return p.first + "_" + p.second;});
+   InputSample signalInput(SIGNAL_FILE);
+   InputSample backgroundInput(BACKGROUND_FILE);
+   auto sigdirectory = signalInput.file->Get<TDirectoryFile>("dimuons");
+   auto bgdirectory = backgroundInput.file->Get<TDirectoryFile>("dimuons");
+   auto unsliced_backgroundtree = backgroundInput.tree;
+   auto unsliced_signaltree = signalInput.tree;
 
-   ROOT::RDataFrame sigdf("tree", sigdirectory, combinedOldToKeep);
-   ROOT::RDataFrame bgdf("tree", bgdirectory, combinedOldToKeep);
+   ROOT::RDataFrame sigdf("tree", sigdirectory);
+   ROOT::RDataFrame bgdf("tree", bgdirectory);
 
-   auto filter = [](ROOT::VecOps::RVec<Double_t> mass){return mass.size() == 1 && (mass[0] < 140) && (mass[0] > 110); };
+   // Take TO_TAKE random events passing the selection instead of the first ones in the file,
+   // which all come from the earliest runs
+   std::string selection = "Length$(muPairs.mass) == 1 && muPairs.mass[0] < 140 && muPairs.mass[0] > 110";
+   SelectionIndex sigSelections(unsliced_signaltree, input_identity(signalInput, unsliced_signaltree->GetEntries()));
+   SelectionIndex bgSelections(unsliced_backgroundtree, input_identity(backgroundInput, unsliced_backgroundtree->GetEntries()));
+   SelectionBitmap sigTaken = EventSampler(signalInput.path)
+     .sample(sigSelections.select(selection), TO_TAKE, 0, DEFAULT_SPLIT_SEED).trainBitmap(unsliced_signaltree->GetEntries());
+   SelectionBitmap bgTaken = EventSampler(backgroundInput.path)
+     .sample(bgSelections.select(selection), TO_TAKE, 0, DEFAULT_SPLIT_SEED).trainBitmap(unsliced_backgroundtree->GetEntries());
 
-   auto sigdf2 = sigdf.Filter(filter, {"muPairs.mass"})
-                      .Range(TO_TAKE);
-   auto bgdf2 = bgdf.Filter(filter, {"muPairs.mass"})
-                      .Range(TO_TAKE);
+   // rdfentry_ is the tree entry number here since the event loop runs on one thread
+   ROOT::RDF::RNode sigdf2 = sigdf.Filter([&sigTaken](ULong64_t entry) {return sigTaken.test(entry);}, {"rdfentry_"});
+   ROOT::RDF::RNode bgdf2 = bgdf.Filter([&bgTaken](ULong64_t entry) {return bgTaken.test(entry);}, {"rdfentry_"});
 
-   std::for_each(columnsToKeep.begin(), columnsToKeep.end(), 
-       [&sigdf2, &bgdf2](std::pair<std::string, std::string> p) {
-     std::string f = p.first;
-     std::string s = p.second;
-     sigdf2 = sigdf2.Define(f + "_" + s, f + "." + s + "[0]");
-     bgdf2 = bgdf2.Define(f + "_" + s, f + "." + s + "[0]");
-   });
+   std::vector<std::string> columns;
+   sigdf2 = define_preset_columns(sigdf2, preset, columns);
+   columns.clear();
+   bgdf2 = define_preset_columns(bgdf2, preset, columns);
 
-   std::for_each(combinedNewToKeep.begin(), combinedNewToKeep.end(), 
+   std::for_each(columns.begin(), columns.end(), 
                  [](std::string s) {std::cout << s << std::endl;});
 
-   combinedNewToKeep.push_back("PU_wgt");
-   sigdf2.Snapshot("tree", std::string(OUTPUT_DIR) + "signal_data.root", combinedNewToKeep);
-   bgdf2.Snapshot("tree", std::string(OUTPUT_DIR) + "background_data.root", combinedNewToKeep);
+   columns.push_back("PU_wgt");
+   ROOT::RDF::RSnapshotOptions options;
+   std::string suffix = "";
+   if (asRNTuple) {
+     options.fOutputFormat = ROOT::RDF::ESnapshotOutputFormat::kRNTuple;
+     suffix = "_rntuple";
+   }
+   sigdf2.Snapshot("tree", std::string(OUTPUT_DIR) + "signal_data" + suffix + ".root", columns, options);
+   bgdf2.Snapshot("tree", std::string(OUTPUT_DIR) + "background_data" + suffix + ".root", columns, options);
 }
 
 int main(int argc, char ** argv) {
+    bool asRNTuple = false;
+    // Has to be the preset run_bulk trains on, ALL like its default
+    variable_preset preset = ALL;
+    std::map<std::string, variable_preset> presets = {
+      {"MUONS", MUONS}, {"JETS", JETS}, {"MUONPAIRS", MUONPAIRS}, {"MUONPAIRS_AND_JETS", MUONPAIRS_AND_JETS}, {"ALL", ALL},
+    };
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--rntuple") {
+        asRNTuple = true;
+      } else if (arg == "--preset" && i + 1 < argc && presets.count(argv[i + 1])) {
+        preset = presets[argv[++i]];
+      } else {
+        std::cout << "Usage: " << argv[0] << " [--rntuple] [--preset MUONS|JETS|MUONPAIRS|MUONPAIRS_AND_JETS|ALL]" << std::endl;
+        return 1;
+      }
+    }
     TApplication app("MyApp", &argc, argv);
-    slice_up_tree();
+    slice_up_tree(asRNTuple, preset);
     return 0;
 }
@@ -0,0 +1,177 @@
+#include "TMath.h"
+#include "TMVA/DataLoader.h"
+#include "TMVA/DataSet.h"
+#include "TMVA/DataSetInfo.h"
+#include "TMVA/DecisionTree.h"
+#include "TMVA/Event.h"
+#include "TMVA/Factory.h"
+#include "TMVA/MethodBDT.h"
+#include "TMVA/ROCCurve.h"
+#include "TMVA/Types.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "overtraining.cpp"
+
+#ifndef __STAGED_BDT
+#define __STAGED_BDT
+
+// Metrics of a boosted forest cut down to its first numTrees trees. Boosting can stop before
+// the forest has every tree asked for, then forestTrees is what was actually evaluated
+class StagedResult {
+  public:
+    Int_t numTrees;
+    Int_t forestTrees;
+    Double_t rocIntegral;
+    Double_t kolS;
+    Double_t kolB;
+    Double_t adS;
+    Double_t adB;
+};
+
+// Key that is the same for two runs exactly when they only differ in their number of trees
+std::string staging_key(RunProperties properties) {
+  std::map<std::string, std::string> m = properties.to_map();
+  m.erase("numTrees");
+  m.erase("isSuccess");
+  m.erase("stagedNumTrees");
+  std::string key;
+  for (auto const &entry : m) {
+    key += entry.first + "=" + entry.second + ";";
+  }
+  return key;
+}
+
+// Gradient boosting adds trees on top of each other, so the forest of a 100 tree run is just
+// the first 100 trees of an 800 tree run with the same settings. This folds BDTG-only runs
+// that only differ in numTrees into a single run with the largest count, which remembers the
+// other counts in stagedNumTrees so they can be evaluated from the same forest afterwards.
+std::vector<RunProperties> merge_tree_count_runs(std::vector<RunProperties> runs) {
+  std::vector<RunProperties> merged;
+  std::map<std::string, size_t> seen;
+  for (RunProperties run : runs) {
+    if (run.methods.size() != 1 || run.methods[0] != BDTG) {
+      merged.push_back(run);
+      continue;
+    }
+    std::string key = staging_key(run);
+    if (seen.count(key) == 0) {
+      seen[key] = merged.size();
+      run.stagedNumTrees = {run.numTrees};
+      merged.push_back(run);
+      continue;
+    }
+    RunProperties &existing = merged[seen[key]];
+    existing.stagedNumTrees.push_back(run.numTrees);
+    existing.numTrees = std::max(existing.numTrees, run.numTrees);
+  }
+
+  for (RunProperties &run : merged) {
+    std::sort(run.stagedNumTrees.begin(), run.stagedNumTrees.end());
+    run.stagedNumTrees.erase(std::unique(run.stagedNumTrees.begin(), run.stagedNumTrees.end()), run.stagedNumTrees.end());
+    // Nothing was folded into this run, so there's nothing extra to evaluate
+    if (run.stagedNumTrees.size() == 1) {
+      run.stagedNumTrees.clear();
+    }
+  }
+  if (merged.size() < runs.size()) {
+    std::cout << "Training " << merged.size() << " runs instead of " << runs.size()
+              << ", runs that only differ in numTrees share one forest" << std::endl;
+  }
+  return merged;
+}
+
+// Evaluates a trained gradient boosted BDT at every requested forest size in one pass over
+// the training and testing events: each event's trees are summed once, and the running sum
+// is read off whenever it reaches one of the requested sizes. Gives the ROC integral of the
+// testing events and the train vs test KS and Anderson-Darling probabilities for signal and
+// background (see overtraining.cpp).
+std::vector<StagedResult> evaluate_bdt_prefixes(TMVA::MethodBDT *bdt, std::vector<Int_t> numTrees) {
+  const std::vector<TMVA::DecisionTree*> &forest = bdt->GetForest();
+  std::sort(numTrees.begin(), numTrees.end());
+  std::vector<Int_t> sizes;
+  for (Int_t n : numTrees) {
+    sizes.push_back(std::min<Int_t>(n, forest.size()));
+  }
+  size_t numSizes = sizes.size();
+  if (numSizes > 0 && sizes[numSizes - 1] < numTrees[numSizes - 1]) {
+    std::cout << "The forest only has " << forest.size() << " of the " << numTrees[numSizes - 1]
+              << " trees asked for, larger sizes are evaluated with all of them" << std::endl;
+  }
+
+  // scores[type][size][event], type 0 is training and 1 is testing
+  std::vector<std::vector<std::vector<Double_t>>> scores(2, std::vector<std::vector<Double_t>>(numSizes));
+  std::vector<std::vector<Bool_t>> isSignal(2);
+  std::vector<std::vector<Double_t>> weights(2);
+  TMVA::DataSet *data = bdt->Data();
+  for (int type = 0; type < 2; type++) {
+    Long64_t numEvents = type == 0 ? data->GetNTrainingEvents() : data->GetNTestEvents();
+    for (size_t s = 0; s < numSizes; s++) {
+      scores[type][s].resize(numEvents);
+    }
+    isSignal[type].resize(numEvents);
+    weights[type].resize(numEvents);
+
+    for (Long64_t e = 0; e < numEvents; e++) {
+      const TMVA::Event *event = type == 0 ? bdt->GetTrainingEvent(e) : bdt->GetTestingEvent(e);
+      Double_t sum = 0;
+      size_t next = 0;
+      for (Int_t tree = 0; tree < sizes[numSizes - 1]; tree++) {
+        sum += forest[tree]->CheckEvent(event, kFALSE);
+        while (next < numSizes && sizes[next] == tree + 1) {
+          // Same transformation MethodBDT applies to the summed gradient boosted response
+          scores[type][next][e] = 2.0 / (1.0 + std::exp(-2.0 * sum)) - 1;
+          next++;
+        }
+      }
+      isSignal[type][e] = bdt->DataInfo().IsSignal(event);
+      weights[type][e] = event->GetWeight();
+    }
+  }
+
+  std::vector<StagedResult> results;
+  for (size_t s = 0; s < numSizes; s++) {
+    StagedResult result;
+    result.numTrees = numTrees[s];
+    result.forestTrees = sizes[s];
+
+    std::vector<Float_t> testScores(scores[1][s].begin(), scores[1][s].end());
+    std::vector<Float_t> testWeights(weights[1].begin(), weights[1].end());
+    TMVA::ROCCurve roc(testScores, isSignal[1], testWeights);
+    result.rocIntegral = roc.GetROCIntegral();
+
+    // split[type][class], class 0 is signal
+    std::vector<weighted_score> split[2][2];
+    for (int type = 0; type < 2; type++) {
+      for (size_t e = 0; e < scores[type][s].size(); e++) {
+        split[type][isSignal[type][e] ? 0 : 1].push_back({scores[type][s][e], weights[type][e]});
+      }
+      std::sort(split[type][0].begin(), split[type][0].end());
+      std::sort(split[type][1].begin(), split[type][1].end());
+    }
+    result.kolS = weighted_ks_prob(split[0][0], split[1][0]);
+    result.kolB = weighted_ks_prob(split[0][1], split[1][1]);
+    result.adS = weighted_ad_prob(split[0][0], split[1][0]);
+    result.adB = weighted_ad_prob(split[0][1], split[1][1]);
+    results.push_back(result);
+  }
+  return results;
+}
+
+// Finds the trained BDTG of a factory and evaluates it at every size in stagedNumTrees
+std::vector<StagedResult> evaluate_staged_run(TMVA::Factory *factory, TMVA::DataLoader *dataloader, RunProperties &properties) {
+  if (properties.stagedNumTrees.size() == 0) {
+    return {};
+  }
+  TMVA::MethodBDT *bdt = dynamic_cast<TMVA::MethodBDT*>(factory->GetMethod(dataloader->GetName(), method_to_tmva_name(BDTG)));
+  if (bdt == NULL) {
+    std::cout << "No BDTG to evaluate at multiple sizes!" << std::endl;
+    return {};
+  }
+  return evaluate_bdt_prefixes(bdt, properties.stagedNumTrees);
+}
+#endif
@@ -0,0 +1,214 @@
+#include "TROOT.h"
+#include "TSystem.h"
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef __THREAD_BUDGET
+#define __THREAD_BUDGET
+
+// Environment variables used to give a process its thread budget, so that several jobs
+// can share one node without recompiling. Unset means "use everything" like before.
+#define THREADS_ENV "BDTG_DNN_THREADS"
+#define NUMA_NODE_ENV "BDTG_DNN_NUMA_NODE"
+#define CPUS_ENV "BDTG_DNN_CPUS"
+
+// From <numaif.h>, which is only there when libnuma is installed. The syscall itself is always
+// available, so we just use it directly.
+#define BUDGET_MPOL_DEFAULT 0
+#define BUDGET_MPOL_PREFERRED 1
+
+// Turns a linux cpulist string (like "0-3,8,10-11") into the list of cores in it
+std::vector<int> parse_cpu_list(std::string list) {
+  std::vector<int> cpus;
+  std::stringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.find_first_not_of(" \n\t") == std::string::npos) {
+      continue;
+    }
+    size_t dash = range.find('-');
+    try {
+      if (dash == std::string::npos) {
+        cpus.push_back(std::stoi(range));
+      } else {
+        int first = std::stoi(range.substr(0, dash));
+        int last = std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+          cpus.push_back(cpu);
+        }
+      }
+    } catch (...) {
+      std::cout << "Could not parse cpu range " << range << ", ignoring it" << std::endl;
+    }
+  }
+  return cpus;
+}
+
+// Looks up which cores belong to a particular NUMA node. Empty if the node doesn't exist
+std::vector<int> numa_node_cpus(int node) {
+  std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  if (!cpulist.is_open()) {
+    return {};
+  }
+  std::string list;
+  std::getline(cpulist, list);
+  return parse_cpu_list(list);
+}
+
+// Reads an integer from the environment, falling back to a default if it isn't set
+int int_from_env(const char *name, int fallback) {
+  const char *value = std::getenv(name);
+  if (value == NULL || std::string(value) == "") {
+    return fallback;
+  }
+  try {
+    return std::stoi(value);
+  } catch (...) {
+    std::cout << "Ignoring invalid value " << value << " for " << name << std::endl;
+    return fallback;
+  }
+}
+
+// How many threads a process (or a single run of a sweep) is allowed to use, and optionally
+// which NUMA node or cores those threads live on.
+class ThreadBudget {
+  public:
+    // 0 means every thread we are allowed to run on
+    Int_t numThreads;
+    // -1 means don't pin to a node
+    Int_t numaNode;
+    // Explicit cpulist ("0-15,32-47"), takes priority over numaNode when set
+    std::string cpuList;
+
+    ThreadBudget(int numThreads = 0, int numaNode = -1, std::string cpuList = "") {
+      this->numThreads = numThreads;
+      this->numaNode = numaNode;
+      this->cpuList = cpuList;
+    }
+
+    // Builds the process-wide budget from BDTG_DNN_THREADS, BDTG_DNN_NUMA_NODE and BDTG_DNN_CPUS
+    static ThreadBudget fromEnvironment() {
+      const char *cpus = std::getenv(CPUS_ENV);
+      return ThreadBudget(int_from_env(THREADS_ENV, 0), int_from_env(NUMA_NODE_ENV, -1), cpus == NULL ? "" : cpus);
+    }
+
+    bool operator==(const ThreadBudget &other) const {
+      return numThreads == other.numThreads && numaNode == other.numaNode && cpuList == other.cpuList;
+    }
+    bool operator!=(const ThreadBudget &other) const {
+      return !(*this == other);
+    }
+
+    // The cores this budget is pinned to. Empty means not pinned
+    std::vector<int> cpus() {
+      if (this->cpuList != "") {
+        return parse_cpu_list(this->cpuList);
+      }
+      if (this->numaNode >= 0) {
+        return numa_node_cpus(this->numaNode);
+      }
+      return {};
+    }
+
+    // Pins the calling thread to the cores of this budget and makes it prefer memory from the
+    // same node. Both the affinity and the memory policy are inherited by every thread created
+    // afterwards, which is why this has to happen before the thread pool gets built and before
+    // the run's data is touched: pages then land on the node that is going to read them.
+    bool pin() {
+      // Remember what we were allowed to run on originally, so an unpinned run after a
+      // pinned one gets the whole machine back
+      static cpu_set_t original;
+      static bool haveOriginal = false;
+      if (!haveOriginal) {
+        sched_getaffinity(0, sizeof(original), &original);
+        haveOriginal = true;
+      }
+
+      std::vector<int> cores = this->cpus();
+      if (cores.size() == 0) {
+        if (this->numaNode >= 0 || this->cpuList != "") {
+          std::cout << "No cores found for numa node " << this->numaNode << " / cpus '" << this->cpuList << "', not pinning" << std::endl;
+        }
+        sched_setaffinity(0, sizeof(original), &original);
+        syscall(SYS_set_mempolicy, BUDGET_MPOL_DEFAULT, NULL, 0);
+        return false;
+      }
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int core : cores) {
+        if (core >= 0 && core < CPU_SETSIZE) {
+          CPU_SET(core, &set);
+        }
+      }
+      if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+        return false;
+      }
+
+      if (this->numaNode >= 0) {
+        // As many words as it takes to hold the node's bit. The kernel reads one bit less than
+        // the maxnode it is given, hence the extra one
+        size_t bitsPerWord = sizeof(unsigned long) * 8;
+        std::vector<unsigned long> nodemask(this->numaNode / bitsPerWord + 1, 0);
+        nodemask[this->numaNode / bitsPerWord] |= 1UL << (this->numaNode % bitsPerWord);
+        if (syscall(SYS_set_mempolicy, BUDGET_MPOL_PREFERRED, nodemask.data(), nodemask.size() * bitsPerWord + 1) != 0) {
+          perror("set_mempolicy");
+        }
+      } else {
+        syscall(SYS_set_mempolicy, BUDGET_MPOL_DEFAULT, NULL, 0);
+      }
+      return true;
+    }
+
+    // Number of threads the pool will actually get. Without cores of its own the budget gets
+    // the ones the process may run on, which taskset and cpuset cgroups restrict, not every
+    // core online
+    int resolvedThreads() {
+      int allowed = this->cpus().size();
+      if (allowed == 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        allowed = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 0;
+      }
+      if (allowed <= 0) {
+        allowed = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      if (this->numThreads <= 0 || this->numThreads > allowed) {
+        return allowed;
+      }
+      return this->numThreads;
+    }
+
+    // Pins (if asked to) and then rebuilds ROOT's implicit multithreading pool with exactly
+    // this many threads. This replaces the bare ROOT::EnableImplicitMT() calls, which grab
+    // every hardware thread on the machine.
+    void apply() {
+      // Threads that already exist keep their old affinity, so any change means a new pool
+      static ThreadBudget lastApplied(-1);
+      if (ROOT::IsImplicitMTEnabled() && lastApplied == *this) {
+        return;
+      }
+      lastApplied = *this;
+
+      this->pin();
+      int threads = this->resolvedThreads();
+      if (ROOT::IsImplicitMTEnabled()) {
+        ROOT::DisableImplicitMT();
+      }
+      ROOT::EnableImplicitMT(threads);
+      std::cout << "Using " << ROOT::GetThreadPoolSize() << " threads";
+      if (this->cpus().size() > 0) {
+        std::cout << " pinned to " << (this->cpuList != "" ? "cpus " + this->cpuList : "numa node " + std::to_string(this->numaNode));
+      }
+      std::cout << std::endl;
+    }
+};
+#endif
@@ -0,0 +1,171 @@
+#include "TSystem.h"
+#include "TXMLEngine.h"
+#include "TMVA/Reader.h"
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef __TRAINED_MODEL
+#define __TRAINED_MODEL
+
+// Where TMVA leaves the weights of each method inside a Run-N directory
+#define WEIGHTS_SUBDIR "dataset/weights/"
+#define WEIGHTS_PREFIX "TMVAClassification_"
+#define WEIGHTS_SUFFIX ".weights.xml"
+
+// A method trained in some Run-N directory, described by its weights file
+class TrainedModel {
+  public:
+    std::string runDir;
+    std::string methodName;
+    std::string weightsFile;
+    // TMVA's type of the method ("DL", "BDT", ...), from the weights file. "HGBDT" is a
+    // forest of hist_gbdt.cpp, which isn't a TMVA method and can't be booked in a reader
+    std::string methodType;
+    // What the model takes as input, in order. These are the (normalized) expressions
+    // the dataloader was given, so they can be evaluated on the original trees.
+    std::vector<std::string> expressions;
+    std::vector<std::string> labels;
+    // Expressions TMVA only carried along (PU_wgt). A reader has to declare them as well
+    std::vector<std::string> spectators;
+    Bool_t isValid;
+
+    TrainedModel(std::string runDir, std::string methodName) {
+      if (runDir.size() > 0 && runDir.back() != '/') {
+        runDir += "/";
+      }
+      this->runDir = runDir;
+      this->methodName = methodName;
+      this->weightsFile = runDir + WEIGHTS_SUBDIR + WEIGHTS_PREFIX + methodName + WEIGHTS_SUFFIX;
+      this->isValid = this->readVariables();
+    }
+
+    // Creates a reader for this model that reads its inputs from the given buffer, which
+    // has to hold one float per expression and outlive the reader
+    TMVA::Reader *makeReader(std::vector<Float_t> &inputs) {
+      inputs.resize(this->expressions.size());
+      TMVA::Reader *reader = new TMVA::Reader("!Color:Silent");
+      for (size_t i = 0; i < this->expressions.size(); i++) {
+        reader->AddVariable(this->expressions[i].c_str(), &inputs[i]);
+      }
+      this->spectatorValues.resize(this->spectators.size());
+      for (size_t i = 0; i < this->spectators.size(); i++) {
+        reader->AddSpectator(this->spectators[i].c_str(), &this->spectatorValues[i]);
+      }
+      reader->BookMVA(this->methodName.c_str(), this->weightsFile.c_str());
+      return reader;
+    }
+
+    // One line description, used for listings
+    std::string describe() {
+      std::string line = this->runDir + " " + this->methodName + " [";
+      for (size_t i = 0; i < this->expressions.size(); i++) {
+        line += (i == 0 ? "" : ", ") + this->expressions[i];
+      }
+      return line + "]";
+    }
+
+  private:
+    // What makeReader's spectators point to, they are never looked at
+    std::vector<Float_t> spectatorValues;
+
+    // Pulls the lists of input variables and spectators out of the weights file
+    bool readVariables() {
+      TXMLEngine xml;
+      XMLDocPointer_t doc = xml.ParseFile(this->weightsFile.c_str());
+      if (doc == NULL) {
+        std::cout << "Could not read " << this->weightsFile << std::endl;
+        return false;
+      }
+      XMLNodePointer_t root = xml.DocGetRootElement(doc);
+      // <MethodSetup Method="DL::TMVA_DNN_GPU">
+      const char *method = xml.GetAttr(root, "Method");
+      std::string type = method != NULL ? method : "";
+      this->methodType = type.substr(0, type.find("::"));
+      for (XMLNodePointer_t node = xml.GetChild(root); node != NULL; node = xml.GetNext(node)) {
+        std::string name = xml.GetNodeName(node);
+        if (name != "Variables" && name != "Spectators") {
+          continue;
+        }
+        for (XMLNodePointer_t var = xml.GetChild(node); var != NULL; var = xml.GetNext(var)) {
+          const char *expression = xml.GetAttr(var, "Expression");
+          const char *label = xml.GetAttr(var, "Label");
+          if (expression == NULL) {
+            continue;
+          }
+          if (name == "Spectators") {
+            this->spectators.push_back(expression);
+            continue;
+          }
+          this->expressions.push_back(expression);
+          this->labels.push_back(label != NULL ? label : expression);
+        }
+      }
+      xml.FreeDoc(doc);
+      return this->expressions.size() > 0;
+    }
+};
+
+// Every method that has weights in a Run-N directory
+std::vector<TrainedModel> find_trained_models(std::string runDir) {
+  if (runDir.size() > 0 && runDir.back() != '/') {
+    runDir += "/";
+  }
+  std::vector<TrainedModel> models;
+  std::string weightsDir = runDir + WEIGHTS_SUBDIR;
+  void *dir = gSystem->OpenDirectory(weightsDir.c_str());
+  if (dir == NULL) {
+    std::cout << "No weights in " << weightsDir << std::endl;
+    return models;
+  }
+  std::string prefix(WEIGHTS_PREFIX), suffix(WEIGHTS_SUFFIX);
+  const char *entry;
+  while ((entry = gSystem->GetDirEntry(dir)) != NULL) {
+    std::string name(entry);
+    if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0
+        || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+      continue;
+    }
+    TrainedModel model(runDir, name.substr(prefix.size(), name.size() - prefix.size() - suffix.size()));
+    if (model.isValid) {
+      models.push_back(model);
+    }
+  }
+  gSystem->FreeDirectory(dir);
+  return models;
+}
+
+// Sets every Expression in an XML tree that names one of the given flat branches back to the
+// expression the branch holds the values of
+void restore_expressions(TXMLEngine &xml, XMLNodePointer_t node, std::map<std::string, std::string> &expressions) {
+  const char *expression = xml.GetAttr(node, "Expression");
+  if (expression != NULL && expressions.count(expression) > 0) {
+    std::string restored = expressions[expression];
+    xml.FreeAttr(node, "Expression");
+    xml.NewAttr(node, 0, "Expression", restored.c_str());
+  }
+  for (XMLNodePointer_t child = xml.GetChild(node); child != NULL; child = xml.GetNext(child)) {
+    restore_expressions(xml, child, expressions);
+  }
+}
+
+// A run trained on flat branches (see flatten_features) has the branches as its inputs in
+// its weights files. They get the expressions back, so the models are read and evaluated on
+// the inputs like those of any other run
+void restore_expressions(std::string runDir, std::map<std::string, std::string> expressions) {
+  if (runDir.size() > 0 && runDir.back() != '/') {
+    runDir += "/";
+  }
+  for (TrainedModel &model : find_trained_models(runDir)) {
+    TXMLEngine xml;
+    XMLDocPointer_t doc = xml.ParseFile(model.weightsFile.c_str());
+    if (doc == NULL) {
+      continue;
+    }
+    restore_expressions(xml, xml.DocGetRootElement(doc), expressions);
+    xml.SaveDoc(doc, model.weightsFile.c_str());
+    xml.FreeDoc(doc);
+  }
+}
+#endif
@@ -0,0 +1,98 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TMVA/DataSet.h"
+#include "TMVA/DataSetInfo.h"
+#include "TMVA/Event.h"
+#include "TMVA/Types.h"
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "run_properties.cpp"
+#include "selection_index.cpp"
+
+#ifndef __TRAINING_EVENTS
+#define __TRAINING_EVENTS
+
+// Which events of its inputs a run trained on, in its Run-N directory. Anything scoring the
+// run's models on those inputs can then tell the training events apart from the others
+#define TRAINING_EVENTS_FILE "training_events.root"
+
+// Training events of one class, as events of the input they were read from. TMVA only had
+// the trees it was given, whose entry numbers (the entry spectators of generateDataLoader)
+// are the positions among the events of the input set in read
+SelectionBitmap training_events(TMVA::DataSetInfo &info, bool signal, const SelectionBitmap &read) {
+  Int_t high = -1, low = -1;
+  for (UInt_t s = 0; s < info.GetNSpectators(); s++) {
+    if (info.GetSpectatorInfo(s).GetLabel() == ENTRY_HIGH_SPECTATOR) {
+      high = s;
+    }
+    if (info.GetSpectatorInfo(s).GetLabel() == ENTRY_LOW_SPECTATOR) {
+      low = s;
+    }
+  }
+  SelectionBitmap trained(read.numEntries);
+  if (high < 0 || low < 0) {
+    return trained;
+  }
+  std::vector<Long64_t> readEntries = read.entries();
+  TMVA::DataSet *data = info.GetDataSet();
+  for (Long64_t e = 0; e < data->GetNEvents(TMVA::Types::kTraining); e++) {
+    const TMVA::Event *event = data->GetEvent(e, TMVA::Types::kTraining);
+    if (info.IsSignal(event) != signal) {
+      continue;
+    }
+    Long64_t position = (Long64_t)event->GetSpectator(high) * ENTRY_SPLIT + (Long64_t)event->GetSpectator(low);
+    if (position < (Long64_t)readEntries.size()) {
+      trained.set(readEntries[position]);
+    }
+  }
+  return trained;
+}
+
+// Writes the training events of both classes, one tree of bitmap words each, titled with
+// the file_identity of the input they belong to
+void write_training_events(std::string path, std::string signalInput, const SelectionBitmap &signal,
+                           std::string backgroundInput, const SelectionBitmap &background) {
+  TFile file(path.c_str(), "RECREATE");
+  for (std::string sample : {std::string("signal"), std::string("background")}) {
+    const SelectionBitmap &trained = sample == "signal" ? signal : background;
+    TTree tree(sample.c_str(), (sample == "signal" ? signalInput : backgroundInput).c_str());
+    ULong64_t word;
+    tree.Branch("word", &word);
+    for (ULong64_t w : trained.words) {
+      word = w;
+      tree.Fill();
+    }
+    tree.Write();
+  }
+  file.Close();
+}
+
+// Reads back the training events a run recorded for the input with the given identity.
+// Returns false if the run didn't record any, or trained on other inputs
+bool read_training_events(std::string runDir, std::string identity, SelectionBitmap &trained) {
+  if (runDir.size() > 0 && runDir.back() != '/') {
+    runDir += "/";
+  }
+  std::unique_ptr<TFile> file(TFile::Open((runDir + TRAINING_EVENTS_FILE).c_str()));
+  if (file == NULL || file->IsZombie()) {
+    return false;
+  }
+  for (std::string sample : {std::string("signal"), std::string("background")}) {
+    TTree *tree = file->Get<TTree>(sample.c_str());
+    if (tree == NULL || identity != tree->GetTitle()) {
+      continue;
+    }
+    ULong64_t word;
+    tree->SetBranchAddress("word", &word);
+    trained = SelectionBitmap(tree->GetEntries() * 64);
+    for (Long64_t i = 0; i < tree->GetEntries(); i++) {
+      tree->GetEntry(i);
+      trained.words[i] = word;
+    }
+    return true;
+  }
+  return false;
+}
+#endif
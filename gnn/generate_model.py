@@ -29,6 +29,8 @@ from common import query_yes_no, query_count, create_graph
 import torch.nn as nn
 from datetime import datetime
 from generate_csvs import generate_csv_data
+from export_weights import export_weights
+from graph_dataset import GraphDataset
 from tqdm import tqdm, trange
 from inputimeout import inputimeout, TimeoutOccurred
 
@@ -76,6 +78,37 @@ def train_node_classifier(model, graph, optimizer, criterion, n_epochs=200, gene
       print(f'Epoch: {epoch:03d}, Train Loss: {loss:.3f}, Val Acc: {acc:.3f}')
   return model
 
+# Same as train_node_classifier, but over mini-batches of events from a graph file (see
+# lib/graph_dataset.py), so memory doesn't grow with the number of events
+def train_node_classifier_batched(model, dataset, optimizer, criterion, device, batch_size, train_events, n_epochs=200, generate_jets=True):
+  for epoch in range(1, n_epochs + 1):
+    model.train()
+    total_loss = 0
+    for batch in dataset.batches(batch_size, shuffle=True, end=train_events):
+      batch = batch.to(device)
+      optimizer.zero_grad()
+      out = model(batch.x_dict, batch.edge_index_dict, generate_jets=generate_jets)
+      loss = criterion(out, combine(batch.y_dict, generate_jets=generate_jets))
+      loss.backward()
+      optimizer.step()
+      total_loss += loss.item()
+
+    if epoch % 10 == 0:
+      print(f'Epoch: {epoch:03d}, Train Loss: {total_loss:.3f}')
+  return model
+
+# Signal scores and labels of every node of events begin..end, a batch at a time
+def predict_batched(model, dataset, device, batch_size, begin, end, generate_jets=True):
+  model.eval()
+  scores, labels = [], []
+  with torch.no_grad():
+    for batch in dataset.batches(batch_size, begin=begin, end=end):
+      batch = batch.to(device)
+      out = model(batch.x_dict, batch.edge_index_dict, generate_jets=generate_jets)
+      scores.append(out[:, 1].double().cpu())
+      labels.append(combine(batch.y_dict, generate_jets=generate_jets).cpu())
+  return torch.cat(scores), torch.cat(labels)
+
 # Lerp between a and b
 def lerp(a, b, t):
   return (1 - t) * a + t * b
@@ -129,6 +162,8 @@ if __name__ == "__main__":
   parser.add_argument("--muons-keys", type=str, nargs='*', default=None, required=False, dest="muons_keys", help="Keys in ROOT tree to use for muons. Should be formatted as 'muons.KEY' or 'muPairs.KEY', so mass is 'muPairs.mass'")
   parser.add_argument("--jets-keys", type=str, nargs='*', default=None, required=False, dest="jets_keys", help="Keys in ROOT tree to use for jets. Should be formatted as 'jets.KEY' or 'jetPairs.KEY', so mass is 'jetPairs.mass'")
 
+  parser.add_argument("--graph-file", type=str, nargs='?', default=None, required=False, dest="graph_file", help="Train on mini-batches of events from a file made by bdtg_dnn/build_graphs instead of the csv files")
+  parser.add_argument("--batch-size", type=int, nargs='?', default=1024, required=False, dest="batch_size", help="Events per mini-batch when training on a graph file")
   parser.add_argument('--plot-roc', action=argparse.BooleanOptionalAction, dest="plot_roc", default=True, help="Whether or not to plot ROC curve when complete")
   parser.add_argument('--generate-csvs', action=argparse.BooleanOptionalAction, dest="generate_csvs", default=True, help="Generate CSV files. If set to false, existing csv directory is required through --csv_dir")
   parser.add_argument('--normalize', action=argparse.BooleanOptionalAction, dest="normalize", default=True, help="Whether to normalize data or not")
@@ -186,6 +221,35 @@ if __name__ == "__main__":
 
   os.mkdir(OUTPUT_DIR)
 
+  if args.graph_file != None:
+    dataset = GraphDataset(args.graph_file)
+    args.generate_jets = dataset.generate_jets
+    train_events = int(len(dataset) * (1 - args.test - args.validation))
+    print(f"Training on {train_events} of {len(dataset)} events, {args.batch_size} at a time")
+
+    device = torch.device('cuda' if torch.cuda.is_available() else 'cpu')
+    num_classes = 2
+    gcn = GCN(num_classes, generate_jets = args.generate_jets).to(device)
+    optimizer_gcn = torch.optim.Adam(gcn.parameters(), lr=0.01, weight_decay=5e-4)
+    criterion = nn.CrossEntropyLoss()
+    gcn = train_node_classifier_batched(gcn, dataset, optimizer_gcn, criterion, device, args.batch_size, train_events, generate_jets = args.generate_jets)
+
+    scores, labels = predict_batched(gcn, dataset, device, args.batch_size, len(dataset) - int(len(dataset) * args.test), len(dataset), generate_jets = args.generate_jets)
+    auroc = BinaryAUROC()(scores, labels)
+    print(f"Area under ROC: {auroc}")
+
+    torch.save(gcn.state_dict(), f"{OUTPUT_DIR}/model")
+    torch.save(optimizer_gcn.state_dict(), f"{OUTPUT_DIR}/optimizer")
+    export_weights(gcn, OUTPUT_DIR, generate_jets=args.generate_jets, features=(dataset.muon_features, dataset.jet_features))
+    with open(OUTPUT_DIR + '/json_data.json', 'w') as outfile:
+      info = {'num_classes': num_classes, 'm_num_features': len(dataset.muon_features)}
+      if args.generate_jets:
+        info['j_num_features'] = len(dataset.jet_features)
+      json.dump(info, outfile)
+    with open(OUTPUT_DIR + '/roc_area.json', 'w') as outfile:
+      json.dump({'auroc': auroc.item()}, outfile)
+    sys.exit(0)
+
   if args.generate_csvs:
     print("Generating input data...")
     generate_csv_data(output_dir = OUTPUT_DIR, takeonly = args.size, normalize = args.normalize, generate_jets=args.generate_jets, jets_keys = args.jets_keys, muons_keys = args.muons_keys)
@@ -252,6 +316,7 @@ if __name__ == "__main__":
 
   torch.save(gcn.state_dict(), f"{OUTPUT_DIR}/model")
   torch.save(optimizer_gcn.state_dict(), f"{OUTPUT_DIR}/optimizer")
+  export_weights(gcn, OUTPUT_DIR, generate_jets=args.generate_jets, csv_dir=args.csv_dir)
 
   with open(OUTPUT_DIR + '/json_data.json', 'w') as outfile:
     if args.generate_jets:
@@ -0,0 +1,68 @@
+import os
+import json
+import argparse
+import torch
+from models import GCN
+
+# Writes the weights of a trained GCN (models.py) to gnn_weights.json, which the C++ inference in
+# bdtg_dnn/gnn_inference.cpp reads. Only the first convolution is exported since it's the only
+# one GCN.forward actually uses. The input features are stored in the order the model saw them,
+# with the normalization generate_csvs applied.
+
+WEIGHTS_FILE = "gnn_weights.json"
+
+# HeteroConv keys are ('muons', 'interacts', 'jets') tuples, or "<muons___interacts___jets>"
+# strings in newer versions of torch_geometric
+def edge_type_name(key):
+  if isinstance(key, tuple):
+    return "__".join(key)
+  return key.strip("<>").replace("___", "__")
+
+def tensors_of(module):
+  return {name: {"shape": list(t.shape), "data": t.detach().cpu().double().flatten().tolist()}
+          for name, t in module.state_dict().items()}
+
+# Features in the order of the csv columns, which is also the order of the normalization data
+def read_features(csv_dir, json_name, csv_name):
+  json_path = os.path.join(csv_dir, json_name)
+  if os.path.exists(json_path):
+    with open(json_path) as f:
+      normalization = json.load(f)
+    return [{"name": k, "mean": v["mean"], "sdev": v["sdev"]} for k, v in normalization.items()]
+  with open(os.path.join(csv_dir, csv_name)) as f:
+    header = f.readline().strip().split(",")
+  return [{"name": k, "mean": 0.0, "sdev": 1.0} for k in header if k not in ["Id", "SigBg"]]
+
+# csv_dir is where generate_csvs wrote its files, if not into the model directory. A model trained
+# on a graph file passes the (muon, jet) features stored with it instead.
+def export_weights(model, model_dir, generate_jets=True, csv_dir=None, features=None):
+  csv_dir = model_dir if csv_dir == None else csv_dir
+  layers = {}
+  for key, conv in model.convs[0].convs.items():
+    layers[edge_type_name(key)] = {"kind": type(conv).__name__, "tensors": tensors_of(conv)}
+
+  data = {
+    "generate_jets": generate_jets,
+    "layers": layers,
+    "lin": tensors_of(model.lin),
+    "muon_features": features[0] if features != None else read_features(csv_dir, "normalization_data.json", "muon_members.csv"),
+    "jet_features": [] if not generate_jets else features[1] if features != None else read_features(csv_dir, "normalization_data_jets.json", "jet_members.csv"),
+  }
+  with open(os.path.join(model_dir, WEIGHTS_FILE), "w") as outfile:
+    json.dump(data, outfile)
+  print(f"Wrote {os.path.join(model_dir, WEIGHTS_FILE)}")
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Exports a trained model for the C++ inference")
+  parser.add_argument("modeldir", help="Directory generate_model.py wrote the model to")
+  parser.add_argument("--csv-dir", type=str, default=None, dest="csv_dir", help="Where the csv files are, if not in modeldir")
+  args = parser.parse_args()
+
+  with open(os.path.join(args.modeldir, "json_data.json")) as f:
+    info = json.load(f)
+  generate_jets = "j_num_features" in info
+
+  model = GCN(info["num_classes"], generate_jets=generate_jets)
+  model.load_state_dict(torch.load(os.path.join(args.modeldir, "model"), map_location="cpu"))
+  model.eval()
+  export_weights(model, args.modeldir, generate_jets=generate_jets, csv_dir=args.csv_dir)
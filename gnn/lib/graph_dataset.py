@@ -0,0 +1,94 @@
+import json
+import numpy as np
+import torch
+from torch_geometric.data import HeteroData
+
+# Reads the per-event graphs bdtg_dnn/build_graphs writes (GraphArena::write in
+# bdtg_dnn/graph_dataset.cpp). Every array is memory mapped, so a mini-batch of events only reads
+# its own part of the file, and its node features are views into the file rather than copies.
+# This lets training stream over any number of events with bounded memory, instead of the one
+# huge graph create_graph builds.
+
+MAGIC = b"CMSGRAPH"
+FORMAT_VERSION = 1
+EDGE_TYPES = [("muons", "interacts", "muons"), ("muons", "interacts", "jets"), ("jets", "interacts", "jets")]
+
+class GraphDataset:
+  def __init__(self, path):
+    with open(path, "rb") as f:
+      if f.read(len(MAGIC)) != MAGIC:
+        raise ValueError(f"{path} is not a graph file from build_graphs")
+      header = np.fromfile(f, dtype=np.int64, count=9)
+    version, n_m_features, n_j_features, n_events, n_muons, n_jets, n_mm, n_mj, n_jj = [int(v) for v in header]
+    if version != FORMAT_VERSION:
+      raise ValueError(f"{path} has format version {version}, expected {FORMAT_VERSION}")
+    with open(path + ".json") as f:
+      description = json.load(f)
+    self.muon_features = description["muon_features"]
+    self.jet_features = description["jet_features"]
+    self.generate_jets = n_j_features > 0
+
+    # Same order as GraphArena::write. Copy-on-write so torch can wrap the arrays without copying
+    self.offset = len(MAGIC) + header.nbytes
+    def array(dtype, count, columns=None):
+      # mmap can't map nothing, which happens for the jets of a muon only dataset
+      a = np.memmap(path, dtype=dtype, mode="c", offset=self.offset, shape=(count,)) if count > 0 else np.zeros(0, dtype=dtype)
+      self.offset += a.nbytes
+      return a if columns == None else a.reshape(-1, max(columns, 1))
+    self.entries = array(np.int64, n_events)
+    self.labels = array(np.int32, n_events)
+    self.edge_weights = array(np.float32, n_events)
+    self.muon_offsets = array(np.int64, n_events + 1)
+    self.jet_offsets = array(np.int64, n_events + 1)
+    self.edge_offsets = [array(np.int64, n_events + 1) for _ in EDGE_TYPES]
+    self.muons = array(np.float32, n_muons * n_m_features, n_m_features)
+    self.jets = array(np.float32, n_jets * n_j_features, n_j_features)
+    self.edges = [(array(np.int32, n), array(np.int32, n)) for n in (n_mm, n_mj, n_jj)]
+
+  def __len__(self):
+    return len(self.entries)
+
+  # Events begin..end as one disconnected HeteroData graph shaped like create_graph's, nodes
+  # numbered from 0 within the batch and labelled with their event's label
+  def batch(self, begin, end):
+    end = min(end, len(self))
+    m0, m1 = self.muon_offsets[begin], self.muon_offsets[end]
+    j0, j1 = self.jet_offsets[begin], self.jet_offsets[end]
+    muon_events = np.repeat(np.arange(begin, end), np.diff(self.muon_offsets[begin:end + 1]))
+    jet_events = np.repeat(np.arange(begin, end), np.diff(self.jet_offsets[begin:end + 1]))
+
+    data = HeteroData()
+    data["muons"].x = torch.from_numpy(self.muons[m0:m1])
+    data["muons"].y = torch.from_numpy(self.labels[muon_events]).long()
+    data["muons"].event = torch.from_numpy(muon_events - begin)
+    edge_types = EDGE_TYPES[:1]
+    if self.generate_jets:
+      data["jets"].x = torch.from_numpy(self.jets[j0:j1])
+      data["jets"].y = torch.from_numpy(self.labels[jet_events]).long()
+      data["jets"].event = torch.from_numpy(jet_events - begin)
+      edge_types = EDGE_TYPES
+
+    for t, edge_type in enumerate(edge_types):
+      e0, e1 = self.edge_offsets[t][begin], self.edge_offsets[t][end]
+      source_base = j0 if edge_type[0] == "jets" else m0
+      destination_base = j0 if edge_type[2] == "jets" else m0
+      sources = torch.from_numpy(self.edges[t][0][e0:e1].astype(np.int64) - source_base)
+      destinations = torch.from_numpy(self.edges[t][1][e0:e1].astype(np.int64) - destination_base)
+      edge_events = np.repeat(np.arange(begin, end), np.diff(self.edge_offsets[t][begin:end + 1]))
+      weights = torch.from_numpy(self.edge_weights[edge_events]).double()
+      data[edge_type].edge_index = torch.stack([sources, destinations])
+      data[edge_type].edge_weight = weights
+      if edge_type == ("muons", "interacts", "jets"):
+        data["jets", "interacts", "muons"].edge_index = torch.stack([destinations, sources])
+        data["jets", "interacts", "muons"].edge_weight = weights
+    return data
+
+  # Mini-batches of batch_size events among events begin..end, in file order or shuffled by batch.
+  # build_graphs already shuffled the events, so every batch mixes signal and background.
+  def batches(self, batch_size, shuffle=False, begin=0, end=None):
+    end = len(self) if end == None else min(end, len(self))
+    starts = np.arange(begin, end, batch_size)
+    if shuffle:
+      np.random.shuffle(starts)
+    for start in starts:
+      yield self.batch(start, min(start + batch_size, end))